@@ -1,7 +1,9 @@
 #!/bin/sh
 
 OPS='
+add_file
 add_one
+aggregates
 attribute
 close_container
 close_field
@@ -9,19 +11,48 @@ close_instance
 create
 destroy
 get_status
+image_load
+image_save
 key
+list_dead
 needs_nonkey_field
 open_container
 open_field
 open_instance
 passthru
 pred_field
+stats
+subtree_dead
 '
 
+comment_add_file="Add the filters (xpaths) in a file, one per line"
+args_add_file="xop, vp"
+signature_add_file="xo_handle_t *xop UNUSED, const char *vp UNUSED"
+
 comment_add_one="Add a filter (xpath) to our filtering mechanism"
 args_add_one="xop, vp"
 signature_add_one="xo_handle_t *xop UNUSED, const char *vp UNUSED"
 
+comment_aggregates="Return the aggregate results for the container being closed"
+args_aggregates="xop, xfp"
+signature_aggregates="xo_handle_t *xop UNUSED, xo_filter_t *xfp UNUSED"
+return_type_aggregates="const char *"
+return_value_aggregates="NULL"
+
+comment_stats="Report what the filter did, one line per expression"
+args_stats="xop, xfp"
+signature_stats="xo_handle_t *xop UNUSED, xo_filter_t *xfp UNUSED"
+return_type_stats="const char *"
+return_value_stats="NULL"
+
+comment_image_load="Use a compiled filter image, mapped from a file"
+args_image_load="xop, vp"
+signature_image_load="xo_handle_t *xop UNUSED, const char *vp UNUSED"
+
+comment_image_save="Save the compiled filter as an image file"
+args_image_save="xop, vp"
+signature_image_save="xo_handle_t *xop UNUSED, const char *vp UNUSED"
+
 args_attribute="xop, xfp, tag, tlen, value, vlen"
 signature_attribute="xo_handle_t *xop UNUSED, xo_filter_t *xfp UNUSED, \
                const char *tag UNUSED, xo_ssize_t tlen UNUSED, \
@@ -63,6 +94,10 @@ signature_pred_field="xo_handle_t *xop UNUSED, xo_filter_t *xfp UNUSED, \
                const char *tag UNUSED, xo_ssize_t tlen UNUSED, \
                const char *value UNUSED, xo_ssize_t vlen UNUSED"
 
+comment_subtree_dead="Can nothing below the current node be output?"
+
+comment_list_dead="Can no later instance of the open list be output?"
+
 args_passthru="xop, op, bufp, name, value, private, flags, func, xfp"
 signature_passthru="XO_ENCODER_HANDLER_ARGS, xo_encoder_func_t func UNUSED,\
                       struct xo_filter_s *xfp UNUSED"
@@ -73,6 +108,7 @@ open_container
 close_container
 open_instance
 close_instance
+list_dead
 '
 
 DEFINES='
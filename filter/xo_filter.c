@@ -14,8 +14,14 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
 #include <regex.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <math.h>
 
 #include "xo_config.h"
@@ -52,13 +58,18 @@ typedef double xo_float_t;	/* Our floating point type */
  * Compiled trie for simultaneous multi-expression XPath matching.
  *
  * At init time all parsed XPath expressions are compiled into a shared
- * prefix-trie so expressions with common prefixes share nodes.
+ * prefix-trie so expressions with common prefixes share nodes.  Element
+ * names are interned into small integers ("atoms"), and the children
+ * of each node are kept in an index sorted by atom, so finding the
+ * nodes for a tag is a hash lookup and a binary search, rather than a
+ * string comparison against every sibling.
  *
  * At runtime a stack of xo_tframe_t frames (one per nesting depth).
  * Each frame records which trie nodes are currently active and in
  * what sub-state.
  */
 typedef uint32_t xo_trie_id_t;	/* Index trie node array (1-based; 0=none) */
+typedef uint32_t xo_atom_t;	/* Interned element name (1-based; 0=none) */
 
 /*
  * One node in the compiled trie.  Stored in a flat 1-based array;
@@ -66,9 +77,18 @@ typedef uint32_t xo_trie_id_t;	/* Index trie node array (1-based; 0=none) */
  */
 typedef struct xo_tnode_s {
     xo_off_t xtn_name;          /* Element name offset in xparse string table */
+    xo_atom_t xtn_atom;		/* Interned name (0 for wildcards) */
     xo_xparse_node_id_t xtn_pred; /* Predicate subtree root (0=none) */
+    xo_trie_id_t xtn_parent;	/* Parent trie node (0 = root level) */
     xo_trie_id_t xtn_child;	/* First child trie node (0 = leaf) */
     xo_trie_id_t xtn_sibling;	/* Next sibling at this level */
+    xo_trie_id_t xtn_hnext;	/* Next node in our xt_bucket chain */
+    uint32_t xtn_index;		/* Our children's offset in xt_index */
+    uint32_t xtn_nindex;	/* Number of children in xt_index */
+    uint32_t xtn_keys;		/* Our xt_keys entry, for XTNF_KEYS */
+    uint32_t xtn_limit;		/* Last open position predicates allow (0=any) */
+    uint32_t xtn_qual_limit;	/* Last qualified position allowed (0=any) */
+    uint32_t xtn_agg;		/* Our xt_aggs entry, for XTNF_AGGREGATE */
     uint16_t xtn_flags;		/* XTNF_* flags */
 } xo_tnode_t;
 
@@ -76,6 +96,75 @@ typedef struct xo_tnode_s {
 #define XTNF_NOT	(1<<1)	/* "not" expression: deny on match */
 #define XTNF_ABSOLUTE	(1<<2)	/* Anchored at tree root (leading '/') */
 #define XTNF_WILDCARD	(1<<3)	/* Wildcard step ('*'): matches any tag */
+#define XTNF_KEYS	(1<<4)	/* Stands for nodes picked by a field's value */
+#define XTNF_MEMBER	(1<<5)	/* Reached via an XTNF_KEYS node's xt_keys */
+#define XTNF_AGGREGATE	(1<<6)	/* Ends an aggregate: accumulate, don't allow */
+
+/*
+ * An interned element name.  The string lives in the xparse string
+ * table, so we record its offset.
+ */
+typedef struct xo_tatom_s {
+    xo_off_t xta_name;		/* Name offset in xparse string table */
+    uint32_t xta_len;		/* Length of the name */
+    uint32_t xta_hash;		/* Hash of the name */
+    xo_atom_t xta_next;		/* Next atom in our xt_atom_bucket chain */
+} xo_tatom_t;
+
+/*
+ * An entry in the child index.  Each node's children (and the root
+ * nodes) are a run of entries sorted by atom, so wildcards come first.
+ */
+typedef struct xo_tindex_s {
+    xo_atom_t xti_atom;		/* Atom of the child (0 for wildcards) */
+    xo_trie_id_t xti_node;	/* The child */
+} xo_tindex_t;
+
+/*
+ * Paths that differ only in a "field == 'literal'" predicate, like
+ * "interface[name == 'ge-0/0/N']", are common in generated filters.
+ * When there are enough of them under one parent, they become members
+ * of a single XTNF_KEYS node, which holds a hash of the literals.  The
+ * XTNF_KEYS node waits for the field, and then the member (or members)
+ * with that value take its place.
+ */
+typedef struct xo_tkent_s {
+    xo_off_t xtke_value;	/* Literal offset in xparse string table */
+    uint32_t xtke_len;		/* Length of the literal */
+    uint32_t xtke_hash;		/* Hash of the literal */
+    xo_trie_id_t xtke_node;	/* Member node */
+    uint32_t xtke_next;		/* Next entry in our bucket chain (+1) */
+} xo_tkent_t;
+
+typedef struct xo_tkeys_s {
+    xo_atom_t xtk_field;	/* Field being tested */
+    uint32_t xtk_count;		/* Number of entries */
+    uint32_t xtk_nbuckets;	/* Number of buckets (power of 2) */
+    uint32_t *xtk_bucket;	/* Hash buckets (entry index + 1) */
+    xo_tkent_t *xtk_ents;	/* Entries */
+} xo_tkeys_t;
+
+#define XO_TKEYS_MIN	4	/* Fewer paths are just tested in turn */
+#define XO_TRIE_BUCKETS	64	/* Initial number of hash buckets */
+
+/*
+ * An aggregate is a top-level "count(path)", "sum(path)", "min(path)",
+ * or "max(path)" expression.  The path is compiled like any other, but
+ * its last node is an XTNF_AGGREGATE node, which adds each match to a
+ * running total rather than making output.  The totals are made into
+ * fields named "<func>-<last-step>" (e.g. "sum-rx-packets") at the
+ * close of the container enclosing the matches.  The definitions
+ * aren't kept in images; they're found again from the paths.
+ */
+#define XTAF_COUNT	1	/* count(): Number of matches */
+#define XTAF_SUM	2	/* sum(): Total of their numeric values */
+#define XTAF_MIN	3	/* min(): Least numeric value */
+#define XTAF_MAX	4	/* max(): Greatest numeric value */
+
+typedef struct xo_tagg_s {
+    uint8_t xtag_func;		/* XTAF_* */
+    char *xtag_name;		/* Field name for the result */
+} xo_tagg_t;
 
 /*
  * The compiled trie: a flat node array plus the root sibling chain.
@@ -86,6 +175,25 @@ typedef struct xo_trie_s {
     xo_trie_id_t xt_cap;	/* Allocated capacity */
     xo_trie_id_t xt_root;	/* First root-level sibling */
     xo_xparse_data_t *xt_xd;	/* Parse data (for string lookup) */
+    struct xo_xprog_s *xt_prog;	/* Compiled predicates (NULL = none) */
+    xo_tatom_t *xt_atoms;	/* Interned names [1..xt_atom_count] */
+    xo_atom_t xt_atom_count;	/* Atoms in use */
+    xo_atom_t xt_atom_cap;	/* Allocated capacity */
+    xo_atom_t *xt_atom_bucket;	/* Hash buckets for atoms */
+    uint32_t xt_atom_nbuckets;	/* Number of atom buckets (power of 2) */
+    xo_trie_id_t *xt_bucket;	/* Hash buckets (parent, atom) for building */
+    uint32_t xt_nbuckets;	/* Number of node buckets (power of 2) */
+    xo_tindex_t *xt_index;	/* Child index, in runs per parent */
+    uint32_t xt_root_index;	/* Root nodes' offset in xt_index */
+    uint32_t xt_root_nindex;	/* Number of root nodes in xt_index */
+    int xt_relative;		/* Some root node is not absolute */
+    xo_tkeys_t *xt_keys;	/* Value hashes [1..xt_keys_count] */
+    uint32_t xt_keys_count;	/* Number of xt_keys in use */
+    xo_tagg_t *xt_aggs;		/* Aggregates [1..xt_aggs_count] */
+    uint32_t xt_aggs_count;	/* Number of xt_aggs in use */
+    xo_trie_id_t *xt_path_node;	/* Final node of each xd_paths entry */
+    uint32_t xt_path_cap;	/* Allocated xt_path_node */
+    int xt_mapped;		/* Arrays live in a filter image (see below) */
 } xo_trie_t;
 
 /*
@@ -106,11 +214,23 @@ typedef struct xo_tframe_s {
     int16_t xtf_deny_delta;	/* deny contribution to undo on pop */
     char *xtf_keys;		/* buffered "k\0v\0k2\0v2\0\0" pairs */
     ssize_t xtf_keys_len;
+    xo_ssize_t xtf_keys_size;	/* allocated size, kept across siblings */
     char *xtf_attrs;		/* buffered "@k\0v\0..." pairs (attributes) */
     ssize_t xtf_attrs_len;
+    xo_ssize_t xtf_attrs_size;	/* allocated size, kept across siblings */
     char *xtf_self;		/* this node's own value (for '.' in predicates) */
     ssize_t xtf_self_len;
+    char *xtf_self_buf;		/* storage for xtf_self, kept across siblings */
+    xo_ssize_t xtf_self_size;	/* allocated size of xtf_self_buf */
+    struct xo_tvalue_s *xtf_values; /* Values parsed as numbers */
+    uint32_t xtf_values_count;	/* # of xtf_values in use */
+    uint32_t xtf_values_cap;	/* allocated xtf_values, kept across siblings */
     uint8_t xtf_dot_count;	/* # matched slots whose predicate uses '.' */
+    uint8_t xtf_limited;	/* Some slot's node has a position limit */
+    uint8_t xtf_list_dead;	/* No later child named xtf_list_atom matches */
+    uint8_t xtf_container;	/* Opened as a container (not instance/field) */
+    xo_atom_t xtf_atom;		/* Our own name (0 if no path names it) */
+    xo_atom_t xtf_list_atom;	/* Name of the dead list (see xtf_list_dead) */
     uint32_t xtf_position_cur;  /* scratch: position for current C_INDEX eval */
     /* Child sibling counters (tracked in the PARENT frame, survive close) */
     uint8_t xtf_child_ncount;
@@ -131,6 +251,43 @@ typedef struct xo_tframe_s {
 #define XTFS_LIVE	2	/* Fully matched (name + predicates) */
 #define XTFS_DEAD	3	/* Predicate failed; ignore sub-tree */
 
+/*
+ * A running total for one aggregate in one open container.  Results
+ * are kept as both integers and floats; the integer one is used until
+ * some value isn't an integer.
+ */
+typedef struct xo_ttotal_s {
+    uint32_t xtt_depth;		/* Depth of the enclosing container */
+    uint32_t xtt_agg;		/* Our xt_aggs entry */
+    uint64_t xtt_count;		/* Number of matches */
+    uint64_t xtt_nvalues;	/* Number of those with numeric values */
+    int xtt_float;		/* Some value wasn't an integer */
+    int64_t xtt_int;		/* Integer result (sum, min, or max) */
+    xo_float_t xtt_value;	/* Floating point result */
+} xo_ttotal_t;
+
+/*
+ * What the matcher did with one trie node, for the "filter-stats"
+ * option.  Visits are slots added for the node; predicates are
+ * evaluated eagerly (when the node opens), later as fields arrive
+ * ("deferred", leaving the filter in XO_STATUS_PRED), or forced when
+ * the node closes without them.
+ */
+typedef struct xo_tstat_s {
+    uint64_t xts_visits;	/* Slots added for this node */
+    uint64_t xts_matches;	/* Times a path ending here matched */
+    uint64_t xts_evals;		/* Predicate evaluations */
+    uint64_t xts_deferred;	/* Predicates left waiting at open */
+    uint64_t xts_eager;		/* Predicates decided at open */
+    uint64_t xts_forced;	/* Predicates decided at close */
+} xo_tstat_t;
+
+#define XO_TSTAT(_xtmp, _id, _field) \
+    do { \
+	if ((_xtmp)->xtm_stats) \
+	    (_xtmp)->xtm_stats[_id]._field += 1; \
+    } while (0)
+
 /*
  * Runtime matching state: a stack of frames driven by open/close events.
  */
@@ -141,6 +298,13 @@ typedef struct xo_tmatch_s {
     xo_tframe_t *xtm_stack;	/* Frame stack [0..xtm_depth] */
     uint32_t xtm_allow;          /* Active allow-match count */
     uint32_t xtm_deny;           /* Active deny-match count */
+    xo_ttotal_t *xtm_totals;	/* Running aggregate totals */
+    uint32_t xtm_totals_count;	/* Number of xtm_totals in use */
+    uint32_t xtm_totals_cap;	/* Allocated xtm_totals */
+    const char *xtm_value;	/* Value of the field being opened, if any */
+    ssize_t xtm_vlen;		/* Length of xtm_value */
+    xo_tstat_t *xtm_stats;	/* Per-node counts [0..xt_count] (filter-stats) */
+    int xtm_stats_checked;	/* Have we looked for "filter-stats" yet? */
 } xo_tmatch_t;
 
 /*
@@ -166,87 +330,296 @@ xo_trie_alloc_node (xo_trie_t *xtp)
 }
 
 /*
- * Return (or create) the wildcard child of `parent`.
- * parent==0 means the root sibling list.
+ * Find the atom for a name, returning 0 if the name isn't one of ours.
+ * The name need not be NUL-terminated.
  */
-static xo_trie_id_t
-xo_trie_get_wildcard_child (xo_trie_t *xtp, xo_trie_id_t parent)
+static xo_atom_t
+xo_trie_atom_find (xo_trie_t *xtp, const char *name, ssize_t len)
 {
-    xo_trie_id_t *listp = parent
-	? &xtp->xt_nodes[parent].xtn_child
-	: &xtp->xt_root;
+    if (xtp->xt_atom_count == 0 || name == NULL)
+	return 0;
 
-    for (xo_trie_id_t s = *listp; s; s = xtp->xt_nodes[s].xtn_sibling)
-	if (xtp->xt_nodes[s].xtn_flags & XTNF_WILDCARD)
-	    return s;
+    uint32_t hash = xo_hash_buf(XO_HASH_INIT, name, len);
+    xo_atom_t atom = xtp->xt_atom_bucket[hash & (xtp->xt_atom_nbuckets - 1)];
+
+    for ( ; atom; atom = xtp->xt_atoms[atom].xta_next) {
+	xo_tatom_t *xtap = &xtp->xt_atoms[atom];
+	if (xtap->xta_hash == hash && xtap->xta_len == len
+	        && memcmp(xo_xparse_str(xtp->xt_xd, xtap->xta_name),
+			  name, len) == 0)
+	    return atom;
+    }
+
+    return 0;
+}
+
+/*
+ * Make the number of atom buckets match the number of atoms, rehashing
+ * the existing atoms into the new buckets.
+ */
+static int
+xo_trie_atom_rehash (xo_trie_t *xtp, uint32_t nbuckets)
+{
+    xo_atom_t *bucket = xo_realloc(xtp->xt_atom_bucket,
+				   nbuckets * sizeof(*bucket));
+    if (bucket == NULL)
+	return -1;
+
+    bzero(bucket, nbuckets * sizeof(*bucket));
+    xtp->xt_atom_bucket = bucket;
+    xtp->xt_atom_nbuckets = nbuckets;
 
+    for (xo_atom_t atom = 1; atom <= xtp->xt_atom_count; atom++) {
+	xo_tatom_t *xtap = &xtp->xt_atoms[atom];
+	uint32_t b = xtap->xta_hash & (nbuckets - 1);
+
+	xtap->xta_next = bucket[b];
+	bucket[b] = atom;
+    }
+
+    return 0;
+}
+
+/*
+ * Return (or create) the atom for the name at `name_id`
+ */
+static xo_atom_t
+xo_trie_atom_intern (xo_trie_t *xtp, xo_off_t name_id)
+{
+    const char *name = xo_xparse_str(xtp->xt_xd, name_id);
+    if (name == NULL)
+	return 0;
+
+    size_t len = strlen(name);
+    xo_atom_t atom = xo_trie_atom_find(xtp, name, len);
+    if (atom)
+	return atom;
+
+    if (xtp->xt_atom_count + 1 >= xtp->xt_atom_cap) {
+	xo_atom_t cap = xtp->xt_atom_cap ? xtp->xt_atom_cap * 2 : 16;
+	xo_tatom_t *p = xo_realloc(xtp->xt_atoms, cap * sizeof(*p));
+	if (p == NULL)
+	    return 0;
+
+	xtp->xt_atoms = p;
+	xtp->xt_atom_cap = cap;
+    }
+
+    atom = ++xtp->xt_atom_count;
+    xo_tatom_t *xtap = &xtp->xt_atoms[atom];
+    xtap->xta_name = name_id;
+    xtap->xta_len = len;
+    xtap->xta_hash = xo_hash_buf(XO_HASH_INIT, name, len);
+
+    if (atom > xtp->xt_atom_nbuckets) {
+	uint32_t nbuckets = xtp->xt_atom_nbuckets
+	    ? xtp->xt_atom_nbuckets * 2 : XO_TRIE_BUCKETS;
+	if (xo_trie_atom_rehash(xtp, nbuckets) < 0)
+	    return 0;
+
+	return atom;		/* The rehash linked in the new atom */
+    }
+
+    uint32_t b = xtap->xta_hash & (xtp->xt_atom_nbuckets - 1);
+    xtap->xta_next = xtp->xt_atom_bucket[b];
+    xtp->xt_atom_bucket[b] = atom;
+
+    return atom;
+}
+
+/*
+ * Hash a (parent, atom) pair, for finding children while building
+ */
+static inline uint32_t
+xo_trie_node_hash (xo_trie_id_t parent, xo_atom_t atom)
+{
+    return (parent * 2654435761U) ^ (atom * 40503U);
+}
+
+/*
+ * Make the number of node buckets match the number of nodes
+ */
+static int
+xo_trie_node_rehash (xo_trie_t *xtp, uint32_t nbuckets)
+{
+    xo_trie_id_t *bucket = xo_realloc(xtp->xt_bucket,
+				      nbuckets * sizeof(*bucket));
+    if (bucket == NULL)
+	return -1;
+
+    bzero(bucket, nbuckets * sizeof(*bucket));
+    xtp->xt_bucket = bucket;
+    xtp->xt_nbuckets = nbuckets;
+
+    for (xo_trie_id_t id = 1; id <= xtp->xt_count; id++) {
+	xo_tnode_t *tn = &xtp->xt_nodes[id];
+	uint32_t b = xo_trie_node_hash(tn->xtn_parent, tn->xtn_atom)
+	    & (nbuckets - 1);
+
+	tn->xtn_hnext = bucket[b];
+	bucket[b] = id;
+    }
+
+    return 0;
+}
+
+/*
+ * Make a new child of `parent` (0 means the root sibling list)
+ */
+static xo_trie_id_t
+xo_trie_new_child (xo_trie_t *xtp, xo_trie_id_t parent,
+		   xo_atom_t atom, xo_off_t name_id)
+{
     xo_trie_id_t id = xo_trie_alloc_node(xtp);
     if (id == 0)
 	return 0;
 
-    /* xo_trie_alloc_node may have realloced xt_nodes; recalculate listp */
-    listp = parent ? &xtp->xt_nodes[parent].xtn_child : &xtp->xt_root;
+    /* xo_trie_alloc_node may have realloced xt_nodes; look them up now */
+    xo_trie_id_t *listp = parent
+	? &xtp->xt_nodes[parent].xtn_child
+	: &xtp->xt_root;
+    xo_tnode_t *tn = &xtp->xt_nodes[id];
 
-    xtp->xt_nodes[id].xtn_flags |= XTNF_WILDCARD;
-    xtp->xt_nodes[id].xtn_sibling = *listp;
+    tn->xtn_name = name_id;
+    tn->xtn_atom = atom;
+    tn->xtn_parent = parent;
+    tn->xtn_sibling = *listp;
     *listp = id;
 
+    if (id > xtp->xt_nbuckets) {
+	uint32_t nbuckets = xtp->xt_nbuckets
+	    ? xtp->xt_nbuckets * 2 : XO_TRIE_BUCKETS;
+	if (xo_trie_node_rehash(xtp, nbuckets) < 0)
+	    return 0;
+
+	return id;		/* The rehash linked in the new node */
+    }
+
+    uint32_t b = xo_trie_node_hash(parent, atom) & (xtp->xt_nbuckets - 1);
+    tn->xtn_hnext = xtp->xt_bucket[b];
+    xtp->xt_bucket[b] = id;
+
     return id;
 }
 
 /*
- * Return (or create) the child of `parent` with name `name_id`.
+ * Return (or create) the wildcard child of `parent`.
  * parent==0 means the root sibling list.
  */
 static xo_trie_id_t
-xo_trie_get_child (xo_trie_t *xtp, xo_trie_id_t parent, xo_off_t name_id)
+xo_trie_get_wildcard_child (xo_trie_t *xtp, xo_trie_id_t parent)
 {
-    xo_trie_id_t *listp = parent
-	? &xtp->xt_nodes[parent].xtn_child
-	: &xtp->xt_root;
+    if (xtp->xt_nbuckets) {
+	uint32_t b = xo_trie_node_hash(parent, 0) & (xtp->xt_nbuckets - 1);
 
-    for (xo_trie_id_t s = *listp; s; s = xtp->xt_nodes[s].xtn_sibling)
-	if (xtp->xt_nodes[s].xtn_name == name_id)
-	    return s;
+	for (xo_trie_id_t s = xtp->xt_bucket[b]; s;
+	         s = xtp->xt_nodes[s].xtn_hnext) {
+	    xo_tnode_t *tn = &xtp->xt_nodes[s];
+	    if (tn->xtn_parent == parent && (tn->xtn_flags & XTNF_WILDCARD))
+		return s;
+	}
+    }
 
-    xo_trie_id_t id = xo_trie_alloc_node(xtp);
-    if (id == 0)
+    xo_trie_id_t id = xo_trie_new_child(xtp, parent, 0, 0);
+    if (id)
+	xtp->xt_nodes[id].xtn_flags |= XTNF_WILDCARD;
+
+    return id;
+}
+
+/*
+ * Return (or create) the child of `parent` with name `name_id`.
+ * parent==0 means the root sibling list.  A child is only shared when
+ * neither step has a predicate, since the predicate belongs to the
+ * node, and when it agrees on being anchored.  A final step can't
+ * share a node that ends a path with the opposite "not"ness, and
+ * aggregates never share their final node, since it names the
+ * aggregate.
+ */
+static xo_trie_id_t
+xo_trie_get_child (xo_trie_t *xtp, xo_trie_id_t parent, xo_off_t name_id,
+		   xo_xparse_node_id_t pred, uint16_t flags, int last)
+{
+    xo_atom_t atom = xo_trie_atom_intern(xtp, name_id);
+    if (atom == 0)
 	return 0;
 
-    /* xo_trie_alloc_node may have realloced xt_nodes; recalculate listp */
-    listp = parent ? &xtp->xt_nodes[parent].xtn_child : &xtp->xt_root;
+    if (pred == 0 && xtp->xt_nbuckets) {
+	uint32_t b = xo_trie_node_hash(parent, atom) & (xtp->xt_nbuckets - 1);
+	uint16_t abs = parent ? 0 : (flags & XTNF_ABSOLUTE);
 
-    xtp->xt_nodes[id].xtn_name = name_id;
-    xtp->xt_nodes[id].xtn_sibling = *listp;
-    *listp = id;
+	for (xo_trie_id_t s = xtp->xt_bucket[b]; s;
+	         s = xtp->xt_nodes[s].xtn_hnext) {
+	    xo_tnode_t *tn = &xtp->xt_nodes[s];
+	    if (tn->xtn_parent != parent || tn->xtn_atom != atom
+		    || tn->xtn_pred != 0
+		    || (tn->xtn_flags & XTNF_ABSOLUTE) != abs)
+		continue;
 
-    return id;
+	    if (last && (tn->xtn_flags & XTNF_TERMINAL)
+		    && ((tn->xtn_flags & XTNF_NOT) != (flags & XTNF_NOT)
+			|| ((tn->xtn_flags | flags) & XTNF_AGGREGATE)))
+		continue;
+
+	    return s;
+	}
+    }
+
+    return xo_trie_new_child(xtp, parent, atom, name_id);
 }
 
-static void
+/*
+ * Return the predicate among an element's children, if any
+ */
+static xo_xparse_node_id_t
+xo_trie_elem_pred (xo_xparse_data_t *xdp, xo_xparse_node_t *xnp)
+{
+    for (xo_xparse_node_id_t cid = xnp->xn_contents; cid; ) {
+	xo_xparse_node_t *cp = xo_xparse_node(xdp, cid);
+	if (cp->xn_type == C_PREDICATE)
+	    return cid;
+	cid = cp->xn_next;
+    }
+
+    return 0;
+}
+
+/*
+ * Insert a path, returning its final node
+ */
+static xo_trie_id_t
 xo_trie_insert (xo_trie_t *xtp, xo_xparse_data_t *xdp,
 		xo_xparse_node_id_t first_elem, uint16_t flags)
 {
     xo_trie_id_t parent = 0;
+    xo_xparse_node_id_t last = 0;
     xo_xparse_node_t *xnp;
 
+    /* Find the last step, which may not share a node ending a "not" */
     for (xo_xparse_node_id_t id = first_elem; id; id = xnp->xn_next) {
 	xnp = xo_xparse_node(xdp, id);
-	if (xnp->xn_type == C_ABSOLUTE) {
+	if (xnp->xn_type == C_ABSOLUTE)
 	    flags |= XTNF_ABSOLUTE;
-	    continue;
-	}
+	else if (xnp->xn_type == L_ASTERISK || xnp->xn_type == C_ELEMENT)
+	    last = id;
+    }
 
+    for (xo_xparse_node_id_t id = first_elem; id; id = xnp->xn_next) {
+	xnp = xo_xparse_node(xdp, id);
+
+	xo_xparse_node_id_t pred = 0;
 	xo_trie_id_t tid;
 	if (xnp->xn_type == L_ASTERISK) {
 	    tid = xo_trie_get_wildcard_child(xtp, parent);
 	} else if (xnp->xn_type == C_ELEMENT) {
-	    tid = xo_trie_get_child(xtp, parent, xnp->xn_str);
+	    pred = xo_trie_elem_pred(xdp, xnp);
+	    tid = xo_trie_get_child(xtp, parent, xnp->xn_str, pred,
+				    flags, id == last);
 	} else {
 	    continue;
 	}
 	if (tid == 0)
-	    return;
+	    return 0;
 
 	/*
 	 * XTNF_ABSOLUTE means the path starts at root.  The check in
@@ -258,24 +631,513 @@ xo_trie_insert (xo_trie_t *xtp, xo_xparse_data_t *xdp,
 	    xtp->xt_nodes[tid].xtn_flags |= XTNF_ABSOLUTE;
 
 	/* Attach predicate if present among this element's children */
-	for (xo_xparse_node_id_t cid = xnp->xn_contents; cid; ) {
-	    xo_xparse_node_t *cp = xo_xparse_node(xdp, cid);
-	    if (cp->xn_type == C_PREDICATE) {
-		xtp->xt_nodes[tid].xtn_pred = cid;
-		break;
-	    }
-	    cid = cp->xn_next;
-	}
+	if (xnp->xn_type == L_ASTERISK)
+	    pred = xo_trie_elem_pred(xdp, xnp);
+	if (pred)
+	    xtp->xt_nodes[tid].xtn_pred = pred;
+
 	parent = tid;
     }
 
     if (parent)
 	xtp->xt_nodes[parent].xtn_flags |=
 	    XTNF_TERMINAL | (flags & ~XTNF_ABSOLUTE);
+
+    return parent;
+}
+
+/*
+ * Is this predicate list a single "field == 'literal'" test, either way
+ * around?  If so, return the field name and the literal.
+ */
+static int
+xo_trie_pred_equality (xo_xparse_data_t *xdp, xo_xparse_node_id_t pred,
+		       xo_off_t *fieldp, xo_off_t *literalp)
+{
+    xo_xparse_node_t *xnp = xo_xparse_node(xdp, pred);
+    if (xnp == NULL || xnp->xn_type != C_PREDICATE || xnp->xn_next
+	    || xnp->xn_contents == 0)
+	return FALSE;
+
+    xnp = xo_xparse_node(xdp, xnp->xn_contents);
+    if (xnp->xn_type != L_EQUALS || xnp->xn_contents == 0)
+	return FALSE;
+
+    xo_xparse_node_t *left = xo_xparse_node(xdp, xnp->xn_contents);
+    xo_xparse_node_t *right = left->xn_next
+	? xo_xparse_node(xdp, left->xn_next) : NULL;
+    if (right == NULL || right->xn_next)
+	return FALSE;
+
+    if (left->xn_type == T_QUOTED) {
+	xo_xparse_node_t *tmp = left;
+	left = right;
+	right = tmp;
+    }
+
+    if (left->xn_type != C_PATH || left->xn_contents == 0
+	    || right->xn_type != T_QUOTED || right->xn_str == 0)
+	return FALSE;
+
+    xo_xparse_node_t *elt = xo_xparse_node(xdp, left->xn_contents);
+    if (elt->xn_type != C_ELEMENT || elt->xn_next || elt->xn_contents)
+	return FALSE;
+
+    *fieldp = elt->xn_str;
+    *literalp = right->xn_str;
+    return TRUE;
+}
+
+/* A candidate for an XTNF_KEYS node, while we sort them out */
+typedef struct xo_tkcand_s {
+    xo_trie_id_t xtkc_parent;	/* Parent of the node */
+    xo_atom_t xtkc_atom;	/* Atom of the node */
+    xo_atom_t xtkc_field;	/* Atom of the field being tested */
+    uint16_t xtkc_abs;		/* XTNF_ABSOLUTE, for root nodes */
+    xo_trie_id_t xtkc_node;	/* The node */
+    xo_off_t xtkc_literal;	/* The literal */
+} xo_tkcand_t;
+
+static int
+xo_tkcand_cmp (const void *a, const void *b)
+{
+    const xo_tkcand_t *ap = a, *bp = b;
+
+    if (ap->xtkc_parent != bp->xtkc_parent)
+	return (ap->xtkc_parent < bp->xtkc_parent) ? -1 : 1;
+    if (ap->xtkc_atom != bp->xtkc_atom)
+	return (ap->xtkc_atom < bp->xtkc_atom) ? -1 : 1;
+    if (ap->xtkc_field != bp->xtkc_field)
+	return (ap->xtkc_field < bp->xtkc_field) ? -1 : 1;
+    if (ap->xtkc_abs != bp->xtkc_abs)
+	return (ap->xtkc_abs < bp->xtkc_abs) ? -1 : 1;
+
+    /* Newer nodes first, as in the sibling lists */
+    return (ap->xtkc_node > bp->xtkc_node) ? -1
+	: (ap->xtkc_node < bp->xtkc_node) ? 1 : 0;
+}
+
+/*
+ * Make an XTNF_KEYS node for a run of candidates
+ */
+static int
+xo_trie_keys_make (xo_trie_t *xtp, xo_tkcand_t *run, uint32_t count)
+{
+    xo_tkeys_t *xtkp = xo_realloc(xtp->xt_keys,
+				  (xtp->xt_keys_count + 2) * sizeof(*xtkp));
+    if (xtkp == NULL)
+	return -1;
+
+    xtp->xt_keys = xtkp;
+    xtkp += xtp->xt_keys_count + 1;
+    bzero(xtkp, sizeof(*xtkp));
+
+    uint32_t nbuckets = 1;
+    while (nbuckets < count)
+	nbuckets <<= 1;
+
+    xtkp->xtk_ents = xo_realloc(NULL, count * sizeof(xo_tkent_t));
+    xtkp->xtk_bucket = xo_realloc(NULL, nbuckets * sizeof(uint32_t));
+    if (xtkp->xtk_ents == NULL || xtkp->xtk_bucket == NULL) {
+	xo_free(xtkp->xtk_ents);
+	xo_free(xtkp->xtk_bucket);
+	return -1;
+    }
+
+    xo_trie_id_t id = xo_trie_new_child(xtp, run->xtkc_parent, run->xtkc_atom,
+				       xtp->xt_nodes[run->xtkc_node].xtn_name);
+    if (id == 0) {
+	xo_free(xtkp->xtk_ents);
+	xo_free(xtkp->xtk_bucket);
+	return -1;
+    }
+
+    xtp->xt_keys_count += 1;
+    xtp->xt_nodes[id].xtn_flags |= XTNF_KEYS | run->xtkc_abs;
+    xtp->xt_nodes[id].xtn_keys = xtp->xt_keys_count;
+
+    xtkp->xtk_field = run->xtkc_field;
+    xtkp->xtk_count = count;
+    xtkp->xtk_nbuckets = nbuckets;
+    bzero(xtkp->xtk_bucket, nbuckets * sizeof(uint32_t));
+
+    /* Fill in backwards, so each chain keeps the newest-first order */
+    for (uint32_t i = count; i-- > 0; ) {
+	xo_tkent_t *xtkep = &xtkp->xtk_ents[i];
+	const char *lit = xo_xparse_str(xtp->xt_xd, run[i].xtkc_literal);
+	uint32_t len = lit ? strlen(lit) : 0;
+
+	xtkep->xtke_value = run[i].xtkc_literal;
+	xtkep->xtke_len = len;
+	xtkep->xtke_hash = xo_hash_buf(XO_HASH_INIT, lit, len);
+	xtkep->xtke_node = run[i].xtkc_node;
+
+	uint32_t b = xtkep->xtke_hash & (nbuckets - 1);
+	xtkep->xtke_next = xtkp->xtk_bucket[b];
+	xtkp->xtk_bucket[b] = i + 1;
+
+	xtp->xt_nodes[run[i].xtkc_node].xtn_flags |= XTNF_MEMBER;
+    }
+
+    return 0;
+}
+
+/*
+ * Find runs of sibling paths that differ only in the literal of a
+ * "field == 'literal'" predicate, and hang each run off an XTNF_KEYS
+ * node.  Failures just leave the paths to be tested in turn.
+ */
+static void
+xo_trie_keys (xo_trie_t *xtp)
+{
+    xo_xparse_data_t *xdp = xtp->xt_xd;
+    xo_tkcand_t *cand = NULL;
+    uint32_t ncand = 0;
+    xo_trie_id_t last = xtp->xt_count;
+
+    for (xo_trie_id_t id = 1; id <= last; id++) {
+	xo_tnode_t *tn = &xtp->xt_nodes[id];
+	xo_off_t field, literal;
+
+	if (tn->xtn_pred == 0 || (tn->xtn_flags & XTNF_WILDCARD)
+		|| !xo_trie_pred_equality(xdp, tn->xtn_pred, &field, &literal))
+	    continue;
+
+	if (cand == NULL) {
+	    cand = xo_realloc(NULL, last * sizeof(*cand));
+	    if (cand == NULL)
+		return;
+	}
+
+	xo_tkcand_t *xtkcp = &cand[ncand++];
+	xtkcp->xtkc_parent = tn->xtn_parent;
+	xtkcp->xtkc_atom = tn->xtn_atom;
+	xtkcp->xtkc_field = xo_trie_atom_intern(xtp, field);
+	xtkcp->xtkc_abs = tn->xtn_parent ? 0 : (tn->xtn_flags & XTNF_ABSOLUTE);
+	xtkcp->xtkc_node = id;
+	xtkcp->xtkc_literal = literal;
+
+	if (xtkcp->xtkc_field == 0)
+	    ncand -= 1;
+    }
+
+    if (ncand >= XO_TKEYS_MIN) {
+	qsort(cand, ncand, sizeof(*cand), xo_tkcand_cmp);
+
+	for (uint32_t i = 0, end; i < ncand; i = end) {
+	    for (end = i + 1; end < ncand
+		     && cand[i].xtkc_parent == cand[end].xtkc_parent
+		     && cand[i].xtkc_atom == cand[end].xtkc_atom
+		     && cand[i].xtkc_field == cand[end].xtkc_field
+		     && cand[i].xtkc_abs == cand[end].xtkc_abs; end++)
+		continue;
+
+	    if (end - i >= XO_TKEYS_MIN)
+		xo_trie_keys_make(xtp, &cand[i], end - i);
+	}
+    }
+
+    xo_free(cand);
+}
+
+static int
+xo_tindex_cmp (const void *a, const void *b)
+{
+    const xo_tindex_t *ap = a, *bp = b;
+
+    if (ap->xti_atom != bp->xti_atom)
+	return (ap->xti_atom < bp->xti_atom) ? -1 : 1;
+
+    /* Newer nodes first, as in the sibling lists */
+    return (ap->xti_node > bp->xti_node) ? -1
+	: (ap->xti_node < bp->xti_node) ? 1 : 0;
+}
+
+/*
+ * If a predicate is "position() < N", "position() <= N", or
+ * "position() == N", either way around, return the last position it
+ * accepts; otherwise zero
+ */
+static uint32_t
+xo_trie_position_bound (xo_xparse_data_t *xdp, xo_xparse_node_id_t id)
+{
+    xo_xparse_node_t *xnp = xo_xparse_node(xdp, id);
+    if (xnp == NULL || xnp->xn_contents == 0)
+	return 0;
+
+    xo_xparse_token_t op = xnp->xn_type;
+    xo_xparse_node_t *left = xo_xparse_node(xdp, xnp->xn_contents);
+    xo_xparse_node_t *right = left->xn_next
+	? xo_xparse_node(xdp, left->xn_next) : NULL;
+    if (right == NULL || right->xn_next)
+	return 0;
+
+    if (left->xn_type == T_NUMBER) {
+	xo_xparse_node_t *tmp = left;
+	left = right;
+	right = tmp;
+
+	if (op == L_GRTR)
+	    op = L_LESS;
+	else if (op == L_GRTREQ)
+	    op = L_LESSEQ;
+	else if (op != L_EQUALS)
+	    return 0;
+    }
+
+    const char *str = xo_xparse_str(xdp, left->xn_str);
+    if (left->xn_type != T_FUNCTION_NAME || left->xn_contents
+	    || str == NULL || !xo_streq(str, "position")
+	    || right->xn_type != T_NUMBER)
+	return 0;
+
+    str = xo_xparse_str(xdp, right->xn_str);
+    if (str == NULL)
+	return 0;
+
+    char *ep;
+    unsigned long num = strtoul(str, &ep, 10);
+    if (*ep != '\0' || num > UINT32_MAX)
+	return 0;
+
+    switch (op) {
+    case L_LESS:
+	return num ? num - 1 : 0;
+    case L_LESSEQ:
+    case L_EQUALS:
+	return num;
+    default:
+	return 0;
+    }
+}
+
+/*
+ * Find the last position each node's predicates can accept, so we can
+ * tell when no later sibling can match.  A leading "[N]" or position()
+ * test limits the open-time position; an "[N]" after other predicates
+ * limits the qualified position (see xo_tmatch_slot_position).  We
+ * leave position() alone when there's a trailing "[N]", since it then
+ * may see either position.
+ */
+static void
+xo_trie_limits (xo_trie_t *xtp)
+{
+    xo_xparse_data_t *xdp = xtp->xt_xd;
+
+    for (xo_trie_id_t id = 1; id <= xtp->xt_count; id++) {
+	xo_tnode_t *tn = &xtp->xt_nodes[id];
+	int leading = FALSE, trailing = FALSE;
+	xo_xparse_node_t *xnp, *cnp;
+
+	for (xo_xparse_node_id_t pid = tn->xtn_pred; pid; pid = xnp->xn_next) {
+	    xnp = xo_xparse_node(xdp, pid);
+	    if (xnp->xn_type != C_PREDICATE || xnp->xn_contents == 0)
+		continue;
+	    cnp = xo_xparse_node(xdp, xnp->xn_contents);
+	    if (cnp->xn_type != C_INDEX)
+		leading = TRUE;
+	    else if (leading)
+		trailing = TRUE;
+	}
+
+	leading = FALSE;
+	for (xo_xparse_node_id_t pid = tn->xtn_pred; pid; pid = xnp->xn_next) {
+	    xnp = xo_xparse_node(xdp, pid);
+	    if (xnp->xn_type != C_PREDICATE || xnp->xn_contents == 0)
+		continue;
+
+	    uint32_t limit = 0, *limitp = &tn->xtn_limit;
+	    cnp = xo_xparse_node(xdp, xnp->xn_contents);
+
+	    if (cnp->xn_type == C_INDEX) {
+		const char *str = xo_xparse_str(xdp, cnp->xn_str);
+		unsigned long num = str ? strtoul(str, NULL, 10) : 0;
+		limit = (num > UINT32_MAX) ? 0 : num;
+		if (leading)
+		    limitp = &tn->xtn_qual_limit;
+	    } else {
+		leading = TRUE;
+		if (!trailing)
+		    limit = xo_trie_position_bound(xdp, xnp->xn_contents);
+	    }
+
+	    if (limit && (*limitp == 0 || limit < *limitp))
+		*limitp = limit;
+	}
+    }
 }
 
+/*
+ * Append one sibling list to the child index, sorted by atom
+ */
+static uint32_t
+xo_trie_index_list (xo_trie_t *xtp, xo_trie_id_t first, uint32_t *offp)
+{
+    uint32_t start = *offp;
+
+    for (xo_trie_id_t s = first; s; s = xtp->xt_nodes[s].xtn_sibling) {
+	if (xtp->xt_nodes[s].xtn_flags & XTNF_MEMBER)
+	    continue;		/* Found via their XTNF_KEYS node */
+
+	xo_tindex_t *xtip = &xtp->xt_index[(*offp)++];
+
+	xtip->xti_atom = xtp->xt_nodes[s].xtn_atom;
+	xtip->xti_node = s;
+    }
+
+    if (*offp - start > 1)
+	qsort(&xtp->xt_index[start], *offp - start,
+	      sizeof(xo_tindex_t), xo_tindex_cmp);
+
+    return start;
+}
+
+/*
+ * Build the child index.  Every node is a child of one parent (or the
+ * root), so the index has one entry per node.
+ */
+static int
+xo_trie_index (xo_trie_t *xtp)
+{
+    if (xtp->xt_count == 0)
+	return 0;
+
+    xtp->xt_index = xo_realloc(NULL, xtp->xt_count * sizeof(xo_tindex_t));
+    if (xtp->xt_index == NULL)
+	return -1;
+
+    uint32_t off = 0;
+
+    xtp->xt_root_index = xo_trie_index_list(xtp, xtp->xt_root, &off);
+    xtp->xt_root_nindex = off - xtp->xt_root_index;
+
+    for (xo_trie_id_t id = 1; id <= xtp->xt_count; id++) {
+	xo_tnode_t *tn = &xtp->xt_nodes[id];
+
+	tn->xtn_index = xo_trie_index_list(xtp, tn->xtn_child, &off);
+	tn->xtn_nindex = off - tn->xtn_index;
+    }
+
+    for (xo_trie_id_t r = xtp->xt_root; r; r = xtp->xt_nodes[r].xtn_sibling)
+	if (!(xtp->xt_nodes[r].xtn_flags & XTNF_ABSOLUTE))
+	    xtp->xt_relative = TRUE;
+
+    return 0;
+}
+
+static const char *xo_trie_agg_names[] = {
+    NULL, "count", "sum", "min", "max",
+};
+
+/*
+ * If a path is an aggregate, return its XTAF_* function, and the
+ * first step of the aggregated path.  The argument must be a plain
+ * location path.
+ */
+static int
+xo_trie_agg_func (xo_xparse_data_t *xdp, xo_xparse_node_id_t id,
+		  xo_xparse_node_id_t *elemp)
+{
+    xo_xparse_node_t *xnp = xo_xparse_node(xdp, id);
+    if (xnp == NULL || xnp->xn_type != T_FUNCTION_NAME)
+	return 0;
+
+    const char *name = xo_xparse_str(xdp, xnp->xn_str);
+    int func;
+
+    for (func = XTAF_COUNT; func <= XTAF_MAX; func++)
+	if (name && xo_streq(name, xo_trie_agg_names[func]))
+	    break;
+    if (func > XTAF_MAX)
+	return 0;
+
+    xo_xparse_node_id_t elem = xnp->xn_contents;
+    xnp = xo_xparse_node(xdp, elem);
+    if (xnp == NULL || xnp->xn_next)
+	return 0;
+
+    if (xnp->xn_type == C_PATH)
+	elem = xnp->xn_contents;
+
+    for (id = elem; id; id = xnp->xn_next) {
+	xnp = xo_xparse_node(xdp, id);
+	if (xnp->xn_type != C_ELEMENT && xnp->xn_type != L_ASTERISK
+		&& (xnp->xn_type != C_ABSOLUTE || id != elem))
+	    return 0;
+    }
+
+    if (elemp)
+	*elemp = elem;
+    return func;
+}
+
+/*
+ * Make the aggregate definitions, finding them in path order, which
+ * is the order xo_trie_add_paths numbers them in.  Loading an image
+ * calls this too.
+ */
+static int
+xo_trie_aggs (xo_trie_t *xtp, xo_xparse_data_t *xdp)
+{
+    xo_xparse_node_id_t *paths = xdp->xd_paths;
+    xo_xparse_node_id_t elem;
+    uint32_t i, count = 0;
+
+    for (i = 0; i < xdp->xd_paths_cur; i++)
+	if (xo_trie_agg_func(xdp, paths[i], NULL))
+	    count += 1;
+
+    if (count == 0)
+	return 0;
+
+    xtp->xt_aggs = xo_realloc(NULL, (count + 1) * sizeof(*xtp->xt_aggs));
+    if (xtp->xt_aggs == NULL)
+	return -1;
+    bzero(xtp->xt_aggs, (count + 1) * sizeof(*xtp->xt_aggs));
+
+    for (i = 0; i < xdp->xd_paths_cur; i++) {
+	int func = xo_trie_agg_func(xdp, paths[i], &elem);
+	if (func == 0)
+	    continue;
+
+	/* The result is named for the last named step */
+	const char *last = NULL;
+	xo_xparse_node_t *xnp;
+	for (xo_xparse_node_id_t id = elem; id; id = xnp->xn_next) {
+	    xnp = xo_xparse_node(xdp, id);
+	    if (xnp->xn_type == C_ELEMENT)
+		last = xo_xparse_str(xdp, xnp->xn_str);
+	    else if (xnp->xn_type == L_ASTERISK)
+		last = NULL;
+	}
+
+	const char *fname = xo_trie_agg_names[func];
+	size_t len = strlen(fname) + (last ? strlen(last) + 1 : 0) + 1;
+	xo_tagg_t *xtap = &xtp->xt_aggs[++xtp->xt_aggs_count];
+
+	xtap->xtag_func = func;
+	xtap->xtag_name = xo_realloc(NULL, len);
+	if (xtap->xtag_name == NULL)
+	    return -1;
+	snprintf(xtap->xtag_name, len, "%s%s%s", fname,
+		 last ? "-" : "", last ?: "");
+    }
+
+    return 0;
+}
+
+static struct xo_xprog_s *xo_xprog_compile(xo_trie_t *);
+static void xo_xprog_free(struct xo_xprog_s *);
+static void xo_trie_free(xo_trie_t *);
+
+/*
+ * Building a trie is done in three steps: start an empty one, add
+ * paths to it (as many times as needed), and finish it.  Bulk loading
+ * adds each expression's paths as it's parsed, rather than compiling
+ * the whole set again for each one.
+ */
 static xo_trie_t *
-xo_trie_compile (xo_handle_t *xop UNUSED, xo_xparse_data_t *xdp)
+xo_trie_start (xo_xparse_data_t *xdp)
 {
     xo_trie_t *xtp = xo_realloc(NULL, sizeof(*xtp));
     if (xtp == NULL)
@@ -284,11 +1146,47 @@ xo_trie_compile (xo_handle_t *xop UNUSED, xo_xparse_data_t *xdp)
     bzero(xtp, sizeof(*xtp));
     xtp->xt_xd = xdp;
 
-    xo_xparse_node_id_t *paths = xdp->xd_paths;
-    for (uint32_t i = 0; i < xdp->xd_paths_cur; i++, paths++) {
+    return xtp;
+}
+
+/*
+ * Insert xd_paths[from..xd_paths_cur) into the trie.  "aggp" counts
+ * the aggregates seen so far, since they're numbered in path order.
+ */
+static void
+xo_trie_add_paths (xo_trie_t *xtp, xo_xparse_data_t *xdp,
+		   uint32_t from, uint32_t *aggp)
+{
+    /* Keep each path's final node, so filter-stats can find it */
+    if (xdp->xd_paths_cur > xtp->xt_path_cap) {
+	uint32_t cap = xtp->xt_path_cap ? xtp->xt_path_cap : 16;
+	while (cap < xdp->xd_paths_cur)
+	    cap *= 2;
+
+	xo_trie_id_t *p = xo_realloc(xtp->xt_path_node, cap * sizeof(*p));
+	if (p) {
+	    bzero(p + xtp->xt_path_cap, (cap - xtp->xt_path_cap) * sizeof(*p));
+	    xtp->xt_path_node = p;
+	    xtp->xt_path_cap = cap;
+	}
+    }
+
+    xo_xparse_node_id_t *paths = xdp->xd_paths + from;
+    for (uint32_t i = from; i < xdp->xd_paths_cur; i++, paths++) {
 	xo_xparse_node_t *xnp = xo_xparse_node(xdp, *paths);
 	uint16_t flags = 0;
 	xo_xparse_node_id_t elem = *paths;
+	xo_trie_id_t tid;
+
+	if (xo_trie_agg_func(xdp, *paths, &elem)) {
+	    tid = xo_trie_insert(xtp, xdp, elem, XTNF_AGGREGATE);
+	    *aggp += 1;
+	    if (tid)
+		xtp->xt_nodes[tid].xtn_agg = *aggp;
+	    if (i < xtp->xt_path_cap)
+		xtp->xt_path_node[i] = tid;
+	    continue;
+	}
 
 	switch (xnp->xn_type) {
 	case C_ELEMENT:
@@ -314,33 +1212,173 @@ xo_trie_compile (xo_handle_t *xop UNUSED, xo_xparse_data_t *xdp)
 	default:
 	    continue;
 	}
-	xo_trie_insert(xtp, xdp, elem, flags);
+
+	tid = xo_trie_insert(xtp, xdp, elem, flags);
+	if (i < xtp->xt_path_cap)
+	    xtp->xt_path_node[i] = tid;
+    }
+}
+
+/*
+ * Finish a trie once all the paths are in, returning it, or NULL
+ * (having freed it) on failure
+ */
+static xo_trie_t *
+xo_trie_finish (xo_trie_t *xtp, xo_xparse_data_t *xdp)
+{
+    if (xo_trie_aggs(xtp, xdp) < 0) {
+	xo_trie_free(xtp);
+	return NULL;
+    }
+
+    xo_trie_keys(xtp);
+    xo_trie_limits(xtp);
+
+    /* The build-time hash is done; the index takes over */
+    xo_free(xtp->xt_bucket);
+    xtp->xt_bucket = NULL;
+    xtp->xt_nbuckets = 0;
+
+    if (xo_trie_index(xtp) < 0) {
+	xo_trie_free(xtp);
+	return NULL;
     }
 
+    /* Compile the predicates; without a program, we walk the tree */
+    xtp->xt_prog = xo_xprog_compile(xtp);
+
     return xtp;
 }
 
+static xo_trie_t *
+xo_trie_compile (xo_handle_t *xop UNUSED, xo_xparse_data_t *xdp)
+{
+    xo_trie_t *xtp = xo_trie_start(xdp);
+    if (xtp == NULL)
+	return NULL;
+
+    uint32_t agg = 0;
+    xo_trie_add_paths(xtp, xdp, 0, &agg);
+
+    return xo_trie_finish(xtp, xdp);
+}
+
 static void
 xo_trie_free (xo_trie_t *xtp)
 {
     if (xtp) {
+	for (uint32_t i = 1; i <= xtp->xt_aggs_count; i++)
+	    xo_free(xtp->xt_aggs[i].xtag_name);
+	xo_free(xtp->xt_aggs);
+	xo_free(xtp->xt_path_node);
+    }
+
+    if (xtp && xtp->xt_mapped) {
+	/* The arrays are in the image; only these are ours */
+	xo_free(xtp->xt_prog);
+	xo_free(xtp->xt_keys);
+	xo_free(xtp);
+
+    } else if (xtp) {
+	xo_xprog_free(xtp->xt_prog);
 	xo_free(xtp->xt_nodes);
+	xo_free(xtp->xt_atoms);
+	xo_free(xtp->xt_atom_bucket);
+	xo_free(xtp->xt_bucket);
+	xo_free(xtp->xt_index);
+
+	for (uint32_t i = 1; i <= xtp->xt_keys_count; i++) {
+	    xo_free(xtp->xt_keys[i].xtk_ents);
+	    xo_free(xtp->xt_keys[i].xtk_bucket);
+	}
+	xo_free(xtp->xt_keys);
 	xo_free(xtp);
     }
 }
 
 /* xo_tframe_* functions are for runtime processing */
 
+/*
+ * Frames are pooled by depth: a frame's key, attribute, and self
+ * buffers stay with its slot in the stack when the node closes, so the
+ * next sibling (or cousin) reuses them.  Once a long list reaches its
+ * steady state, opening and closing instances allocates nothing.
+ */
+#define XO_TFRAME_BUF_MIN	64
+
+static char *
+xo_tframe_grow (char **bufp, xo_ssize_t *sizep, xo_ssize_t need)
+{
+    if (need <= *sizep)
+	return *bufp;
+
+    xo_ssize_t size = *sizep ? *sizep : XO_TFRAME_BUF_MIN;
+    while (size < need)
+	size *= 2;
+
+    char *newp = xo_realloc(*bufp, size);
+    if (newp == NULL)
+	return NULL;
+
+    *bufp = newp;
+    *sizep = size;
+    return newp;
+}
+
+/*
+ * Reset a frame for a new node, keeping its pooled buffers
+ */
+static void
+xo_tframe_reset (xo_tframe_t *frame)
+{
+    char *keys = frame->xtf_keys, *attrs = frame->xtf_attrs;
+    char *self = frame->xtf_self_buf;
+    struct xo_tvalue_s *values = frame->xtf_values;
+    xo_ssize_t keys_size = frame->xtf_keys_size;
+    xo_ssize_t attrs_size = frame->xtf_attrs_size;
+    xo_ssize_t self_size = frame->xtf_self_size;
+    uint32_t values_cap = frame->xtf_values_cap;
+
+    bzero(frame, sizeof(*frame));
+
+    frame->xtf_keys = keys;
+    frame->xtf_keys_size = keys_size;
+    frame->xtf_attrs = attrs;
+    frame->xtf_attrs_size = attrs_size;
+    frame->xtf_self_buf = self;
+    frame->xtf_self_size = self_size;
+    frame->xtf_values = values;
+    frame->xtf_values_cap = values_cap;
+}
+
+/*
+ * Release a frame's pooled buffers
+ */
+static void
+xo_tframe_free (xo_tframe_t *frame)
+{
+    xo_free(frame->xtf_keys);
+    xo_free(frame->xtf_attrs);
+    xo_free(frame->xtf_self_buf);
+    xo_free(frame->xtf_values);
+    bzero(frame, sizeof(*frame));
+}
+
 static void
 xo_tframe_key_add (xo_tframe_t *frame,
 		   const char *tag, xo_ssize_t tlen,
 		   const char *value, xo_ssize_t vlen)
 {
     xo_ssize_t new_len = tlen + vlen + 3; /* two NULs plus final NUL */
-    char *newp = xo_realloc(frame->xtf_keys, frame->xtf_keys_len + new_len);
+    char *oldp = frame->xtf_keys;
+    char *newp = xo_tframe_grow(&frame->xtf_keys, &frame->xtf_keys_size,
+				frame->xtf_keys_len + new_len);
     if (newp == NULL)
 	return;
 
+    if (newp != oldp)		/* Cached numbers point into the old buffer */
+	frame->xtf_values_count = 0;
+
     char *addp = newp + frame->xtf_keys_len;
     memcpy(addp, tag, tlen);
     addp += tlen;
@@ -351,17 +1389,6 @@ xo_tframe_key_add (xo_tframe_t *frame,
     *addp++ = '\0';
 
     frame->xtf_keys_len += new_len - 1; /* exclude the final extra NUL */
-    frame->xtf_keys = newp;
-}
-
-static void
-xo_tframe_free_keys (xo_tframe_t *frame)
-{
-    if (frame->xtf_keys) {
-	xo_free(frame->xtf_keys);
-	frame->xtf_keys = NULL;
-	frame->xtf_keys_len = 0;
-    }
 }
 
 /*
@@ -375,7 +1402,8 @@ xo_tframe_set_self (xo_tframe_t *frame, const char *value, xo_ssize_t vlen)
     if (value == NULL || vlen <= 0)
 	return;
 
-    char *newp = xo_realloc(NULL, vlen + 1);
+    char *newp = xo_tframe_grow(&frame->xtf_self_buf, &frame->xtf_self_size,
+				vlen + 1);
     if (newp == NULL)
 	return;
 
@@ -383,16 +1411,7 @@ xo_tframe_set_self (xo_tframe_t *frame, const char *value, xo_ssize_t vlen)
     newp[vlen] = '\0';
     frame->xtf_self = newp;
     frame->xtf_self_len = vlen;
-}
-
-static void
-xo_tframe_free_self (xo_tframe_t *frame)
-{
-    if (frame->xtf_self) {
-	xo_free(frame->xtf_self);
-	frame->xtf_self = NULL;
-	frame->xtf_self_len = 0;
-    }
+    frame->xtf_values_count = 0; /* Any cached self value is stale */
 }
 
 static void
@@ -401,10 +1420,15 @@ xo_tframe_attr_add (xo_tframe_t *frame,
 		    const char *value, xo_ssize_t vlen)
 {
     xo_ssize_t new_len = tlen + vlen + 3;
-    char *newp = xo_realloc(frame->xtf_attrs, frame->xtf_attrs_len + new_len);
+    char *oldp = frame->xtf_attrs;
+    char *newp = xo_tframe_grow(&frame->xtf_attrs, &frame->xtf_attrs_size,
+				frame->xtf_attrs_len + new_len);
     if (newp == NULL)
 	return;
 
+    if (newp != oldp)
+	frame->xtf_values_count = 0;
+
     char *addp = newp + frame->xtf_attrs_len;
     memcpy(addp, tag, tlen);
     addp += tlen;
@@ -415,17 +1439,6 @@ xo_tframe_attr_add (xo_tframe_t *frame,
     *addp++ = '\0';
 
     frame->xtf_attrs_len += new_len - 1;
-    frame->xtf_attrs = newp;
-}
-
-static void
-xo_tframe_free_attrs (xo_tframe_t *frame)
-{
-    if (frame->xtf_attrs) {
-	xo_free(frame->xtf_attrs);
-	frame->xtf_attrs = NULL;
-	frame->xtf_attrs_len = 0;
-    }
 }
 
 static int
@@ -467,13 +1480,19 @@ static void
 xo_tmatch_cleanup (xo_tmatch_t *xtmp)
 {
     if (xtmp->xtm_stack) {
-	for (uint32_t d = 0; d <= xtmp->xtm_depth; d++) {
-	    xo_tframe_free_keys(&xtmp->xtm_stack[d]);
-	    xo_tframe_free_attrs(&xtmp->xtm_stack[d]);
-	}
+	/* Closed frames above the depth still hold pooled buffers */
+	for (uint32_t d = 0; d < xtmp->xtm_cap; d++)
+	    xo_tframe_free(&xtmp->xtm_stack[d]);
 	xo_free(xtmp->xtm_stack);
 	xtmp->xtm_stack = NULL;
     }
+
+    xo_free(xtmp->xtm_totals);
+    xtmp->xtm_totals = NULL;
+    xtmp->xtm_totals_count = xtmp->xtm_totals_cap = 0;
+
+    xo_free(xtmp->xtm_stats);
+    xtmp->xtm_stats = NULL;
 }
 
 /*
@@ -492,6 +1511,11 @@ static int xo_tmatch_try_eager(xo_handle_t *, xo_filter_t *, xo_tframe_t *,
 			       xo_tmatch_t *);
 static void xo_filter_force_resolve_pred(xo_handle_t *, xo_filter_t *,
 					 const char *);
+static void xo_rematch_precompile(xo_filter_t *);
+static void xo_rematch_cleanup(xo_filter_t *);
+static int xo_filter_image_release(xo_filter_t *, int);
+
+#define XO_REMATCH_MAX	32	/* Cached rematch() patterns per filter */
 
 typedef unsigned xo_xsf_flags_t;   /* Type for XFSF_* flag fields */
 
@@ -503,11 +1527,20 @@ struct xo_filter_s {		 /* Forward/typdef decl in xo_private.h */
     xo_xsf_flags_t xf_flags;	 /* Flags (XFSF_*) */
     xo_trie_t *xf_trie;	 /* Compiled trie (NULL until first filter added) */
     xo_tmatch_t xf_tmatch;	 /* Runtime trie-matching state */
+    struct xo_rematch_s *xf_rematch[XO_REMATCH_MAX]; /* rematch() cache */
+    uint32_t xf_rematch_next;	 /* Next xf_rematch slot to (re)use */
+    void *xf_image;		 /* Mapped filter image (NULL = none) */
+    size_t xf_image_size;	 /* Size of xf_image */
+    xo_buffer_t xf_results;	 /* Aggregate results (see xo_filter_op_aggregates) */
+    xo_buffer_t xf_labels;	 /* Expression text, for filter-stats */
+    xo_off_t *xf_path_label;	 /* xf_labels offset + 1 per xd_paths entry */
+    uint32_t xf_path_label_cap;	 /* Allocated xf_path_label */
 };
 
 /* Flags for xf_flags */
 #define XFSF_BLOCK		(1<<0)	/* Block emitting data */
 #define XFSF_FORCE_RESOLVE	(1<<1)	/* Missing fields are "" at close */
+#define XFSF_AGGREGATE		(1<<2)	/* Emitting aggregate results */
 
 int
 xo_encoder_wb_marker (xo_handle_t *xop, xo_whiteboard_op_t op,
@@ -558,21 +1591,131 @@ xo_filter_xparse_data (xo_handle_t *xop UNUSED, xo_filter_t *xfp)
 static void
 xo_filter_op_destroy (xo_handle_t *xop, xo_filter_t *xfp)
 {
+    if (xfp->xf_image)
+	xo_filter_image_release(xfp, FALSE);
+
     xo_xparse_clean(&xfp->xf_xd);
     xo_tmatch_cleanup(&xfp->xf_tmatch);
     xo_trie_free(xfp->xf_trie);
     xfp->xf_trie = NULL;
+    xo_rematch_cleanup(xfp);
+    xo_buf_cleanup(&xfp->xf_results);
+    xo_buf_cleanup(&xfp->xf_labels);
+    xo_free(xfp->xf_path_label);
 
     xo_set_filter_data(xop, NULL);
     xo_free(xfp);
 }
 
+/*
+ * Add a match to an aggregate's total in the nearest container
+ * enclosing the matched node.  Matches with no enclosing container
+ * have nowhere for their result to go, so they aren't counted.  Only
+ * fields have values, which are only known while they are opened;
+ * values that aren't numbers are counted but don't add to totals.
+ */
+static void
+xo_tmatch_total (xo_tmatch_t *xtmp, xo_tframe_t *frame, xo_tnode_t *tn)
+{
+    uint32_t depth = frame - xtmp->xtm_stack;
+
+    while (depth > 1 && !xtmp->xtm_stack[--depth].xtf_container)
+	continue;
+    if (depth == 0 || !xtmp->xtm_stack[depth].xtf_container)
+	return;
+
+    xo_ttotal_t *xttp = xtmp->xtm_totals;
+    uint32_t i;
+
+    for (i = 0; i < xtmp->xtm_totals_count; i++, xttp++)
+	if (xttp->xtt_depth == depth && xttp->xtt_agg == tn->xtn_agg)
+	    break;
+
+    if (i == xtmp->xtm_totals_count) {
+	if (i == xtmp->xtm_totals_cap) {
+	    uint32_t cap = xtmp->xtm_totals_cap ? xtmp->xtm_totals_cap * 2 : 8;
+	    xttp = xo_realloc(xtmp->xtm_totals, cap * sizeof(*xttp));
+	    if (xttp == NULL)
+		return;
+	    xtmp->xtm_totals = xttp;
+	    xtmp->xtm_totals_cap = cap;
+	}
+
+	xttp = &xtmp->xtm_totals[xtmp->xtm_totals_count++];
+	bzero(xttp, sizeof(*xttp));
+	xttp->xtt_depth = depth;
+	xttp->xtt_agg = tn->xtn_agg;
+    }
+
+    xttp->xtt_count += 1;
+
+    int func = xtmp->xtm_trie->xt_aggs[tn->xtn_agg].xtag_func;
+    if (func == XTAF_COUNT || xtmp->xtm_value == NULL || xtmp->xtm_vlen <= 0
+	    || frame != &xtmp->xtm_stack[xtmp->xtm_depth])
+	return;
+
+    /* The value isn't NUL-terminated, so we copy it for strto* */
+    char buf[64], *ep;
+    if (xtmp->xtm_vlen >= (ssize_t) sizeof(buf))
+	return;
+    memcpy(buf, xtmp->xtm_value, xtmp->xtm_vlen);
+    buf[xtmp->xtm_vlen] = '\0';
+
+    int is_float = FALSE;
+    int64_t ival = strtoll(buf, &ep, 10);
+    xo_float_t fval = ival;
+    if (*ep != '\0' || ep == buf) {
+	fval = strtod(buf, &ep);
+	if (*ep != '\0' || ep == buf)
+	    return;
+	is_float = TRUE;
+    }
+
+    if (xttp->xtt_nvalues++ == 0) {
+	xttp->xtt_float = is_float;
+	xttp->xtt_int = ival;
+	xttp->xtt_value = fval;
+	return;
+    }
+
+    if (is_float)
+	xttp->xtt_float = TRUE;
+
+    switch (func) {
+    case XTAF_SUM:
+	xttp->xtt_int += ival;
+	xttp->xtt_value += fval;
+	break;
+
+    case XTAF_MIN:
+	if (fval < xttp->xtt_value) {
+	    xttp->xtt_int = ival;
+	    xttp->xtt_value = fval;
+	}
+	break;
+
+    case XTAF_MAX:
+	if (fval > xttp->xtt_value) {
+	    xttp->xtt_int = ival;
+	    xttp->xtt_value = fval;
+	}
+	break;
+    }
+}
+
 static void
 xo_tmatch_record_live (xo_tmatch_t *xtmp, xo_tframe_t *frame, xo_tnode_t *tn)
 {
     if (!(tn->xtn_flags & XTNF_TERMINAL))
 	return;
 
+    XO_TSTAT(xtmp, tn - xtmp->xtm_trie->xt_nodes, xts_matches);
+
+    if (tn->xtn_flags & XTNF_AGGREGATE) {
+	xo_tmatch_total(xtmp, frame, tn);
+	return;
+    }
+
     if (tn->xtn_flags & XTNF_NOT) {
 	xtmp->xtm_deny += 1;
 	frame->xtf_deny_delta += 1;
@@ -686,103 +1829,278 @@ xo_tmatch_note_pred (xo_filter_t *xfp, xo_tframe_t *frame,
     }
 }
 
-static void
-xo_tmatch_open (xo_handle_t *xop, xo_filter_t *xfp,
-		xo_tmatch_t *xtmp, const char *tag, ssize_t tlen,
-		const char *value, ssize_t vlen)
+/*
+ * Return the first entry in an index run whose atom is not less than
+ * the one we're looking for
+ */
+static uint32_t
+xo_tindex_lower (xo_tindex_t *base, uint32_t count, xo_atom_t atom)
 {
-    xo_trie_t *xtp = xtmp->xtm_trie;
-    xo_xparse_data_t *xdp = xtp->xt_xd;
+    uint32_t lo = 0, hi = count;
 
-    if (xtmp->xtm_depth + 1 >= xtmp->xtm_cap) {
-	uint32_t cap = xtmp->xtm_cap * 2;
-	xo_tframe_t *p = xo_realloc(xtmp->xtm_stack, cap * sizeof(*p));
-	if (p == NULL)
-	    return;
-	bzero(p + xtmp->xtm_cap, (cap - xtmp->xtm_cap) * sizeof(*p));
-	xtmp->xtm_stack = p;
-	xtmp->xtm_cap = cap;
+    while (lo < hi) {
+	uint32_t mid = lo + (hi - lo) / 2;
+	if (base[mid].xti_atom < atom)
+	    lo = mid + 1;
+	else
+	    hi = mid;
     }
 
-    xo_tframe_t *parent = &xtmp->xtm_stack[xtmp->xtm_depth];
-    xtmp->xtm_depth += 1;
-    xo_tframe_t *frame = &xtmp->xtm_stack[xtmp->xtm_depth];
-    bzero(frame, sizeof(*frame));
+    return lo;
+}
 
-    xo_dbg(xop, "xo_tmatch_open: depth %u tag '%.*s'",
-	   xtmp->xtm_depth, tlen, tag);
+/*
+ * Add a slot to the frame for each node in an index run that matches
+ * the tag's atom, plus the wildcards, which sort first.  For the root
+ * nodes, absolute paths only match at depth 1, and we skip nodes
+ * already added by descending from a parent.
+ */
+static void
+xo_tmatch_add (xo_handle_t *xop, xo_filter_t *xfp, xo_tmatch_t *xtmp,
+	       xo_tframe_t *parent, xo_tframe_t *frame,
+	       xo_tindex_t *base, uint32_t count, xo_atom_t atom, int root,
+	       const char *value, ssize_t vlen)
+{
+    xo_trie_t *xtp = xtmp->xtm_trie;
+    uint32_t k = 0, end;
 
-    /* Descend from every LIVE parent slot */
-    for (uint32_t i = 0; i < parent->xtf_count; i++) {
-	if (parent->xtf_state[i] != XTFS_LIVE)
-	    continue;
-	xo_tnode_t *ptn = &xtp->xt_nodes[parent->xtf_node[i]];
-	for (xo_trie_id_t c = ptn->xtn_child;
-		     c && frame->xtf_count < XO_TFRAME_MAX;
-		     c = xtp->xt_nodes[c].xtn_sibling) {
-	    xo_tnode_t *tn = &xtp->xt_nodes[c];
-	    const char *nm = xo_xparse_str(xdp, tn->xtn_name);
-	    if (!(tn->xtn_flags & XTNF_WILDCARD) &&
-		    (nm == NULL || !xo_streqn(nm, tag, tlen)))
-		continue;
+    for (end = 0; end < count && base[end].xti_atom == 0; end++)
+	continue;
 
-	    uint32_t position = xo_tframe_child_position(parent, c);
-	    uint32_t s = frame->xtf_count++;
-	    frame->xtf_node[s] = c;
-	    frame->xtf_position[s] = position;
-
-	    if (tn->xtn_pred) {
-		xo_tmatch_note_pred(xfp, frame, tn->xtn_pred, value, vlen);
-		frame->xtf_position_cur = position;
-		frame->xtf_state[s] =
-		    xo_tmatch_try_eager(xop, xfp, frame, tn->xtn_pred,
-					tn, xtmp);
-	    } else {
-		frame->xtf_state[s] = XTFS_LIVE;
-		xo_tmatch_record_live(xtmp, frame, tn);
-	    }
-	}
-    }
+    for (;;) {
+	if (k == end) {
+	    if (atom == 0 || end == count)
+		break;
 
-    /* Re-probe root nodes for relative paths; absolute only at depth 1 */
-    for (xo_trie_id_t r = xtp->xt_root; r && frame->xtf_count < XO_TFRAME_MAX;
-	 r = xtp->xt_nodes[r].xtn_sibling) {
-	xo_tnode_t *tn = &xtp->xt_nodes[r];
-	if ((tn->xtn_flags & XTNF_ABSOLUTE) && xtmp->xtm_depth != 1)
+	    /* Done with the wildcards; on to the tag's own run */
+	    k = end + xo_tindex_lower(base + end, count - end, atom);
+	    for (end = k; end < count && base[end].xti_atom == atom; end++)
+		continue;
+	    atom = 0;
 	    continue;
+	}
 
-	const char *nm = xo_xparse_str(xdp, tn->xtn_name);
-	if (!(tn->xtn_flags & XTNF_WILDCARD) &&
-		(nm == NULL || !xo_streqn(nm, tag, tlen)))
-	    continue;
+	if (frame->xtf_count >= XO_TFRAME_MAX)
+	    break;
 
-	/* Avoid duplicating a node already added via parent descent */
-	int dup = FALSE;
-	for (uint32_t j = 0; j < frame->xtf_count; j++) {
-	    if (frame->xtf_node[j] == r) {
-		dup = TRUE;
-		break;
+	xo_trie_id_t c = base[k++].xti_node;
+	xo_tnode_t *tn = &xtp->xt_nodes[c];
+
+	if (root) {
+	    if ((tn->xtn_flags & XTNF_ABSOLUTE) && xtmp->xtm_depth != 1)
+		continue;
+
+	    /* Avoid duplicating a node already added via parent descent */
+	    int dup = FALSE;
+	    for (uint32_t j = 0; j < frame->xtf_count; j++) {
+		if (frame->xtf_node[j] == c) {
+		    dup = TRUE;
+		    break;
+		}
 	    }
-	}
 
-	if (dup)
-	    continue;
+	    if (dup)
+		continue;
+	}
 
-	uint32_t position = xo_tframe_child_position(parent, r);
+	uint32_t position = xo_tframe_child_position(parent, c);
 	uint32_t s = frame->xtf_count++;
-	frame->xtf_node[s] = r;
+	frame->xtf_node[s] = c;
 	frame->xtf_position[s] = position;
+	if (tn->xtn_limit || tn->xtn_qual_limit)
+	    frame->xtf_limited = TRUE;
+
+	XO_TSTAT(xtmp, c, xts_visits);
 
-	if (tn->xtn_pred) {
+	if (tn->xtn_flags & XTNF_KEYS) {
+	    frame->xtf_state[s] = XTFS_PRED; /* Wait for the field */
+	    XO_TSTAT(xtmp, c, xts_deferred);
+	} else if (tn->xtn_pred) {
 	    xo_tmatch_note_pred(xfp, frame, tn->xtn_pred, value, vlen);
 	    frame->xtf_position_cur = position;
 	    frame->xtf_state[s] =
 		xo_tmatch_try_eager(xop, xfp, frame, tn->xtn_pred, tn, xtmp);
+	    if (frame->xtf_state[s] == XTFS_PRED)
+		XO_TSTAT(xtmp, c, xts_deferred);
+	    else
+		XO_TSTAT(xtmp, c, xts_eager);
 	} else {
 	    frame->xtf_state[s] = XTFS_LIVE;
 	    xo_tmatch_record_live(xtmp, frame, tn);
 	}
     }
+}
+
+/*
+ * Has a node used up every position its predicates allow among the
+ * children of this parent?  The counters only grow, so once it has,
+ * no later sibling can match it.
+ */
+static int
+xo_tmatch_exhausted (xo_tframe_t *parent, xo_trie_id_t c, xo_tnode_t *tn)
+{
+    uint32_t j;
+
+    if (tn->xtn_limit) {
+	for (j = 0; j < parent->xtf_child_ncount; j++)
+	    if (parent->xtf_child_node[j] == c)
+		break;
+	if (j < parent->xtf_child_ncount
+		&& parent->xtf_child_count_val[j] >= tn->xtn_limit)
+	    return TRUE;
+    }
+
+    if (tn->xtn_qual_limit) {
+	for (j = 0; j < parent->xtf_child_qual_ncount; j++)
+	    if (parent->xtf_child_qual_node[j] == c)
+		break;
+	if (j < parent->xtf_child_qual_ncount
+		&& parent->xtf_child_qual_val[j] >= tn->xtn_qual_limit)
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Does every node a child named by 'atom' could match in an index run
+ * have its positions used up?  "Not" nodes don't count, since they
+ * can't make output.
+ */
+static int
+xo_tmatch_run_exhausted (xo_trie_t *xtp, xo_tframe_t *parent,
+			 xo_tindex_t *base, uint32_t count, xo_atom_t atom)
+{
+    for (uint32_t k = 0; k < count; k++) {
+	if (base[k].xti_atom != 0 && base[k].xti_atom != atom)
+	    continue;
+
+	xo_trie_id_t c = base[k].xti_node;
+	xo_tnode_t *tn = &xtp->xt_nodes[c];
+	if (tn->xtn_flags & XTNF_NOT)
+	    continue;
+
+	if ((tn->xtn_flags & XTNF_KEYS) || !xo_tmatch_exhausted(parent, c, tn))
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Can no later child named by 'atom' of the current frame make any
+ * output?  That's the case when every path it could match has a
+ * position predicate whose positions are used up.  Like
+ * xo_filter_op_subtree_dead, this needs all paths to be absolute, and
+ * no pending predicates above us, since they could still make an
+ * ancestor live.  When it's so, the frame remembers it, and
+ * xo_tmatch_open skips those children without matching them.
+ */
+static int
+xo_tmatch_list_dead (xo_tmatch_t *xtmp, xo_atom_t atom)
+{
+    xo_trie_t *xtp = xtmp->xtm_trie;
+    xo_tframe_t *parent = &xtmp->xtm_stack[xtmp->xtm_depth];
+
+    if (parent->xtf_list_dead && parent->xtf_list_atom == atom)
+	return TRUE;
+
+    if (xtp->xt_relative || xtmp->xtm_allow || xtmp->xtm_deny)
+	return FALSE;
+
+    for (uint32_t d = 1; d <= xtmp->xtm_depth; d++) {
+	xo_tframe_t *framep = &xtmp->xtm_stack[d];
+	for (uint32_t i = 0; i < framep->xtf_count; i++)
+	    if (framep->xtf_state[i] == XTFS_PRED)
+		return FALSE;
+    }
+
+    for (uint32_t i = 0; i < parent->xtf_count; i++) {
+	if (parent->xtf_state[i] != XTFS_LIVE)
+	    continue;
+
+	xo_tnode_t *ptn = &xtp->xt_nodes[parent->xtf_node[i]];
+	if (!xo_tmatch_run_exhausted(xtp, parent, &xtp->xt_index[ptn->xtn_index],
+				     ptn->xtn_nindex, atom))
+	    return FALSE;
+    }
+
+    /* Absolute root nodes only match at depth one */
+    if (xtmp->xtm_depth == 0
+	    && !xo_tmatch_run_exhausted(xtp, parent,
+					&xtp->xt_index[xtp->xt_root_index],
+					xtp->xt_root_nindex, atom))
+	return FALSE;
+
+    parent->xtf_list_dead = TRUE;
+    parent->xtf_list_atom = atom;
+    return TRUE;
+}
+
+static void
+xo_tmatch_open (xo_handle_t *xop, xo_filter_t *xfp,
+		xo_tmatch_t *xtmp, const char *tag, ssize_t tlen,
+		const char *value, ssize_t vlen)
+{
+    xo_trie_t *xtp = xtmp->xtm_trie;
+
+    if (xtmp->xtm_depth + 1 >= xtmp->xtm_cap) {
+	uint32_t cap = xtmp->xtm_cap * 2;
+	xo_tframe_t *p = xo_realloc(xtmp->xtm_stack, cap * sizeof(*p));
+	if (p == NULL)
+	    return;
+	bzero(p + xtmp->xtm_cap, (cap - xtmp->xtm_cap) * sizeof(*p));
+	xtmp->xtm_stack = p;
+	xtmp->xtm_cap = cap;
+    }
+
+    /*
+     * The "filter-stats" option may be set after the filter is added,
+     * so we look at the first open.  Counting costs a test per event
+     * when it's off.
+     */
+    if (!xtmp->xtm_stats_checked) {
+	xtmp->xtm_stats_checked = TRUE;
+	if (xo_isset_flags(xop, XOF_FILTER_STATS)) {
+	    size_t size = (xtp->xt_count + 1) * sizeof(*xtmp->xtm_stats);
+	    xtmp->xtm_stats = xo_realloc(NULL, size);
+	    if (xtmp->xtm_stats)
+		bzero(xtmp->xtm_stats, size);
+	}
+    }
+
+    xo_tframe_t *parent = &xtmp->xtm_stack[xtmp->xtm_depth];
+    xtmp->xtm_depth += 1;
+    xo_tframe_t *frame = &xtmp->xtm_stack[xtmp->xtm_depth];
+    xo_tframe_reset(frame);
+
+    xo_dbg(xop, "xo_tmatch_open: depth %u tag '%.*s'",
+	   xtmp->xtm_depth, tlen, tag);
+
+    /* A tag that names no node can still match wildcards */
+    xo_atom_t atom = xo_trie_atom_find(xtp, tag, tlen);
+    frame->xtf_atom = atom;
+
+    /* Nothing in a dead list can match, so don't look */
+    if (parent->xtf_list_dead && parent->xtf_list_atom == atom) {
+	xo_dbg(xop, "xo_tmatch_open: list '%.*s' is dead", tlen, tag);
+	return;
+    }
+
+    /* Descend from every LIVE parent slot */
+    for (uint32_t i = 0; i < parent->xtf_count; i++) {
+	if (parent->xtf_state[i] != XTFS_LIVE)
+	    continue;
+	xo_tnode_t *ptn = &xtp->xt_nodes[parent->xtf_node[i]];
+	xo_tmatch_add(xop, xfp, xtmp, parent, frame,
+		      &xtp->xt_index[ptn->xtn_index], ptn->xtn_nindex,
+		      atom, FALSE, value, vlen);
+    }
+
+    /* Re-probe root nodes for relative paths; absolute only at depth 1 */
+    xo_tmatch_add(xop, xfp, xtmp, parent, frame,
+		  &xtp->xt_index[xtp->xt_root_index], xtp->xt_root_nindex,
+		  atom, TRUE, value, vlen);
 
     xo_dbg(xop, "xo_tmatch_open: frame %u active [allow %u/deny %u]",
 	   frame->xtf_count, xtmp->xtm_allow, xtmp->xtm_deny);
@@ -798,14 +2116,24 @@ xo_tmatch_close (xo_handle_t *xop, xo_filter_t *xfp UNUSED,
     xo_tframe_t *frame = &xtmp->xtm_stack[xtmp->xtm_depth];
     xtmp->xtm_allow -= frame->xtf_allow_delta;
     xtmp->xtm_deny  -= frame->xtf_deny_delta;
-    xo_tframe_free_keys(frame);
-    xo_tframe_free_attrs(frame);
-    xo_tframe_free_self(frame);
 
     xo_dbg(xop, "xo_tmatch_close: depth %u [allow %u/deny %u]",
 	   xtmp->xtm_depth, xtmp->xtm_allow, xtmp->xtm_deny);
 
+    /* Totals for a closing container are done with */
+    if (frame->xtf_container && xtmp->xtm_totals_count) {
+	uint32_t i, j;
+	for (i = j = 0; i < xtmp->xtm_totals_count; i++)
+	    if (xtmp->xtm_totals[i].xtt_depth != xtmp->xtm_depth)
+		xtmp->xtm_totals[j++] = xtmp->xtm_totals[i];
+	xtmp->xtm_totals_count = j;
+    }
+
     xtmp->xtm_depth -= 1;
+
+    /* Closing a sibling is what can use up a position predicate */
+    if (frame->xtf_limited)
+	xo_tmatch_list_dead(xtmp, frame->xtf_atom);
 }
 
 /*
@@ -819,27 +2147,25 @@ static xo_filter_status_t xo_tmatch_attr(xo_handle_t *, xo_filter_t *,
 					  xo_tmatch_t *, const char *,
 					  xo_ssize_t, const char *, xo_ssize_t);
 
+static int xo_filter_unsupported_tokens[] = {
+    L_DOTDOT, L_DOTDOTDOT,
+    K_COMMENT, K_ID, K_KEY, K_NODE,
+    K_PROCESSING_INSTRUCTION, K_TEXT, L_DSLASH,
+    T_AXIS_NAME, T_VAR, M_SEQUENCE, C_DESCENDANT,
+    C_TEST, C_UNION, C_NESTED_PREDICATES, C_PREDICATE_PATHS,
+    0
+};
+
 /*
- * Add a filter (xpath) to our filtering mechanism
+ * Parse one expression, adding its paths to xd_paths, and check that
+ * we can filter with them.  On failure, the new paths are dropped.
  */
 static int
-xo_filter_op_add_one (xo_handle_t *xop, const char *input)
+xo_filter_parse_one (xo_handle_t *xop, xo_xparse_data_t *xdp,
+		     const char *input)
 {
-    static int unsupported_tokens[] = {
-	L_DOTDOT, L_DOTDOTDOT,
-	K_COMMENT, K_ID, K_KEY, K_NODE,
-	K_PROCESSING_INSTRUCTION, K_TEXT, L_DSLASH,
-	T_AXIS_NAME, T_VAR, M_SEQUENCE, C_DESCENDANT,
-	C_TEST, C_UNION, C_NESTED_PREDICATES, C_PREDICATE_PATHS,
-	0
-    };
-
-    xo_filter_t *xfp = xo_get_filter_data(xop, TRUE);
-    if (xfp == NULL)
-	return -1;
-
-    xo_xparse_data_t *xdp = xo_filter_xparse_data(xop, xfp);
-    int start = xdp->xd_paths_cur;
+    int *unsupported_tokens = xo_filter_unsupported_tokens;
+    uint32_t start = xdp->xd_paths_cur;
 
     xo_xparse_set_unsupported_tokens(xdp, unsupported_tokens);
 
@@ -850,9 +2176,85 @@ xo_filter_op_add_one (xo_handle_t *xop, const char *input)
 					 unsupported_tokens, "");
     }
 
-    if (rc)
+    /* The only functions that can stand alone are aggregates */
+    for (uint32_t i = start; rc == 0 && i < xdp->xd_paths_cur; i++) {
+	xo_xparse_node_t *xnp = xo_xparse_node(xdp, xdp->xd_paths[i]);
+	if (xnp->xn_type == T_FUNCTION_NAME
+		&& xo_trie_agg_func(xdp, xdp->xd_paths[i], NULL) == 0) {
+	    xo_failure_filter(xop, "filter: '%s()' is not an aggregate "
+			      "of a path (count, sum, min, or max)",
+			      xo_xparse_str(xdp, xnp->xn_str));
+	    rc = -1;
+	}
+    }
+
+    if (rc) {
+	xo_xparse_truncate_paths(xdp, start);
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Remember the text of the expression that made xd_paths[start..],
+ * so filter-stats can report by expression.  This is only done when
+ * the option is set before the filter is added, since keeping a copy
+ * of every expression isn't free; otherwise paths are numbered.
+ */
+static void
+xo_filter_label_paths (xo_handle_t *xop, xo_filter_t *xfp,
+		       uint32_t start, const char *input)
+{
+    uint32_t count = xfp->xf_xd.xd_paths_cur;
+
+    if (start == count || !xo_isset_flags(xop, XOF_FILTER_STATS))
+	return;
+
+    if (count > xfp->xf_path_label_cap) {
+	uint32_t cap = xfp->xf_path_label_cap ? xfp->xf_path_label_cap : 16;
+	while (cap < count)
+	    cap *= 2;
+
+	xo_off_t *p = xo_realloc(xfp->xf_path_label, cap * sizeof(*p));
+	if (p == NULL)
+	    return;
+
+	bzero(p + xfp->xf_path_label_cap,
+	      (cap - xfp->xf_path_label_cap) * sizeof(*p));
+	xfp->xf_path_label = p;
+	xfp->xf_path_label_cap = cap;
+    }
+
+    xo_off_t off = xo_buf_offset(&xfp->xf_labels) + 1;
+    xo_buf_append_val(&xfp->xf_labels, input, strlen(input) + 1);
+
+    for (uint32_t i = start; i < count; i++)
+	xfp->xf_path_label[i] = off;
+}
+
+/*
+ * Add a filter (xpath) to our filtering mechanism
+ */
+static int
+xo_filter_op_add_one (xo_handle_t *xop, const char *input)
+{
+    xo_filter_t *xfp = xo_get_filter_data(xop, TRUE);
+    if (xfp == NULL)
+	return -1;
+
+    /* An image's arrays are read-only, so we take a copy to add to */
+    if (xfp->xf_image && xo_filter_image_release(xfp, TRUE) < 0)
+	return -1;
+
+    xo_xparse_data_t *xdp = xo_filter_xparse_data(xop, xfp);
+    uint32_t start = xdp->xd_paths_cur;
+
+    if (xo_filter_parse_one(xop, xdp, input) < 0)
 	return -1;
 
+    xo_filter_label_paths(xop, xfp, start, input);
+
     /* Recompile the trie from all expressions accumulated so far */
     xo_trie_free(xfp->xf_trie);
     xo_tmatch_cleanup(&xfp->xf_tmatch);
@@ -867,9 +2269,232 @@ xo_filter_op_add_one (xo_handle_t *xop, const char *input)
 	return -1;
     }
 
+    xo_rematch_precompile(xfp);
+
+    return 0;
+}
+
+/*
+ * The expressions seen while loading a file, so repeats are dropped
+ * before we spend time parsing them.  The hash holds offsets (plus
+ * one, so zero marks an empty slot) into the text buffer.
+ */
+typedef struct xo_fseen_s {
+    xo_buffer_t xfs_text;	/* Expressions, each NUL-terminated */
+    xo_off_t *xfs_hash;		/* Offsets (plus one) into xfs_text */
+    uint32_t xfs_nhash;		/* Number of slots (power of 2) */
+    uint32_t xfs_count;		/* Number of expressions seen */
+} xo_fseen_t;
+
+static int
+xo_fseen_rehash (xo_fseen_t *xfsp, uint32_t nhash)
+{
+    xo_off_t *hash = xo_realloc(NULL, nhash * sizeof(*hash));
+    if (hash == NULL)
+	return -1;
+
+    bzero(hash, nhash * sizeof(*hash));
+
+    for (uint32_t i = 0; i < xfsp->xfs_nhash; i++) {
+	xo_off_t off = xfsp->xfs_hash[i];
+	if (off == 0)
+	    continue;
+
+	const char *str = xo_buf_data(&xfsp->xfs_text, off - 1);
+	uint32_t h = xo_hash_buf(XO_HASH_INIT, str, strlen(str));
+	while (hash[h & (nhash - 1)])
+	    h += 1;
+	hash[h & (nhash - 1)] = off;
+    }
+
+    xo_free(xfsp->xfs_hash);
+    xfsp->xfs_hash = hash;
+    xfsp->xfs_nhash = nhash;
+
     return 0;
 }
 
+/*
+ * Record an expression, returning TRUE if we've already seen it
+ */
+static int
+xo_fseen_check (xo_fseen_t *xfsp, const char *str, size_t len)
+{
+    if (xfsp->xfs_count * 2 >= xfsp->xfs_nhash
+	    && xo_fseen_rehash(xfsp, xfsp->xfs_nhash
+			       ? xfsp->xfs_nhash * 2 : 256) < 0)
+	return FALSE;		/* Can't tell, so parse it */
+
+    uint32_t mask = xfsp->xfs_nhash - 1;
+    uint32_t h = xo_hash_buf(XO_HASH_INIT, str, len);
+    xo_off_t off;
+
+    for ( ; (off = xfsp->xfs_hash[h & mask]) != 0; h++) {
+	const char *cp = xo_buf_data(&xfsp->xfs_text, off - 1);
+	if (memcmp(cp, str, len) == 0 && cp[len] == '\0')
+	    return TRUE;
+    }
+
+    off = xo_buf_offset(&xfsp->xfs_text);
+    char *newp = xo_buf_append_val(&xfsp->xfs_text, str, len + 1);
+    if (newp == NULL)
+	return FALSE;
+
+    newp[len] = '\0';
+    xfsp->xfs_hash[h & mask] = off + 1;
+    xfsp->xfs_count += 1;
+
+    return FALSE;
+}
+
+/*
+ * Read a line of any length into the buffer, returning its length
+ * (without the newline) or -1 at end of file
+ */
+static ssize_t
+xo_filter_read_line (FILE *fp, xo_buffer_t *xbp)
+{
+    char buf[BUFSIZ];
+    size_t len;
+
+    xo_buf_reset(xbp);
+
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+	len = strlen(buf);
+	if (xo_buf_append_val(xbp, buf, len) == NULL)
+	    return -1;
+	if (len > 0 && buf[len - 1] == '\n')
+	    break;
+    }
+
+    len = xo_buf_offset(xbp);
+    if (len == 0)
+	return -1;
+
+    if (xo_buf_append_val(xbp, "", 1) == NULL) /* NUL-terminate */
+	return -1;
+
+    return len;
+}
+
+/*
+ * Add the filters (xpaths) in a file, one per line.  Blank lines and
+ * lines starting with '#' are ignored, as are repeats.  Each line is
+ * parsed on its own and its paths go straight into a new trie, which
+ * is finished once at the end, so loading is linear in the size of
+ * the file, not quadratic as calling xo_filter_op_add_one per line
+ * would be.  A line that fails to parse is reported (by file and line
+ * number) and skipped, the rest are still used, and -1 is returned.
+ */
+static int
+xo_filter_op_add_file (xo_handle_t *xop, const char *path)
+{
+    const char bom0 = 0xEF, bom1 = 0xBB, bom2 = 0xBF;
+
+    xo_filter_t *xfp = xo_get_filter_data(xop, TRUE);
+    if (xfp == NULL)
+	return -1;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+	xo_failure_filter(xop, "filter: could not open '%s': %s",
+			  path, strerror(errno));
+	return -1;
+    }
+
+    /* An image's arrays are read-only, so we take a copy to add to */
+    if (xfp->xf_image && xo_filter_image_release(xfp, TRUE) < 0) {
+	fclose(fp);
+	return -1;
+    }
+
+    xo_xparse_data_t *xdp = xo_filter_xparse_data(xop, xfp);
+
+    /* Start with the paths we already have */
+    xo_trie_t *xtp = xo_trie_start(xdp);
+    if (xtp == NULL) {
+	fclose(fp);
+	return -1;
+    }
+
+    uint32_t agg = 0;
+    xo_trie_add_paths(xtp, xdp, 0, &agg);
+
+    xo_buffer_t line;
+    xo_fseen_t seen;
+    unsigned lineno = 0, errors = 0, count = 0;
+    ssize_t len;
+
+    xo_buf_init(&line);
+    bzero(&seen, sizeof(seen));
+    xo_buf_init(&seen.xfs_text);
+
+    snprintf(xdp->xd_filename, sizeof(xdp->xd_filename), "%s", path);
+
+    while ((len = xo_filter_read_line(fp, &line)) >= 0) {
+	char *cp = line.xb_bufp, *ep = cp + len;
+
+	/* The UTF-8 file can start with a "BOM", which we skip */
+	if (lineno++ == 0 && len >= 3 && cp[0] == bom0
+		&& cp[1] == bom1 && cp[2] == bom2)
+	    cp += 3;
+
+	while (cp < ep && isspace((int) *cp))
+	    cp += 1;
+	while (ep > cp && isspace((int) ep[-1]))
+	    ep -= 1;
+	*ep = '\0';
+
+	if (cp == ep || *cp == '#')
+	    continue;
+
+	if (xo_fseen_check(&seen, cp, ep - cp))
+	    continue;
+
+	count += 1;
+	xdp->xd_line = lineno;
+
+	uint32_t start = xdp->xd_paths_cur;
+	if (xo_filter_parse_one(xop, xdp, cp) < 0) {
+	    errors += 1;
+	    continue;
+	}
+
+	xo_filter_label_paths(xop, xfp, start, cp);
+	xo_trie_add_paths(xtp, xdp, start, &agg);
+    }
+
+    fclose(fp);
+    xo_buf_cleanup(&line);
+    xo_buf_cleanup(&seen.xfs_text);
+    xo_free(seen.xfs_hash);
+
+    xdp->xd_filename[0] = '\0';
+    xdp->xd_line = 1;
+
+    if (errors)
+	xo_failure_filter(xop, "filter: %s: %u of %u expressions "
+			  "could not be added", path, errors, count);
+
+    /* Swap in the new trie */
+    xo_trie_free(xfp->xf_trie);
+    xo_tmatch_cleanup(&xfp->xf_tmatch);
+
+    xfp->xf_trie = xo_trie_finish(xtp, xdp);
+    if (xfp->xf_trie == NULL)
+	return -1;
+
+    if (xo_tmatch_init(xop, &xfp->xf_tmatch, xfp->xf_trie) < 0) {
+	xo_trie_free(xfp->xf_trie);
+	xfp->xf_trie = NULL;
+	return -1;
+    }
+
+    xo_rematch_precompile(xfp);
+
+    return errors ? -1 : 0;
+}
+
 static xo_filter_status_t
 xo_filter_op_get_status (xo_handle_t *xop UNUSED, xo_filter_t *xfp)
 {
@@ -965,7 +2590,23 @@ xo_filter_open (xo_handle_t *xop, xo_filter_t *xfp,
 
     xfp->xf_total_depth += 1;
 
-    xo_tmatch_open(xop, xfp, &xfp->xf_tmatch, tag, tlen, value, vlen);
+    xo_tmatch_t *xtmp = &xfp->xf_tmatch;
+    xtmp->xtm_value = value;
+    xtmp->xtm_vlen = vlen;
+
+    xo_tmatch_open(xop, xfp, xtmp, tag, tlen, value, vlen);
+
+    xtmp->xtm_value = NULL;
+    xtmp->xtm_vlen = 0;
+
+    /*
+     * While aggregate results are emitted, their fields are as good
+     * as matched, which keeps them and the containers above them
+     */
+    if (xfp->xf_flags & XFSF_AGGREGATE) {
+	xtmp->xtm_stack[xtmp->xtm_depth].xtf_allow_delta += 1;
+	xtmp->xtm_allow += 1;
+    }
 
     xo_filter_change_status(xop, xfp, "open", tag, tlen);
 
@@ -976,7 +2617,13 @@ static int
 xo_filter_op_open_container (xo_handle_t *xop, xo_filter_t *xfp,
 			  const char *tag)
 {
-    return xo_filter_open(xop, xfp, tag, strlen(tag), "container", NULL, 0);
+    int rc = xo_filter_open(xop, xfp, tag, strlen(tag), "container", NULL, 0);
+
+    /* Aggregate totals are kept by container, not instance */
+    if (xfp && xfp->xf_trie)
+	xfp->xf_tmatch.xtm_stack[xfp->xf_tmatch.xtm_depth].xtf_container = TRUE;
+
+    return rc;
 }
 
 static int
@@ -1006,51 +2653,196 @@ xo_filter_close (xo_handle_t *xop, xo_filter_t *xfp,
     if (xfp->xf_total_depth > 0)
 	xfp->xf_total_depth -= 1;
 
-    XO_DBG(xop, "filter: close %s: '%.*s'", type, tlen, tag);
+    XO_DBG(xop, "filter: close %s: '%.*s'", type, tlen, tag);
+
+    xo_tmatch_close(xop, xfp, &xfp->xf_tmatch, tag, tlen);
+
+    xo_filter_change_status(xop, xfp, "close", tag, tlen);
+
+    return xfp->xf_status;
+}
+
+static int
+xo_filter_op_close_field (xo_handle_t *xop, xo_filter_t *xfp,
+		      const char *tag, ssize_t  tlen)
+{
+    return xo_filter_close(xop, xfp, tag, tlen, "field");
+}
+
+static int
+xo_filter_op_close_instance (xo_handle_t *xop, xo_filter_t *xfp,
+			  const char *tag)
+{
+    /*
+     * If the instance is still in PRED state at close time, the predicate
+     * field was never seen.  Force-resolve treating absent fields as empty
+     * string (XPath: absent node → empty nodeset → string("")).
+     */
+    if (xfp != NULL && xfp->xf_trie != NULL
+	    && xfp->xf_status == XO_STATUS_PRED)
+	xo_filter_force_resolve_pred(xop, xfp, tag);
+
+    xo_filter_status_t pre_close = xfp ? xfp->xf_status : XO_STATUS_ZERO;
+    xo_filter_close(xop, xfp, tag, strlen(tag), "instance");
+
+    /*
+     * If force-resolve promoted us to FULL, return FULL even though the
+     * frame pop has now decremented xtm_allow back.
+     */
+    return (pre_close == XO_STATUS_FULL) ? XO_STATUS_FULL
+	: (xfp ? xfp->xf_status : XO_STATUS_ZERO);
+}
+
+static int
+xo_filter_op_close_container (xo_handle_t *xop UNUSED, xo_filter_t *xfp,
+			   const char *tag)
+{
+    if (xfp)
+	xfp->xf_flags &= ~XFSF_AGGREGATE;
+
+    return xo_filter_close(xop, xfp, tag, strlen(tag), "container");
+}
+
+/*
+ * Return the aggregate results for the container being closed, as
+ * "name\0value\0...\0" pairs, or NULL if there are none.  libxo
+ * emits them as the container's last fields, and until the container
+ * closes, the fields it opens are treated as matches.
+ */
+static const char *
+xo_filter_op_aggregates (xo_handle_t *xop UNUSED, xo_filter_t *xfp)
+{
+    if (xfp == NULL || xfp->xf_trie == NULL)
+	return NULL;
+
+    xo_tmatch_t *xtmp = &xfp->xf_tmatch;
+    xo_trie_t *xtp = xtmp->xtm_trie;
+    xo_buffer_t *xbp = &xfp->xf_results;
+    char buf[64];
+
+    xo_buf_reset(xbp);
+
+    /* Results come in the order the aggregates were given */
+    for (uint32_t k = 1; k <= xtp->xt_aggs_count; k++) {
+	xo_ttotal_t *xttp = xtmp->xtm_totals;
+	uint32_t i;
+
+	for (i = 0; i < xtmp->xtm_totals_count; i++, xttp++)
+	    if (xttp->xtt_depth == xtmp->xtm_depth && xttp->xtt_agg == k)
+		break;
+	if (i == xtmp->xtm_totals_count)
+	    continue;
+
+	xo_tagg_t *xtap = &xtp->xt_aggs[xttp->xtt_agg];
+	if (xtap->xtag_func == XTAF_COUNT)
+	    snprintf(buf, sizeof(buf), "%" PRIu64, xttp->xtt_count);
+	else if (xttp->xtt_nvalues == 0)
+	    continue;		/* Nothing to report */
+	else if (xttp->xtt_float)
+	    snprintf(buf, sizeof(buf), "%.15g", xttp->xtt_value);
+	else
+	    snprintf(buf, sizeof(buf), "%" PRId64, xttp->xtt_int);
+
+	xo_buf_append_val(xbp, xtap->xtag_name, strlen(xtap->xtag_name) + 1);
+	xo_buf_append_val(xbp, buf, strlen(buf) + 1);
+    }
+
+    if (xo_buf_offset(xbp) == 0)
+	return NULL;
+
+    xo_buf_append_val(xbp, "", 1);
+    xfp->xf_flags |= XFSF_AGGREGATE;
+
+    return xbp->xb_bufp;
+}
+
+/*
+ * Return what the filter has done, for the "filter-stats" option, as
+ * "line\0line\0...\0" with one line per expression, or NULL if we
+ * weren't counting.  An expression's counts are summed over the trie
+ * nodes on its paths, so work on a shared prefix is counted for every
+ * expression that shares it; matches are those of its final nodes.
+ */
+static const char *
+xo_filter_op_stats (xo_handle_t *xop UNUSED, xo_filter_t *xfp)
+{
+    if (xfp == NULL || xfp->xf_trie == NULL || xfp->xf_tmatch.xtm_stats == NULL)
+	return NULL;
+
+    xo_xparse_data_t *xdp = &xfp->xf_xd;
+    xo_trie_t *xtp = xfp->xf_trie;
+    xo_tstat_t *stats = xfp->xf_tmatch.xtm_stats;
+    xo_buffer_t *xbp = &xfp->xf_results;
+    char buf[256];
+    uint64_t keyed = 0;
 
-    xo_tmatch_close(xop, xfp, &xfp->xf_tmatch, tag, tlen);
+    xo_buf_reset(xbp);
 
-    xo_filter_change_status(xop, xfp, "close", tag, tlen);
+    for (xo_trie_id_t id = 1; id <= xtp->xt_count; id++)
+	if (xtp->xt_nodes[id].xtn_flags & XTNF_KEYS)
+	    keyed += stats[id].xts_visits;
 
-    return xfp->xf_status;
-}
+    snprintf(buf, sizeof(buf), "paths %u, trie nodes %u, keyed lookups %"
+	     PRIu64, xdp->xd_paths_cur, xtp->xt_count, keyed);
+    xo_buf_append_val(xbp, buf, strlen(buf) + 1);
 
-static int
-xo_filter_op_close_field (xo_handle_t *xop, xo_filter_t *xfp,
-		      const char *tag, ssize_t  tlen)
-{
-    return xo_filter_close(xop, xfp, tag, tlen, "field");
-}
+    /* A mapped image doesn't say which node ends each path */
+    if (xtp->xt_path_node == NULL) {
+	xo_buf_append_val(xbp, "", 1);
+	return xbp->xb_bufp;
+    }
 
-static int
-xo_filter_op_close_instance (xo_handle_t *xop, xo_filter_t *xfp,
-			  const char *tag)
-{
-    /*
-     * If the instance is still in PRED state at close time, the predicate
-     * field was never seen.  Force-resolve treating absent fields as empty
-     * string (XPath: absent node → empty nodeset → string("")).
-     */
-    if (xfp != NULL && xfp->xf_trie != NULL
-	    && xfp->xf_status == XO_STATUS_PRED)
-	xo_filter_force_resolve_pred(xop, xfp, tag);
+    for (uint32_t i = 0; i < xdp->xd_paths_cur; ) {
+	xo_off_t label = (i < xfp->xf_path_label_cap)
+	    ? xfp->xf_path_label[i] : 0;
+	xo_tstat_t sum;
+	uint32_t first = i;
+
+	bzero(&sum, sizeof(sum));
+
+	/* The paths of a union share their expression's label */
+	do {
+	    xo_trie_id_t tid = (i < xtp->xt_path_cap)
+		? xtp->xt_path_node[i] : 0;
+	    if (tid)
+		sum.xts_matches += stats[tid].xts_matches;
+
+	    for ( ; tid; tid = xtp->xt_nodes[tid].xtn_parent) {
+		xo_tstat_t *xtsp = &stats[tid];
+		sum.xts_visits += xtsp->xts_visits;
+		sum.xts_evals += xtsp->xts_evals;
+		sum.xts_deferred += xtsp->xts_deferred;
+		sum.xts_eager += xtsp->xts_eager;
+		sum.xts_forced += xtsp->xts_forced;
+	    }
 
-    xo_filter_status_t pre_close = xfp ? xfp->xf_status : XO_STATUS_ZERO;
-    xo_filter_close(xop, xfp, tag, strlen(tag), "instance");
+	    i += 1;
+	} while (label && i < xdp->xd_paths_cur
+		 && i < xfp->xf_path_label_cap
+		 && xfp->xf_path_label[i] == label);
+
+	int len;
+	if (label)
+	    len = snprintf(buf, sizeof(buf), "\"%s\"",
+			   xfp->xf_labels.xb_bufp + label - 1);
+	else
+	    len = snprintf(buf, sizeof(buf), "path %u", first + 1);
+
+	if (len >= (int) sizeof(buf))	/* Long ones end with "..." */
+	    memcpy(buf + sizeof(buf) - 5, "...\"", 5);
+	xo_buf_append_val(xbp, buf, strlen(buf));
+
+	snprintf(buf, sizeof(buf), ": visited %" PRIu64 ", matched %" PRIu64
+		 ", predicates %" PRIu64 ", deferred %" PRIu64
+		 ", eager %" PRIu64 ", forced %" PRIu64,
+		 sum.xts_visits, sum.xts_matches, sum.xts_evals,
+		 sum.xts_deferred, sum.xts_eager, sum.xts_forced);
+	xo_buf_append_val(xbp, buf, strlen(buf) + 1);
+    }
 
-    /*
-     * If force-resolve promoted us to FULL, return FULL even though the
-     * frame pop has now decremented xtm_allow back.
-     */
-    return (pre_close == XO_STATUS_FULL) ? XO_STATUS_FULL
-	: (xfp ? xfp->xf_status : XO_STATUS_ZERO);
-}
+    xo_buf_append_val(xbp, "", 1);
 
-static int
-xo_filter_op_close_container (xo_handle_t *xop UNUSED, xo_filter_t *xfp,
-			   const char *tag)
-{
-    return xo_filter_close(xop, xfp, tag, strlen(tag), "container");
+    return xbp->xb_bufp;
 }
 
 /*
@@ -1166,7 +2958,7 @@ typedef struct xo_eval_value_s {
 
 static xo_eval_value_t xo_filter_pred_eval(xo_handle_t *, xo_filter_t *,
 					   xo_tframe_t *, xo_xparse_node_id_t);
-static int xo_eval_cast_boolean(xo_handle_t *, xo_eval_value_t);
+static int xo_eval_cast_boolean(xo_handle_t *, xo_tframe_t *, xo_eval_value_t);
 
 #define XO_EVAL_OP_ARGS \
     xo_handle_t *xop UNUSED, xo_filter_t *xfp UNUSED, \
@@ -1327,14 +3119,86 @@ xo_eval_make_number (xo_handle_t *xop, const char *str)
     return value;
 }
 
+/*
+ * A key, attribute, or self value that a predicate has used as a
+ * number.  Compound predicates use the same field several times (e.g.
+ * "[mtu > 1500 and mtu < 9000]"), so we parse each value once and keep
+ * the answer in the frame that holds the string, until the next
+ * sibling reuses the frame.
+ */
+typedef struct xo_tvalue_s {
+    const char *xtv_str;	/* The value, in one of the frame's buffers */
+    xo_eval_value_t xtv_number;	/* The value as a number */
+} xo_tvalue_t;
+
+/*
+ * Is this string one of the frame's own key, attribute, or self values?
+ * Other strings (literals, function results) aren't cached.
+ */
+static int
+xo_tframe_owns (xo_tframe_t *framep, const char *str)
+{
+    uintptr_t addr = (uintptr_t) str;
+
+    if (str == framep->xtf_self)
+	return TRUE;
+
+    if (framep->xtf_keys && addr >= (uintptr_t) framep->xtf_keys
+	    && addr < (uintptr_t) framep->xtf_keys + framep->xtf_keys_len)
+	return TRUE;
+
+    if (framep->xtf_attrs && addr >= (uintptr_t) framep->xtf_attrs
+	    && addr < (uintptr_t) framep->xtf_attrs + framep->xtf_attrs_len)
+	return TRUE;
+
+    return FALSE;
+}
+
+/*
+ * Return a string as a number, using the frame's cache when the string
+ * is one of the frame's values
+ */
+static xo_eval_value_t
+xo_tframe_number (xo_handle_t *xop, xo_tframe_t *framep, const char *str)
+{
+    if (framep == NULL || str == NULL || !xo_tframe_owns(framep, str))
+	return xo_eval_make_number(xop, str);
+
+    xo_tvalue_t *xtvp = framep->xtf_values;
+    for (uint32_t i = 0; i < framep->xtf_values_count; i++, xtvp++)
+	if (xtvp->xtv_str == str)
+	    return xtvp->xtv_number;
+
+    xo_eval_value_t value = xo_eval_make_number(xop, str);
+
+    if (framep->xtf_values_count >= framep->xtf_values_cap) {
+	uint32_t cap = framep->xtf_values_cap ? framep->xtf_values_cap * 2 : 4;
+	xtvp = xo_realloc(framep->xtf_values, cap * sizeof(*xtvp));
+	if (xtvp == NULL)
+	    return value;
+
+	framep->xtf_values = xtvp;
+	framep->xtf_values_cap = cap;
+    }
+
+    xtvp = &framep->xtf_values[framep->xtf_values_count++];
+    xtvp->xtv_str = str;
+    xtvp->xtv_number = value;
+
+    return value;
+}
+
 static xo_eval_value_t
-xo_eval_make_number_from_value (xo_handle_t *xop, xo_eval_value_t value)
+xo_eval_make_number_from_value (xo_handle_t *xop, xo_tframe_t *framep,
+				xo_eval_value_t value)
 {
     switch (value.xev_type) {
     case C_DSTRING:
-    case C_STRING:;
 	return xo_eval_make_number(xop, value.xev_str);
 
+    case C_STRING:
+	return xo_tframe_number(xop, framep, value.xev_str);
+
     case C_FLOAT:
     case C_BOOLEAN:
     case C_UINT64:
@@ -1465,10 +3329,11 @@ xo_eval_dot (XO_EVAL_NODE_ARGS)
 }
 
 static int
-xo_eval_cast_boolean (xo_handle_t *xop, xo_eval_value_t value)
+xo_eval_cast_boolean (xo_handle_t *xop, xo_tframe_t *framep,
+		      xo_eval_value_t value)
 {
     if (value.xev_type == C_STRING || value.xev_type == C_DSTRING)
-	value = xo_eval_make_number_from_value(xop, value);
+	value = xo_eval_make_number_from_value(xop, framep, value);
 
     switch (value.xev_type) {
     case C_DSTRING:
@@ -1487,12 +3352,13 @@ xo_eval_cast_boolean (xo_handle_t *xop, xo_eval_value_t value)
 }
 
 static xo_float_t
-xo_eval_cast_float (xo_handle_t *xop, xo_eval_value_t value)
+xo_eval_cast_float (xo_handle_t *xop, xo_tframe_t *framep,
+		    xo_eval_value_t value)
 {
     xo_float_t fval = 0;
 
     if (value.xev_type == C_STRING || value.xev_type == C_DSTRING)
-	value = xo_eval_make_number_from_value(xop, value);
+	value = xo_eval_make_number_from_value(xop, framep, value);
 
     switch (value.xev_type) {
     case C_DSTRING:
@@ -1518,12 +3384,13 @@ xo_eval_cast_float (xo_handle_t *xop, xo_eval_value_t value)
 }
 
 static int64_t
-xo_eval_cast_int64 (xo_handle_t *xop, xo_eval_value_t value)
+xo_eval_cast_int64 (xo_handle_t *xop, xo_tframe_t *framep,
+		    xo_eval_value_t value)
 {
     xo_float_t fval = 0;
 
     if (value.xev_type == C_STRING || value.xev_type == C_DSTRING)
-	value = xo_eval_make_number_from_value(xop, value);
+	value = xo_eval_make_number_from_value(xop, framep, value);
 
     switch (value.xev_type) {
     case C_DSTRING:
@@ -1548,50 +3415,50 @@ xo_eval_cast_int64 (xo_handle_t *xop, xo_eval_value_t value)
     }
 }
 
-static char *
-xo_eval_cast_string (xo_handle_t *xop UNUSED, xo_eval_value_t value)
-{
-    char buf[16];
-    const char *bp UNUSED = buf;
+/*
+ * Return a value as a string.  Strings are borrowed, not copied, and
+ * other values are formatted into the caller's buffer, which should be
+ * XO_EVAL_NUMBUF bytes; either way, nothing needs to be freed, but the
+ * answer only lives as long as the value and the buffer.
+ */
+#define XO_EVAL_NUMBUF	32	/* Big enough for any number we format */
 
+static const char *
+xo_eval_cast_string (xo_eval_value_t value, char *buf, size_t bufsiz)
+{
     switch (value.xev_type) {
-
     case C_DSTRING:
     case C_STRING:
-	bp = value.xev_str;
-	break;
+	return value.xev_str ?: "";
 
     case C_BOOLEAN:
-	snprintf(buf, sizeof(buf), "%s", value.xev_int64 ? "true" : "false");
-	break;
+	return value.xev_int64 ? "true" : "false";
 
     case C_INT64:
-	snprintf(buf, sizeof(buf), "%" PRId64, value.xev_int64);
-	break;
+	snprintf(buf, bufsiz, "%" PRId64, value.xev_int64);
+	return buf;
 
     case C_UINT64:
-	snprintf(buf, sizeof(buf), "%" PRIu64, value.xev_uint64);
-	break;
+	snprintf(buf, bufsiz, "%" PRIu64, value.xev_uint64);
+	return buf;
 
     case C_FLOAT:
-	snprintf(buf, sizeof(buf), "%lf", value.xev_float);
-	break;
+	snprintf(buf, bufsiz, "%lf", value.xev_float);
+	return buf;
 
     case M_ERROR:
-	bp = "";		/* Silently ignore; cast to "" */
-	break;
+	return "";		/* Silently ignore; cast to "" */
 
     default:
-	bp = "(unknown)";
+	return "(unknown)";
     }
-
-    return strdup(bp);
 }
 
 static inline xo_eval_value_t
-xo_eval_cast_float_value (xo_handle_t *xop, xo_eval_value_t old)
+xo_eval_cast_float_value (xo_handle_t *xop, xo_tframe_t *framep,
+			  xo_eval_value_t old)
 {
-    xo_float_t new = xo_eval_cast_float(xop, old);
+    xo_float_t new = xo_eval_cast_float(xop, framep, old);
     return xo_eval_value_float(0, new);
 }
 
@@ -1702,44 +3569,44 @@ xo_eval_compare (XO_EVAL_OP_ARGS)
 	break;
 
     case TYPE_CMP(C_STRING, C_INT64):
-	fval = xo_eval_cast_float(xop, left);
+	fval = xo_eval_cast_float(xop, framep, left);
 	rc = (fval > right.xev_int64) ? 1 : (fval < right.xev_int64) ? -1 : 0;
 	break;
 
     case TYPE_CMP(C_INT64, C_STRING):
-	fval = xo_eval_cast_float(xop, right);
+	fval = xo_eval_cast_float(xop, framep, right);
 	rc = (left.xev_int64 > fval) ? 1 : (left.xev_int64 < fval) ? -1 : 0;
 	break;
 
     case TYPE_CMP(C_STRING, C_UINT64):
-	fval = xo_eval_cast_float(xop, left);
+	fval = xo_eval_cast_float(xop, framep, left);
 	rc = (fval > right.xev_uint64) ? 1 : (fval < right.xev_uint64) ? -1 : 0;
 	break;
 
     case TYPE_CMP(C_UINT64, C_STRING):
-	fval = xo_eval_cast_float(xop, right);
+	fval = xo_eval_cast_float(xop, framep, right);
 	rc = (left.xev_uint64 > fval) ? 1 : (left.xev_uint64 < fval) ? -1 : 0;
 	break;
 
     case TYPE_CMP(C_STRING, C_FLOAT):
-	fval = xo_eval_cast_float(xop, left);
+	fval = xo_eval_cast_float(xop, framep, left);
 	rc = (fval > right.xev_float) ? 1 : (fval < right.xev_float) ? -1 : 0;
 	break;
 
     case TYPE_CMP(C_FLOAT, C_STRING):
-	fval = xo_eval_cast_float(xop, right);
+	fval = xo_eval_cast_float(xop, framep, right);
 	rc = (left.xev_float > fval) ? 1 : (left.xev_float < fval) ? -1 : 0;
 	break;
 
     case TYPE_CMP(C_INT64, C_FLOAT):
     case TYPE_CMP(C_UINT64, C_FLOAT):
-	fval = xo_eval_cast_float(xop, left);
+	fval = xo_eval_cast_float(xop, framep, left);
 	rc = (fval > right.xev_float) ? 1 : (fval < right.xev_float) ? -1 : 0;
 	break;
 
     case TYPE_CMP(C_FLOAT, C_INT64):
     case TYPE_CMP(C_FLOAT, C_UINT64):
-	fval = xo_eval_cast_float(xop, right);
+	fval = xo_eval_cast_float(xop, framep, right);
 	rc = (left.xev_float > fval) ? 1 : (left.xev_float < fval) ? -1 : 0;
 	break;
 
@@ -1780,7 +3647,7 @@ xo_eval_op_and (XO_EVAL_OP_ARGS)
 {
     xo_eval_value_t value = xo_eval_value_make(C_BOOLEAN, 0, 0);
 
-    int bool = xo_eval_cast_boolean(xop, left);
+    int bool = xo_eval_cast_boolean(xop, framep, left);
     if (!bool && !(left.xev_flags & XEVF_MISSING)) {
 	value.xev_int64 = 0;
 	value.xev_flags |= XEVF_FINAL;
@@ -1788,7 +3655,7 @@ xo_eval_op_and (XO_EVAL_OP_ARGS)
 	return value;
     }
 
-    bool = xo_eval_cast_boolean(xop, right);
+    bool = xo_eval_cast_boolean(xop, framep, right);
     if (!bool) {
 	value.xev_int64 = 0;
 	value.xev_flags |= XEVF_FINAL;
@@ -1805,7 +3672,7 @@ xo_eval_op_or (XO_EVAL_OP_ARGS)
 {
     xo_eval_value_t value = xo_eval_value_make(C_BOOLEAN, 0, 0);
 
-    int bool = xo_eval_cast_boolean(xop, left);
+    int bool = xo_eval_cast_boolean(xop, framep, left);
     if (bool) {
 	value.xev_int64 = 1;
 	value.xev_flags |= XEVF_FINAL;
@@ -1813,7 +3680,7 @@ xo_eval_op_or (XO_EVAL_OP_ARGS)
 	return value;
     }
 
-    bool = xo_eval_cast_boolean(xop, right);
+    bool = xo_eval_cast_boolean(xop, framep, right);
     if (bool) {
 	value.xev_int64 = 1;
 	value.xev_flags |= XEVF_FINAL;
@@ -1888,8 +3755,8 @@ xo_eval_op_ge (XO_EVAL_OP_ARGS)
 static xo_eval_value_t
 xo_eval_calc (XO_EVAL_OP_ARGS, xo_eval_calc_fn_t calc_fn)
 {
-    xo_eval_value_t lfloat = xo_eval_cast_float_value(xop, left);
-    xo_eval_value_t rfloat = xo_eval_cast_float_value(xop, right);
+    xo_eval_value_t lfloat = xo_eval_cast_float_value(xop, framep, left);
+    xo_eval_value_t rfloat = xo_eval_cast_float_value(xop, framep, right);
 
     xo_eval_value_t result = calc_fn(xop, xfp, lfloat, rfloat);
 
@@ -2003,7 +3870,7 @@ xo_eval_not (XO_EVAL_NODE_ARGS)
     if (value.xev_flags & XEVF_MISSING)
 	return value;
 
-    int bool = xo_eval_cast_boolean(xop, value);
+    int bool = xo_eval_cast_boolean(xop, framep, value);
     xo_eval_value_free(value);
     value.xev_type = C_BOOLEAN;
     value.xev_int64 = bool ? 0 : 1; /* Perform the 'not' */
@@ -2069,18 +3936,14 @@ xo_eval_func_starts_with (XO_EVAL_NODE_ARGS)
 {
     xo_eval_value_t value = XO_EVAL_VALUE_BOOLEAN_FALSE;
 
-    char *base = xo_eval_cast_string(xop, argv[0]);
-    char *start = xo_eval_cast_string(xop, argv[1]);
-    XO_DBG(xop, "starts_with: '%s' '%s'", base ?: "", start ?: "");
+    char bbuf[XO_EVAL_NUMBUF], sbuf[XO_EVAL_NUMBUF];
+    const char *base = xo_eval_cast_string(argv[0], bbuf, sizeof(bbuf));
+    const char *start = xo_eval_cast_string(argv[1], sbuf, sizeof(sbuf));
+    XO_DBG(xop, "starts_with: '%s' '%s'", base, start);
 
-    if (base && start && strncmp(base, start, strlen(start)) == 0)
+    if (strncmp(base, start, strlen(start)) == 0)
 	value.xev_int64 = TRUE;
 
-    if (base)
-	xo_free(base);
-    if (start)
-	xo_free(start);
-
     return value;
 }
 
@@ -2089,22 +3952,16 @@ xo_eval_func_ends_with (XO_EVAL_NODE_ARGS)
 {
     xo_eval_value_t value = XO_EVAL_VALUE_BOOLEAN_FALSE;
 
-    char *base = xo_eval_cast_string(xop, argv[0]);
-    char *start = xo_eval_cast_string(xop, argv[1]);
-    XO_DBG(xop, "ends_with: '%s' '%s'", base ?: "", start ?: "");
-
-    if (base && start) {
-	int blen = strlen(base);
-	int slen = strlen(start);
+    char bbuf[XO_EVAL_NUMBUF], sbuf[XO_EVAL_NUMBUF];
+    const char *base = xo_eval_cast_string(argv[0], bbuf, sizeof(bbuf));
+    const char *start = xo_eval_cast_string(argv[1], sbuf, sizeof(sbuf));
+    XO_DBG(xop, "ends_with: '%s' '%s'", base, start);
 
-	if (strncmp(base + blen - slen, start, strlen(start)) == 0)
-	    value.xev_int64 = TRUE;
-    }
+    size_t blen = strlen(base);
+    size_t slen = strlen(start);
 
-    if (base)
-	xo_free(base);
-    if (start)
-	xo_free(start);
+    if (blen >= slen && memcmp(base + blen - slen, start, slen) == 0)
+	value.xev_int64 = TRUE;
 
     return value;
 }
@@ -2123,10 +3980,22 @@ xo_eval_func_false (XO_EVAL_NODE_ARGS)
     return value;
 }
 
+/*
+ * position() is the context node's position among its siblings, as
+ * used by "[N]" predicates
+ */
+static xo_eval_value_t
+xo_eval_func_position (XO_EVAL_NODE_ARGS)
+{
+    xo_eval_value_t value = xo_eval_value_make(C_UINT64, 0, 0);
+    value.xev_uint64 = framep ? framep->xtf_position_cur : 0;
+    return value;
+}
+
 static xo_eval_value_t
 xo_eval_func_boolean (XO_EVAL_NODE_ARGS)
 {
-    int bool = xo_eval_cast_boolean(xop, argv[0]);
+    int bool = xo_eval_cast_boolean(xop, framep, argv[0]);
 
     xo_eval_value_t value = XO_EVAL_VALUE_BOOLEAN_FALSE;
     value.xev_int64 = bool ? 1 : 0;
@@ -2136,19 +4005,23 @@ xo_eval_func_boolean (XO_EVAL_NODE_ARGS)
 static xo_eval_value_t
 xo_eval_func_string (XO_EVAL_NODE_ARGS)
 {
-    char *str = xo_eval_cast_string(xop, argv[0]);
-    return xo_eval_value_string(C_DSTRING, 0, str);
+    /* A borrowed string outlives us; anything else needs a copy */
+    if (argv[0].xev_type == C_STRING)
+	return xo_eval_value_string(C_STRING, 0, argv[0].xev_str ?: "");
+
+    char buf[XO_EVAL_NUMBUF];
+    const char *str = xo_eval_cast_string(argv[0], buf, sizeof(buf));
+    return xo_eval_value_string(C_DSTRING, 0, strdup(str));
 }
 
 static xo_eval_value_t
 xo_eval_func_normalize_space (XO_EVAL_NODE_ARGS)
 {
-    char *str = xo_eval_cast_string(xop, argv[0]);
-    const char *p = str ?: "";
+    char buf[XO_EVAL_NUMBUF];
+    const char *p = xo_eval_cast_string(argv[0], buf, sizeof(buf));
 
     char *out = xo_realloc(NULL, strlen(p) + 1);
     if (out == NULL) {
-	xo_free(str);
 	xo_eval_value_t result = xo_eval_value_make(C_DSTRING, 0, 0);
 	result.xev_str = strdup("");
 	return result;
@@ -2173,8 +4046,6 @@ xo_eval_func_normalize_space (XO_EVAL_NODE_ARGS)
 	q -= 1;
     *q = '\0';
 
-    xo_free(str);
-
     xo_eval_value_t result = xo_eval_value_make(C_DSTRING, 0, 0);
     result.xev_str = out;
     return result;
@@ -2183,7 +4054,7 @@ xo_eval_func_normalize_space (XO_EVAL_NODE_ARGS)
 static xo_eval_value_t
 xo_eval_func_not (XO_EVAL_NODE_ARGS)
 {
-    int bool = xo_eval_cast_boolean(xop, argv[0]);
+    int bool = xo_eval_cast_boolean(xop, framep, argv[0]);
     xo_eval_value_t value = XO_EVAL_VALUE_BOOLEAN_FALSE;
     value.xev_int64 = bool ? 0 : 1;
     return value;
@@ -2192,7 +4063,7 @@ xo_eval_func_not (XO_EVAL_NODE_ARGS)
 static xo_eval_value_t
 xo_eval_func_ceiling (XO_EVAL_NODE_ARGS)
 {
-    xo_float_t fval = xo_eval_cast_float(xop, argv[0]);
+    xo_float_t fval = xo_eval_cast_float(xop, framep, argv[0]);
     fval = ceil(fval);
     return xo_eval_value_float(0, fval);
 }
@@ -2200,7 +4071,7 @@ xo_eval_func_ceiling (XO_EVAL_NODE_ARGS)
 static xo_eval_value_t
 xo_eval_func_floor (XO_EVAL_NODE_ARGS)
 {
-    xo_float_t fval = xo_eval_cast_float(xop, argv[0]);
+    xo_float_t fval = xo_eval_cast_float(xop, framep, argv[0]);
     fval = floor(fval);
     return xo_eval_value_float(0, fval);
 }
@@ -2228,14 +4099,13 @@ xo_eval_func_substring (XO_EVAL_NODE_ARGS)
 
     xo_eval_value_t value = xo_eval_value_make(C_STRING, 0, 0);
 
-    char *str = xo_eval_cast_string(xop, fn_argv[0]);
+    char buf[XO_EVAL_NUMBUF];
+    const char *str = xo_eval_cast_string(fn_argv[0], buf, sizeof(buf));
     int64_t slen = strlen(str);
 
-    int64_t pos = xo_eval_cast_int64(xop, fn_argv[1]);
-    int64_t len = fn_argc == 2 ? slen : xo_eval_cast_int64(xop, fn_argv[2]);
-
-    /* Release our arguments */
-    xo_eval_arguments_free(xop, xfp, framep, xnp, indent, 3, fn_argv);
+    int64_t pos = xo_eval_cast_int64(xop, framep, fn_argv[1]);
+    int64_t len = (fn_argc == 2) ? slen
+	: xo_eval_cast_int64(xop, framep, fn_argv[2]);
 
     /*
      * Strings a 1-origin, not 0.  Also the spec says:
@@ -2268,14 +4138,18 @@ xo_eval_func_substring (XO_EVAL_NODE_ARGS)
 	    len = slen;
     }
 
-    if (len > 0) {
+    if (len <= 0) {
+	value.xev_str = "";
+    } else if (len == slen && fn_argv[0].xev_type == C_STRING) {
+	value.xev_str = cp;	/* A tail of a borrowed string; borrow it too */
+    } else {
 	value.xev_type = C_DSTRING;
 	value.xev_str = strndup(cp, len);
-    } else {
-	value.xev_str = "";
     }
 
-    xo_free(str);
+    /* Release our arguments */
+    xo_eval_arguments_free(xop, xfp, framep, xnp, indent, 3, fn_argv);
+
     return value;
 }
 
@@ -2284,9 +4158,10 @@ xo_eval_func_substring_before (XO_EVAL_NODE_ARGS)
 {
     xo_eval_value_t value = xo_eval_value_make(C_STRING, 0, 0);
 
-    char *haystack = xo_eval_cast_string(xop, argv[0]);
-    char *needle = xo_eval_cast_string(xop, argv[1]);
-    char *found = (haystack && needle) ? strstr(haystack, needle) : NULL;
+    char hbuf[XO_EVAL_NUMBUF], nbuf[XO_EVAL_NUMBUF];
+    const char *haystack = xo_eval_cast_string(argv[0], hbuf, sizeof(hbuf));
+    const char *needle = xo_eval_cast_string(argv[1], nbuf, sizeof(nbuf));
+    const char *found = strstr(haystack, needle);
 
     if (found) {
 	value.xev_type = C_DSTRING;
@@ -2295,8 +4170,6 @@ xo_eval_func_substring_before (XO_EVAL_NODE_ARGS)
 	value.xev_str = "";
     }
 
-    xo_free(haystack);
-    xo_free(needle);
     return value;
 }
 
@@ -2305,20 +4178,20 @@ xo_eval_func_substring_after (XO_EVAL_NODE_ARGS)
 {
     xo_eval_value_t value = xo_eval_value_make(C_STRING, 0, 0);
 
-    char *haystack = xo_eval_cast_string(xop, argv[0]);
-    char *needle = xo_eval_cast_string(xop, argv[1]);
-    char *found = (haystack && needle) ? strstr(haystack, needle) : NULL;
+    char hbuf[XO_EVAL_NUMBUF], nbuf[XO_EVAL_NUMBUF];
+    const char *haystack = xo_eval_cast_string(argv[0], hbuf, sizeof(hbuf));
+    const char *needle = xo_eval_cast_string(argv[1], nbuf, sizeof(nbuf));
+    const char *found = strstr(haystack, needle);
 
-    if (found) {
-	const char *after = found + strlen(needle);
-	value.xev_type = C_DSTRING;
-	value.xev_str = strdup(after);
-    } else {
+    if (found == NULL) {
 	value.xev_str = "";
+    } else if (argv[0].xev_type == C_STRING) {
+	value.xev_str = found + strlen(needle); /* Borrow the tail */
+    } else {
+	value.xev_type = C_DSTRING;
+	value.xev_str = strdup(found + strlen(needle));
     }
 
-    xo_free(haystack);
-    xo_free(needle);
     return value;
 }
 
@@ -2336,7 +4209,7 @@ xo_eval_func_choose (XO_EVAL_NODE_ARGS)
 	return xo_eval_value_missing();
     }
 
-    int bool = xo_eval_cast_boolean(xop, cond);
+    int bool = xo_eval_cast_boolean(xop, framep, cond);
     xo_eval_value_free(cond);
 
     /* Locate the then and else node ids */
@@ -2358,7 +4231,8 @@ xo_eval_func_choose2 (XO_EVAL_NODE_ARGS)
 
     xo_eval_value_t value = xo_eval(xop, xfp, framep, "choose2-first",
 				    indent + XO_INDENT, first_id, NULL);
-    if (!(value.xev_flags & XEVF_MISSING) && xo_eval_cast_boolean(xop, value))
+    if (!(value.xev_flags & XEVF_MISSING)
+	    && xo_eval_cast_boolean(xop, framep, value))
 	return value;
 
     xo_eval_value_free(value);
@@ -2386,11 +4260,9 @@ xo_eval_func_concat (XO_EVAL_NODE_ARGS)
 	    xo_buf_cleanup(&buf);
 	    return xo_eval_value_missing();
 	}
-	char *str = xo_eval_cast_string(xop, value);
-	if (str) {
-	    xo_buf_append(&buf, str, strlen(str));
-	    xo_free(str);
-	}
+	char nbuf[XO_EVAL_NUMBUF];
+	const char *str = xo_eval_cast_string(value, nbuf, sizeof(nbuf));
+	xo_buf_append(&buf, str, strlen(str));
 	xo_eval_value_free(value);
     }
 
@@ -2415,31 +4287,27 @@ xo_eval_func_contains (XO_EVAL_NODE_ARGS)
 {
     xo_eval_value_t value = XO_EVAL_VALUE_BOOLEAN_FALSE;
 
-    char *haystack = xo_eval_cast_string(xop, argv[0]);
-    char *needle = xo_eval_cast_string(xop, argv[1]);
-    XO_DBG(xop, "contains: '%s' '%s'", haystack ?: "", needle ?: "");
+    char hbuf[XO_EVAL_NUMBUF], nbuf[XO_EVAL_NUMBUF];
+    const char *haystack = xo_eval_cast_string(argv[0], hbuf, sizeof(hbuf));
+    const char *needle = xo_eval_cast_string(argv[1], nbuf, sizeof(nbuf));
+    XO_DBG(xop, "contains: '%s' '%s'", haystack, needle);
 
-    if (haystack && needle && strstr(haystack, needle) != NULL)
+    if (strstr(haystack, needle) != NULL)
 	value.xev_int64 = TRUE;
 
-    if (haystack)
-	xo_free(haystack);
-    if (needle)
-	xo_free(needle);
-
     return value;
 }
 
 static xo_eval_value_t
 xo_eval_func_number (XO_EVAL_NODE_ARGS)
 {
-    return xo_eval_make_number_from_value(xop, argv[0]);
+    return xo_eval_make_number_from_value(xop, framep, argv[0]);
 }
 
 static xo_eval_value_t
 xo_eval_func_round (XO_EVAL_NODE_ARGS)
 {
-    xo_float_t fval = xo_eval_cast_float(xop, argv[0]);
+    xo_float_t fval = xo_eval_cast_float(xop, framep, argv[0]);
     fval = round(fval);
     return xo_eval_value_float(0, fval);
 }
@@ -2447,9 +4315,9 @@ xo_eval_func_round (XO_EVAL_NODE_ARGS)
 static xo_eval_value_t
 xo_eval_func_string_length (XO_EVAL_NODE_ARGS)
 {
-    char *str = xo_eval_cast_string(xop, argv[0]);
-    xo_float_t len = str ? strlen(str) : 0;
-    xo_free(str);
+    char buf[XO_EVAL_NUMBUF];
+    const char *str = xo_eval_cast_string(argv[0], buf, sizeof(buf));
+    xo_float_t len = strlen(str);
     return xo_eval_value_float(0, len);
 }
 
@@ -2470,7 +4338,7 @@ xo_eval_func_sum (XO_EVAL_NODE_ARGS)
 	    xo_eval_value_free(value);
 	    return xo_eval_value_missing();
 	}
-	total += xo_eval_cast_float(xop, value);
+	total += xo_eval_cast_float(xop, framep, value);
 	xo_eval_value_free(value);
     }
 
@@ -2484,27 +4352,16 @@ xo_eval_func_sum (XO_EVAL_NODE_ARGS)
 static xo_eval_value_t
 xo_eval_func_translate (XO_EVAL_NODE_ARGS)
 {
-    char *str = xo_eval_cast_string(xop, argv[0]);
-    char *from = xo_eval_cast_string(xop, argv[1]);
-    char *to = xo_eval_cast_string(xop, argv[2]);
-
-    if (str == NULL || from == NULL) {
-	xo_free(str);
-	xo_free(from);
-	xo_free(to);
-	xo_eval_value_t result = xo_eval_value_make(C_DSTRING, 0, 0);
-	result.xev_str = strdup("");
-	return result;
-    }
+    char sbuf[XO_EVAL_NUMBUF], fbuf[XO_EVAL_NUMBUF], tbuf[XO_EVAL_NUMBUF];
+    const char *str = xo_eval_cast_string(argv[0], sbuf, sizeof(sbuf));
+    const char *from = xo_eval_cast_string(argv[1], fbuf, sizeof(fbuf));
+    const char *to = xo_eval_cast_string(argv[2], tbuf, sizeof(tbuf));
 
     size_t from_len = strlen(from);
-    size_t to_len = to ? strlen(to) : 0;
+    size_t to_len = strlen(to);
     char *out = xo_realloc(NULL, strlen(str) + 1);
 
     if (out == NULL) {
-	xo_free(str);
-	xo_free(from);
-	xo_free(to);
 	xo_eval_value_t result = xo_eval_value_make(C_DSTRING, 0, 0);
 	result.xev_str = strdup("");
 	return result;
@@ -2524,10 +4381,6 @@ xo_eval_func_translate (XO_EVAL_NODE_ARGS)
     }
     *q = '\0';
 
-    xo_free(str);
-    xo_free(from);
-    xo_free(to);
-
     xo_eval_value_t result = xo_eval_value_make(C_DSTRING, 0, 0);
     result.xev_str = out;
     return result;
@@ -2553,41 +4406,200 @@ xo_eval_func_translate (XO_EVAL_NODE_ARGS)
  *
  * Don't call it a regex, though I don't know what it is...
  */
-static xo_eval_value_t
-xo_eval_func_rematch (XO_EVAL_NODE_ARGS)
+/*
+ * Compiled rematch() patterns are cached in the filter, keyed by the
+ * pattern and its regcomp flags.  Literal patterns are compiled when
+ * the filter is added; others are cached when first seen, replacing
+ * the oldest entry once the cache is full.  Patterns without special
+ * characters (apart from a leading '^' or trailing '$') don't need
+ * regcomp at all; we compare the strings directly.
+ */
+#define XRMK_REGEX	0	/* Use regexec */
+#define XRMK_CONTAINS	1	/* Literal, anywhere in the input */
+#define XRMK_PREFIX	2	/* Literal, at the start ("^lit") */
+#define XRMK_SUFFIX	3	/* Literal, at the end ("lit$") */
+#define XRMK_EXACT	4	/* Literal, the whole input ("^lit$") */
+
+typedef struct xo_rematch_s {
+    char *xrm_pattern;		/* The pattern, as given */
+    int xrm_flags;		/* REG_* flags given to regcomp */
+    int xrm_kind;		/* How we match (XRMK_*) */
+    char *xrm_lit;		/* Literal text (if not XRMK_REGEX) */
+    size_t xrm_lit_len;		/* Length of xrm_lit */
+    regex_t xrm_re;		/* Compiled regex (if XRMK_REGEX) */
+} xo_rematch_t;
+
+static void
+xo_rematch_free (xo_rematch_t *xrmp)
 {
-    int fn_argc = xo_eval_argument_count(XO_EVAL_NODE_PASS);
-    if (fn_argc < 2 || fn_argc > 3) {
-	xo_failure_filter(xop, "rematch() requires 2 or 3 arguments, got %d",
-			  fn_argc);
-	return xo_eval_value_invalid();
+    if (xrmp == NULL)
+	return;
+
+    if (xrmp->xrm_kind == XRMK_REGEX)
+	regfree(&xrmp->xrm_re);
+
+    xo_free(xrmp->xrm_lit);
+    xo_free(xrmp->xrm_pattern);
+    xo_free(xrmp);
+}
+
+static void
+xo_rematch_cleanup (xo_filter_t *xfp)
+{
+    for (int i = 0; i < XO_REMATCH_MAX; i++) {
+	xo_rematch_free(xfp->xf_rematch[i]);
+	xfp->xf_rematch[i] = NULL;
     }
+}
 
-    xo_eval_value_t fn_argv[3];
-    xo_eval_arguments(XO_EVAL_NODE_PASS, 3, fn_argv);
+/*
+ * Decide how a pattern can be matched.  We're conservative: any
+ * character that's special in an extended regex means regexec, as do
+ * any flags (other than REG_EXTENDED) that might change the meaning.
+ */
+static int
+xo_rematch_kind (const char *pattern, int rflags,
+		 const char **litp, size_t *lenp)
+{
+    if ((rflags & ~REG_EXTENDED) != 0)
+	return XRMK_REGEX;
 
-    /* Defer if arguments aren't resolved yet (field not yet seen) */
-    if ((fn_argv[0].xev_flags & XEVF_MISSING)
-  	    || (fn_argv[1].xev_flags & XEVF_MISSING)
-  	    || (fn_argv[2].xev_flags & XEVF_MISSING)) {
-	xo_eval_arguments_free(xop, xfp, framep, xnp, indent, 3, fn_argv);
-	return xo_eval_value_missing();
+    const char *lit = pattern;
+    size_t len = strlen(pattern);
+    int prefix = FALSE, suffix = FALSE;
+
+    if (len > 0 && *lit == '^') {
+	prefix = TRUE;
+	lit += 1;
+	len -= 1;
     }
 
-    char *pattern = xo_eval_cast_string(xop, fn_argv[0]);
-    char *input   = xo_eval_cast_string(xop, fn_argv[1]);
+    if (len > 0 && lit[len - 1] == '$') {
+	suffix = TRUE;
+	len -= 1;
+    }
 
-    /* Third arg is optional; absent slot is XEVF_INVALID — treat as "" */
-    char *opts;
+    /* Some regcomp's reject empty patterns; let them */
+    if (len == 0 || strcspn(lit, ".[]()*+?{}|^$\\") < len)
+	return XRMK_REGEX;
 
-    if (fn_argc >= 3)
-	opts = xo_eval_cast_string(xop, fn_argv[2]);
-    else
-	opts = strdup("");
+    *litp = lit;
+    *lenp = len;
 
-    xo_eval_arguments_free(xop, xfp, framep, xnp, indent, 3, fn_argv);
+    return prefix ? (suffix ? XRMK_EXACT : XRMK_PREFIX)
+	: suffix ? XRMK_SUFFIX : XRMK_CONTAINS;
+}
+
+static xo_rematch_t *
+xo_rematch_compile (const char *pattern, int rflags,
+		    char *errbuf, size_t errsize)
+{
+    xo_rematch_t *xrmp = xo_realloc(NULL, sizeof(*xrmp));
+    if (xrmp == NULL) {
+	snprintf(errbuf, errsize, "out of memory");
+	return NULL;
+    }
+
+    bzero(xrmp, sizeof(*xrmp));
+    xrmp->xrm_flags = rflags;
+    xrmp->xrm_pattern = strdup(pattern);
+
+    const char *lit = NULL;
+    size_t len = 0;
+
+    xrmp->xrm_kind = xo_rematch_kind(pattern, rflags, &lit, &len);
+    if (xrmp->xrm_kind != XRMK_REGEX) {
+	xrmp->xrm_lit = strndup(lit, len);
+	xrmp->xrm_lit_len = len;
+	if (xrmp->xrm_lit == NULL)
+	    xrmp->xrm_kind = XRMK_REGEX;
+    }
+
+    if (xrmp->xrm_pattern == NULL) {
+	snprintf(errbuf, errsize, "out of memory");
+	xrmp->xrm_kind = XRMK_CONTAINS; /* Nothing to regfree */
+	xo_rematch_free(xrmp);
+	return NULL;
+    }
+
+    if (xrmp->xrm_kind == XRMK_REGEX) {
+	int rc = regcomp(&xrmp->xrm_re, pattern, rflags);
+	if (rc != 0) {
+	    regerror(rc, &xrmp->xrm_re, errbuf, errsize);
+	    xrmp->xrm_kind = XRMK_CONTAINS; /* Nothing to regfree */
+	    xo_rematch_free(xrmp);
+	    return NULL;
+	}
+    }
+
+    return xrmp;
+}
+
+/*
+ * Find a pattern in the cache, compiling (and caching) it if needed.
+ * Returns NULL, with a message in errbuf, if the pattern is bad.
+ */
+static xo_rematch_t *
+xo_rematch_find (xo_filter_t *xfp, const char *pattern, int rflags,
+		 char *errbuf, size_t errsize)
+{
+    xo_rematch_t *xrmp;
+
+    for (int i = 0; i < XO_REMATCH_MAX; i++) {
+	xrmp = xfp->xf_rematch[i];
+	if (xrmp && xrmp->xrm_flags == rflags
+	    && xo_streq(xrmp->xrm_pattern, pattern))
+	    return xrmp;
+    }
+
+    xrmp = xo_rematch_compile(pattern, rflags, errbuf, errsize);
+    if (xrmp == NULL)
+	return NULL;
+
+    uint32_t slot = xfp->xf_rematch_next++ % XO_REMATCH_MAX;
+    xo_rematch_free(xfp->xf_rematch[slot]);
+    xfp->xf_rematch[slot] = xrmp;
+
+    return xrmp;
+}
+
+/*
+ * Match a literal pattern, returning the start of the match (or NULL)
+ */
+static const char *
+xo_rematch_literal (xo_rematch_t *xrmp, const char *input)
+{
+    size_t len = xrmp->xrm_lit_len, ilen;
+
+    switch (xrmp->xrm_kind) {
+    case XRMK_CONTAINS:
+	return strstr(input, xrmp->xrm_lit);
+
+    case XRMK_PREFIX:
+	return (strncmp(input, xrmp->xrm_lit, len) == 0) ? input : NULL;
 
-    /* want_group: -1 = boolean; 0 = 's' (pmatch[0]); 1+ = 'm'/'mN' */
+    case XRMK_SUFFIX:
+	ilen = strlen(input);
+	return (ilen >= len && memcmp(input + ilen - len,
+				      xrmp->xrm_lit, len) == 0)
+	    ? input + ilen - len : NULL;
+
+    case XRMK_EXACT:
+	return xo_streq(input, xrmp->xrm_lit) ? input : NULL;
+
+    default:
+	return NULL;
+    }
+}
+
+/*
+ * Turn rematch() flags into regcomp flags, and the capture group we
+ * want: -1 = boolean; 0 = 's' (pmatch[0]); 1+ = 'm'/'mN'.  Unknown
+ * flags are reported if xop is given.
+ */
+static int
+xo_rematch_flags (xo_handle_t *xop, const char *opts, int *want_groupp)
+{
     int rflags = REG_EXTENDED;
     int want_group = -1;
 
@@ -2613,10 +4625,87 @@ xo_eval_func_rematch (XO_EVAL_NODE_ARGS)
 	    break;
 
 	default:
-	    xo_failure_filter(xop, "unknown rematch() flag: '%c'", *op);
+	    if (xop)
+		xo_failure_filter(xop, "unknown rematch() flag: '%c'", *op);
 	}
     }
 
+    if (want_groupp)
+	*want_groupp = want_group;
+
+    return rflags;
+}
+
+/*
+ * Compile the literal patterns given to rematch() when a filter is
+ * added, so they're ready before the first instance arrives.
+ */
+static void
+xo_rematch_precompile (xo_filter_t *xfp)
+{
+    xo_xparse_data_t *xdp = &xfp->xf_xd;
+    char errbuf[128];
+
+    for (xo_xparse_node_id_t id = 1; id <= xdp->xd_last_node; id++) {
+	xo_xparse_node_t *xnp = xo_xparse_node(xdp, id);
+	if (xnp->xn_type != T_FUNCTION_NAME)
+	    continue;
+
+	const char *str = xo_xparse_str(xdp, xnp->xn_str);
+	if (str == NULL || !xo_streq(str, "rematch"))
+	    continue;
+
+	xo_xparse_node_t *pat = xo_xparse_node(xdp, xnp->xn_contents);
+	xo_xparse_node_t *arg = pat ? xo_xparse_node(xdp, pat->xn_next) : NULL;
+	xo_xparse_node_t *opts = arg ? xo_xparse_node(xdp, arg->xn_next) : NULL;
+
+	if (pat == NULL || pat->xn_type != T_QUOTED || arg == NULL
+	    || (opts && (opts->xn_type != T_QUOTED || opts->xn_next)))
+	    continue;
+
+	const char *pattern = xo_xparse_str(xdp, pat->xn_str);
+	const char *optstr = opts ? xo_xparse_str(xdp, opts->xn_str) : "";
+	if (pattern == NULL || optstr == NULL)
+	    continue;
+
+	/* Bad patterns are reported when they're used */
+	xo_rematch_find(xfp, pattern, xo_rematch_flags(NULL, optstr, NULL),
+			errbuf, sizeof(errbuf));
+    }
+}
+
+static xo_eval_value_t
+xo_eval_func_rematch (XO_EVAL_NODE_ARGS)
+{
+    int fn_argc = xo_eval_argument_count(XO_EVAL_NODE_PASS);
+    if (fn_argc < 2 || fn_argc > 3) {
+	xo_failure_filter(xop, "rematch() requires 2 or 3 arguments, got %d",
+			  fn_argc);
+	return xo_eval_value_invalid();
+    }
+
+    xo_eval_value_t fn_argv[3];
+    xo_eval_arguments(XO_EVAL_NODE_PASS, 3, fn_argv);
+
+    /* Defer if arguments aren't resolved yet (field not yet seen) */
+    if ((fn_argv[0].xev_flags & XEVF_MISSING)
+  	    || (fn_argv[1].xev_flags & XEVF_MISSING)
+  	    || (fn_argv[2].xev_flags & XEVF_MISSING)) {
+	xo_eval_arguments_free(xop, xfp, framep, xnp, indent, 3, fn_argv);
+	return xo_eval_value_missing();
+    }
+
+    char pbuf[XO_EVAL_NUMBUF], ibuf[XO_EVAL_NUMBUF], obuf[XO_EVAL_NUMBUF];
+    const char *pattern = xo_eval_cast_string(fn_argv[0], pbuf, sizeof(pbuf));
+    const char *input = xo_eval_cast_string(fn_argv[1], ibuf, sizeof(ibuf));
+
+    /* Third arg is optional; absent slot is XEVF_INVALID — treat as "" */
+    const char *opts = (fn_argc >= 3)
+	? xo_eval_cast_string(fn_argv[2], obuf, sizeof(obuf)) : "";
+
+    int want_group;
+    int rflags = xo_rematch_flags(xop, opts, &want_group);
+
     /* For boolean mode we don't need match offsets */
     int ngroups = (want_group < 0) ? 0 : want_group + 1;
 
@@ -2627,24 +4716,34 @@ xo_eval_func_rematch (XO_EVAL_NODE_ARGS)
 	result = xo_eval_value_make(C_DSTRING, 0, 0);
     }
 
-    if (pattern == NULL || input == NULL)
-	goto rematch_done;
-
-    regex_t re;
     char errbuf[128];
-    int rc = regcomp(&re, pattern, rflags);
-    if (rc != 0) {
-	regerror(rc, &re, errbuf, sizeof(errbuf));
+    xo_rematch_t *xrmp = xo_rematch_find(xfp, pattern, rflags,
+					 errbuf, sizeof(errbuf));
+    if (xrmp == NULL) {
 	xo_failure_filter(xop, "rematch: bad pattern '%s': %s", pattern, errbuf);
 	goto rematch_done;
     }
 
     regmatch_t pmatch[10];
-    bzero(pmatch, sizeof(pmatch));
+    int rc;
 
-    rc = regexec(&re, input, ngroups > 0 ? (size_t) ngroups : 0,
-		 ngroups > 0 ? pmatch : NULL, 0);
-    regfree(&re);
+    if (xrmp->xrm_kind != XRMK_REGEX) {
+	/* A literal has no groups, so only pmatch[0] can be set */
+	for (int i = 0; i < 10; i++)
+	    pmatch[i].rm_so = pmatch[i].rm_eo = -1;
+
+	const char *cp = xo_rematch_literal(xrmp, input);
+	rc = cp ? 0 : REG_NOMATCH;
+	if (cp) {
+	    pmatch[0].rm_so = cp - input;
+	    pmatch[0].rm_eo = pmatch[0].rm_so + xrmp->xrm_lit_len;
+	}
+
+    } else {
+	bzero(pmatch, sizeof(pmatch));
+	rc = regexec(&xrmp->xrm_re, input, ngroups > 0 ? (size_t) ngroups : 0,
+		     ngroups > 0 ? pmatch : NULL, 0);
+    }
 
     if (rc == 0) {
 	if (want_group < 0) {
@@ -2660,9 +4759,8 @@ xo_eval_func_rematch (XO_EVAL_NODE_ARGS)
     }
 
  rematch_done:
-    xo_free(pattern);
-    xo_free(input);
-    xo_free(opts);
+    /* The strings may be borrowed from the arguments, so free them last */
+    xo_eval_arguments_free(xop, xfp, framep, xnp, indent, 3, fn_argv);
 
     if (result.xev_type == C_DSTRING && result.xev_str == NULL)
 	result.xev_str = strdup(""); /* default value */
@@ -2677,6 +4775,7 @@ xo_eval_func_rematch (XO_EVAL_NODE_ARGS)
 typedef uint32_t xo_eval_func_flags_t;
 
 #define XEFF_NO_EVAL	(1<<0)	/* Function evaluates its own args (no infra) */
+#define XEFF_CONTEXT	(1<<1)	/* Depends on the context node; never folded */
 
 typedef struct xo_eval_func_map_s {
     xo_eval_node_fn_t xfm_func;	/* The function that implements the logic */
@@ -2698,6 +4797,7 @@ xo_eval_func_map_t xo_eval_functions[] = {
     { xo_eval_func_normalize_space, "normalize-space", 0, 1 },
     { xo_eval_func_not, "not", 0, 1 },
     { xo_eval_func_number, "number", 0, 1 },
+    { xo_eval_func_position, "position", XEFF_CONTEXT, 0 },
     { xo_eval_func_rematch, "rematch", XEFF_NO_EVAL, -1 },
     { xo_eval_func_round, "round", 0, 1 },
     { xo_eval_func_starts_with, "starts-with", 0, 2 },
@@ -2962,7 +5062,700 @@ xo_eval (xo_handle_t *xop, xo_filter_t *xfp, xo_tframe_t *framep,
 	last = value;
     }
 
-    return value;
+    return value;
+}
+
+/* ------------------------------------------------------------- */
+
+/*
+ * Predicates are compiled into small programs for a register machine,
+ * so evaluating them (once per key, for every instance) doesn't walk
+ * the parse tree and its function tables, or strdup() strings.  Each
+ * instruction sets one register (xi_dst) from up to two others (xi_a,
+ * xi_b), with xi_arg holding a constant index, string offset, node
+ * id, or jump target.  Operands are evaluated in the same order as
+ * xo_eval, so missing values and short-circuiting behave the same.
+ * Anything we don't compile (e.g. functions that evaluate their own
+ * arguments) is handed back to xo_eval by XIOP_EVAL.  A predicate
+ * that can't be compiled has no program and is evaluated by xo_eval.
+ */
+typedef struct xo_xinsn_s {
+    uint8_t xi_op;		/* Opcode (XIOP_*) */
+    uint8_t xi_dst;		/* Destination register */
+    uint8_t xi_a;		/* First operand register */
+    uint8_t xi_b;		/* Second operand register (or arg count) */
+    uint32_t xi_arg;		/* Constant, offset, node id, or jump target */
+} xo_xinsn_t;
+
+/* Opcodes for xi_op */
+#define XIOP_RET	0	/* Return xi_dst */
+#define XIOP_CONST	1	/* dst = xp_consts[arg] */
+#define XIOP_STR	2	/* dst = string at offset arg */
+#define XIOP_KEY	3	/* dst = key or field named at offset arg */
+#define XIOP_KEY_ATTR	4	/* dst = attribute, resolved like a key */
+#define XIOP_ATTR	5	/* dst = attribute named at offset arg */
+#define XIOP_DOT	6	/* dst = '.' */
+#define XIOP_INDEX	7	/* dst = (position == arg) */
+#define XIOP_NOT	8	/* dst = not a */
+#define XIOP_EVAL	9	/* dst = xo_eval(node arg) */
+#define XIOP_CALL	10	/* dst = xo_eval_functions[arg](a .. a + b - 1) */
+#define XIOP_STARTS_WITH 11	/* dst = starts-with(a, a + 1) */
+#define XIOP_ENDS_WITH	12	/* dst = ends-with(a, a + 1) */
+#define XIOP_CONTAINS	13	/* dst = contains(a, a + 1) */
+#define XIOP_AND	14	/* dst = a and b; jump to arg if final */
+#define XIOP_OR		15	/* dst = a or b; jump to arg if final */
+#define XIOP_EQ		16	/* dst = a == b */
+#define XIOP_NE		17	/* dst = a != b */
+#define XIOP_LT		18	/* dst = a < b */
+#define XIOP_LE		19	/* dst = a <= b */
+#define XIOP_GT		20	/* dst = a > b */
+#define XIOP_GE		21	/* dst = a >= b */
+#define XIOP_PLUS	22	/* dst = a + b */
+#define XIOP_MINUS	23	/* dst = a - b */
+#define XIOP_MUL	24	/* dst = a * b */
+#define XIOP_DIV	25	/* dst = a div b */
+#define XIOP_MOD	26	/* dst = a mod b */
+
+#define XO_XPROG_REGS	16	/* Registers (deeper predicates use xo_eval) */
+#define XO_XPROG_NO_JUMP UINT32_MAX /* End of the and/or patch list */
+
+/*
+ * The compiled predicates of a trie, sharing one code array and
+ * constant pool.  xp_start maps a predicate's contents node id to
+ * the start of its program, plus one.
+ */
+typedef struct xo_xprog_s {
+    xo_xinsn_t *xp_code;	/* Instructions */
+    uint32_t xp_code_len;	/* Instructions in use */
+    uint32_t xp_code_cap;	/* Allocated instructions */
+    xo_eval_value_t *xp_consts;	/* Constant pool */
+    uint32_t xp_consts_len;	/* Constants in use */
+    uint32_t xp_consts_cap;	/* Allocated constants */
+    uint32_t *xp_start;		/* Program start (+1) per node id (0=none) */
+    uint32_t xp_start_len;	/* Entries in xp_start */
+} xo_xprog_t;
+
+static void
+xo_xprog_free (xo_xprog_t *xpp)
+{
+    if (xpp) {
+	xo_free(xpp->xp_code);
+	xo_free(xpp->xp_consts);
+	xo_free(xpp->xp_start);
+	xo_free(xpp);
+    }
+}
+
+static int
+xo_xprog_emit (xo_xprog_t *xpp, unsigned op, unsigned dst,
+	       unsigned a, unsigned b, uint32_t arg)
+{
+    if (xpp->xp_code_len >= xpp->xp_code_cap) {
+	uint32_t cap = xpp->xp_code_cap ? xpp->xp_code_cap * 2 : 32;
+	xo_xinsn_t *p = xo_realloc(xpp->xp_code, cap * sizeof(*p));
+	if (p == NULL)
+	    return FALSE;
+
+	xpp->xp_code = p;
+	xpp->xp_code_cap = cap;
+    }
+
+    xo_xinsn_t *xip = &xpp->xp_code[xpp->xp_code_len++];
+    xip->xi_op = op;
+    xip->xi_dst = dst;
+    xip->xi_a = a;
+    xip->xi_b = b;
+    xip->xi_arg = arg;
+
+    return TRUE;
+}
+
+static int
+xo_xprog_emit_const (xo_xprog_t *xpp, unsigned dst, xo_eval_value_t value)
+{
+    if (xpp->xp_consts_len >= xpp->xp_consts_cap) {
+	uint32_t cap = xpp->xp_consts_cap ? xpp->xp_consts_cap * 2 : 8;
+	xo_eval_value_t *p = xo_realloc(xpp->xp_consts, cap * sizeof(*p));
+	if (p == NULL)
+	    return FALSE;
+
+	xpp->xp_consts = p;
+	xpp->xp_consts_cap = cap;
+    }
+
+    xpp->xp_consts[xpp->xp_consts_len] = value;
+
+    return xo_xprog_emit(xpp, XIOP_CONST, dst, 0, 0, xpp->xp_consts_len++);
+}
+
+/*
+ * Map an operator token to its opcode, or zero if it's not one
+ */
+static unsigned
+xo_xprog_binop (xo_xparse_token_t type)
+{
+    switch (type) {
+    case K_AND:		return XIOP_AND;
+    case K_OR:		return XIOP_OR;
+    case L_EQUALS:	return XIOP_EQ;
+    case L_NOTEQUALS:	return XIOP_NE;
+    case L_LESS:	return XIOP_LT;
+    case L_LESSEQ:	return XIOP_LE;
+    case L_GRTR:	return XIOP_GT;
+    case L_GRTREQ:	return XIOP_GE;
+    case L_PLUS:	return XIOP_PLUS;
+    case L_MINUS:	return XIOP_MINUS;
+    case L_STAR:	return XIOP_MUL;
+    case K_DIV:		return XIOP_DIV;
+    case K_MOD:		return XIOP_MOD;
+    default:		return 0;
+    }
+}
+
+/*
+ * Perform a binary operation, using the same functions as xo_eval
+ */
+static inline xo_eval_value_t
+xo_xprog_binop_value (xo_handle_t *xop, xo_filter_t *xfp,
+		      xo_tframe_t *framep, unsigned op,
+		      xo_eval_value_t left, xo_eval_value_t right)
+{
+    xo_eval_op_fn_t op_fn;
+
+    switch (op) {
+    case XIOP_AND:	op_fn = xo_eval_op_and; break;
+    case XIOP_OR:	op_fn = xo_eval_op_or; break;
+    case XIOP_EQ:	op_fn = xo_eval_op_equals; break;
+    case XIOP_NE:	op_fn = xo_eval_op_notequals; break;
+    case XIOP_LT:	op_fn = xo_eval_op_lt; break;
+    case XIOP_LE:	op_fn = xo_eval_op_le; break;
+    case XIOP_GT:	op_fn = xo_eval_op_gt; break;
+    case XIOP_GE:	op_fn = xo_eval_op_ge; break;
+    case XIOP_PLUS:	op_fn = xo_eval_op_plus; break;
+    case XIOP_MINUS:	op_fn = xo_eval_op_minus; break;
+    case XIOP_MUL:	op_fn = xo_eval_op_mul; break;
+    case XIOP_DIV:	op_fn = xo_eval_op_div; break;
+    case XIOP_MOD:	op_fn = xo_eval_op_mod; break;
+    default:
+	return xo_eval_value_invalid();
+    }
+
+    return op_fn(xop, xfp, framep, NULL, "xprog", 0, left, right);
+}
+
+/*
+ * Is a constant one we can fold?  We only fold numbers and booleans,
+ * whose operations can't warn or depend on the handle.
+ */
+static int
+xo_xprog_foldable (xo_eval_value_t value)
+{
+    switch (value.xev_type) {
+    case C_INT64:
+    case C_UINT64:
+    case C_FLOAT:
+    case C_BOOLEAN:
+	return (value.xev_flags == 0);
+
+    default:
+	return FALSE;
+    }
+}
+
+/*
+ * Evaluate a node at compile time, if it's a constant: a valid
+ * number, a function with no arguments, or operations on those.
+ * Returns TRUE and fills in the value if so.
+ */
+static int
+xo_xprog_const (xo_xparse_data_t *xdp, xo_xparse_node_id_t id,
+		xo_eval_value_t *valp)
+{
+    xo_xparse_node_t *xnp = xo_xparse_node(xdp, id);
+    const char *str;
+    char *ep;
+
+    switch (xnp->xn_type) {
+    case T_NUMBER:
+	/* Invalid numbers warn on each use, so we leave them be */
+	str = xo_xparse_str(xdp, xnp->xn_str);
+	if (str == NULL)
+	    return FALSE;
+
+	strtod(str, &ep);
+	if (*ep != '\0') {
+	    strtoll(str, &ep, 0);
+	    if (*ep != '\0')
+		return FALSE;
+	}
+
+	*valp = xo_eval_make_number(NULL, str);
+	return TRUE;
+
+    case T_FUNCTION_NAME:
+	str = xo_xparse_str(xdp, xnp->xn_str);
+	xo_eval_func_map_t *entry = str
+	    ? xo_eval_find_func(xo_eval_functions, str) : NULL;
+	if (entry == NULL || entry->xfm_nargs != 0 || xnp->xn_contents
+	    || (entry->xfm_flags & (XEFF_NO_EVAL | XEFF_CONTEXT)))
+	    return FALSE;
+
+	*valp = entry->xfm_func(NULL, NULL, NULL, xnp, 0, 0, NULL);
+	return xo_xprog_foldable(*valp);
+
+    case C_EXPR:
+	return xnp->xn_contents
+	    ? xo_xprog_const(xdp, xnp->xn_contents, valp) : FALSE;
+
+    case C_NOT:
+	if (xnp->xn_contents == 0 || !xo_xprog_const(xdp, xnp->xn_contents, valp))
+	    return FALSE;
+
+	int bool = xo_eval_cast_boolean(NULL, NULL, *valp);
+	valp->xev_type = C_BOOLEAN;
+	valp->xev_int64 = bool ? 0 : 1;
+	return TRUE;
+
+    default:
+	break;
+    }
+
+    unsigned op = xo_xprog_binop(xnp->xn_type);
+    if (op == 0 || xnp->xn_contents == 0)
+	return FALSE;
+
+    /* Fold the operands, just as xo_eval does */
+    xo_eval_value_t last, value = XO_EVAL_VALUE_ZERO;
+    int first = TRUE;
+
+    for (id = xnp->xn_contents; id; id = xnp->xn_next) {
+	xnp = xo_xparse_node(xdp, id);
+	if (!xo_xprog_const(xdp, id, &value) || !xo_xprog_foldable(value))
+	    return FALSE;
+
+	if (first) {
+	    first = FALSE;
+	} else {
+	    /* Comparing booleans with floats isn't supported (and warns) */
+	    if (op >= XIOP_EQ && op <= XIOP_GE
+		&& ((last.xev_type == C_BOOLEAN && value.xev_type == C_FLOAT)
+		    || (last.xev_type == C_FLOAT
+			&& value.xev_type == C_BOOLEAN)))
+		return FALSE;
+
+	    value = xo_xprog_binop_value(NULL, NULL, NULL, op, last, value);
+	    if (value.xev_flags & XEVF_FINAL) {
+		value.xev_flags &= ~XEVF_FINAL;
+		break;
+	    }
+	}
+
+	last = value;
+    }
+
+    *valp = value;
+    return TRUE;
+}
+
+static int xo_xprog_compile_node(xo_xprog_t *, xo_xparse_data_t *,
+				 xo_xparse_node_id_t, unsigned);
+
+/*
+ * Compile a path, which we handle when it's a single element or
+ * attribute; anything else goes to xo_eval_path.
+ */
+static int
+xo_xprog_compile_path (xo_xprog_t *xpp, xo_xparse_data_t *xdp,
+		       xo_xparse_node_id_t id, unsigned dst)
+{
+    xo_xparse_node_t *xnp = xo_xparse_node(xdp, id);
+    xo_xparse_node_t *elt = NULL;
+    xo_xparse_node_id_t cid;
+
+    for (cid = xnp->xn_contents; cid; cid = xnp->xn_next) {
+	xnp = xo_xparse_node(xdp, cid);
+	if (xnp->xn_type == C_ABSOLUTE)
+	    continue;
+
+	if (elt || (xnp->xn_type != C_ELEMENT && xnp->xn_type != C_ATTRIBUTE))
+	    return xo_xprog_emit(xpp, XIOP_EVAL, dst, 0, 0, id);
+
+	elt = xnp;
+    }
+
+    if (elt == NULL)
+	return xo_xprog_emit(xpp, XIOP_EVAL, dst, 0, 0, id);
+
+    return xo_xprog_emit(xpp, (elt->xn_type == C_ATTRIBUTE)
+			 ? XIOP_KEY_ATTR : XIOP_KEY, dst, 0, 0, elt->xn_str);
+}
+
+/*
+ * Compile a function call.  The arguments are placed in consecutive
+ * registers, starting at dst.
+ */
+static int
+xo_xprog_compile_function (xo_xprog_t *xpp, xo_xparse_data_t *xdp,
+			   xo_xparse_node_id_t id, unsigned dst)
+{
+    xo_xparse_node_t *xnp = xo_xparse_node(xdp, id);
+    const char *str = xo_xparse_str(xdp, xnp->xn_str);
+    xo_eval_func_map_t *entry = str
+	? xo_eval_find_func(xo_eval_functions, str) : NULL;
+    xo_xparse_node_id_t aid;
+    unsigned argc = 0;
+
+    for (aid = xnp->xn_contents; aid; aid = xo_xparse_node(xdp, aid)->xn_next)
+	argc += 1;
+
+    /* Unknown functions and bad argument counts warn in xo_eval */
+    if (entry == NULL || (entry->xfm_flags & XEFF_NO_EVAL)
+	|| (entry->xfm_nargs >= 0 && argc != (unsigned) entry->xfm_nargs))
+	return xo_xprog_emit(xpp, XIOP_EVAL, dst, 0, 0, id);
+
+    if (dst + argc > XO_XPROG_REGS)
+	return FALSE;
+
+    unsigned reg = dst;
+    for (aid = xnp->xn_contents; aid; aid = xo_xparse_node(xdp, aid)->xn_next)
+	if (!xo_xprog_compile_node(xpp, xdp, aid, reg++))
+	    return FALSE;
+
+    unsigned op = XIOP_CALL;
+    if (entry->xfm_func == xo_eval_func_starts_with)
+	op = XIOP_STARTS_WITH;
+    else if (entry->xfm_func == xo_eval_func_ends_with)
+	op = XIOP_ENDS_WITH;
+    else if (entry->xfm_func == xo_eval_func_contains)
+	op = XIOP_CONTAINS;
+
+    return xo_xprog_emit(xpp, op, dst, dst, argc, entry - xo_eval_functions);
+}
+
+/*
+ * Compile a chain of operands joined by a binary operator.  The
+ * and/or instructions jump to the end of the chain when their answer
+ * is final; since we don't know where that is yet, we link them
+ * through xi_arg and patch them afterwards.
+ */
+static int
+xo_xprog_compile_chain (xo_xprog_t *xpp, xo_xparse_data_t *xdp,
+			xo_xparse_node_id_t id, unsigned op, unsigned dst)
+{
+    xo_xparse_node_t *xnp = xo_xparse_node(xdp, id);
+    xo_xparse_node_id_t cid = xnp->xn_contents;
+    uint32_t patch = XO_XPROG_NO_JUMP;
+
+    if (cid == 0)
+	return xo_xprog_emit(xpp, XIOP_EVAL, dst, 0, 0, id);
+
+    if (!xo_xprog_compile_node(xpp, xdp, cid, dst))
+	return FALSE;
+
+    for (cid = xo_xparse_node(xdp, cid)->xn_next; cid;
+	 cid = xo_xparse_node(xdp, cid)->xn_next) {
+	if (!xo_xprog_compile_node(xpp, xdp, cid, dst + 1))
+	    return FALSE;
+
+	uint32_t here = xpp->xp_code_len;
+	if (!xo_xprog_emit(xpp, op, dst, dst, dst + 1,
+			   (op == XIOP_AND || op == XIOP_OR) ? patch : 0))
+	    return FALSE;
+
+	if (op == XIOP_AND || op == XIOP_OR)
+	    patch = here;
+    }
+
+    while (patch != XO_XPROG_NO_JUMP) {
+	xo_xinsn_t *xip = &xpp->xp_code[patch];
+	patch = xip->xi_arg;
+	xip->xi_arg = xpp->xp_code_len;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Compile a single node (not its siblings), leaving its value in
+ * register dst.  Returns FALSE if the predicate can't be compiled.
+ */
+static int
+xo_xprog_compile_node (xo_xprog_t *xpp, xo_xparse_data_t *xdp,
+		       xo_xparse_node_id_t id, unsigned dst)
+{
+    xo_xparse_node_t *xnp = xo_xparse_node(xdp, id);
+    xo_eval_value_t value;
+    const char *str;
+
+    if (dst >= XO_XPROG_REGS)
+	return FALSE;
+
+    if (xo_xprog_const(xdp, id, &value))
+	return xo_xprog_emit_const(xpp, dst, value);
+
+    switch (xnp->xn_type) {
+    case C_PATH:
+	return xo_xprog_compile_path(xpp, xdp, id, dst);
+
+    case C_ATTRIBUTE:
+	return xo_xprog_emit(xpp, XIOP_ATTR, dst, 0, 0, xnp->xn_str);
+
+    case L_DOT:
+	return xo_xprog_emit(xpp, XIOP_DOT, dst, 0, 0, 0);
+
+    case C_INDEX:
+	str = xo_xparse_str(xdp, xnp->xn_str);
+	unsigned long idx = str ? strtoul(str, NULL, 10) : 0;
+	if (idx > UINT32_MAX)
+	    break;
+
+	return xo_xprog_emit(xpp, XIOP_INDEX, dst, 0, 0, idx);
+
+    case T_QUOTED:
+	if (xo_xparse_str(xdp, xnp->xn_str) == NULL)
+	    return xo_xprog_emit_const(xpp, dst, xo_eval_value_missing());
+
+	return xo_xprog_emit(xpp, XIOP_STR, dst, 0, 0, xnp->xn_str);
+
+    case C_NOT:
+	if (xnp->xn_contents == 0)
+	    break;
+
+	return xo_xprog_compile_node(xpp, xdp, xnp->xn_contents, dst)
+	    && xo_xprog_emit(xpp, XIOP_NOT, dst, dst, 0, 0);
+
+    case C_EXPR:
+	/* An empty expression leaves xo_eval's previous value alone */
+	if (xnp->xn_contents == 0)
+	    return FALSE;
+
+	return xo_xprog_compile_node(xpp, xdp, xnp->xn_contents, dst);
+
+    case T_FUNCTION_NAME:
+	return xo_xprog_compile_function(xpp, xdp, id, dst);
+
+    case T_NUMBER:
+	break;			/* Invalid number; let xo_eval warn */
+
+    default:;
+	unsigned op = xo_xprog_binop(xnp->xn_type);
+	if (op)
+	    return xo_xprog_compile_chain(xpp, xdp, id, op, dst);
+
+	/* Same as C_EXPR: an empty unknown node has no value of its own */
+	if (xnp->xn_contents == 0)
+	    return FALSE;
+	break;
+    }
+
+    return xo_xprog_emit(xpp, XIOP_EVAL, dst, 0, 0, id);
+}
+
+/*
+ * Compile the predicates for all the nodes in the trie.  Returns NULL
+ * on allocation failure, in which case xo_eval does all the work.
+ */
+static xo_xprog_t *
+xo_xprog_compile (xo_trie_t *xtp)
+{
+    xo_xparse_data_t *xdp = xtp->xt_xd;
+    xo_xprog_t *xpp = xo_realloc(NULL, sizeof(*xpp));
+    if (xpp == NULL)
+	return NULL;
+
+    bzero(xpp, sizeof(*xpp));
+
+    xpp->xp_start_len = xdp->xd_last_node + 1;
+    xpp->xp_start = xo_realloc(NULL,
+			       xpp->xp_start_len * sizeof(*xpp->xp_start));
+    if (xpp->xp_start == NULL) {
+	xo_xprog_free(xpp);
+	return NULL;
+    }
+
+    bzero(xpp->xp_start, xpp->xp_start_len * sizeof(*xpp->xp_start));
+
+    for (xo_trie_id_t tid = 1; tid <= xtp->xt_count; tid++) {
+	xo_xparse_node_t *xnp;
+
+	for (xo_xparse_node_id_t id = xtp->xt_nodes[tid].xtn_pred; id;
+	     id = xnp->xn_next) {
+	    xnp = xo_xparse_node(xdp, id);
+	    xo_xparse_node_id_t cid = xnp->xn_contents;
+
+	    if (xnp->xn_type != C_PREDICATE || cid == 0
+		|| xpp->xp_start[cid] != 0)
+		continue;
+
+	    uint32_t code_len = xpp->xp_code_len;
+	    uint32_t consts_len = xpp->xp_consts_len;
+
+	    if (xo_xprog_compile_node(xpp, xdp, cid, 0)
+		&& xo_xprog_emit(xpp, XIOP_RET, 0, 0, 0, 0)) {
+		xpp->xp_start[cid] = code_len + 1;
+	    } else {
+		/* Can't compile it; discard whatever we emitted */
+		xpp->xp_code_len = code_len;
+		xpp->xp_consts_len = consts_len;
+	    }
+	}
+    }
+
+    return xpp;
+}
+
+/*
+ * Run a compiled predicate, starting at instruction pc
+ */
+static xo_eval_value_t
+xo_xprog_run (xo_handle_t *xop, xo_filter_t *xfp, xo_tframe_t *framep,
+	      xo_xprog_t *xpp, uint32_t pc)
+{
+    xo_eval_value_t reg[XO_XPROG_REGS];
+    xo_eval_value_t value;
+    xo_eval_func_map_t *entry;
+    const char *str, *base, *part;
+    char bbuf[XO_EVAL_NUMBUF], pbuf[XO_EVAL_NUMBUF];
+    int i;
+
+    for (;;) {
+	xo_xinsn_t *xip = &xpp->xp_code[pc++];
+	xo_eval_value_t *argv = &reg[xip->xi_a];
+
+	switch (xip->xi_op) {
+	case XIOP_RET:
+	    return reg[xip->xi_dst];
+
+	case XIOP_CONST:
+	    value = xpp->xp_consts[xip->xi_arg];
+	    break;
+
+	case XIOP_STR:
+	    value = xo_eval_value_string(C_STRING, 0,
+				xo_xparse_str(&xfp->xf_xd, xip->xi_arg));
+	    break;
+
+	case XIOP_KEY:
+	case XIOP_KEY_ATTR:
+	case XIOP_ATTR:
+	    str = xo_xparse_str(&xfp->xf_xd, xip->xi_arg);
+	    str = (xip->xi_op == XIOP_KEY)
+		? xo_filter_key_find(xfp, framep, str)
+		: xo_filter_attr_find(xfp, framep, str);
+
+	    if (str == NULL && xip->xi_op != XIOP_ATTR
+		&& (xfp->xf_flags & XFSF_FORCE_RESOLVE))
+		str = "";	/* Absent field = empty string */
+
+	    value = str ? xo_eval_value_string(C_STRING, 0, str)
+		: xo_eval_value_missing();
+	    break;
+
+	case XIOP_DOT:
+	    str = framep->xtf_self;
+	    if (str == NULL && (xfp->xf_flags & XFSF_FORCE_RESOLVE))
+		str = "";
+
+	    value = str ? xo_eval_value_string(C_STRING, 0, str)
+		: xo_eval_value_missing();
+	    break;
+
+	case XIOP_INDEX:
+	    value = xo_eval_value_make(C_BOOLEAN, 0, 0);
+	    value.xev_uint64 = (framep->xtf_position_cur != 0
+				&& framep->xtf_position_cur == xip->xi_arg);
+	    break;
+
+	case XIOP_NOT:
+	    value = *argv;
+	    if (!(value.xev_flags & XEVF_MISSING)) {
+		int bool = xo_eval_cast_boolean(xop, framep, value);
+		xo_eval_value_free(value);
+		value.xev_type = C_BOOLEAN;
+		value.xev_int64 = bool ? 0 : 1;
+	    }
+	    break;
+
+	case XIOP_EVAL:
+	    value = xo_eval(xop, xfp, framep, "xprog", XO_INDENT,
+			    xip->xi_arg, NULL);
+	    break;
+
+	case XIOP_CALL:
+	case XIOP_STARTS_WITH:
+	case XIOP_ENDS_WITH:
+	case XIOP_CONTAINS:
+	    entry = &xo_eval_functions[xip->xi_arg];
+
+	    for (i = 0; i < xip->xi_b; i++)
+		if (argv[i].xev_flags & XEVF_MISSING)
+		    break;
+
+	    if (i < xip->xi_b && entry->xfm_nargs > 0) {
+		value = xo_eval_value_missing();
+
+	    } else if (xip->xi_op == XIOP_CALL) {
+		value = entry->xfm_func(xop, xfp, framep, NULL, 0,
+					xip->xi_b, argv);
+	    } else {
+		value = xo_eval_value_boolean_false();
+		base = xo_eval_cast_string(argv[0], bbuf, sizeof(bbuf));
+		part = xo_eval_cast_string(argv[1], pbuf, sizeof(pbuf));
+		size_t blen, plen = strlen(part);
+
+		if (xip->xi_op == XIOP_STARTS_WITH)
+		    value.xev_int64 = (strncmp(base, part, plen) == 0);
+		else if (xip->xi_op == XIOP_CONTAINS)
+		    value.xev_int64 = (strstr(base, part) != NULL);
+		else if ((blen = strlen(base)) >= plen)
+		    value.xev_int64 = (memcmp(base + blen - plen,
+					      part, plen) == 0);
+	    }
+
+	    for (i = 0; i < xip->xi_b; i++)
+		xo_eval_value_free(argv[i]);
+	    break;
+
+	default:
+	    /* Binary operators; a missing operand makes a missing answer */
+	    if ((argv->xev_flags & XEVF_MISSING)
+		|| (reg[xip->xi_b].xev_flags & XEVF_MISSING)) {
+		value = xo_eval_value_missing();
+	    } else {
+		value = xo_xprog_binop_value(xop, xfp, framep, xip->xi_op,
+					     *argv, reg[xip->xi_b]);
+	    }
+
+	    xo_eval_value_free(*argv);
+	    xo_eval_value_free(reg[xip->xi_b]);
+
+	    if (value.xev_flags & XEVF_FINAL) {
+		value.xev_flags &= ~XEVF_FINAL;
+		pc = xip->xi_arg;
+	    }
+	}
+
+	reg[xip->xi_dst] = value;
+    }
+}
+
+/*
+ * Evaluate the contents of a single predicate, using its program if
+ * it has one.  With debugging on, we always walk the tree, since
+ * xo_eval tells us what it's doing.
+ */
+static xo_eval_value_t
+xo_filter_pred_expr (xo_handle_t *xop, xo_filter_t *xfp,
+		     xo_tframe_t *framep, const char *pname,
+		     xo_xparse_node_id_t cid)
+{
+    xo_xprog_t *xpp = xfp->xf_trie ? xfp->xf_trie->xt_prog : NULL;
+
+    if (xpp && cid < xpp->xp_start_len && xpp->xp_start[cid]
+	&& !XO_HAS_DEBUG(xop))
+	return xo_xprog_run(xop, xfp, framep, xpp, xpp->xp_start[cid] - 1);
+
+    return xo_eval(xop, xfp, framep, pname, XO_INDENT, cid, NULL);
 }
 
 /*
@@ -2999,8 +5792,8 @@ xo_filter_pred_eval (xo_handle_t *xop, xo_filter_t *xfp,
 	if (xnp->xn_type != C_PREDICATE) /* Can't eval anything else */
 	    continue;
 
-	xo_eval_value_t pv = xo_eval(xop, xfp, framep, "top", XO_INDENT,
-				     xnp->xn_contents, NULL);
+	xo_eval_value_t pv = xo_filter_pred_expr(xop, xfp, framep, "top",
+						 xnp->xn_contents);
 	xo_eval_dump_value(xop, xfp, pv, XO_INDENT,
 			   "xo_filter_pred_eval: working");
 
@@ -3011,7 +5804,7 @@ xo_filter_pred_eval (xo_handle_t *xop, xo_filter_t *xfp,
 	    continue;
 	}
 
-	int passes = xo_eval_cast_boolean(xop, pv);
+	int passes = xo_eval_cast_boolean(xop, framep, pv);
 	xo_eval_value_free(pv);
 
 	if (!passes) {
@@ -3083,10 +5876,12 @@ xo_tmatch_try_eager (xo_handle_t *xop, xo_filter_t *xfp,
     if (xo_pred_has_trailing_cindex(xfp, pred))
 	return XTFS_PRED;
 
+    XO_TSTAT(xtmp, tn - xtmp->xtm_trie->xt_nodes, xts_evals);
+
     xo_eval_value_t result = xo_filter_pred_eval(xop, xfp, framep, pred);
     if (result.xev_flags & XEVF_MISSING)
 	return XTFS_PRED;
-    int live = xo_eval_cast_boolean(xop, result);
+    int live = xo_eval_cast_boolean(xop, framep, result);
     xo_eval_value_free(result);
     if (live) {
 	xo_tmatch_record_live(xtmp, framep, tn);
@@ -3113,7 +5908,7 @@ xo_filter_leading_preds_eval (xo_handle_t *xop, xo_filter_t *xfp,
 	xo_xparse_node_id_t cid = xnp->xn_contents;
 	if (cid && xo_xparse_node(&xfp->xf_xd, cid)->xn_type == C_INDEX)
 	    continue;  /* skip positional predicates */
-	value = xo_eval(xop, xfp, framep, "lead-pred", XO_INDENT, cid, NULL);
+	value = xo_filter_pred_expr(xop, xfp, framep, "lead-pred", cid);
 	if (value.xev_flags & XEVF_MISSING)
 	    return value;
     }
@@ -3148,7 +5943,7 @@ xo_tmatch_slot_position (xo_handle_t *xop, xo_filter_t *xfp,
 	xo_eval_value_free(lv);
 	return framep->xtf_position[slot]; /* not yet decidable */
     }
-    int passes = xo_eval_cast_boolean(xop, lv);
+    int passes = xo_eval_cast_boolean(xop, framep, lv);
     xo_eval_value_free(lv);
 
     if (!passes)
@@ -3171,6 +5966,63 @@ xo_tmatch_slot_position (xo_handle_t *xop, xo_filter_t *xfp,
     return qpos;
 }
 
+/*
+ * Does an XTNF_KEYS node want this field?
+ */
+static int
+xo_tmatch_keys_needs (xo_trie_t *xtp, xo_tnode_t *tn,
+		      const char *tag, xo_ssize_t tlen)
+{
+    xo_tkeys_t *xtkp = &xtp->xt_keys[tn->xtn_keys];
+
+    return xtkp->xtk_field == xo_trie_atom_find(xtp, tag, tlen);
+}
+
+/*
+ * The field for the XTNF_KEYS node in this slot has arrived, so the
+ * members with its value replace the node; if none have it, the slot
+ * is dead.  Values are compared as strings, as xo_eval_compare does.
+ */
+static void
+xo_tmatch_keys_resolve (xo_tmatch_t *xtmp, xo_tframe_t *framep,
+			uint32_t slot, xo_tnode_t *tn,
+			const char *value, xo_ssize_t vlen)
+{
+    xo_trie_t *xtp = xtmp->xtm_trie;
+    xo_tkeys_t *xtkp = &xtp->xt_keys[tn->xtn_keys];
+
+    vlen = strnlen(value, vlen);
+    uint32_t hash = xo_hash_buf(XO_HASH_INIT, value, vlen);
+    uint32_t e = xtkp->xtk_bucket[hash & (xtkp->xtk_nbuckets - 1)];
+    uint32_t s = slot;
+
+    framep->xtf_state[slot] = XTFS_DEAD;
+
+    for ( ; e; e = xtkp->xtk_ents[e - 1].xtke_next) {
+	xo_tkent_t *xtkep = &xtkp->xtk_ents[e - 1];
+	if (xtkep->xtke_hash != hash || xtkep->xtke_len != vlen
+		|| memcmp(xo_xparse_str(xtp->xt_xd, xtkep->xtke_value),
+			  value, vlen) != 0)
+	    continue;
+
+	/* The first member takes our slot; others need one of their own */
+	if (s != slot || framep->xtf_state[slot] != XTFS_DEAD) {
+	    if (framep->xtf_count >= XO_TFRAME_MAX)
+		break;
+
+	    s = framep->xtf_count++;
+	    framep->xtf_position[s] = framep->xtf_position[slot];
+	    framep->xtf_flags[s] = 0;
+	}
+
+	framep->xtf_node[s] = xtkep->xtke_node;
+	framep->xtf_state[s] = XTFS_LIVE;
+	XO_TSTAT(xtmp, xtkep->xtke_node, xts_visits);
+	XO_TSTAT(xtmp, xtkep->xtke_node, xts_evals);
+	xo_tmatch_record_live(xtmp, framep, &xtp->xt_nodes[xtkep->xtke_node]);
+    }
+}
+
 static xo_filter_status_t
 xo_tmatch_key (xo_handle_t *xop, xo_filter_t *xfp, xo_tmatch_t *xtmp,
 	       const char *tag, xo_ssize_t tlen,
@@ -3188,6 +6040,12 @@ xo_tmatch_key (xo_handle_t *xop, xo_filter_t *xfp, xo_tmatch_t *xtmp,
 
 	xo_tnode_t *tn = &xtp->xt_nodes[framep->xtf_node[i]];
 
+	if (tn->xtn_flags & XTNF_KEYS) {
+	    if (xo_tmatch_keys_needs(xtp, tn, tag, tlen))
+		xo_tmatch_keys_resolve(xtmp, framep, i, tn, value, vlen);
+	    continue;
+	}
+
 	if (!xo_filter_pred_needs(&xfp->xf_xd, xfp, tn->xtn_pred,
 				  tag, tlen, FALSE))
 	    continue;
@@ -3197,13 +6055,14 @@ xo_tmatch_key (xo_handle_t *xop, xo_filter_t *xfp, xo_tmatch_t *xtmp,
 	framep->xtf_position_cur = xo_tmatch_slot_position(xop, xfp, xtmp,
 							    framep, i,
 							    tn->xtn_pred);
+	XO_TSTAT(xtmp, framep->xtf_node[i], xts_evals);
 	xo_eval_value_t result =
 	    xo_filter_pred_eval(xop, xfp, framep, tn->xtn_pred);
 
 	if (result.xev_flags & XEVF_MISSING)
 	    continue;
 
-	int live = xo_eval_cast_boolean(xop, result);
+	int live = xo_eval_cast_boolean(xop, framep, result);
 	xo_eval_value_free(result);
 	if (live) {
 	    framep->xtf_state[i] = XTFS_LIVE;
@@ -3262,13 +6121,14 @@ xo_tmatch_attr (xo_handle_t *xop, xo_filter_t *xfp, xo_tmatch_t *xtmp,
 	framep->xtf_position_cur = xo_tmatch_slot_position(xop, xfp, xtmp,
 							   framep, i,
 							   tn->xtn_pred);
+	XO_TSTAT(xtmp, framep->xtf_node[i], xts_evals);
 	xo_eval_value_t result =
 	    xo_filter_pred_eval(xop, xfp, framep, tn->xtn_pred);
 
 	if (result.xev_flags & XEVF_MISSING)
 	    continue;
 
-	int live = xo_eval_cast_boolean(xop, result);
+	int live = xo_eval_cast_boolean(xop, framep, result);
 	xo_eval_value_free(result);
 	if (live) {
 	    framep->xtf_state[i] = XTFS_LIVE;
@@ -3383,8 +6243,11 @@ xo_filter_op_needs_nonkey_field (XO_FILTER_NEEDS_NONKEY_FIELD_SIGNATURE)
 	if (framep->xtf_state[i] != XTFS_PRED)
 	    continue;
 	xo_tnode_t *tn = &xtp->xt_nodes[framep->xtf_node[i]];
-	if (xo_filter_pred_needs(&xfp->xf_xd, xfp, tn->xtn_pred,
-				 tag, tlen, FALSE))
+	if (tn->xtn_flags & XTNF_KEYS) {
+	    if (xo_tmatch_keys_needs(xtp, tn, tag, tlen))
+		return TRUE;
+	} else if (xo_filter_pred_needs(&xfp->xf_xd, xfp, tn->xtn_pred,
+					tag, tlen, FALSE))
 	    return TRUE;
     }
 
@@ -3412,6 +6275,11 @@ xo_filter_force_resolve_pred (xo_handle_t *xop, xo_filter_t *xfp,
 	if (framep->xtf_state[i] != XTFS_PRED)
 	    continue;
 	xo_tnode_t *tn = &xtmp->xtm_trie->xt_nodes[framep->xtf_node[i]];
+	XO_TSTAT(xtmp, framep->xtf_node[i], xts_forced);
+	if (tn->xtn_flags & XTNF_KEYS) {
+	    xo_tmatch_keys_resolve(xtmp, framep, i, tn, "", 0);
+	    continue;
+	}
 	if (tn->xtn_pred == 0) {
 	    framep->xtf_state[i] = XTFS_LIVE;
 	    xo_tmatch_record_live(xtmp, framep, tn);
@@ -3419,10 +6287,11 @@ xo_filter_force_resolve_pred (xo_handle_t *xop, xo_filter_t *xfp,
 	}
 	framep->xtf_position_cur = (framep->xtf_flags[i] & XTFF_QUAL_COUNTED)
 	    ? framep->xtf_qual_position[i] : framep->xtf_position[i];
+	XO_TSTAT(xtmp, framep->xtf_node[i], xts_evals);
 	xo_eval_value_t result =
 	    xo_filter_pred_eval(xop, xfp, framep, tn->xtn_pred);
 	if (!(result.xev_flags & XEVF_MISSING)) {
-	    int live = xo_eval_cast_boolean(xop, result);
+	    int live = xo_eval_cast_boolean(xop, framep, result);
 	    xo_eval_value_free(result);
 	    if (live) {
 		framep->xtf_state[i] = XTFS_LIVE;
@@ -3458,6 +6327,647 @@ xo_filter_op_pred_field (XO_FILTER_PRED_FIELD_SIGNATURE)
     return xfp->xf_status;
 }
 
+/*
+ * Return TRUE if nothing below the current node can be output.  That's
+ * the case when a "not" path has matched, or when no slot in the
+ * current frame is still alive (live, or waiting on a predicate) and
+ * no relative path can start matching deeper in the tree.  Absolute
+ * paths only start at depth one, so they can't.
+ */
+static int
+xo_filter_op_subtree_dead (xo_handle_t *xop UNUSED, xo_filter_t *xfp)
+{
+    if (xfp == NULL || xfp->xf_trie == NULL || xfp->xf_xd.xd_paths_cur == 0)
+	return FALSE;
+
+    xo_tmatch_t *xtmp = &xfp->xf_tmatch;
+    if (xtmp->xtm_deny)
+	return TRUE;		/* No means no (see xo_filter_change_status) */
+
+    if (xtmp->xtm_allow || (xfp->xf_xd.xd_flags & XDF_ALL_NOTS))
+	return FALSE;
+
+    if (xtmp->xtm_depth == 0)
+	return FALSE;
+
+    xo_trie_t *xtp = xtmp->xtm_trie;
+    xo_tframe_t *framep = &xtmp->xtm_stack[xtmp->xtm_depth];
+
+    for (uint32_t i = 0; i < framep->xtf_count; i++)
+	if (framep->xtf_state[i] != XTFS_DEAD)
+	    return FALSE;
+
+    return !xtp->xt_relative;
+}
+
+/*
+ * Return TRUE if no later instance of the list named 'tag', which is
+ * open in the current frame, can be output.  Beyond a matched "not"
+ * path, that's when every path an instance could match has used up
+ * the positions its predicates allow, as with "route[1]" or
+ * "route[position() <= 10]" (see xo_tmatch_list_dead).
+ */
+static int
+xo_filter_op_list_dead (xo_handle_t *xop UNUSED, xo_filter_t *xfp,
+			const char *tag)
+{
+    if (xfp == NULL || xfp->xf_trie == NULL || xfp->xf_xd.xd_paths_cur == 0)
+	return FALSE;
+
+    xo_tmatch_t *xtmp = &xfp->xf_tmatch;
+    if (xtmp->xtm_deny)
+	return TRUE;		/* No means no (see xo_filter_change_status) */
+
+    if (xtmp->xtm_allow || (xfp->xf_xd.xd_flags & XDF_ALL_NOTS))
+	return FALSE;
+
+    xo_atom_t atom = xo_trie_atom_find(xtmp->xtm_trie, tag, strlen(tag));
+
+    return xo_tmatch_list_dead(xtmp, atom);
+}
+
+/*
+ * Compiled filter images
+ *
+ * Parsing and compiling a long filter takes milliseconds, which
+ * short-lived commands pay on every run.  An image holds the parse
+ * data, the trie, and the predicate programs, all of which are arrays
+ * of offsets and ids, so they work wherever they're mapped.  Loading
+ * an image is a few checks and setting some pointers into the
+ * mapping; only the rematch() cache and the match stack are built.
+ *
+ * Images are written in native byte order and structure layout, so
+ * they're only good for the libxo build that made them; the header
+ * records enough to refuse any other.  Bump XO_FIMAGE_VERSION when
+ * the layout of anything written here (including the XIOP_* codes)
+ * changes.  The mapped arrays are read-only; if another filter is
+ * added, the parse data is copied into the heap and recompiled, as
+ * if the image's expressions had been added by hand.
+ */
+#define XO_FIMAGE_MAGIC		0x786f6669 /* "xofi", in our byte order */
+#define XO_FIMAGE_VERSION	2	/* Image layout version */
+#define XO_FIMAGE_ALIGN		8	/* Sections start on this boundary */
+#define XO_FIMAGE_NSIZES	8	/* Structure sizes we record */
+
+/* Sections of an image */
+#define XFIS_STR	0	/* Parse strings (xd_str_buf) */
+#define XFIS_NODE	1	/* Parse nodes (xd_node_buf) */
+#define XFIS_PATHS	2	/* Root of each expression (xd_paths) */
+#define XFIS_TNODES	3	/* Trie nodes (xt_nodes) */
+#define XFIS_ATOMS	4	/* Interned names (xt_atoms) */
+#define XFIS_ABUCKET	5	/* Atom hash buckets (xt_atom_bucket) */
+#define XFIS_INDEX	6	/* Child index (xt_index) */
+#define XFIS_KEYS	7	/* Value hashes (xt_keys), less their pointers */
+#define XFIS_KBUCKET	8	/* Each xt_keys' xtk_bucket, in turn */
+#define XFIS_KENTS	9	/* Each xt_keys' xtk_ents, in turn */
+#define XFIS_CODE	10	/* Predicate instructions (xp_code) */
+#define XFIS_CONSTS	11	/* Predicate constants (xp_consts) */
+#define XFIS_START	12	/* Predicate starts (xp_start) */
+#define XFIS_MAX	13
+
+typedef struct xo_fimage_sect_s {
+    uint64_t xfs_offset;	/* Offset from the start of the image */
+    uint64_t xfs_size;		/* Size in bytes */
+} xo_fimage_sect_t;
+
+typedef struct xo_fimage_hdr_s {
+    uint32_t xfh_magic;		/* XO_FIMAGE_MAGIC */
+    uint32_t xfh_version;	/* XO_FIMAGE_VERSION */
+    char xfh_libxo[16];		/* LIBXO_VERSION that made the image */
+    uint16_t xfh_sizes[XO_FIMAGE_NSIZES]; /* See xo_fimage_sizes */
+    uint32_t xfh_flags;		/* xd_flags worth keeping (XDF_ALL_*) */
+    uint32_t xfh_paths;		/* xd_paths_cur */
+    uint64_t xfh_last_node;	/* xd_last_node */
+    uint64_t xfh_last_str;	/* xd_last_str */
+    uint32_t xfh_nodes;		/* xt_count */
+    uint32_t xfh_root;		/* xt_root */
+    uint32_t xfh_atoms;		/* xt_atom_count */
+    uint32_t xfh_atom_nbuckets;	/* xt_atom_nbuckets */
+    uint32_t xfh_root_index;	/* xt_root_index */
+    uint32_t xfh_root_nindex;	/* xt_root_nindex */
+    uint32_t xfh_relative;	/* xt_relative */
+    uint32_t xfh_keys;		/* xt_keys_count */
+    uint32_t xfh_prog;		/* Non-zero if there's an xo_xprog_t */
+    uint32_t xfh_code;		/* xp_code_len */
+    uint32_t xfh_consts;	/* xp_consts_len */
+    uint32_t xfh_start;		/* xp_start_len */
+    xo_fimage_sect_t xfh_sect[XFIS_MAX]; /* Where the arrays are */
+} xo_fimage_hdr_t;
+
+/*
+ * Record the sizes of the structures we write, so an image from a
+ * build with a different layout is refused
+ */
+static void
+xo_fimage_sizes (uint16_t *sizes)
+{
+    sizes[0] = sizeof(xo_xparse_node_t);
+    sizes[1] = sizeof(xo_tnode_t);
+    sizes[2] = sizeof(xo_tatom_t);
+    sizes[3] = sizeof(xo_tindex_t);
+    sizes[4] = sizeof(xo_tkeys_t);
+    sizes[5] = sizeof(xo_tkent_t);
+    sizes[6] = sizeof(xo_xinsn_t);
+    sizes[7] = sizeof(xo_eval_value_t);
+}
+
+/*
+ * Append data to the current section, which starts at sp->xfs_offset
+ */
+static int
+xo_fimage_put (FILE *fp, xo_fimage_sect_t *sp, const void *data,
+	       size_t size, uint64_t *offp)
+{
+    if (size && fwrite(data, 1, size, fp) != size)
+	return -1;
+
+    sp->xfs_size += size;
+    *offp += size;
+    return 0;
+}
+
+/*
+ * Start a section, padding up to XO_FIMAGE_ALIGN
+ */
+static int
+xo_fimage_begin (FILE *fp, xo_fimage_sect_t *sp, uint64_t *offp)
+{
+    static const char zeros[XO_FIMAGE_ALIGN];
+    size_t pad = (XO_FIMAGE_ALIGN - *offp % XO_FIMAGE_ALIGN) % XO_FIMAGE_ALIGN;
+
+    if (pad && fwrite(zeros, 1, pad, fp) != pad)
+	return -1;
+
+    *offp += pad;
+    sp->xfs_offset = *offp;
+    sp->xfs_size = 0;
+    return 0;
+}
+
+static int
+xo_fimage_write (FILE *fp, xo_filter_t *xfp)
+{
+    xo_xparse_data_t *xdp = &xfp->xf_xd;
+    xo_trie_t *xtp = xfp->xf_trie;
+    xo_xprog_t *xpp = xtp->xt_prog;
+    xo_fimage_hdr_t hdr;
+    xo_fimage_sect_t *sp = hdr.xfh_sect;
+    uint64_t off = sizeof(hdr);
+    uint32_t i;
+    int rc = 0;
+
+    bzero(&hdr, sizeof(hdr));
+    hdr.xfh_magic = XO_FIMAGE_MAGIC;
+    hdr.xfh_version = XO_FIMAGE_VERSION;
+    strncpy(hdr.xfh_libxo, LIBXO_VERSION, sizeof(hdr.xfh_libxo) - 1);
+    xo_fimage_sizes(hdr.xfh_sizes);
+    hdr.xfh_flags = xdp->xd_flags & (XDF_ALL_NOTS | XDF_ALL_ABS);
+    hdr.xfh_paths = xdp->xd_paths_cur;
+    hdr.xfh_last_node = xdp->xd_last_node;
+    hdr.xfh_last_str = xdp->xd_last_str;
+    hdr.xfh_nodes = xtp->xt_count;
+    hdr.xfh_root = xtp->xt_root;
+    hdr.xfh_atoms = xtp->xt_atom_count;
+    hdr.xfh_atom_nbuckets = xtp->xt_atom_nbuckets;
+    hdr.xfh_root_index = xtp->xt_root_index;
+    hdr.xfh_root_nindex = xtp->xt_root_nindex;
+    hdr.xfh_relative = xtp->xt_relative;
+    hdr.xfh_keys = xtp->xt_keys_count;
+    if (xpp) {
+	hdr.xfh_prog = TRUE;
+	hdr.xfh_code = xpp->xp_code_len;
+	hdr.xfh_consts = xpp->xp_consts_len;
+	hdr.xfh_start = xpp->xp_start_len;
+    }
+
+    /* The header goes last, once we know where everything went */
+    if (fwrite(&hdr, 1, sizeof(hdr), fp) != sizeof(hdr))
+	return -1;
+
+#define XO_FIMAGE_SECT(_sect, _data, _size) \
+    (xo_fimage_begin(fp, &sp[_sect], &off) \
+     || xo_fimage_put(fp, &sp[_sect], _data, _size, &off))
+
+    if (XO_FIMAGE_SECT(XFIS_STR, xdp->xd_str_buf.xb_bufp,
+		       xo_buf_offset(&xdp->xd_str_buf))
+	|| XO_FIMAGE_SECT(XFIS_NODE, xdp->xd_node_buf.xb_bufp,
+			  (xdp->xd_last_node + 1) * sizeof(xo_xparse_node_t))
+	|| XO_FIMAGE_SECT(XFIS_PATHS, xdp->xd_paths,
+			  xdp->xd_paths_cur * sizeof(*xdp->xd_paths))
+	|| XO_FIMAGE_SECT(XFIS_TNODES, xtp->xt_nodes, xtp->xt_count
+			  ? (xtp->xt_count + 1) * sizeof(xo_tnode_t) : 0)
+	|| XO_FIMAGE_SECT(XFIS_ATOMS, xtp->xt_atoms, xtp->xt_atom_count
+			  ? (xtp->xt_atom_count + 1) * sizeof(xo_tatom_t) : 0)
+	|| XO_FIMAGE_SECT(XFIS_ABUCKET, xtp->xt_atom_bucket,
+			  xtp->xt_atom_nbuckets * sizeof(xo_atom_t))
+	|| XO_FIMAGE_SECT(XFIS_INDEX, xtp->xt_index,
+			  xtp->xt_count * sizeof(xo_tindex_t)))
+	return -1;
+
+    /* The value hashes are written without their pointers */
+    if (xo_fimage_begin(fp, &sp[XFIS_KEYS], &off))
+	return -1;
+
+    for (i = 0; xtp->xt_keys_count && i <= xtp->xt_keys_count; i++) {
+	xo_tkeys_t keys = xtp->xt_keys[i];
+
+	keys.xtk_bucket = NULL;
+	keys.xtk_ents = NULL;
+	if (xo_fimage_put(fp, &sp[XFIS_KEYS], &keys, sizeof(keys), &off))
+	    return -1;
+    }
+
+    if (xo_fimage_begin(fp, &sp[XFIS_KBUCKET], &off))
+	return -1;
+
+    for (i = 1; i <= xtp->xt_keys_count; i++)
+	if (xo_fimage_put(fp, &sp[XFIS_KBUCKET], xtp->xt_keys[i].xtk_bucket,
+			  xtp->xt_keys[i].xtk_nbuckets * sizeof(uint32_t),
+			  &off))
+	    return -1;
+
+    if (xo_fimage_begin(fp, &sp[XFIS_KENTS], &off))
+	return -1;
+
+    for (i = 1; i <= xtp->xt_keys_count; i++)
+	if (xo_fimage_put(fp, &sp[XFIS_KENTS], xtp->xt_keys[i].xtk_ents,
+			  xtp->xt_keys[i].xtk_count * sizeof(xo_tkent_t),
+			  &off))
+	    return -1;
+
+    if (xpp && (XO_FIMAGE_SECT(XFIS_CODE, xpp->xp_code,
+			       xpp->xp_code_len * sizeof(xo_xinsn_t))
+		|| XO_FIMAGE_SECT(XFIS_CONSTS, xpp->xp_consts,
+				  xpp->xp_consts_len * sizeof(xo_eval_value_t))
+		|| XO_FIMAGE_SECT(XFIS_START, xpp->xp_start,
+				  xpp->xp_start_len * sizeof(uint32_t))))
+	return -1;
+
+#undef XO_FIMAGE_SECT
+
+    if (fseek(fp, 0, SEEK_SET) != 0
+	|| fwrite(&hdr, 1, sizeof(hdr), fp) != sizeof(hdr))
+	rc = -1;
+
+    return rc;
+}
+
+/*
+ * Save the compiled filter as an image file.  We write a temporary
+ * file and rename it into place, so a command running at the same
+ * time sees either the old image or the new one.
+ */
+static int
+xo_filter_op_image_save (xo_handle_t *xop, const char *path)
+{
+    xo_filter_t *xfp = xo_get_filter_data(xop, FALSE);
+    if (xfp == NULL || xfp->xf_trie == NULL) {
+	xo_failure_filter(xop, "no compiled filter to save");
+	return -1;
+    }
+
+    size_t len = strlen(path);
+    char *tmp = xo_realloc(NULL, len + 8);
+    if (tmp == NULL)
+	return -1;
+
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".XXXXXX", 8);
+
+    int rc = -1;
+    FILE *fp = NULL;
+    int fd = mkstemp(tmp);
+    if (fd >= 0)
+	fp = fdopen(fd, "w");
+
+    if (fp == NULL) {
+	xo_failure_filter(xop, "filter image '%s': %s", path, strerror(errno));
+	if (fd >= 0) {
+	    close(fd);
+	    unlink(tmp);
+	}
+	xo_free(tmp);
+	return -1;
+    }
+
+    rc = xo_fimage_write(fp, xfp);
+    if (fclose(fp) != 0)
+	rc = -1;
+
+    if (rc == 0 && rename(tmp, path) != 0)
+	rc = -1;
+
+    if (rc) {
+	xo_failure_filter(xop, "filter image '%s': %s", path, strerror(errno));
+	unlink(tmp);
+    }
+
+    xo_free(tmp);
+    return rc;
+}
+
+/*
+ * Is this section inside the image, aligned, and 'want' bytes long?
+ */
+static int
+xo_fimage_sect_ok (const xo_fimage_hdr_t *hdrp, size_t size, int sect,
+		   uint64_t want)
+{
+    const xo_fimage_sect_t *sp = &hdrp->xfh_sect[sect];
+
+    return sp->xfs_size == want && sp->xfs_offset % XO_FIMAGE_ALIGN == 0
+	&& sp->xfs_offset >= sizeof(*hdrp) && sp->xfs_offset <= size
+	&& sp->xfs_size <= size - sp->xfs_offset;
+}
+
+/*
+ * Check that an image was made by this build of libxo and that its
+ * arrays are all there.  Images are trusted like the libraries that
+ * read them: we catch mistakes, like stale or truncated images, but
+ * don't check every id in them.
+ */
+static int
+xo_fimage_valid (const xo_fimage_hdr_t *hdrp, size_t size)
+{
+    uint16_t sizes[XO_FIMAGE_NSIZES];
+    const char *base = (const char *) hdrp;
+
+    xo_fimage_sizes(sizes);
+
+    if (hdrp->xfh_magic != XO_FIMAGE_MAGIC
+	|| hdrp->xfh_version != XO_FIMAGE_VERSION
+	|| strncmp(hdrp->xfh_libxo, LIBXO_VERSION, sizeof(hdrp->xfh_libxo))
+	|| memcmp(hdrp->xfh_sizes, sizes, sizeof(sizes)) != 0)
+	return FALSE;
+
+    uint64_t nodes = hdrp->xfh_nodes;
+    uint64_t atoms = hdrp->xfh_atoms;
+    uint64_t keys = hdrp->xfh_keys;
+
+    if (hdrp->xfh_root > nodes
+	|| (uint64_t) hdrp->xfh_root_index + hdrp->xfh_root_nindex > nodes
+	|| (hdrp->xfh_atom_nbuckets & (hdrp->xfh_atom_nbuckets - 1))
+	|| hdrp->xfh_sect[XFIS_STR].xfs_size == 0
+	|| !xo_fimage_sect_ok(hdrp, size, XFIS_STR,
+			      hdrp->xfh_sect[XFIS_STR].xfs_size)
+	|| !xo_fimage_sect_ok(hdrp, size, XFIS_NODE, (hdrp->xfh_last_node + 1)
+			      * sizeof(xo_xparse_node_t))
+	|| !xo_fimage_sect_ok(hdrp, size, XFIS_PATHS, hdrp->xfh_paths
+			      * sizeof(xo_xparse_node_id_t))
+	|| !xo_fimage_sect_ok(hdrp, size, XFIS_TNODES,
+			      nodes ? (nodes + 1) * sizeof(xo_tnode_t) : 0)
+	|| !xo_fimage_sect_ok(hdrp, size, XFIS_ATOMS,
+			      atoms ? (atoms + 1) * sizeof(xo_tatom_t) : 0)
+	|| !xo_fimage_sect_ok(hdrp, size, XFIS_ABUCKET,
+			      hdrp->xfh_atom_nbuckets * sizeof(xo_atom_t))
+	|| !xo_fimage_sect_ok(hdrp, size, XFIS_INDEX,
+			      nodes * sizeof(xo_tindex_t))
+	|| !xo_fimage_sect_ok(hdrp, size, XFIS_KEYS,
+			      keys ? (keys + 1) * sizeof(xo_tkeys_t) : 0))
+	return FALSE;
+
+    /* The strings end with a NUL, so a bad offset can't run off */
+    if (base[hdrp->xfh_sect[XFIS_STR].xfs_offset
+	     + hdrp->xfh_sect[XFIS_STR].xfs_size - 1] != '\0')
+	return FALSE;
+
+    const xo_tkeys_t *kp = (const void *) (base
+					   + hdrp->xfh_sect[XFIS_KEYS].xfs_offset);
+    uint64_t nbuckets = 0, nents = 0;
+
+    for (uint32_t i = 1; i <= keys; i++) {
+	nbuckets += kp[i].xtk_nbuckets;
+	nents += kp[i].xtk_count;
+    }
+
+    if (!xo_fimage_sect_ok(hdrp, size, XFIS_KBUCKET,
+			   nbuckets * sizeof(uint32_t))
+	|| !xo_fimage_sect_ok(hdrp, size, XFIS_KENTS,
+			      nents * sizeof(xo_tkent_t)))
+	return FALSE;
+
+    if (hdrp->xfh_prog
+	&& (hdrp->xfh_start != hdrp->xfh_last_node + 1
+	    || !xo_fimage_sect_ok(hdrp, size, XFIS_CODE,
+				  hdrp->xfh_code * sizeof(xo_xinsn_t))
+	    || !xo_fimage_sect_ok(hdrp, size, XFIS_CONSTS,
+				  hdrp->xfh_consts * sizeof(xo_eval_value_t))
+	    || !xo_fimage_sect_ok(hdrp, size, XFIS_START,
+				  hdrp->xfh_start * sizeof(uint32_t))))
+	return FALSE;
+
+    return TRUE;
+}
+
+/*
+ * Point a buffer at read-only data in the image
+ */
+static void
+xo_fimage_buf (xo_buffer_t *xbp, char *data, xo_off_t size)
+{
+    xbp->xb_bufp = data;
+    xbp->xb_curp = data + size;
+    xbp->xb_size = size;
+}
+
+/*
+ * Use a compiled filter image, mapped from a file.  This must come
+ * before any other filter is added.
+ */
+static int
+xo_filter_op_image_load (xo_handle_t *xop, const char *path)
+{
+    xo_filter_t *xfp = xo_get_filter_data(xop, TRUE);
+    if (xfp == NULL)
+	return -1;
+
+    xo_xparse_data_t *xdp = xo_filter_xparse_data(xop, xfp);
+    if (xdp->xd_paths_cur != 0 || xfp->xf_image) {
+	xo_failure_filter(xop, "filter image '%s' must come before "
+			  "any other filter", path);
+	return -1;
+    }
+
+    struct stat st;
+    char *base = MAP_FAILED;
+    int fd = open(path, O_RDONLY);
+
+    if (fd >= 0) {
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(xo_fimage_hdr_t))
+	    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	else
+	    errno = EINVAL;
+	close(fd);
+    }
+
+    if (base == MAP_FAILED) {
+	xo_failure_filter(xop, "filter image '%s': %s", path, strerror(errno));
+	return -1;
+    }
+
+    size_t size = st.st_size;
+    const xo_fimage_hdr_t *hdrp = (const void *) base;
+    const xo_fimage_sect_t *sp = hdrp->xfh_sect;
+
+    if (!xo_fimage_valid(hdrp, size)) {
+	xo_failure_filter(xop, "filter image '%s' was not made by "
+			  "this libxo", path);
+	munmap(base, size);
+	return -1;
+    }
+
+    xo_trie_t *xtp = xo_realloc(NULL, sizeof(*xtp));
+    xo_tkeys_t *keys = hdrp->xfh_keys
+	? xo_realloc(NULL, sp[XFIS_KEYS].xfs_size) : NULL;
+    xo_xprog_t *xpp = hdrp->xfh_prog ? xo_realloc(NULL, sizeof(*xpp)) : NULL;
+
+    if (xtp == NULL || (hdrp->xfh_keys && keys == NULL)
+	|| (hdrp->xfh_prog && xpp == NULL)) {
+	xo_free(xtp);
+	xo_free(keys);
+	xo_free(xpp);
+	munmap(base, size);
+	return -1;
+    }
+
+#define XO_FIMAGE_DATA(_sect) ((void *) (base + sp[_sect].xfs_offset))
+
+    /* Trade the empty parse data for the image's */
+    xo_buf_cleanup(&xdp->xd_str_buf);
+    xo_buf_cleanup(&xdp->xd_node_buf);
+    xo_free(xdp->xd_paths);
+
+    xo_fimage_buf(&xdp->xd_str_buf, XO_FIMAGE_DATA(XFIS_STR),
+		  sp[XFIS_STR].xfs_size);
+    xo_fimage_buf(&xdp->xd_node_buf, XO_FIMAGE_DATA(XFIS_NODE),
+		  sp[XFIS_NODE].xfs_size);
+    xdp->xd_last_node = hdrp->xfh_last_node;
+    xdp->xd_last_str = hdrp->xfh_last_str;
+    xdp->xd_paths = XO_FIMAGE_DATA(XFIS_PATHS);
+    xdp->xd_paths_cur = xdp->xd_paths_max = hdrp->xfh_paths;
+    xdp->xd_flags |= hdrp->xfh_flags;
+
+    bzero(xtp, sizeof(*xtp));
+    xtp->xt_mapped = TRUE;
+    xtp->xt_xd = xdp;
+    xtp->xt_nodes = XO_FIMAGE_DATA(XFIS_TNODES);
+    xtp->xt_count = xtp->xt_cap = hdrp->xfh_nodes;
+    xtp->xt_root = hdrp->xfh_root;
+    xtp->xt_atoms = XO_FIMAGE_DATA(XFIS_ATOMS);
+    xtp->xt_atom_count = xtp->xt_atom_cap = hdrp->xfh_atoms;
+    xtp->xt_atom_bucket = XO_FIMAGE_DATA(XFIS_ABUCKET);
+    xtp->xt_atom_nbuckets = hdrp->xfh_atom_nbuckets;
+    xtp->xt_index = XO_FIMAGE_DATA(XFIS_INDEX);
+    xtp->xt_root_index = hdrp->xfh_root_index;
+    xtp->xt_root_nindex = hdrp->xfh_root_nindex;
+    xtp->xt_relative = hdrp->xfh_relative;
+
+    /* The value hashes are the only arrays with pointers to set */
+    if (keys) {
+	uint32_t *bucket = XO_FIMAGE_DATA(XFIS_KBUCKET);
+	xo_tkent_t *ents = XO_FIMAGE_DATA(XFIS_KENTS);
+
+	memcpy(keys, XO_FIMAGE_DATA(XFIS_KEYS), sp[XFIS_KEYS].xfs_size);
+
+	for (uint32_t i = 1; i <= hdrp->xfh_keys; i++) {
+	    keys[i].xtk_bucket = bucket;
+	    keys[i].xtk_ents = ents;
+	    bucket += keys[i].xtk_nbuckets;
+	    ents += keys[i].xtk_count;
+	}
+
+	xtp->xt_keys = keys;
+	xtp->xt_keys_count = hdrp->xfh_keys;
+    }
+
+    if (xpp) {
+	xpp->xp_code = XO_FIMAGE_DATA(XFIS_CODE);
+	xpp->xp_code_len = xpp->xp_code_cap = hdrp->xfh_code;
+	xpp->xp_consts = XO_FIMAGE_DATA(XFIS_CONSTS);
+	xpp->xp_consts_len = xpp->xp_consts_cap = hdrp->xfh_consts;
+	xpp->xp_start = XO_FIMAGE_DATA(XFIS_START);
+	xpp->xp_start_len = hdrp->xfh_start;
+	xtp->xt_prog = xpp;
+    }
+
+#undef XO_FIMAGE_DATA
+
+    xfp->xf_image = base;
+    xfp->xf_image_size = size;
+    xfp->xf_trie = xtp;
+
+    if (xo_trie_aggs(xtp, xdp) < 0) {
+	xo_filter_image_release(xfp, FALSE);
+	return -1;
+    }
+
+    if (xo_tmatch_init(xop, &xfp->xf_tmatch, xtp) < 0) {
+	xo_filter_image_release(xfp, FALSE);
+	return -1;
+    }
+
+    xo_rematch_precompile(xfp);
+
+    return 0;
+}
+
+/*
+ * Let go of a filter image.  If 'keep' is set, the parse data is
+ * copied into the heap first, so more expressions can be added to it
+ * and the trie recompiled; otherwise it's left empty.
+ */
+static int
+xo_filter_image_release (xo_filter_t *xfp, int keep)
+{
+    xo_xparse_data_t *xdp = &xfp->xf_xd;
+    xo_buffer_t str = xdp->xd_str_buf;
+    xo_buffer_t node = xdp->xd_node_buf;
+    xo_xparse_node_id_t *paths = xdp->xd_paths;
+    int rc = 0;
+
+    xo_tmatch_cleanup(&xfp->xf_tmatch);
+    xo_trie_free(xfp->xf_trie);
+    xfp->xf_trie = NULL;
+
+    bzero(&xdp->xd_str_buf, sizeof(xdp->xd_str_buf));
+    bzero(&xdp->xd_node_buf, sizeof(xdp->xd_node_buf));
+    xdp->xd_paths = NULL;
+    xdp->xd_paths_max = 0;
+
+    if (keep) {
+	size_t psize = xdp->xd_paths_cur * sizeof(*paths);
+
+	xdp->xd_paths = psize ? xo_realloc(NULL, psize) : NULL;
+	if ((psize && xdp->xd_paths == NULL)
+	    || xo_buf_append_val(&xdp->xd_str_buf, str.xb_bufp,
+				 xo_buf_offset(&str)) == NULL
+	    || xo_buf_append_val(&xdp->xd_node_buf, node.xb_bufp,
+				 node.xb_size) == NULL) {
+	    xo_buf_cleanup(&xdp->xd_str_buf);
+	    xo_buf_cleanup(&xdp->xd_node_buf);
+	    xo_free(xdp->xd_paths);
+	    xdp->xd_paths = NULL;
+	    keep = FALSE;
+	    rc = -1;
+	} else {
+	    memcpy(xdp->xd_paths, paths, psize);
+	    xdp->xd_paths_max = xdp->xd_paths_cur;
+	}
+    }
+
+    if (!keep) {
+	xdp->xd_paths_cur = 0;
+	xdp->xd_last_node = 0;
+	xdp->xd_last_str = 0;
+    }
+
+    munmap(xfp->xf_image, xfp->xf_image_size);
+    xfp->xf_image = NULL;
+    xfp->xf_image_size = 0;
+
+    return rc;
+}
+
 static xo_filter_ops_t xo_filter_ops_local = {
     XO_FILTER_OPS_VERSION,
     XO_FILTER_OPS_FUNCS
@@ -12,11 +12,21 @@
 #define XO_FILTER_OPS_H
 
 
+#define XO_FILTER_ADD_FILE_ARGS xop, vp
+#define XO_FILTER_ADD_FILE_SIGNATURE xo_handle_t *xop UNUSED, const char *vp UNUSED
+
+typedef int (*xo_filter_add_file_func_t)(XO_FILTER_ADD_FILE_SIGNATURE);
+
 #define XO_FILTER_ADD_ONE_ARGS xop, vp
 #define XO_FILTER_ADD_ONE_SIGNATURE xo_handle_t *xop UNUSED, const char *vp UNUSED
 
 typedef int (*xo_filter_add_one_func_t)(XO_FILTER_ADD_ONE_SIGNATURE);
 
+#define XO_FILTER_AGGREGATES_ARGS xop, xfp
+#define XO_FILTER_AGGREGATES_SIGNATURE xo_handle_t *xop UNUSED, xo_filter_t *xfp UNUSED
+
+typedef const char * (*xo_filter_aggregates_func_t)(XO_FILTER_AGGREGATES_SIGNATURE);
+
 #define XO_FILTER_ATTRIBUTE_ARGS xop, xfp, tag, tlen, value, vlen
 #define XO_FILTER_ATTRIBUTE_SIGNATURE xo_handle_t *xop UNUSED, xo_filter_t *xfp UNUSED,                const char *tag UNUSED, xo_ssize_t tlen UNUSED,                const char *value UNUSED, xo_ssize_t vlen UNUSED
 
@@ -52,11 +62,26 @@ typedef void (*xo_filter_destroy_func_t)(XO_FILTER_DESTROY_SIGNATURE);
 
 typedef xo_filter_status_t (*xo_filter_get_status_func_t)(XO_FILTER_GET_STATUS_SIGNATURE);
 
+#define XO_FILTER_IMAGE_LOAD_ARGS xop, vp
+#define XO_FILTER_IMAGE_LOAD_SIGNATURE xo_handle_t *xop UNUSED, const char *vp UNUSED
+
+typedef int (*xo_filter_image_load_func_t)(XO_FILTER_IMAGE_LOAD_SIGNATURE);
+
+#define XO_FILTER_IMAGE_SAVE_ARGS xop, vp
+#define XO_FILTER_IMAGE_SAVE_SIGNATURE xo_handle_t *xop UNUSED, const char *vp UNUSED
+
+typedef int (*xo_filter_image_save_func_t)(XO_FILTER_IMAGE_SAVE_SIGNATURE);
+
 #define XO_FILTER_KEY_ARGS xop, xfp, tag, tlen, value, vlen
 #define XO_FILTER_KEY_SIGNATURE xo_handle_t *xop UNUSED, xo_filter_t *xfp UNUSED,                const char *tag UNUSED, xo_ssize_t tlen UNUSED,                const char *value UNUSED, xo_ssize_t vlen UNUSED
 
 typedef int (*xo_filter_key_func_t)(XO_FILTER_KEY_SIGNATURE);
 
+#define XO_FILTER_LIST_DEAD_ARGS XO_FILTER_DEFAULT_TAG_ARGS
+#define XO_FILTER_LIST_DEAD_SIGNATURE XO_FILTER_DEFAULT_TAG_SIGNATURE
+
+typedef int (*xo_filter_list_dead_func_t)(XO_FILTER_LIST_DEAD_SIGNATURE);
+
 #define XO_FILTER_NEEDS_NONKEY_FIELD_ARGS xop, xfp, tag, tlen
 #define XO_FILTER_NEEDS_NONKEY_FIELD_SIGNATURE xo_handle_t *xop UNUSED, xo_filter_t *xfp UNUSED,                const char *tag UNUSED, xo_ssize_t tlen UNUSED
 
@@ -86,9 +111,21 @@ typedef int (*xo_filter_passthru_func_t)(XO_FILTER_PASSTHRU_SIGNATURE);
 #define XO_FILTER_PRED_FIELD_SIGNATURE xo_handle_t *xop UNUSED, xo_filter_t *xfp UNUSED,                const char *tag UNUSED, xo_ssize_t tlen UNUSED,                const char *value UNUSED, xo_ssize_t vlen UNUSED
 
 typedef int (*xo_filter_pred_field_func_t)(XO_FILTER_PRED_FIELD_SIGNATURE);
+
+#define XO_FILTER_STATS_ARGS xop, xfp
+#define XO_FILTER_STATS_SIGNATURE xo_handle_t *xop UNUSED, xo_filter_t *xfp UNUSED
+
+typedef const char * (*xo_filter_stats_func_t)(XO_FILTER_STATS_SIGNATURE);
+
+#define XO_FILTER_SUBTREE_DEAD_ARGS XO_FILTER_DEFAULT_ARGS
+#define XO_FILTER_SUBTREE_DEAD_SIGNATURE XO_FILTER_DEFAULT_SIGNATURE
+
+typedef int (*xo_filter_subtree_dead_func_t)(XO_FILTER_SUBTREE_DEAD_SIGNATURE);
 typedef struct xo_filter_ops_s {
     int xfo_version;
+    xo_filter_add_file_func_t xfo_filter_add_file_func;
     xo_filter_add_one_func_t xfo_filter_add_one_func;
+    xo_filter_aggregates_func_t xfo_filter_aggregates_func;
     xo_filter_attribute_func_t xfo_filter_attribute_func;
     xo_filter_close_container_func_t xfo_filter_close_container_func;
     xo_filter_close_field_func_t xfo_filter_close_field_func;
@@ -96,17 +133,35 @@ typedef struct xo_filter_ops_s {
     xo_filter_create_func_t xfo_filter_create_func;
     xo_filter_destroy_func_t xfo_filter_destroy_func;
     xo_filter_get_status_func_t xfo_filter_get_status_func;
+    xo_filter_image_load_func_t xfo_filter_image_load_func;
+    xo_filter_image_save_func_t xfo_filter_image_save_func;
     xo_filter_key_func_t xfo_filter_key_func;
+    xo_filter_list_dead_func_t xfo_filter_list_dead_func;
     xo_filter_needs_nonkey_field_func_t xfo_filter_needs_nonkey_field_func;
     xo_filter_open_container_func_t xfo_filter_open_container_func;
     xo_filter_open_field_func_t xfo_filter_open_field_func;
     xo_filter_open_instance_func_t xfo_filter_open_instance_func;
     xo_filter_passthru_func_t xfo_filter_passthru_func;
     xo_filter_pred_field_func_t xfo_filter_pred_field_func;
+    xo_filter_stats_func_t xfo_filter_stats_func;
+    xo_filter_subtree_dead_func_t xfo_filter_subtree_dead_func;
 } xo_filter_ops_t;
 
 extern xo_filter_ops_t xo_filter_ops;
 
+/*
+ * Add the filters (xpaths) in a file, one per line
+ */
+static inline int
+xo_filter_add_file (XO_FILTER_ADD_FILE_SIGNATURE)
+{
+#ifdef LIBXO_NEED_FILTERS
+    if (xo_filter_ops.xfo_filter_add_file_func)
+        return xo_filter_ops.xfo_filter_add_file_func(XO_FILTER_ADD_FILE_ARGS);
+#endif /* LIBXO_NEED_FILTERS */
+    return 0;
+}
+
 /*
  * Add a filter (xpath) to our filtering mechanism
  */
@@ -120,6 +175,19 @@ xo_filter_add_one (XO_FILTER_ADD_ONE_SIGNATURE)
     return 0;
 }
 
+/*
+ * Return the aggregate results for the container being closed
+ */
+static inline const char *
+xo_filter_aggregates (XO_FILTER_AGGREGATES_SIGNATURE)
+{
+#ifdef LIBXO_NEED_FILTERS
+    if (xo_filter_ops.xfo_filter_aggregates_func)
+        return xo_filter_ops.xfo_filter_aggregates_func(XO_FILTER_AGGREGATES_ARGS);
+#endif /* LIBXO_NEED_FILTERS */
+    return NULL;
+}
+
 static inline int
 xo_filter_attribute (XO_FILTER_ATTRIBUTE_SIGNATURE)
 {
@@ -190,6 +258,32 @@ xo_filter_get_status (XO_FILTER_GET_STATUS_SIGNATURE)
     return 0;
 }
 
+/*
+ * Use a compiled filter image, mapped from a file
+ */
+static inline int
+xo_filter_image_load (XO_FILTER_IMAGE_LOAD_SIGNATURE)
+{
+#ifdef LIBXO_NEED_FILTERS
+    if (xo_filter_ops.xfo_filter_image_load_func)
+        return xo_filter_ops.xfo_filter_image_load_func(XO_FILTER_IMAGE_LOAD_ARGS);
+#endif /* LIBXO_NEED_FILTERS */
+    return 0;
+}
+
+/*
+ * Save the compiled filter as an image file
+ */
+static inline int
+xo_filter_image_save (XO_FILTER_IMAGE_SAVE_SIGNATURE)
+{
+#ifdef LIBXO_NEED_FILTERS
+    if (xo_filter_ops.xfo_filter_image_save_func)
+        return xo_filter_ops.xfo_filter_image_save_func(XO_FILTER_IMAGE_SAVE_ARGS);
+#endif /* LIBXO_NEED_FILTERS */
+    return 0;
+}
+
 static inline int
 xo_filter_key (XO_FILTER_KEY_SIGNATURE)
 {
@@ -200,6 +294,19 @@ xo_filter_key (XO_FILTER_KEY_SIGNATURE)
     return 0;
 }
 
+/*
+ * Can no later instance of the open list be output?
+ */
+static inline int
+xo_filter_list_dead (XO_FILTER_LIST_DEAD_SIGNATURE)
+{
+#ifdef LIBXO_NEED_FILTERS
+    if (xo_filter_ops.xfo_filter_list_dead_func)
+        return xo_filter_ops.xfo_filter_list_dead_func(XO_FILTER_LIST_DEAD_ARGS);
+#endif /* LIBXO_NEED_FILTERS */
+    return 0;
+}
+
 static inline int
 xo_filter_needs_nonkey_field (XO_FILTER_NEEDS_NONKEY_FIELD_SIGNATURE)
 {
@@ -260,8 +367,36 @@ xo_filter_pred_field (XO_FILTER_PRED_FIELD_SIGNATURE)
     return 0;
 }
 
+/*
+ * Report what the filter did, one line per expression
+ */
+static inline const char *
+xo_filter_stats (XO_FILTER_STATS_SIGNATURE)
+{
+#ifdef LIBXO_NEED_FILTERS
+    if (xo_filter_ops.xfo_filter_stats_func)
+        return xo_filter_ops.xfo_filter_stats_func(XO_FILTER_STATS_ARGS);
+#endif /* LIBXO_NEED_FILTERS */
+    return NULL;
+}
+
+/*
+ * Can nothing below the current node be output?
+ */
+static inline int
+xo_filter_subtree_dead (XO_FILTER_SUBTREE_DEAD_SIGNATURE)
+{
+#ifdef LIBXO_NEED_FILTERS
+    if (xo_filter_ops.xfo_filter_subtree_dead_func)
+        return xo_filter_ops.xfo_filter_subtree_dead_func(XO_FILTER_SUBTREE_DEAD_ARGS);
+#endif /* LIBXO_NEED_FILTERS */
+    return 0;
+}
+
 #define XO_FILTER_OPS_FUNCS \
+    xo_filter_op_add_file, \
     xo_filter_op_add_one, \
+    xo_filter_op_aggregates, \
     xo_filter_op_attribute, \
     xo_filter_op_close_container, \
     xo_filter_op_close_field, \
@@ -269,13 +404,18 @@ xo_filter_pred_field (XO_FILTER_PRED_FIELD_SIGNATURE)
     xo_filter_op_create, \
     xo_filter_op_destroy, \
     xo_filter_op_get_status, \
+    xo_filter_op_image_load, \
+    xo_filter_op_image_save, \
     xo_filter_op_key, \
+    xo_filter_op_list_dead, \
     xo_filter_op_needs_nonkey_field, \
     xo_filter_op_open_container, \
     xo_filter_op_open_field, \
     xo_filter_op_open_instance, \
     xo_filter_op_passthru, \
     xo_filter_op_pred_field, \
+    xo_filter_op_stats, \
+    xo_filter_op_subtree_dead, \
     /* end */
 
 #endif /* XO_FILTER_OPS_H */
@@ -19,6 +19,7 @@
 
 #include "xo.h"
 #include "xo_encoder.h"
+#include "xo_private.h"
 #include "xo_buf.h"
 
 #include "xo_xpath.tab.h"
@@ -489,12 +490,82 @@ xo_xparse_check_axis_name (xo_xparse_data_t *xdp, xo_xparse_node_id_t id)
 		   xo_xparse_location(xdp), str);
 }
 
+/*
+ * Resize the string hash, putting the interned strings in their new
+ * slots.  The strings are found by walking xd_str_hash itself.
+ */
+static int
+xo_xparse_str_rehash (xo_xparse_data_t *xdp, uint32_t nhash)
+{
+    xo_off_t *hash = xo_realloc(NULL, nhash * sizeof(*hash));
+    if (hash == NULL)
+	return -1;
+
+    bzero(hash, nhash * sizeof(*hash));
+
+    for (uint32_t i = 0; i < xdp->xd_str_nhash; i++) {
+	xo_off_t off = xdp->xd_str_hash[i];
+	if (off == 0)
+	    continue;
+
+	const char *str = xo_xparse_str(xdp, off);
+	uint32_t h = xo_hash_buf(XO_HASH_INIT, str, strlen(str));
+	while (hash[h & (nhash - 1)])
+	    h += 1;
+	hash[h & (nhash - 1)] = off;
+    }
+
+    xo_free(xdp->xd_str_hash);
+    xdp->xd_str_hash = hash;
+    xdp->xd_str_nhash = nhash;
+
+    return 0;
+}
+
+/*
+ * Return the offset of a string in the string buffer, adding it if
+ * it's not already there.  Filters made from many similar expressions
+ * repeat the same names and values over and over, so we keep one copy
+ * of each.  Strings are never changed once made, so sharing is safe.
+ */
+static xo_xparse_str_id_t
+xo_xparse_str_intern (xo_xparse_data_t *xdp, const char *str, xo_off_t len)
+{
+    xo_buffer_t *xbp = &xdp->xd_str_buf;
+
+    /* Keep the table no more than half full */
+    if (xdp->xd_str_count * 2 >= xdp->xd_str_nhash
+	    && xo_xparse_str_rehash(xdp, xdp->xd_str_nhash
+				    ? xdp->xd_str_nhash * 2 : 256) < 0)
+	return 0;
+
+    uint32_t mask = xdp->xd_str_nhash - 1;
+    uint32_t h = xo_hash_buf(XO_HASH_INIT, str, len);
+    xo_off_t off;
+
+    for ( ; (off = xdp->xd_str_hash[h & mask]) != 0; h++) {
+	const char *cp = xo_xparse_str(xdp, off);
+	if (memcmp(cp, str, len) == 0 && cp[len] == '\0')
+	    return off;
+    }
+
+    off = xbp->xb_curp - xbp->xb_bufp;
+    char *newp = xo_buf_append_val(xbp, str, len + 1);
+    if (newp == NULL)
+	return 0;
+
+    newp[len] = '\0';
+    xdp->xd_str_hash[h & mask] = off;
+    xdp->xd_str_count += 1;
+
+    return off;
+}
+
 xo_xparse_str_id_t
 xo_xparse_str_new (xo_xparse_data_t *xdp, xo_xparse_token_t type)
 {
     xo_off_t len = xdp->xd_cur - xdp->xd_start;
     const char *start = xdp->xd_buf + xdp->xd_start;
-    xo_buffer_t *xbp = &xdp->xd_str_buf;
 
     /* If this is a quoted string, we want to trim the quotes */
     if (type == T_QUOTED && len >= 2) {
@@ -502,13 +573,11 @@ xo_xparse_str_new (xo_xparse_data_t *xdp, xo_xparse_token_t type)
 	len -= 2;
     }
 
-    xo_off_t cur = xbp->xb_curp - xbp->xb_bufp;
-    char *newp = xo_buf_append_val(xbp, start, len + 1);
-    newp[len] = '\0';
-
-    xdp->xd_last_str = cur;
+    xo_off_t cur = xo_xparse_str_intern(xdp, start, len);
+    if (cur)
+	xdp->xd_last_str = cur;
 
-    return newp ? cur : 0;
+    return cur;
 }
 
 void
@@ -731,14 +800,7 @@ xo_xpath_feature_warn (const char *tag, xo_xparse_data_t *xdp,
 static xo_xparse_str_id_t
 xo_xparse_str_literal (xo_xparse_data_t *xdp, const char *str)
 {
-    xo_buffer_t *xbp = &xdp->xd_str_buf;
-    xo_off_t cur = xbp->xb_curp - xbp->xb_bufp;
-    size_t len = strlen(str);
-
-    if (xo_buf_append_val(xbp, str, len + 1) == NULL)
-	return 0;
-
-    return cur;
+    return xo_xparse_str_intern(xdp, str, strlen(str));
 }
 
 /*
@@ -836,7 +898,8 @@ static void
 xo_xparse_result_add (xo_xparse_data_t *xdp, xo_xparse_node_id_t id)
 {
     if (xdp->xd_paths_cur >= xdp->xd_paths_max) {
-	uint32_t new_max = xdp->xd_paths_max + XO_PATHS_DEF;
+	uint32_t new_max = xdp->xd_paths_max
+	    ? xdp->xd_paths_max * 2 : XO_PATHS_DEF;
 
 	xo_xparse_node_id_t *pp;
 	pp = xo_realloc(xdp->xd_paths, new_max * sizeof(*pp));
@@ -850,6 +913,64 @@ xo_xparse_result_add (xo_xparse_data_t *xdp, xo_xparse_node_id_t id)
     xdp->xd_paths[xdp->xd_paths_cur++] = id;
 }
 
+/*
+ * If all the expressions are NOTs or absolute paths, our life gets
+ * easier, so we set flags for these cases:
+ *
+ * all nots: !one | !two | !three
+ * all abs:  /one | /two | /three
+ *
+ * Only the paths from "start" on are looked at; the flags already
+ * cover the ones before it.  Rescanning them all for each expression
+ * makes adding many expressions quadratic.
+ */
+static void
+xo_xparse_path_flags (xo_xparse_data_t *xdp, uint32_t start)
+{
+    xo_xparse_node_t *xnp;
+    uint32_t deny_count = 0, abs_count = 0;
+    uint32_t i, cur = xdp->xd_paths_cur;
+    xo_xparse_node_id_t *paths = xdp->xd_paths + start;
+
+    for (i = start; i < cur; i++, paths++) {
+	xnp = xo_xparse_node(xdp, *paths);
+	if (xnp == NULL)
+	    continue;
+
+	if (xnp->xn_type == C_NOT)
+	    deny_count += 1;
+
+	if (xnp->xn_type == C_PATH && xnp->xn_contents)
+	    xnp = xo_xparse_node(xdp, xnp->xn_contents);
+
+	if (xnp->xn_type == C_ABSOLUTE)
+	    abs_count += 1;
+    }
+
+    if (start == 0)
+	xdp->xd_flags |= XDF_ALL_NOTS | XDF_ALL_ABS;
+
+    if (deny_count < cur - start)
+	xdp->xd_flags &= ~XDF_ALL_NOTS;
+
+    if (abs_count < cur - start)
+	xdp->xd_flags &= ~XDF_ALL_ABS;
+}
+
+/*
+ * Drop the paths from "count" on, as when an expression fails the
+ * caller's checks after parsing
+ */
+void
+xo_xparse_truncate_paths (xo_xparse_data_t *xdp, uint32_t count)
+{
+    if (count >= xdp->xd_paths_cur)
+	return;
+
+    xdp->xd_paths_cur = count;
+    xo_xparse_path_flags(xdp, 0);
+}
+
 /*
  * Add the final results of a parsing to the data.  The real work here
  * is rewriting patterns (like unions) into more easily handled forms.
@@ -859,6 +980,7 @@ xo_xparse_results (xo_xparse_data_t *xdp, xo_xparse_node_id_t id)
 {
     xo_xparse_node_t *xnp = xo_xparse_node(xdp, id);
     xo_xparse_node_id_t next;
+    uint32_t start = xdp->xd_paths_cur;
 
     if (xnp == NULL) {
 	/* nothing; error? */
@@ -877,51 +999,12 @@ xo_xparse_results (xo_xparse_data_t *xdp, xo_xparse_node_id_t id)
 	xo_xparse_result_add(xdp, id);
     }
 
-    uint32_t deny_count = 0, abs_count = 0;
-    uint32_t i;
-    xo_xparse_node_id_t *paths = xdp->xd_paths;
-
-    /*
-     * If all the expressions are NOTs or absolute paths, our life
-     * gets easier.  So we whiffle thru them, counting the matches,
-     * and then set the flags appropriately.
-     *
-     * all nots: !one | !two | !three
-     * all abs:  /one | /two | /three
-     */
-    uint32_t cur = xdp->xd_paths_cur;
-    for (i = 0; i < cur; i++, paths++) {
-	xnp = xo_xparse_node(xdp, *paths);
-	if (xnp == NULL)
-	    continue;
-
-	if (xnp->xn_type == C_NOT)
-	    deny_count += 1;
-
-	if (xnp->xn_type == C_ABSOLUTE)
-	    abs_count += 1;
-    }
-
-    const char *all_nots UNUSED;
-    if (deny_count >= cur) {
-	xdp->xd_flags |= XDF_ALL_NOTS;
-	all_nots = ", all-nots: true";
-    } else {
-	xdp->xd_flags &= ~XDF_ALL_NOTS;
-	all_nots = "";
-    }
-
-    const char *all_abs UNUSED;
-    if (abs_count >= cur) {
-	xdp->xd_flags |= XDF_ALL_ABS;
-	all_abs = ", all-abs: true";
-    } else {
-	xdp->xd_flags &= ~XDF_ALL_ABS;
-	all_abs = "";
-    }
+    xo_xparse_path_flags(xdp, start);
 
     XO_DBG(xdp->xd_xop, "xo: parse results: %u paths%s%s",
-	   cur, all_nots, all_abs);
+	   xdp->xd_paths_cur,
+	   (xdp->xd_flags & XDF_ALL_NOTS) ? ", all-nots: true" : "",
+	   (xdp->xd_flags & XDF_ALL_ABS) ? ", all-abs: true" : "");
 }
 
 int
@@ -1451,6 +1534,7 @@ xo_xparse_clean (xo_xparse_data_t *xdp)
     if (xdp) {
 	xo_buf_cleanup(&xdp->xd_node_buf);
 	xo_buf_cleanup(&xdp->xd_str_buf);
+	xo_free(xdp->xd_str_hash);
 	xo_free(xdp->xd_buf);
 	bzero(xdp, sizeof(*xdp));
     }
@@ -64,6 +64,9 @@ typedef struct xo_xparse_data_s {
     xo_buffer_t xd_node_buf;    /* Buffer for allocating node data */
     xo_off_t xd_last_node;	/* Node offset of last allocated node */
     xo_off_t xd_last_str;	/* Node offset of last allocated string */
+    xo_off_t *xd_str_hash;	/* Interned strings (offsets), by hash */
+    uint32_t xd_str_nhash;	/* Number of xd_str_hash slots (power of 2) */
+    uint32_t xd_str_count;	/* Number of strings in xd_str_hash */
 
     xo_xpath_warn_func_t xd_warn_func; /* Function to emit warnings */
     void *xd_warn_data;	       /* Opaque data passed to xd_warn_func */
@@ -139,7 +142,8 @@ xo_xparse_node_new (xo_xparse_data_t *xdp)
     xo_buffer_t *xbp = &xdp->xd_node_buf;
     xo_off_t off = new_node * sizeof(xo_xparse_node_t);
 
-    if (!xo_buf_has_room(xbp, off))
+    /* Room for the whole node, not just its start */
+    if (!xo_buf_has_room(xbp, off + sizeof(xo_xparse_node_t)))
 	return 0;
 
     /* We don't need to move xb_cur along since our test new_node * sz */
@@ -360,6 +364,9 @@ xo_xparse_node_is_attr_axis (xo_xparse_data_t *xdp, xo_xparse_node_id_t id)
 void
 xo_xparse_results (xo_xparse_data_t *xdp, xo_xparse_node_id_t id);
 
+void
+xo_xparse_truncate_paths (xo_xparse_data_t *xdp, uint32_t count);
+
 void
 xo_xparse_dump_one_node (xo_xparse_data_t *xdp, xo_xparse_node_id_t id,
 			 int indent, const char *title);
@@ -398,7 +398,12 @@ xp_not_expr :
 		{ 
 		    xo_xparse_node_id_t id = xo_xparse_node_new(xparse_data);
 		    xo_xparse_node_t *xnp = xo_xparse_node(xparse_data, $1);
-		    if (xnp->xn_type == C_ELEMENT) {
+		    /*
+		     * An absolute path's steps hang off its xn_next, which
+		     * a union would reuse, so it's wrapped like the rest
+		     */
+		    if (xnp->xn_type == C_ELEMENT
+			    || xnp->xn_type == C_ABSOLUTE) {
 			xnp = xo_xparse_node(xparse_data, id);
 			xnp->xn_type = C_PATH;
 			xo_xparse_node_set_contents(xparse_data, id, $1);
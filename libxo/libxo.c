@@ -42,9 +42,17 @@
 #include <ctype.h>
 #include <wctype.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
 #include "xo_config.h"
 
+#ifdef LIBXO_NEED_THREADS
+#include <pthread.h>
+#endif /* LIBXO_NEED_THREADS */
+
 #ifdef HAVE_LANGINFO_H
 #include <langinfo.h>
 #endif /* HAVE_LANGINFO_H */
@@ -181,7 +189,7 @@ const char xo_version_extra[] = LIBXO_VERSION_EXTRA;
 #define UNUSED XO_UNUSED
 
 #ifndef LIBXO_TEXT_ONLY
-#define XO_MAP_INCR 128		/* Must be even */
+#define XO_MAP_INCR 128		/* Grow xo_map[] by this many entries */
 
 #ifndef XO_MAPDIR
 #define XO_MAPDIR XO_SHAREDIR "/map"
@@ -234,6 +242,10 @@ typedef unsigned xo_xsf_flags_t; /* XSF_* flags */
 #define XO_OPT_FILTER		6 /* Filter output using path */
 #define XO_EXTERR_BRIEF		7 /* Display brief extended error info */
 #define XO_EXTERR_VERBOSE	8 /* Display verbose exterr info */
+#define XO_OPT_FIELDS		9 /* Keep only the given value fields */
+#define XO_OPT_FILTER_SPILL	10 /* Spill pending output past this size */
+#define XO_OPT_FILTER_IMAGE	11 /* Use a compiled filter image */
+#define XO_OPT_FILTER_FILE	12 /* Filter using the paths in a file */
 
 /*
  * xo_stack_t: As we open and close containers and levels, we
@@ -250,6 +262,8 @@ typedef struct xo_stack_s {
     xo_xsf_flags_t xs_rb_flags; /* Parent XSF_RB_BITS  at rb-marker time */
     char *xs_name;		/* Name (for XPath value) */
     char *xs_keys;		/* XPath predicate for any key fields */
+    xo_off_t xs_xpath_off;	/* Offset of our part of xo_xpath */
+    xo_off_t xs_xpath_koff;	/* Offset of our keys in xo_xpath */
 } xo_stack_t;
 
 #define XS_OFFSET_CLEAR -1	/* Used to make a "not in use" offset */
@@ -301,6 +315,60 @@ typedef struct xo_colors_s {
     xo_color_t xoc_col_bg;	/* Background color */
 } xo_colors_t;
 
+/*
+ * A color string ("fg-red,bold") is compiled into a delta, which can
+ * then be applied to the current colors without reparsing it.
+ */
+typedef struct xo_colors_delta_s {
+    xo_effect_t xcd_effects_clear; /* Effects to turn off */
+    xo_effect_t xcd_effects_set; /* Effects to turn on (after clearing) */
+    int8_t xcd_col_fg;		/* New foreground color (or -1 to keep) */
+    int8_t xcd_col_bg;		/* New background color (or -1 to keep) */
+} xo_colors_delta_t;
+
+#define XO_COLORS_OUT_MAX 128	/* Max ANSI sequence or HTML classes */
+
+/*
+ * For retained {C:} fields, we cache the compiled color string, along
+ * with the output from the last transition, so we can repeat it
+ * when the same colors come through again.
+ */
+typedef struct xo_colors_cache_s {
+    xo_colors_delta_t xcc_delta; /* Compiled xcc_spec */
+    int xcc_valid;		/* Is the transition info valid? */
+    int xcc_style;		/* Style for xcc_out */
+    xo_colors_t xcc_old;	/* Colors before the transition */
+    xo_colors_t xcc_new;	/* Colors requested by the transition */
+    xo_colors_t xcc_result;	/* Colors after the transition */
+    ssize_t xcc_olen;		/* Length of xcc_out (-1 for no change) */
+    char xcc_out[XO_COLORS_OUT_MAX]; /* ANSI sequence or HTML classes */
+    ssize_t xcc_size;		/* Allocated size of xcc_spec */
+    ssize_t xcc_slen;		/* Length of xcc_spec */
+    char xcc_spec[0];		/* Color string (not NUL-terminated) */
+} xo_colors_cache_t;
+
+/*
+ * Filtering keeps output in xo_data tentatively, and when a late
+ * match arrives, drops the parts that aren't wanted.  Rather than
+ * moving the kept data together, we record each dropped range as a
+ * "cut", in ascending order, and xo_write hands the writer the
+ * segments between them.  Offsets into xo_data stay good until it's
+ * written.
+ */
+typedef struct xo_cut_s {
+    xo_off_t xc_start;		/* First byte dropped */
+    xo_off_t xc_end;		/* Byte after the last one dropped */
+} xo_cut_t;
+
+/*
+ * When pending output grows past the handle's spill limit (see
+ * xo_set_filter_spill), the contents of xo_data are moved to the end
+ * of an unlinked temporary file.  The offsets we keep across calls
+ * (a frame's xs_rb_off, xs_tag_end, and xs_key_off, and the cuts)
+ * count the bytes in that file, so a spill doesn't change them; see
+ * xo_filt_offset.
+ */
+
 /*
  * xo_handle_t: this is the principle data structure for libxo.
  * It's used as a store for state, options, content, and all manor
@@ -327,8 +395,11 @@ struct xo_handle_s {
     int xo_stack_size;		/* Size of the stack */
     xo_info_t *xo_info;		/* Info fields for all elements */
     int xo_info_count;		/* Number of info entries */
+    unsigned long xo_info_gen;	/* Generation number (changes on set) */
     va_list xo_vap;		/* Variable arguments (stdargs) */
     char *xo_leading_xpath;	/* A leading XPath expression */
+    xo_buffer_t xo_xpath;	/* HTML: XPath of the stack (escaped) */
+    int xo_xpath_valid;		/* Number of frames rendered in xo_xpath */
     mbstate_t xo_mbstate;	/* Multi-byte character conversion state */
     ssize_t xo_anchor_offset;	/* Start of anchored text */
     ssize_t xo_anchor_columns;	/* Number of columns since the start anchor */
@@ -348,15 +419,48 @@ struct xo_handle_s {
     xo_whiteboard_func_t xo_wb_marker; /* Function to mark whiteboard */
     void *xo_private;		/* Private data for external encoders */
 #ifdef LIBXO_NEED_MAP
-    char **xo_map;		/* Name mapping array */
+    struct xo_map_entry_s *xo_map; /* Name mapping array */
     int xo_map_size;		/* Size (count) of xo_map[] */
     int xo_map_len;		/* Current length (count) of xo_map[] */
+    int *xo_map_bucket;		/* Hash buckets (indices into xo_map[]) */
+    unsigned xo_map_nbuckets;	/* Number of hash buckets (power of 2) */
+    unsigned long xo_map_gen;	/* Generation number (changes on add) */
     xo_buffer_t xo_map_data;	/* Data values for name mapping */
 #endif /* LIBXO_NEED_MAP */
+    struct xo_retain_field_s *xo_rfield; /* Transient: current field's info */
 #ifdef LIBXO_NEED_FILTERS
     struct xo_filter_s *xo_filters; /* Opaque data pointer */
+    xo_cut_t *xo_cuts;		/* Ranges of xo_data dropped by filtering */
+    int xo_cuts_count;		/* Number of xo_cuts in use */
+    int xo_cuts_size;		/* Number of xo_cuts allocated */
+    xo_off_t xo_cuts_bytes;	/* Total length of xo_cuts */
+    FILE *xo_spill_fp;		/* Spill: unlinked file of pending output */
+    xo_off_t xo_spill_off;	/* Spill: bytes of output held in the file */
+    xo_off_t xo_spill_limit;	/* Spill: xo_data size that triggers a spill */
+    xo_spill_stats_t xo_spill_stats; /* Spill: counters */
+    xo_off_t xo_filt_peak;	/* filter-stats: most output pending at once */
+    unsigned long long xo_filt_dropped; /* filter-stats: bytes discarded */
 #endif /* LIBXO_NEED_FILTERS */
     xo_xsf_flags_t xo_rb_snap;	/* Transient: parent XSF_RB_BITS before open */
+    struct xo_handle_s **xo_tee; /* Tee: child handles (see xo_create_tee) */
+    int xo_tee_count;		/* Tee: number of child handles */
+    struct xo_handle_s *xo_frag_parent; /* Fragment: handle we splice into */
+    int xo_frag_depth;		/* Fragment: depth of the parent's list */
+    xo_buffer_t xo_frag_data;	/* Fragment: output written so far */
+    struct xo_shared_s *xo_shared; /* Shared: per-thread staging handles */
+    struct xo_shared_s *xo_staging; /* Staging: shared handle we commit to */
+    xo_write_nb_func_t xo_write_nb; /* Non-blocking write callback */
+    int xo_pollfd;		/* Non-blocking: descriptor to poll (or -1) */
+    xo_buffer_t xo_pending;	/* Non-blocking: output not yet written */
+    xo_ssize_t xo_pending_off;	/* Non-blocking: bytes of xo_pending written */
+    xo_ssize_t xo_pending_high;	/* Non-blocking: call xo_pending_func above */
+    xo_ssize_t xo_pending_low;	/* Non-blocking: ... and again at or below */
+    xo_pending_func_t xo_pending_func; /* Non-blocking: watermark callback */
+    void *xo_pending_opaque;	/* Non-blocking: opaque for xo_pending_func */
+    xo_buffer_t xo_lazy;	/* Values returned by lazy callbacks */
+    xo_buffer_t xo_fields_data;	/* Names kept by "fields=" (NUL-separated) */
+    unsigned xo_fields_count;	/* Number of names in xo_fields_data */
+    unsigned long xo_fields_gen; /* Generation number (changes on add) */
 };
 
 /* Flag operations */
@@ -387,6 +491,11 @@ struct xo_handle_s {
 #define XOIF_FILTERING 0	/* Allow the compiler to trim filter code */
 #endif /* LIBXO_NEED_FILTERS */
 
+#define XOIF_APPEND_CHECKED XOF_BIT(8) /* Checked fd for O_APPEND (NDJSON) */
+#define XOIF_BIG_RECORD	XOF_BIT(9) /* Warned about record > PIPE_BUF */
+#define XOIF_PENDING_HIGH XOF_BIT(10) /* Pending output is above high water */
+#define XOIF_LAZY_SKIP	XOF_BIT(11) /* Filter discards this field; skip lazy */
+
 /*
  * Normal printf has width and precision, which for strings operate as
  * min and max number of columns.  But this depends on the idea that
@@ -444,6 +553,8 @@ typedef struct xo_format_s {
     unsigned char xf_zflag;	/* 'z' (size_t) */
     unsigned char xf_qflag;	/* 'q' (quad_t) */
     unsigned char xf_seen_minus; /* Seen a minus */
+    unsigned char xf_lazy;	/* Value comes from a callback ("%@L@s") */
+    char *xf_value;		/* Lazy value (in the xo_lazy buffer) */
     int xf_leading_zero;	/* Seen a leading zero (zero fill)  */
     unsigned xf_dots;		/* Seen one or more '.'s */
     int xf_width[XF_WIDTH_NUM]; /* Width/precision/size numeric fields */
@@ -480,6 +591,21 @@ xo_transition (xo_handle_t *xop, xo_xof_flags_t flags, const char *name,
 static int
 xo_color_find (const char *str);
 
+static xo_handle_t *
+xo_shared_stage (xo_handle_t *xop);
+
+static void
+xo_shared_commit (xo_handle_t *xop);
+
+static ssize_t
+xo_shared_flush (xo_handle_t *xop);
+
+static ssize_t
+xo_shared_finish (xo_handle_t *xop);
+
+static void
+xo_shared_release (xo_handle_t *xop);
+
 static void
 xo_buf_append_div (xo_handle_t *xop, const char *class, xo_xff_flags_t flags,
 		   const char *name, ssize_t nlen,
@@ -493,6 +619,12 @@ xo_anchor_clear (xo_handle_t *xop);
 static int
 xo_map_option (xo_handle_t *xop, const char *opts);
 
+static int
+xo_fields_add (xo_handle_t *xop, const char *names);
+
+static void
+xo_gettext_cache_clear_all (void);
+
 /*
  * xo_style is used to retrieve the current style.  When we're built
  * for "text only" mode, we use this function to drive the removal
@@ -558,6 +690,140 @@ xo_flush_file (void *opaque)
     return fflush(fp);
 }
 
+/*
+ * NDJSON ("newline-delimited JSON") mode makes each top-level record
+ * (a top-level container or an instance of a top-level list) into a
+ * single line, and only writes output between records.
+ */
+static inline int
+xo_is_ndjson (xo_handle_t *xop)
+{
+    return XOF_ISSET(xop, XOF_NDJSON) && xo_style(xop) == XO_STYLE_JSON;
+}
+
+/*
+ * Are we between records?  That's the top level, or directly inside
+ * a top-level list.
+ */
+static inline int
+xo_ndjson_at_base (xo_handle_t *xop)
+{
+    return xop->xo_depth == 0
+	|| (xop->xo_depth == 1 && (xop->xo_stack[1].xs_flags & XSF_LIST));
+}
+
+/*
+ * NDJSON has no top-level braces and no pretty printing
+ */
+static void
+xo_ndjson_fixup (xo_handle_t *xop)
+{
+    if (XOF_ISSET(xop, XOF_NDJSON)) {
+	XOF_SET(xop, XOF_NO_TOP);
+	XOF_CLEAR(xop, XOF_PRETTY);
+    }
+}
+
+/*
+ * Write a buffer to a file descriptor, riding out short writes
+ */
+static ssize_t
+xo_write_fd (int fd, const char *data, ssize_t len)
+{
+    ssize_t rc, total = 0;
+
+    while (total < len) {
+	rc = write(fd, data + total, len - total);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	total += rc;
+    }
+
+    return total;
+}
+
+/*
+ * In NDJSON mode, the buffer holds only whole records.  When writing
+ * to a FILE, we bypass stdio, which is free to split them, and hand
+ * the records to write(2) directly.  A write of up to PIPE_BUF bytes
+ * to a pipe or an O_APPEND file is not interleaved with other
+ * writers, so we batch as many whole records as fit in PIPE_BUF into
+ * each write.  The file's flags belong to the caller, so if a regular
+ * file wasn't opened with O_APPEND, we only warn.  A single record
+ * larger than PIPE_BUF has no such guarantee, so it's written under
+ * an exclusive flock(2), which keeps it whole against other writers
+ * that lock the file (as we do).
+ */
+static ssize_t
+xo_write_records (xo_handle_t *xop, const char *data, ssize_t len)
+{
+    FILE *fp = xop->xo_opaque;
+    int fd = fileno(fp);
+    ssize_t rc, total = 0;
+
+    if (fd < 0)
+	return fprintf(fp, "%s", data);
+
+    fflush(fp);			/* Anything stdio holds goes first */
+
+    if (!XOIF_ISSET(xop, XOIF_APPEND_CHECKED)) {
+	XOIF_SET(xop, XOIF_APPEND_CHECKED);
+
+	/* Appending is what keeps separate writers from clobbering */
+	struct stat st;
+	int fl = fcntl(fd, F_GETFL);
+	if (fl >= 0 && !(fl & O_APPEND)
+		&& fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+	    xo_failure(xop, "ndjson: file is not open for appending (O_APPEND);"
+		       " other writers may overwrite records");
+    }
+
+    while (len > 0) {
+	const char *cp = data, *ep = data + len, *nl;
+	ssize_t blen = 0, llen;
+
+	/* Gather whole lines, up to PIPE_BUF bytes */
+	while (cp < ep) {
+	    nl = memchr(cp, '\n', ep - cp);
+	    llen = nl ? nl + 1 - cp : ep - cp;
+	    if (blen > 0 && blen + llen > PIPE_BUF)
+		break;
+
+	    blen += llen;
+	    cp += llen;
+	    if (blen > PIPE_BUF)
+		break;
+	}
+
+	if (blen > PIPE_BUF) {
+	    if (!XOIF_ISSET(xop, XOIF_BIG_RECORD)) {
+		XOIF_SET(xop, XOIF_BIG_RECORD);
+		xo_failure(xop, "record of %zd bytes exceeds PIPE_BUF (%d);"
+			   " using flock", blen, PIPE_BUF);
+	    }
+
+	    int locked = (flock(fd, LOCK_EX) == 0);
+	    rc = xo_write_fd(fd, data, blen);
+	    if (locked)
+		flock(fd, LOCK_UN);
+	} else {
+	    rc = xo_write_fd(fd, data, blen);
+	}
+
+	if (rc < 0)
+	    return -1;
+
+	total += rc;
+	data += blen;
+	len -= blen;
+    }
+
+    return total;
+}
+
 /* Get the current stack pointer */
 static inline xo_stack_t *
 xo_stack_cur (xo_handle_t *xop)
@@ -816,6 +1082,9 @@ xo_is_style_text_utf8 (xo_handle_t *xop)
  * the internal handle, after it has been initialized.  The usage
  * is:
  *    xop = xo_default(xop);
+ * For a shared handle, the calling thread's staging handle is
+ * returned, or NULL if it can't be made, so callers that might be
+ * given a shared handle must check for NULL.
  */
 static xo_handle_t *
 xo_default (xo_handle_t *xop)
@@ -824,7 +1093,9 @@ xo_default (xo_handle_t *xop)
 	if (xo_default_inited == 0)
 	    xo_default_init();
 	xop = &xo_default_handle;
-    }
+
+    } else if (xop->xo_shared)
+	xop = xo_shared_stage(xop); /* Each thread uses its own */
 
     return xop;
 }
@@ -879,6 +1150,8 @@ xo_indent (xo_handle_t *xop)
     int rc = 0;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return 0;
 
     if (XOF_ISSET(xop, XOF_PRETTY)) {
 	rc = xop->xo_indent * xop->xo_indent_by;
@@ -981,8 +1254,11 @@ xo_escape_xml (xo_handle_t *xop, xo_buffer_t *xbp,
 	delta += lost * (XO_XML_ESCAPE_BINARY_UNICODE_SIZE - 1);
     char private_buffer[XO_XML_ESCAPE_BINARY_UNICODE_SIZE + 1];
 
-    /* No room?  Bail, but don't append */
-    if (xo_check_for_room(xop, xbp, delta))
+    /*
+     * No room?  Bail, but don't append.  The raw value already sits
+     * at xb_curp, so we need room for it as well as the escapes.
+     */
+    if (xo_check_for_room(xop, xbp, len + delta))
 	return 0;
 
     ep = xbp->xb_curp;
@@ -1092,7 +1368,7 @@ xo_escape_json (xo_handle_t *xop, xo_buffer_t *xbp,
 	return len;
 
     /* No room?  Bail, but don't append */
-    if (xo_check_for_room(xop, xbp, delta))
+    if (xo_check_for_room(xop, xbp, len + delta))
 	return 0;
 
     ep = xbp->xb_curp;
@@ -1185,7 +1461,7 @@ xo_escape_sdparams (xo_handle_t *xop, xo_buffer_t *xbp,
     if (delta == 0)		/* Nothing to escape; bail */
 	return len;
 
-    if (xo_check_for_room(xop, xbp, delta)) /* No room; bail, but don't append */
+    if (xo_check_for_room(xop, xbp, len + delta)) /* No room; bail, but don't append */
 	return 0;
 
     ep = xbp->xb_curp;
@@ -1235,668 +1511,1095 @@ xo_buf_escape (xo_handle_t *xop, xo_buffer_t *xbp,
 }
 
 /*
- * Write the current contents of the data buffer using the handle's
- * xo_write function.
+ * Output for a non-blocking writer is queued in xo_pending until the
+ * writer accepts it.  xo_pending_off counts the bytes at the front of
+ * the queue that have already been written.
  */
-static ssize_t
-xo_write (xo_handle_t *xop)
+static inline xo_ssize_t
+xo_nb_pending (xo_handle_t *xop)
 {
-    ssize_t rc = 0;
-    xo_buffer_t *xbp = &xop->xo_data;
-
-    if (xbp->xb_curp != xbp->xb_bufp) {
-	xo_buf_append(xbp, "", 1); /* Append ending NUL */
-	xo_anchor_clear(xop);
-	if (xop->xo_write)
-	    rc = xop->xo_write(xop->xo_opaque, xbp->xb_bufp);
-
-	xo_buf_reset(xbp);
-
-	/* We have now official made output */
-	XOIF_SET(xop, XOIF_MADE_OUTPUT);
-    }
-
-    /* Turn off the flags that don't survive across writes */
-    XOIF_CLEAR(xop, XOIF_UNITS_PENDING);
-
-    return rc;
+    return xo_buf_offset(&xop->xo_pending) - xop->xo_pending_off;
 }
 
 /*
- * Format arguments into our buffer.  If a custom formatter has been set,
- * we use that to do the work; otherwise we vsnprintf().
+ * Tell the caller when pending output crosses the watermarks
  */
-static ssize_t
-xo_vsnprintf (xo_handle_t *xop, xo_buffer_t *xbp, const char *fmt, va_list vap)
+static void
+xo_nb_check_limit (xo_handle_t *xop)
 {
-    va_list va_local;
-    ssize_t rc;
-    ssize_t left = xbp->xb_size - (xbp->xb_curp - xbp->xb_bufp);
-
-    va_copy(va_local, vap);
+    if (xop->xo_pending_func == NULL)
+	return;
 
-    if (xop->xo_formatter)
-	rc = xop->xo_formatter(xop, xbp->xb_curp, left, fmt, va_local);
-    else
-	rc = vsnprintf(xbp->xb_curp, left, fmt, va_local);
+    xo_ssize_t pending = xo_nb_pending(xop);
 
-    if (rc >= left) {
-	if (xo_check_for_room(xop, xbp, rc)) {
-	    va_end(va_local);
-	    return -1;
+    if (!XOIF_ISSET(xop, XOIF_PENDING_HIGH)) {
+	if (pending > xop->xo_pending_high) {
+	    XOIF_SET(xop, XOIF_PENDING_HIGH);
+	    xop->xo_pending_func(xop, xop->xo_pending_opaque, pending, TRUE);
 	}
-
-	/*
-	 * After we call vsnprintf(), the stage of vap is not defined.
-	 * We need to copy it before we pass.  Then we have to do our
-	 * own logic below to move it along.  This is because the
-	 * implementation can have va_list be a pointer (bsd) or a
-	 * structure (macosx) or anything in between.
-	 */
-
-	va_end(va_local);	/* Reset vap to the start */
-	va_copy(va_local, vap);
-
-	left = xbp->xb_size - (xbp->xb_curp - xbp->xb_bufp);
-	if (xop->xo_formatter)
-	    rc = xop->xo_formatter(xop, xbp->xb_curp, left, fmt, va_local);
-	else
-	    rc = vsnprintf(xbp->xb_curp, left, fmt, va_local);
+    } else if (pending <= xop->xo_pending_low) {
+	XOIF_CLEAR(xop, XOIF_PENDING_HIGH);
+	xop->xo_pending_func(xop, xop->xo_pending_opaque, pending, FALSE);
     }
-    va_end(va_local);
-
-    return rc;
 }
 
 /*
- * Print some data through the handle.
+ * Hand as much data as the writer will take to it.  Returns the
+ * number of bytes written, or -1 on a hard error.  EAGAIN (or a
+ * zero-length write) means the writer is full, which isn't an error.
  */
-static ssize_t
-xo_printf_v (xo_handle_t *xop, const char *fmt, va_list vap)
+static xo_ssize_t
+xo_nb_write_some (xo_handle_t *xop, const char *data, xo_ssize_t len)
 {
-    xo_buffer_t *xbp = &xop->xo_data;
-    ssize_t left = xbp->xb_size - (xbp->xb_curp - xbp->xb_bufp);
-    ssize_t rc;
-    va_list va_local;
-
-    va_copy(va_local, vap);
-
-    rc = vsnprintf(xbp->xb_curp, left, fmt, va_local);
+    xo_ssize_t rc, total = 0;
 
-    if (rc >= left) {
-	if (xo_check_for_room(xop, xbp, rc)) {
-	    va_end(va_local);
+    while (total < len) {
+	rc = xop->xo_write_nb(xop->xo_opaque, data + total, len - total);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;
 	    return -1;
 	}
+	if (rc == 0)
+	    break;
 
-	va_end(va_local);	/* Reset vap to the start */
-	va_copy(va_local, vap);
-
-	left = xbp->xb_size - (xbp->xb_curp - xbp->xb_bufp);
-	rc = vsnprintf(xbp->xb_curp, left, fmt, va_local);
+	total += rc;
     }
 
-    va_end(va_local);
-
-    if (rc > 0)
-	xbp->xb_curp += rc;
-
-    return rc;
+    return total;
 }
 
-static ssize_t
-xo_printf (xo_handle_t *xop, const char *fmt, ...)
+/*
+ * Write what we can of the queue, returning the number of bytes
+ * still pending (or -1 on error)
+ */
+static xo_ssize_t
+xo_nb_drain (xo_handle_t *xop)
 {
-    ssize_t rc;
-    va_list vap;
+    xo_buffer_t *xbp = &xop->xo_pending;
+    xo_ssize_t rc = 0, pending = xo_nb_pending(xop);
 
-    va_start(vap, fmt);
+    if (pending > 0) {
+	rc = xo_nb_write_some(xop, xbp->xb_bufp + xop->xo_pending_off,
+			      pending);
+	if (rc > 0) {
+	    xop->xo_pending_off += rc;
+	    pending -= rc;
+	}
+    }
 
-    rc = xo_printf_v(xop, fmt, vap);
+    if (pending == 0) {
+	xo_buf_reset(xbp);
+	xop->xo_pending_off = 0;
+    } else if (xop->xo_pending_off > xbp->xb_size / 2) {
+	/* Slide the unwritten tail to the front */
+	memmove(xbp->xb_bufp, xbp->xb_bufp + xop->xo_pending_off, pending);
+	xbp->xb_curp = xbp->xb_bufp + pending;
+	xop->xo_pending_off = 0;
+    }
 
-    va_end(vap);
-    return rc;
+    xo_nb_check_limit(xop);
+
+    return (rc < 0) ? -1 : pending;
 }
 
-static ssize_t
-xo_buf_utf8_len (xo_handle_t *xop, const char *buf, ssize_t bufsiz)
+/*
+ * Write data for a non-blocking writer; whatever it won't take now is
+ * queued.  Since the data is either written or queued, we report it
+ * all as written.
+ */
+static xo_ssize_t
+xo_nb_write (xo_handle_t *xop, const char *data, xo_ssize_t len)
 {
-    unsigned b = (unsigned char) *buf;
-    ssize_t len;
+    xo_ssize_t rc = 0;
 
-    len = xo_utf8_rlen(*buf);
-    if (len < 0) {
-        xo_failure(xop, "invalid UTF-8 data: %02hhx", b);
-	return -1;
+    if (xo_nb_pending(xop) == 0) {
+	rc = xo_nb_write_some(xop, data, len);
+	if (rc < 0)
+	    return -1;
     }
 
-    if (len > bufsiz) {
-        xo_failure(xop, "invalid UTF-8 data (short): %02hhx (%d/%d)",
-		   b, len, bufsiz);
-	return -1;
+    if (rc < len) {
+	/* Anything already queued must go first, so queue behind it */
+	if (xo_buf_append_val(&xop->xo_pending, data + rc, len - rc) == NULL)
+	    return -1;
+	if (xo_nb_drain(xop) < 0)
+	    return -1;
     }
 
     return len;
 }
 
 /*
- * Append a single UTF-8 character to a buffer, converting it to locale
- * encoding.  Returns the number of columns consumed by that character,
- * as best we can determine it.
+ * When a handle is destroyed, give its non-blocking writer a bounded
+ * chance to take what's still queued: we wait (in steps) for pollfd
+ * to be writable, or just sleep if there isn't one.  Whatever is left
+ * after XO_NB_DESTROY_WAIT is discarded, with a warning.
  */
-static ssize_t
-xo_buf_append_locale_from_utf8 (xo_handle_t *xop, xo_buffer_t *xbp,
-				const char *ibuf, ssize_t ilen)
+#define XO_NB_DESTROY_WAIT 1000	/* Total wait (milliseconds) */
+#define XO_NB_DESTROY_STEP 10	/* Wait between drains (milliseconds) */
+
+static void
+xo_nb_drain_final (xo_handle_t *xop)
 {
-    xo_codepoint_t wc;
-    ssize_t len;
+    xo_ssize_t pending = xo_nb_drain(xop);
+    int waited;
 
-    /*
-     * Build our wide character from the input buffer; the number of
-     * bits we pull off the first character is dependent on the length,
-     * but we put 6 bits off all other bytes.
-     */
-    wc = xo_utf8_codepoint(ibuf, ilen, ilen, 0);
-    if (xo_utf8_iserror(wc)) {
-	xo_failure(xop, "invalid UTF-8 byte sequence");
-	return 0;
-    }
+    for (waited = 0; pending > 0 && waited < XO_NB_DESTROY_WAIT;
+	 waited += XO_NB_DESTROY_STEP) {
+	struct pollfd pfd = { .fd = xop->xo_pollfd, .events = POLLOUT };
 
-    if (XOF_ISSET(xop, XOF_NO_LOCALE)) {
-	if (xo_check_for_room(xop, xbp, ilen))
-	    return 0;
+	if (poll(&pfd, (pfd.fd >= 0) ? 1 : 0, XO_NB_DESTROY_STEP) < 0
+		&& errno != EINTR)
+	    break;
 
-	memcpy(xbp->xb_curp, ibuf, ilen);
-	xbp->xb_curp += ilen;
+	pending = xo_nb_drain(xop);
+    }
 
-    } else {
-	if (xo_check_for_room(xop, xbp, MB_LEN_MAX + 1))
-	    return 0;
+    if (pending < 0)
+	pending = xo_nb_pending(xop);
 
-	bzero(&xop->xo_mbstate, sizeof(xop->xo_mbstate));
-	len = wcrtomb(xbp->xb_curp, wc, &xop->xo_mbstate);
-
-	if (len <= 0) {
-	    xo_failure(xop, "could not convert wide char: %lx",
-		       (unsigned long) wc);
-	    return 0;
-	}
-	xbp->xb_curp += len;
-    }
-
-    return xo_wcwidth(wc);
-}
+    if (pending > 0)
+	xo_failure(xop, "xo_destroy: discarding %lld bytes of output "
+		   "the writer did not take", (long long) pending);
+}
 
 /*
- * Append a UTF-8 string to a buffer, converting it into locale encoding
+ * Forget the cuts made in the data buffer, which is being reset
  */
-static void
-xo_buf_append_locale (xo_handle_t *xop, xo_buffer_t *xbp,
-		      const char *cp, ssize_t len)
+static inline void
+xo_filt_cuts_reset (xo_handle_t *xop UNUSED)
 {
-    const char *sp = cp, *ep = cp + len;
-    ssize_t save_off = xbp->xb_bufp - xbp->xb_curp;
-    ssize_t slen;
-    int cols = 0;
-
-    for ( ; cp < ep; cp++) {
-	if (!xo_is_utf8_byte(*cp)) {
-	    cols += 1;
-	    continue;
-	}
-
-	/*
-	 * We're looking at a non-ascii UTF-8 character.
-	 * First we copy the previous data.
-	 * Then we need find the length and validate it.
-	 * Then we turn it into a wide string.
-	 * Then we turn it into a localized string.
-	 * Then we repeat.  Isn't i18n fun?
-	 */
-	if (sp != cp)
-	    xo_buf_append(xbp, sp, cp - sp); /* Append previous data */
-
-	slen = xo_buf_utf8_len(xop, cp, ep - cp);
-	if (slen <= 0) {
-	    /* Bad data; back it all out */
-	    xo_buf_set_offset(xbp, save_off);
-	    return;
-	}
-
-	cols += xo_buf_append_locale_from_utf8(xop, xbp, cp, slen);
-
-	/* Next time through, we'll start at the next character */
-	cp += slen - 1;
-	sp = cp + 1;
-    }
-
-    /* Update column values */
-    if (XOF_ISSET(xop, XOF_COLUMNS))
-	xop->xo_columns += cols;
-    if (XOIF_ISSET(xop, XOIF_ANCHOR))
-	xop->xo_anchor_columns += cols;
+#ifdef LIBXO_NEED_FILTERS
+    xop->xo_cuts_count = 0;
+    xop->xo_cuts_bytes = 0;
+#endif /* LIBXO_NEED_FILTERS */
+}
 
-    /* Before we fall into the basic logic below, we need reset len */
-    len = ep - sp;
-    if (len != 0) /* Append trailing data */
-	xo_buf_append(xbp, sp, len);
+static inline int
+xo_filt_has_cuts (xo_handle_t *xop UNUSED)
+{
+#ifdef LIBXO_NEED_FILTERS
+    return xop->xo_cuts_count > 0;
+#else /* LIBXO_NEED_FILTERS */
+    return FALSE;
+#endif /* LIBXO_NEED_FILTERS */
 }
 
 /*
- * Append the given string to the given buffer, without escaping or
- * character set conversion.  This is the straight copy to the data
- * buffer with no fanciness.
+ * Return the number of bytes of output held in the spill file
  */
-static void
-xo_data_append (xo_handle_t *xop, const char *str, ssize_t len)
+static inline xo_off_t
+xo_filt_spilled (xo_handle_t *xop UNUSED)
 {
-    xo_buf_append(&xop->xo_data, str, len);
+#ifdef LIBXO_NEED_FILTERS
+    return xop->xo_spill_off;
+#else /* LIBXO_NEED_FILTERS */
+    return 0;
+#endif /* LIBXO_NEED_FILTERS */
 }
 
 /*
- * Append the given string to the given buffer
+ * Return the current offset in the output, counting any bytes that
+ * have been spilled.  This is the one to keep across calls.
  */
-static void
-xo_data_escape (xo_handle_t *xop, const char *str, ssize_t len)
+static inline xo_off_t
+xo_filt_offset (xo_handle_t *xop)
 {
-    xo_buf_escape(xop, &xop->xo_data, str, len, 0);
+    return xo_filt_spilled(xop) + xo_buf_offset(&xop->xo_data);
 }
 
-#ifdef LIBXO_NO_RETAIN
 /*
- * Empty implementations of the retain logic
+ * Note the amount of output that's pending, for filter-stats.  Output
+ * only shrinks when it's written or discarded, so we're called then.
  */
-
-void
-xo_retain_clear_all (void)
+static inline void
+xo_filt_note_pending (xo_handle_t *xop UNUSED)
 {
-    return;
-}
+#ifdef LIBXO_NEED_FILTERS
+    xo_off_t off = xo_filt_offset(xop);
 
-void
-xo_retain_clear (const char *fmt UNUSED)
-{
-    return;
+    if (xop->xo_filt_peak < off)
+	xop->xo_filt_peak = off;
+#endif /* LIBXO_NEED_FILTERS */
 }
+
+/*
+ * Close up the cuts in the data buffer (including its ending NUL),
+ * for writers that need the output in one piece
+ */
 static void
-xo_retain_add (const char *fmt UNUSED, xo_field_info_t *fields UNUSED,
-		unsigned num_fields UNUSED)
+xo_filt_squeeze (xo_handle_t *xop UNUSED)
 {
-    return;
-}
+#ifdef LIBXO_NEED_FILTERS
+    xo_buffer_t *xbp = &xop->xo_data;
+    xo_off_t len = xo_buf_offset(xbp);
+    xo_off_t write_off = xop->xo_cuts[0].xc_start;
+    int i;
 
-static int
-xo_retain_find (const char *fmt UNUSED, xo_field_info_t **valp UNUSED,
-		 unsigned *nump UNUSED)
-{
-    return -1;
-}
+    for (i = 0; i < xop->xo_cuts_count; i++) {
+	xo_off_t start = xop->xo_cuts[i].xc_end;
+	xo_off_t end = (i + 1 < xop->xo_cuts_count)
+	    ? xop->xo_cuts[i + 1].xc_start : len;
 
-unsigned long
-xo_retain_get_hits (void)
-{
-    return 0;
+	memmove(xbp->xb_bufp + write_off, xbp->xb_bufp + start, end - start);
+	write_off += end - start;
+    }
+
+    xo_buf_set_offset(xbp, write_off);
+    xo_filt_cuts_reset(xop);
+#endif /* LIBXO_NEED_FILTERS */
 }
 
-#else /* !LIBXO_NO_RETAIN */
 /*
- * Retain: We retain parsed field definitions to enhance performance,
- * especially inside loops.  We depend on the caller treating the format
- * strings as immutable, so that we can retain pointers into them.  We
- * hold the pointers in a hash table, so allow quick access.  Retained
- * information is retained until xo_retain_clear is called.
+ * Hand one segment of the data buffer to the writer.  A custom writer
+ * wants a NUL-terminated string, so we borrow the byte that follows.
  */
+static ssize_t
+xo_write_segment (xo_handle_t *xop, char *data, ssize_t len)
+{
+    if (xop->xo_write_nb)
+	return xo_nb_write(xop, data, len);
 
-/*
- * xo_retain_entry_t holds information about one retained set of
- * parsed fields.
- */
-typedef struct xo_retain_entry_s {
-    struct xo_retain_entry_s *xre_next; /* Pointer to next (older) entry */
-    unsigned long xre_hits;		 /* Number of times we've hit */
-    const char *xre_format;		 /* Pointer to format string */
-    unsigned xre_num_fields;		 /* Number of fields saved */
-    xo_field_info_t *xre_fields;	 /* Pointer to fields */
-} xo_retain_entry_t;
+    if (xop->xo_write == xo_write_to_file)
+	return fwrite(data, 1, len, (FILE *) xop->xo_opaque);
 
-/*
- * xo_retain_t holds a complete set of parsed fields as a hash table.
- */
-#ifndef XO_RETAIN_SIZE
-#define XO_RETAIN_SIZE 6
-#endif /* XO_RETAIN_SIZE */
-#define RETAIN_HASH_SIZE (1<<XO_RETAIN_SIZE)
+    if (xop->xo_write == NULL)
+	return 0;
 
-typedef struct xo_retain_s {
-    xo_retain_entry_t *xr_bucket[RETAIN_HASH_SIZE];
-} xo_retain_t;
+    char save = data[len];
+    data[len] = '\0';
+    ssize_t rc = xop->xo_write(xop->xo_opaque, data);
+    data[len] = save;
 
-static THREAD_LOCAL(xo_retain_t) xo_retain;
-static THREAD_LOCAL(unsigned) xo_retain_count;
-static THREAD_LOCAL(unsigned long) xo_retain_hits;
+    return rc;
+}
 
+#ifdef LIBXO_NEED_FILTERS
 /*
- * Simple hash function based on Thomas Wang's paper.  The original is
- * gone, but an archive is available on the Way Back Machine:
- *
- * http://web.archive.org/web/20071223173210/\
- *     http://www.concentric.net/~Ttwang/tech/inthash.htm
- *
- * For our purposes, we can assume the low four bits are uninteresting
- * since any string less that 16 bytes wouldn't be worthy of
- * retaining.  We toss the high bits also, since these bits are likely
- * to be common among constant format strings.  We then run Wang's
- * algorithm, and cap the result at RETAIN_HASH_SIZE.
+ * Write the output from 'off' up to 'end', reading the part that was
+ * spilled back from the spill file
  */
-static unsigned
-xo_retain_hash (const char *fmt)
+static ssize_t
+xo_filt_write_range (xo_handle_t *xop, xo_off_t off, xo_off_t end)
 {
-    volatile uintptr_t iptr = (uintptr_t) (const void *) fmt;
+    xo_buffer_t *xbp = &xop->xo_data;
+    xo_off_t spilled = xop->xo_spill_off;
+    char buf[XO_BUFSIZ + 1];	/* Room for xo_write_segment's NUL */
+    ssize_t total = 0, len, rc;
 
-    /* Discard low four bits and high bits; they aren't interesting */
-    uint32_t val = (uint32_t) ((iptr >> 4) & (((1 << 24) - 1)));
+    while (off < end && off < spilled) {
+	len = ((end < spilled) ? end : spilled) - off;
+	if (len > XO_BUFSIZ)
+	    len = XO_BUFSIZ;
 
-    val = (val ^ 61) ^ (val >> 16);
-    val = val + (val << 3);
-    val = val ^ (val >> 4);
-    val = val * 0x3a8f05c5;	/* My large prime number */
-    val = val ^ (val >> 15);
-    val &= RETAIN_HASH_SIZE - 1;
+	len = pread(fileno(xop->xo_spill_fp), buf, len, off);
+	if (len <= 0) {
+	    xo_failure(xop, "could not read spilled output: %s",
+		       (len < 0) ? strerror(errno) : "short file");
+	    return -1;
+	}
 
-    return val;
-}	
+	rc = xo_write_segment(xop, buf, len);
+	if (rc < 0)
+	    return -1;
 
-/*
- * Walk all buckets, clearing all retained entries
- */
-void
-xo_retain_clear_all (void)
-{
-    int i;
-    xo_retain_entry_t *xrep, *next;
+	xop->xo_spill_stats.xss_replayed += len;
+	total += rc;
+	off += len;
+    }
 
-    for (i = 0; i < RETAIN_HASH_SIZE; i++) {
-	for (xrep = xo_retain.xr_bucket[i]; xrep; xrep = next) {
-	    next = xrep->xre_next;
-	    xo_free(xrep);
-	}
-	xo_retain.xr_bucket[i] = NULL;
+    if (off < end) {
+	rc = xo_write_segment(xop, xbp->xb_bufp + off - spilled, end - off);
+	total = (rc < 0) ? -1 : total + rc;
     }
-    xo_retain_count = 0;
-    xo_retain_hits = 0;
+
+    return total;
 }
 
 /*
- * Walk all buckets, clearing all retained entries
+ * Empty the spill file, now that its contents have been written
  */
-void
-xo_retain_clear (const char *fmt)
+static void
+xo_filt_spill_reset (xo_handle_t *xop)
 {
-    xo_retain_entry_t **xrepp;
-    unsigned hash = xo_retain_hash(fmt);
+    if (xop->xo_spill_off == 0)
+	return;
 
-    for (xrepp = &xo_retain.xr_bucket[hash]; *xrepp;
-	 xrepp = &(*xrepp)->xre_next) {
-	if ((*xrepp)->xre_format == fmt) {
-	    *xrepp = (*xrepp)->xre_next;
-	    xo_retain_count -= 1;
-	    return;
-	}
-    }
+    xop->xo_spill_off = 0;
+    if (ftruncate(fileno(xop->xo_spill_fp), 0) < 0)
+	xo_failure(xop, "could not empty spill file: %s", strerror(errno));
 }
+#endif /* LIBXO_NEED_FILTERS */
 
 /*
- * Search the hash for an entry matching 'fmt'; return it's fields.
+ * Write the output around the cuts that filtering has made in it,
+ * one kept segment at a time, starting with any that was spilled
  */
-static int
-xo_retain_find (const char *fmt, xo_field_info_t **valp, unsigned *nump)
+static ssize_t
+xo_filt_write_segments (xo_handle_t *xop UNUSED)
 {
-    if (xo_retain_count == 0)
-	return -1;
+    ssize_t total = 0;
 
-    unsigned hash = xo_retain_hash(fmt);
-    xo_retain_entry_t *xrep;
+#ifdef LIBXO_NEED_FILTERS
+    xo_off_t len = xo_filt_offset(xop) - 1; /* Less the ending NUL */
+    xo_off_t off = 0, end;
+    ssize_t rc;
+    int i;
 
-    for (xrep = xo_retain.xr_bucket[hash]; xrep != NULL;
-	 xrep = xrep->xre_next) {
-	if (xrep->xre_format == fmt) {
-	    *valp = xrep->xre_fields;
-	    *nump = xrep->xre_num_fields;
-	    xrep->xre_hits += 1;
-	    xo_retain_hits += 1;
-	    return 0;
+    for (i = 0; i <= xop->xo_cuts_count && total >= 0; i++) {
+	end = (i < xop->xo_cuts_count) ? xop->xo_cuts[i].xc_start : len;
+	if (end > off) {
+	    rc = xo_filt_write_range(xop, off, end);
+	    total = (rc < 0) ? -1 : total + rc;
 	}
+
+	if (i < xop->xo_cuts_count)
+	    off = xop->xo_cuts[i].xc_end;
     }
 
-    return -1;
+    xo_filt_cuts_reset(xop);
+    xo_filt_spill_reset(xop);
+#endif /* LIBXO_NEED_FILTERS */
+
+    return total;
 }
 
-static void
-xo_retain_add (const char *fmt, xo_field_info_t *fields, unsigned num_fields)
+/*
+ * Write the current contents of the data buffer using the handle's
+ * xo_write function.
+ */
+static ssize_t
+xo_write (xo_handle_t *xop)
 {
-    unsigned hash = xo_retain_hash(fmt);
-    xo_retain_entry_t *xrep;
-    ssize_t sz = sizeof(*xrep) + (num_fields + 1) * sizeof(*fields);
-    xo_field_info_t *xfip;
-
-    xrep = xo_realloc(NULL, sz);
-    if (xrep == NULL)
-	return;
+    ssize_t rc = 0;
+    xo_buffer_t *xbp = &xop->xo_data;
 
-    xfip = (xo_field_info_t *) &xrep[1];
-    memcpy(xfip, fields, num_fields * sizeof(*fields));
+    if (xbp->xb_curp != xbp->xb_bufp) {
+	xo_filt_note_pending(xop);
+	xo_buf_append(xbp, "", 1); /* Append ending NUL */
+	xo_anchor_clear(xop);
 
-    bzero(xrep, sizeof(*xrep));
-
-    xrep->xre_format = fmt;
-    xrep->xre_fields = xfip;
-    xrep->xre_num_fields = num_fields;
-
-    /* Record the field info in the retain bucket */
-    xrep->xre_next = xo_retain.xr_bucket[hash];
-    xo_retain.xr_bucket[hash] = xrep;
-    xo_retain_count += 1;
-}
+	/*
+	 * NDJSON records must be written whole, so close up any cuts.
+	 * Spilled output can't be, and is written in pieces.
+	 */
+	if (xo_filt_has_cuts(xop) && xop->xo_write == xo_write_to_file
+		&& xo_is_ndjson(xop) && xo_filt_spilled(xop) == 0)
+	    xo_filt_squeeze(xop);
+
+	if (xo_filt_has_cuts(xop) || xo_filt_spilled(xop))
+	    rc = xo_filt_write_segments(xop);
+	else if (xop->xo_write_nb)
+	    rc = xo_nb_write(xop, xbp->xb_bufp,
+			     xbp->xb_curp - xbp->xb_bufp - 1);
+	else if (xop->xo_write == xo_write_to_file && xo_is_ndjson(xop))
+	    rc = xo_write_records(xop, xbp->xb_bufp,
+				  xbp->xb_curp - xbp->xb_bufp - 1);
+	else if (xop->xo_write)
+	    rc = xop->xo_write(xop->xo_opaque, xbp->xb_bufp);
 
-unsigned long
-xo_retain_get_hits (void)
-{
-    return xo_retain_hits;
-}
+	xo_buf_reset(xbp);
 
-#endif /* !LIBXO_NO_RETAIN */
+	/* We have now official made output */
+	XOIF_SET(xop, XOIF_MADE_OUTPUT);
+    }
 
-/*
- * The "warn" flag has nothing to do with the "warn" function.  This
- * flag tells libxo to report mistakes in the calling code that are
- * important to the developer but not-a-all to the user.  xo_failure()
- * is the driver for this.
- */
+    /* Turn off the flags that don't survive across writes */
+    XOIF_CLEAR(xop, XOIF_UNITS_PENDING);
 
-/* Flags for xo_warn_hcfv() */
-typedef unsigned xo_warn_flags_t;
-#define XO_XWF_CHECK_WARN	(1<<0) /* Check for warning flag */
-#define XO_XWF_NO_EXTERR	(1<<1) /* Don't report extended error */
-#define XO_XWF_CHECK_FILT	(1<<2) /* Check for filter warning flag */
+    return rc;
+}
 
 /*
- * Generate a warning.  Normally, this is a text message written to
- * standard error.  If the XOF_WARN_XML flag is set, then we generate
- * XMLified content on standard output.
+ * Format arguments into our buffer.  If a custom formatter has been set,
+ * we use that to do the work; otherwise we vsnprintf().
  */
-static void
-xo_warn_hcfv (xo_handle_t *xop, int code, xo_warn_flags_t flags,
-	     const char *fmt, va_list vap)
+static ssize_t
+xo_vsnprintf (xo_handle_t *xop, xo_buffer_t *xbp, const char *fmt, va_list vap)
 {
-    xop = xo_default(xop);
-    if ((flags & XO_XWF_CHECK_WARN) && !XOF_ISSET(xop, XOF_WARN))
-	return;
-
-    if ((flags & XO_XWF_CHECK_FILT) && !XOF_ISSET(xop, XOF_FILTER_WARN))
-	return;
-
-    if (fmt == NULL)
-	return;
-
-    char exterr[UEXTERROR_MAXLEN] XO_UNUSED; /* The optimizer will remove */
-    int extstatus = -1;
-
-#ifdef HAVE_EXTERR
-    if (!(flags & XO_XWF_NO_EXTERR))
-	extstatus = uexterr_gettext(exterr, sizeof(exterr));
-#endif /* HAVE_EXTERR */
-    
-
-    ssize_t len = strlen(fmt);
-    ssize_t plen = xo_program ? strlen(xo_program) : 0;
-    char *newfmt = alloca(len + 1 + plen + 2); /* NUL, and ": " */
-
-    if (plen) {
-	memcpy(newfmt, xo_program, plen);
-	newfmt[plen++] = ':';
-	newfmt[plen++] = ' ';
-    }
+    va_list va_local;
+    ssize_t rc;
+    ssize_t left = xbp->xb_size - (xbp->xb_curp - xbp->xb_bufp);
 
-    memcpy(newfmt + plen, fmt, len);
-    newfmt[len + plen] = '\0';
+    va_copy(va_local, vap);
 
-    if (XOF_ISSET(xop, XOF_WARN_XML)) {
-	static char err_open[] = "<error>";
-	static char err_close[] = "</error>";
-	static char msg_open[] = "<message>";
-	static char msg_close[] = "</message>";
+    if (xop->xo_formatter)
+	rc = xop->xo_formatter(xop, xbp->xb_curp, left, fmt, va_local);
+    else
+	rc = vsnprintf(xbp->xb_curp, left, fmt, va_local);
 
-	xo_buffer_t *xbp = &xop->xo_data;
+    if (rc >= left) {
+	if (xo_check_for_room(xop, xbp, rc)) {
+	    va_end(va_local);
+	    return -1;
+	}
 
-	xo_buf_append(xbp, err_open, sizeof(err_open) - 1);
-	xo_buf_append(xbp, msg_open, sizeof(msg_open) - 1);
+	/*
+	 * After we call vsnprintf(), the stage of vap is not defined.
+	 * We need to copy it before we pass.  Then we have to do our
+	 * own logic below to move it along.  This is because the
+	 * implementation can have va_list be a pointer (bsd) or a
+	 * structure (macosx) or anything in between.
+	 */
 
-	va_list va_local;
+	va_end(va_local);	/* Reset vap to the start */
 	va_copy(va_local, vap);
 
-	ssize_t left = xbp->xb_size - (xbp->xb_curp - xbp->xb_bufp);
-	ssize_t rc = vsnprintf(xbp->xb_curp, left, newfmt, vap);
-
-	if (rc >= left) {
-	    if (xo_check_for_room(xop, xbp, rc)) {
-		va_end(va_local);
-		return;
-	    }
-
-	    va_end(vap);	/* Reset vap to the start */
-	    va_copy(vap, va_local);
-
-	    left = xbp->xb_size - (xbp->xb_curp - xbp->xb_bufp);
-	    rc = vsnprintf(xbp->xb_curp, left, fmt, vap);
-	}
-
-	va_end(va_local);
+	left = xbp->xb_size - (xbp->xb_curp - xbp->xb_bufp);
+	if (xop->xo_formatter)
+	    rc = xop->xo_formatter(xop, xbp->xb_curp, left, fmt, va_local);
+	else
+	    rc = vsnprintf(xbp->xb_curp, left, fmt, va_local);
+    }
+    va_end(va_local);
 
-	rc = xo_escape_xml(xop, xbp, rc, 1);
-	xbp->xb_curp += rc;
+    return rc;
+}
 
-	xo_buf_append(xbp, msg_close, sizeof(msg_close) - 1);
-	xo_buf_append(xbp, err_close, sizeof(err_close) - 1);
+/*
+ * Print some data through the handle.
+ */
+static ssize_t
+xo_printf_v (xo_handle_t *xop, const char *fmt, va_list vap)
+{
+    xo_buffer_t *xbp = &xop->xo_data;
+    ssize_t left = xbp->xb_size - (xbp->xb_curp - xbp->xb_bufp);
+    ssize_t rc;
+    va_list va_local;
 
-	if (code >= 0) {
-	    const char *msg = strerror(code);
+    va_copy(va_local, vap);
 
-	    if (msg) {
-		xo_buf_append(xbp, ": ", 2);
-		xo_buf_append(xbp, msg, strlen(msg));
-	    }
+    rc = vsnprintf(xbp->xb_curp, left, fmt, va_local);
 
-	    if (extstatus == 0 && exterr[0] != '\0')
-		xo_buf_append(xbp, exterr, strlen(exterr));
+    if (rc >= left) {
+	if (xo_check_for_room(xop, xbp, rc)) {
+	    va_end(va_local);
+	    return -1;
 	}
 
-	xo_buf_append(xbp, "\n", 1); /* Append newline and NUL to string */
-	(void) xo_write(xop);
-
-    } else {
-	vfprintf(stderr, newfmt, vap);
-	if (code >= 0) {
-	    const char *msg = strerror(code);
-
-	    if (msg)
-		fprintf(stderr, ": %s", msg);
-
-	    if (extstatus == 0 && exterr[0] != '\0')
-		fprintf(stderr, " (%s)", exterr);
-	}
+	va_end(va_local);	/* Reset vap to the start */
+	va_copy(va_local, vap);
 
-	fprintf(stderr, "\n");
+	left = xbp->xb_size - (xbp->xb_curp - xbp->xb_bufp);
+	rc = vsnprintf(xbp->xb_curp, left, fmt, va_local);
     }
-}
 
-/*
- * Generate a warning.  Normally, this is a text message written to
- * standard error.  If the XOF_WARN_XML flag is set, then we generate
- * XMLified content on standard output.
- */
-void
-xo_warn_hcv (xo_handle_t *xop, int code, int check_warn,
-	     const char *fmt, va_list vap)
-{
-    xo_warn_hcfv(xop, code, check_warn, fmt, vap);
-}
+    va_end(va_local);
 
-void
-xo_warn_hc (xo_handle_t *xop, int code, const char *fmt, ...)
-{
-    va_list vap;
+    if (rc > 0)
+	xbp->xb_curp += rc;
 
-    va_start(vap, fmt);
-    xo_warn_hcv(xop, code, 0, fmt, vap);
-    va_end(vap);
+    return rc;
 }
 
-void
-xo_warn_c (int code, const char *fmt, ...)
+static ssize_t
+xo_printf (xo_handle_t *xop, const char *fmt, ...)
 {
+    ssize_t rc;
     va_list vap;
 
     va_start(vap, fmt);
-    xo_warn_hcv(NULL, code, 0, fmt, vap);
-    va_end(vap);
-}
 
-void
-xo_warn (const char *fmt, ...)
-{
-    int code = errno;
-    va_list vap;
+    rc = xo_printf_v(xop, fmt, vap);
 
-    va_start(vap, fmt);
-    xo_warn_hcv(NULL, code, 0, fmt, vap);
     va_end(vap);
+    return rc;
 }
 
-void
-xo_warnx (const char *fmt, ...)
+static ssize_t
+xo_buf_utf8_len (xo_handle_t *xop, const char *buf, ssize_t bufsiz)
 {
-    va_list vap;
+    unsigned b = (unsigned char) *buf;
+    ssize_t len;
 
-    va_start(vap, fmt);
-    xo_warn_hcv(NULL, -1, 0, fmt, vap);
-    va_end(vap);
-}
+    len = xo_utf8_rlen(*buf);
+    if (len < 0) {
+        xo_failure(xop, "invalid UTF-8 data: %02hhx", b);
+	return -1;
+    }
 
-void
-xo_err (int eval, const char *fmt, ...)
-{
-    int code = errno;
-    va_list vap;
+    if (len > bufsiz) {
+        xo_failure(xop, "invalid UTF-8 data (short): %02hhx (%d/%d)",
+		   b, len, bufsiz);
+	return -1;
+    }
 
-    va_start(vap, fmt);
-    xo_warn_hcv(NULL, code, 0, fmt, vap);
-    va_end(vap);
-    xo_finish();
-    exit(eval);
+    return len;
 }
 
-void
-xo_errx (int eval, const char *fmt, ...)
+/*
+ * Append a single UTF-8 character to a buffer, converting it to locale
+ * encoding.  Returns the number of columns consumed by that character,
+ * as best we can determine it.
+ */
+static ssize_t
+xo_buf_append_locale_from_utf8 (xo_handle_t *xop, xo_buffer_t *xbp,
+				const char *ibuf, ssize_t ilen)
+{
+    xo_codepoint_t wc;
+    ssize_t len;
+
+    /*
+     * Build our wide character from the input buffer; the number of
+     * bits we pull off the first character is dependent on the length,
+     * but we put 6 bits off all other bytes.
+     */
+    wc = xo_utf8_codepoint(ibuf, ilen, ilen, 0);
+    if (xo_utf8_iserror(wc)) {
+	xo_failure(xop, "invalid UTF-8 byte sequence");
+	return 0;
+    }
+
+    if (XOF_ISSET(xop, XOF_NO_LOCALE)) {
+	if (xo_check_for_room(xop, xbp, ilen))
+	    return 0;
+
+	memcpy(xbp->xb_curp, ibuf, ilen);
+	xbp->xb_curp += ilen;
+
+    } else {
+	if (xo_check_for_room(xop, xbp, MB_LEN_MAX + 1))
+	    return 0;
+
+	bzero(&xop->xo_mbstate, sizeof(xop->xo_mbstate));
+	len = wcrtomb(xbp->xb_curp, wc, &xop->xo_mbstate);
+
+	if (len <= 0) {
+	    xo_failure(xop, "could not convert wide char: %lx",
+		       (unsigned long) wc);
+	    return 0;
+	}
+	xbp->xb_curp += len;
+    }
+
+    return xo_wcwidth(wc);
+}
+
+/*
+ * Append a UTF-8 string to a buffer, converting it into locale encoding
+ */
+static void
+xo_buf_append_locale (xo_handle_t *xop, xo_buffer_t *xbp,
+		      const char *cp, ssize_t len)
+{
+    const char *sp = cp, *ep = cp + len;
+    ssize_t save_off = xbp->xb_bufp - xbp->xb_curp;
+    ssize_t slen;
+    int cols = 0;
+
+    for ( ; cp < ep; cp++) {
+	if (!xo_is_utf8_byte(*cp)) {
+	    cols += 1;
+	    continue;
+	}
+
+	/*
+	 * We're looking at a non-ascii UTF-8 character.
+	 * First we copy the previous data.
+	 * Then we need find the length and validate it.
+	 * Then we turn it into a wide string.
+	 * Then we turn it into a localized string.
+	 * Then we repeat.  Isn't i18n fun?
+	 */
+	if (sp != cp)
+	    xo_buf_append(xbp, sp, cp - sp); /* Append previous data */
+
+	slen = xo_buf_utf8_len(xop, cp, ep - cp);
+	if (slen <= 0) {
+	    /* Bad data; back it all out */
+	    xo_buf_set_offset(xbp, save_off);
+	    return;
+	}
+
+	cols += xo_buf_append_locale_from_utf8(xop, xbp, cp, slen);
+
+	/* Next time through, we'll start at the next character */
+	cp += slen - 1;
+	sp = cp + 1;
+    }
+
+    /* Update column values */
+    if (XOF_ISSET(xop, XOF_COLUMNS))
+	xop->xo_columns += cols;
+    if (XOIF_ISSET(xop, XOIF_ANCHOR))
+	xop->xo_anchor_columns += cols;
+
+    /* Before we fall into the basic logic below, we need reset len */
+    len = ep - sp;
+    if (len != 0) /* Append trailing data */
+	xo_buf_append(xbp, sp, len);
+}
+
+/*
+ * Append the given string to the given buffer, without escaping or
+ * character set conversion.  This is the straight copy to the data
+ * buffer with no fanciness.
+ */
+static void
+xo_data_append (xo_handle_t *xop, const char *str, ssize_t len)
+{
+    xo_buf_append(&xop->xo_data, str, len);
+}
+
+/*
+ * Append the given string to the given buffer
+ */
+static void
+xo_data_escape (xo_handle_t *xop, const char *str, ssize_t len)
+{
+    xo_buf_escape(xop, &xop->xo_data, str, len, 0);
+}
+
+/*
+ * xo_retain_field_t holds information we've learned about a retained
+ * field while rendering it, so we don't need to learn it again.  This
+ * is mutable, unlike the xo_field_info_t.  Each cached value records
+ * the handle (and its generation number) it's valid for.
+ */
+typedef struct xo_retain_field_s {
+    const xo_handle_t *xrf_map_handle; /* Handle for xrf_map_name */
+    unsigned long xrf_map_gen;	/* Handle's xo_map_gen for xrf_map_name */
+    const char *xrf_map_name;	/* Mapped name (or NULL if not mapped) */
+    ssize_t xrf_map_nlen;	/* Length of xrf_map_name */
+    xo_colors_cache_t *xrf_colors; /* Compiled colors (for {C:}) */
+    const xo_handle_t *xrf_info_handle; /* Handle for xrf_info */
+    unsigned long xrf_info_gen;	/* Handle's xo_info_gen for xrf_info */
+    unsigned long xrf_info_map_gen; /* Handle's xo_map_gen for xrf_info */
+    xo_info_t *xrf_info;	/* Info for this field (or NULL) */
+    const xo_handle_t *xrf_fields_handle; /* Handle for xrf_fields_skip */
+    unsigned long xrf_fields_gen; /* Handle's xo_fields_gen for same */
+    int xrf_fields_skip;	/* Not in the handle's "fields=" list */
+} xo_retain_field_t;
+
+#ifdef LIBXO_NO_RETAIN
+/*
+ * Empty implementations of the retain logic
+ */
+
+void
+xo_retain_clear_all (void)
+{
+    return;
+}
+
+void
+xo_retain_clear (const char *fmt UNUSED)
+{
+    return;
+}
+static void
+xo_retain_add (const char *fmt UNUSED, xo_field_info_t *fields UNUSED,
+		unsigned num_fields UNUSED)
+{
+    return;
+}
+
+static int
+xo_retain_find (const char *fmt UNUSED, xo_field_info_t **valp UNUSED,
+		xo_retain_field_t **rvalp UNUSED, unsigned *nump UNUSED)
+{
+    return -1;
+}
+
+unsigned long
+xo_retain_get_hits (void)
+{
+    return 0;
+}
+
+#else /* !LIBXO_NO_RETAIN */
+/*
+ * Retain: We retain parsed field definitions to enhance performance,
+ * especially inside loops.  We depend on the caller treating the format
+ * strings as immutable, so that we can retain pointers into them.  We
+ * hold the pointers in a hash table, so allow quick access.  Retained
+ * information is retained until xo_retain_clear is called.
+ */
+
+/*
+ * xo_retain_entry_t holds information about one retained set of
+ * parsed fields.
+ */
+typedef struct xo_retain_entry_s {
+    struct xo_retain_entry_s *xre_next; /* Pointer to next (older) entry */
+    unsigned long xre_hits;		 /* Number of times we've hit */
+    const char *xre_format;		 /* Pointer to format string */
+    unsigned xre_num_fields;		 /* Number of fields saved */
+    xo_field_info_t *xre_fields;	 /* Pointer to fields */
+    xo_retain_field_t *xre_rfields;	 /* Pointer to per-field info */
+} xo_retain_entry_t;
+
+/*
+ * xo_retain_t holds a complete set of parsed fields as a hash table.
+ */
+#ifndef XO_RETAIN_SIZE
+#define XO_RETAIN_SIZE 6
+#endif /* XO_RETAIN_SIZE */
+#define RETAIN_HASH_SIZE (1<<XO_RETAIN_SIZE)
+
+typedef struct xo_retain_s {
+    xo_retain_entry_t *xr_bucket[RETAIN_HASH_SIZE];
+} xo_retain_t;
+
+static THREAD_LOCAL(xo_retain_t) xo_retain;
+static THREAD_LOCAL(unsigned) xo_retain_count;
+static THREAD_LOCAL(unsigned long) xo_retain_hits;
+
+/*
+ * Simple hash function based on Thomas Wang's paper.  The original is
+ * gone, but an archive is available on the Way Back Machine:
+ *
+ * http://web.archive.org/web/20071223173210/\
+ *     http://www.concentric.net/~Ttwang/tech/inthash.htm
+ *
+ * For our purposes, we can assume the low four bits are uninteresting
+ * since any string less that 16 bytes wouldn't be worthy of
+ * retaining.  We toss the high bits also, since these bits are likely
+ * to be common among constant format strings.  We then run Wang's
+ * algorithm, and cap the result at RETAIN_HASH_SIZE.
+ */
+static unsigned
+xo_retain_hash (const char *fmt)
+{
+    volatile uintptr_t iptr = (uintptr_t) (const void *) fmt;
+
+    /* Discard low four bits and high bits; they aren't interesting */
+    uint32_t val = (uint32_t) ((iptr >> 4) & (((1 << 24) - 1)));
+
+    val = (val ^ 61) ^ (val >> 16);
+    val = val + (val << 3);
+    val = val ^ (val >> 4);
+    val = val * 0x3a8f05c5;	/* My large prime number */
+    val = val ^ (val >> 15);
+    val &= RETAIN_HASH_SIZE - 1;
+
+    return val;
+}	
+
+/*
+ * Free a retained entry, along with anything its fields have cached
+ */
+static void
+xo_retain_free (xo_retain_entry_t *xrep)
+{
+    unsigned i;
+
+    for (i = 0; i < xrep->xre_num_fields; i++)
+	if (xrep->xre_rfields[i].xrf_colors)
+	    xo_free(xrep->xre_rfields[i].xrf_colors);
+
+    xo_free(xrep);
+}
+
+/*
+ * Walk all buckets, clearing all retained entries
+ */
+void
+xo_retain_clear_all (void)
+{
+    int i;
+    xo_retain_entry_t *xrep, *next;
+
+    for (i = 0; i < RETAIN_HASH_SIZE; i++) {
+	for (xrep = xo_retain.xr_bucket[i]; xrep; xrep = next) {
+	    next = xrep->xre_next;
+	    xo_retain_free(xrep);
+	}
+	xo_retain.xr_bucket[i] = NULL;
+    }
+    xo_retain_count = 0;
+    xo_retain_hits = 0;
+
+    xo_gettext_cache_clear_all();
+}
+
+/*
+ * Walk all buckets, clearing all retained entries
+ */
+void
+xo_retain_clear (const char *fmt)
+{
+    xo_retain_entry_t **xrepp;
+    unsigned hash = xo_retain_hash(fmt);
+
+    for (xrepp = &xo_retain.xr_bucket[hash]; *xrepp;
+	 xrepp = &(*xrepp)->xre_next) {
+	if ((*xrepp)->xre_format == fmt) {
+	    xo_retain_entry_t *xrep = *xrepp;
+	    *xrepp = xrep->xre_next;
+	    xo_retain_free(xrep);
+	    xo_retain_count -= 1;
+	    return;
+	}
+    }
+}
+
+/*
+ * Search the hash for an entry matching 'fmt'; return it's fields.
+ */
+static int
+xo_retain_find (const char *fmt, xo_field_info_t **valp,
+		xo_retain_field_t **rvalp, unsigned *nump)
+{
+    if (xo_retain_count == 0)
+	return -1;
+
+    unsigned hash = xo_retain_hash(fmt);
+    xo_retain_entry_t *xrep;
+
+    for (xrep = xo_retain.xr_bucket[hash]; xrep != NULL;
+	 xrep = xrep->xre_next) {
+	if (xrep->xre_format == fmt) {
+	    *valp = xrep->xre_fields;
+	    *rvalp = xrep->xre_rfields;
+	    *nump = xrep->xre_num_fields;
+	    xrep->xre_hits += 1;
+	    xo_retain_hits += 1;
+	    return 0;
+	}
+    }
+
+    return -1;
+}
+
+static void
+xo_retain_add (const char *fmt, xo_field_info_t *fields, unsigned num_fields)
+{
+    unsigned hash = xo_retain_hash(fmt);
+    xo_retain_entry_t *xrep;
+    ssize_t fsz = (num_fields + 1) * sizeof(*fields);
+    ssize_t rsz = num_fields * sizeof(xo_retain_field_t);
+    xo_field_info_t *xfip;
+    xo_retain_field_t *xrfp;
+
+    xrep = xo_realloc(NULL, sizeof(*xrep) + fsz + rsz);
+    if (xrep == NULL)
+	return;
+
+    /* The per-field info comes first (for alignment); it starts empty */
+    xrfp = (xo_retain_field_t *) &xrep[1];
+    bzero(xrfp, rsz);
+
+    xfip = (xo_field_info_t *) &xrfp[num_fields];
+    memcpy(xfip, fields, num_fields * sizeof(*fields));
+
+    bzero(xrep, sizeof(*xrep));
+
+    xrep->xre_format = fmt;
+    xrep->xre_fields = xfip;
+    xrep->xre_rfields = xrfp;
+    xrep->xre_num_fields = num_fields;
+
+    /* Record the field info in the retain bucket */
+    xrep->xre_next = xo_retain.xr_bucket[hash];
+    xo_retain.xr_bucket[hash] = xrep;
+    xo_retain_count += 1;
+}
+
+unsigned long
+xo_retain_get_hits (void)
+{
+    return xo_retain_hits;
+}
+
+#endif /* !LIBXO_NO_RETAIN */
+
+/*
+ * The "warn" flag has nothing to do with the "warn" function.  This
+ * flag tells libxo to report mistakes in the calling code that are
+ * important to the developer but not-a-all to the user.  xo_failure()
+ * is the driver for this.
+ */
+
+/* Flags for xo_warn_hcfv() */
+typedef unsigned xo_warn_flags_t;
+#define XO_XWF_CHECK_WARN	(1<<0) /* Check for warning flag */
+#define XO_XWF_NO_EXTERR	(1<<1) /* Don't report extended error */
+#define XO_XWF_CHECK_FILT	(1<<2) /* Check for filter warning flag */
+
+/*
+ * Generate a warning.  Normally, this is a text message written to
+ * standard error.  If the XOF_WARN_XML flag is set, then we generate
+ * XMLified content on standard output.
+ */
+static void
+xo_warn_hcfv (xo_handle_t *xop, int code, xo_warn_flags_t flags,
+	     const char *fmt, va_list vap)
+{
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return;
+    if ((flags & XO_XWF_CHECK_WARN) && !XOF_ISSET(xop, XOF_WARN))
+	return;
+
+    if ((flags & XO_XWF_CHECK_FILT) && !XOF_ISSET(xop, XOF_FILTER_WARN))
+	return;
+
+    if (fmt == NULL)
+	return;
+
+    char exterr[UEXTERROR_MAXLEN] XO_UNUSED; /* The optimizer will remove */
+    int extstatus = -1;
+
+#ifdef HAVE_EXTERR
+    if (!(flags & XO_XWF_NO_EXTERR))
+	extstatus = uexterr_gettext(exterr, sizeof(exterr));
+#endif /* HAVE_EXTERR */
+    
+
+    ssize_t len = strlen(fmt);
+    ssize_t plen = xo_program ? strlen(xo_program) : 0;
+    char *newfmt = alloca(len + 1 + plen + 2); /* NUL, and ": " */
+
+    if (plen) {
+	memcpy(newfmt, xo_program, plen);
+	newfmt[plen++] = ':';
+	newfmt[plen++] = ' ';
+    }
+
+    memcpy(newfmt + plen, fmt, len);
+    newfmt[len + plen] = '\0';
+
+    if (XOF_ISSET(xop, XOF_WARN_XML)) {
+	static char err_open[] = "<error>";
+	static char err_close[] = "</error>";
+	static char msg_open[] = "<message>";
+	static char msg_close[] = "</message>";
+
+	xo_buffer_t *xbp = &xop->xo_data;
+
+	xo_buf_append(xbp, err_open, sizeof(err_open) - 1);
+	xo_buf_append(xbp, msg_open, sizeof(msg_open) - 1);
+
+	va_list va_local;
+	va_copy(va_local, vap);
+
+	ssize_t left = xbp->xb_size - (xbp->xb_curp - xbp->xb_bufp);
+	ssize_t rc = vsnprintf(xbp->xb_curp, left, newfmt, vap);
+
+	if (rc >= left) {
+	    if (xo_check_for_room(xop, xbp, rc)) {
+		va_end(va_local);
+		return;
+	    }
+
+	    va_end(vap);	/* Reset vap to the start */
+	    va_copy(vap, va_local);
+
+	    left = xbp->xb_size - (xbp->xb_curp - xbp->xb_bufp);
+	    rc = vsnprintf(xbp->xb_curp, left, fmt, vap);
+	}
+
+	va_end(va_local);
+
+	rc = xo_escape_xml(xop, xbp, rc, 1);
+	xbp->xb_curp += rc;
+
+	xo_buf_append(xbp, msg_close, sizeof(msg_close) - 1);
+	xo_buf_append(xbp, err_close, sizeof(err_close) - 1);
+
+	if (code >= 0) {
+	    const char *msg = strerror(code);
+
+	    if (msg) {
+		xo_buf_append(xbp, ": ", 2);
+		xo_buf_append(xbp, msg, strlen(msg));
+	    }
+
+	    if (extstatus == 0 && exterr[0] != '\0')
+		xo_buf_append(xbp, exterr, strlen(exterr));
+	}
+
+	xo_buf_append(xbp, "\n", 1); /* Append newline and NUL to string */
+	(void) xo_write(xop);
+
+    } else {
+	vfprintf(stderr, newfmt, vap);
+	if (code >= 0) {
+	    const char *msg = strerror(code);
+
+	    if (msg)
+		fprintf(stderr, ": %s", msg);
+
+	    if (extstatus == 0 && exterr[0] != '\0')
+		fprintf(stderr, " (%s)", exterr);
+	}
+
+	fprintf(stderr, "\n");
+    }
+}
+
+/*
+ * Generate a warning.  Normally, this is a text message written to
+ * standard error.  If the XOF_WARN_XML flag is set, then we generate
+ * XMLified content on standard output.
+ */
+void
+xo_warn_hcv (xo_handle_t *xop, int code, int check_warn,
+	     const char *fmt, va_list vap)
+{
+    xo_warn_hcfv(xop, code, check_warn, fmt, vap);
+}
+
+void
+xo_warn_hc (xo_handle_t *xop, int code, const char *fmt, ...)
+{
+    va_list vap;
+
+    va_start(vap, fmt);
+    xo_warn_hcv(xop, code, 0, fmt, vap);
+    va_end(vap);
+}
+
+void
+xo_warn_c (int code, const char *fmt, ...)
+{
+    va_list vap;
+
+    va_start(vap, fmt);
+    xo_warn_hcv(NULL, code, 0, fmt, vap);
+    va_end(vap);
+}
+
+void
+xo_warn (const char *fmt, ...)
+{
+    int code = errno;
+    va_list vap;
+
+    va_start(vap, fmt);
+    xo_warn_hcv(NULL, code, 0, fmt, vap);
+    va_end(vap);
+}
+
+void
+xo_warnx (const char *fmt, ...)
+{
+    va_list vap;
+
+    va_start(vap, fmt);
+    xo_warn_hcv(NULL, -1, 0, fmt, vap);
+    va_end(vap);
+}
+
+void
+xo_err (int eval, const char *fmt, ...)
+{
+    int code = errno;
+    va_list vap;
+
+    va_start(vap, fmt);
+    xo_warn_hcv(NULL, code, 0, fmt, vap);
+    va_end(vap);
+    xo_finish();
+    exit(eval);
+}
+
+void
+xo_errx (int eval, const char *fmt, ...)
 {
     va_list vap;
 
@@ -1934,6 +2637,8 @@ xo_message_hcv (xo_handle_t *xop, int code, const char *fmt, va_list vap)
     va_list va_local;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
     if (fmt == NULL || *fmt == '\0')
 	return;
@@ -2191,6 +2896,7 @@ xo_create (xo_style_t style, xo_xof_flags_t flags)
 	XOF_SET(xop, flags);
 	xo_init_handle(xop);
 	xop->xo_style = style;	/* Reset style (see LIBXO_OPTIONS) */
+	xo_ndjson_fixup(xop);
     }
 
     return xop;
@@ -2221,6 +2927,56 @@ xo_create_to_file (FILE *fp, xo_style_t style, xo_xof_flags_t flags)
     return xop;
 }
 
+/**
+ * Create a "tee" handle, which passes everything it's given along
+ * to a set of child handles, allowing one set of calls to make
+ * output in several styles (e.g. text on the terminal and JSON in a
+ * log file).  Format strings are parsed once for all the children,
+ * which do only their own rendering.  The list of children must be
+ * terminated with a NULL.  The tee doesn't own the children, which
+ * must outlive it and be destroyed by the caller.
+ *
+ * @param xop First child handle
+ * @return Newly allocated handle
+ * @see xo_destroy
+ */
+xo_handle_t *
+xo_create_tee (xo_handle_t *xop, ...)
+{
+    va_list vap;
+    int count;
+
+    if (xop == NULL)
+	return NULL;
+
+    va_start(vap, xop);
+    for (count = 1; va_arg(vap, xo_handle_t *) != NULL; count++)
+	continue;
+    va_end(vap);
+
+    xo_handle_t *tee = xo_create(XO_STYLE_TEXT, 0);
+    if (tee == NULL)
+	return NULL;
+
+    tee->xo_tee = xo_realloc(NULL, count * sizeof(tee->xo_tee[0]));
+    if (tee->xo_tee == NULL) {
+	xo_destroy(tee);
+	return NULL;
+    }
+
+    int i = 0;
+    tee->xo_tee[i++] = xop;
+
+    va_start(vap, xop);
+    while (i < count)
+	tee->xo_tee[i++] = va_arg(vap, xo_handle_t *);
+    va_end(vap);
+
+    tee->xo_tee_count = count;
+
+    return tee;
+}
+
 /**
  * Set the default handler to output to a file.
  *
@@ -2232,6 +2988,8 @@ int
 xo_set_file_h (xo_handle_t *xop, FILE *fp)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
 
     if (fp == NULL) {
 	xo_failure(xop, "xo_set_file: NULL fp");
@@ -2240,6 +2998,7 @@ xo_set_file_h (xo_handle_t *xop, FILE *fp)
 
     xop->xo_opaque = fp;
     xop->xo_write = xo_write_to_file;
+    xop->xo_write_nb = NULL;
     xop->xo_close = xo_close_file;
     xop->xo_flush = xo_flush_file;
 
@@ -2266,19 +3025,52 @@ xo_set_file (FILE *fp)
 void
 xo_destroy (xo_handle_t *xop_arg)
 {
+    if (xop_arg && xop_arg->xo_shared)
+	xo_shared_release(xop_arg);
+
     xo_handle_t *xop = xo_default(xop_arg);
 
     xo_flush_h(xop);
 
+    if (xop->xo_write_nb)
+	xo_nb_drain_final(xop);
+
     if (xop->xo_close && XOF_ISSET(xop, XOF_CLOSE_FP))
 	xop->xo_close(xop->xo_opaque);
 
+    /* Release the names and keys of any frames left open */
+    int i;
+    for (i = 0; i <= xop->xo_depth && i < xop->xo_stack_size; i++) {
+	if (xop->xo_stack[i].xs_name)
+	    xo_free(xop->xo_stack[i].xs_name);
+	if (xop->xo_stack[i].xs_keys)
+	    xo_free(xop->xo_stack[i].xs_keys);
+    }
+
     xo_free(xop->xo_stack);
+    xo_free(xop->xo_tee);
     xo_buf_cleanup(&xop->xo_data);
     xo_buf_cleanup(&xop->xo_fmt);
     xo_buf_cleanup(&xop->xo_predicate);
     xo_buf_cleanup(&xop->xo_attrs);
     xo_buf_cleanup(&xop->xo_color_buf);
+    xo_buf_cleanup(&xop->xo_xpath);
+    xo_buf_cleanup(&xop->xo_frag_data);
+    xo_buf_cleanup(&xop->xo_pending);
+    xo_buf_cleanup(&xop->xo_lazy);
+    xo_buf_cleanup(&xop->xo_fields_data);
+
+#ifdef LIBXO_NEED_FILTERS
+    xo_free(xop->xo_cuts);
+    if (xop->xo_spill_fp)
+	fclose(xop->xo_spill_fp);
+#endif /* LIBXO_NEED_FILTERS */
+
+#ifdef LIBXO_NEED_MAP
+    xo_free(xop->xo_map);
+    xo_free(xop->xo_map_bucket);
+    xo_buf_cleanup(&xop->xo_map_data);
+#endif /* LIBXO_NEED_MAP */
 
     if (xop->xo_version)
 	xo_free(xop->xo_version);
@@ -2301,6 +3093,8 @@ void
 xo_set_style (xo_handle_t *xop, xo_style_t style)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
     xop->xo_style = style;
 }
 
@@ -2314,6 +3108,8 @@ xo_style_t
 xo_get_style (xo_handle_t *xop)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return XO_STYLE_TEXT;
     return xo_style(xop);
 }
 
@@ -2348,6 +3144,7 @@ static xo_flag_mapping_t xo_xof_names[] = {
     { XOF_COLUMNS, "columns" },
     { XOF_DEBUG, "debug" },
     { XOF_DTRT, "dtrt" },
+    { XOF_FILTER_STATS, "filter-stats" },
     { XOF_FILTER_WARN, "filter-warn" },
     { XOF_FLUSH, "flush" },
     { XOF_FLUSH_LINE, "flush-line" },
@@ -2356,6 +3153,7 @@ static xo_flag_mapping_t xo_xof_names[] = {
     { XOF_KEYS, "keys" },
     { XOF_LOG_GETTEXT, "log-gettext" },
     { XOF_LOG_SYSLOG, "log-syslog" },
+    { XOF_NDJSON, "ndjson" },
     { XOF_NO_HUMANIZE, "no-humanize" },
     { XOF_NO_LOCALE, "no-locale" },
     { XOF_RETAIN_NONE, "no-retain" },
@@ -2380,12 +3178,55 @@ static xo_flag_mapping_t xo_option_names[] = {
     { XO_OPT_MAP, "map" },
     { XO_OPT_MAP_FILE, "map-file" },
     { XO_OPT_FILTER, "filter" },
+    { XO_OPT_FIELDS, "fields" },
+    { XO_OPT_FILTER_SPILL, "filter-spill" },
+    { XO_OPT_FILTER_IMAGE, "filter-image" },
+    { XO_OPT_FILTER_FILE, "filter-file" },
     { XO_EXTERR_BRIEF, "exterr" },
     { XO_EXTERR_BRIEF, "exterr-brief" },
     { XO_EXTERR_VERBOSE, "exterr-verbose" },
     { 0, NULL }
 };
 
+#ifdef XO_USE_INT_RETURN_CODES
+#define XO_SSIZE_MAX INT_MAX	/* Largest xo_ssize_t */
+#else /* XO_USE_INT_RETURN_CODES */
+#define XO_SSIZE_MAX SSIZE_MAX	/* Largest xo_ssize_t */
+#endif /* XO_USE_INT_RETURN_CODES */
+
+/*
+ * Parse a size in bytes, with an optional "k", "m", or "g" suffix;
+ * returns -1 if it's not one, or is too big for an xo_ssize_t
+ */
+static xo_ssize_t
+xo_parse_size (const char *str)
+{
+    unsigned long long val, mult = 1;
+    char *ep;
+
+    errno = 0;
+    val = strtoull(str, &ep, 0);
+    if (ep == str || errno == ERANGE)
+	return -1;
+
+    switch (*ep) {
+    case 'g': case 'G':
+	mult *= 1024;
+	/* FALLTHROUGH */
+    case 'm': case 'M':
+	mult *= 1024;
+	/* FALLTHROUGH */
+    case 'k': case 'K':
+	mult *= 1024;
+	ep += 1;
+    }
+
+    if (*ep != '\0' || val > (unsigned long long) XO_SSIZE_MAX / mult)
+	return -1;
+
+    return val * mult;
+}
+
 /*
  * Convert string name to XOF_* flag value.
  * Not all are useful.  Or safe.  Or sane.
@@ -2643,8 +3484,9 @@ static int
 xo_set_options_words (xo_handle_t *xop, int argc, char **argv)
 {
     char *cp, *vp, *zp;
-    int style = -1, new_style, rc = 0, final_rc = 0;
+    int style = -1, new_style, rc = 0, final_rc = 0, ndjson = FALSE;
     xo_xof_flags_t new_flag;
+    xo_ssize_t size;
 
     for (int i = 0; i < argc; i++) {
 	if (rc)
@@ -2701,6 +3543,8 @@ xo_set_options_words (xo_handle_t *xop, int argc, char **argv)
 	new_flag = xo_name_to_flag(cp);
 	if (new_flag != 0) {
 	    XOF_SET(xop, new_flag);
+	    if (new_flag == XOF_NDJSON)
+		ndjson = TRUE;
 	    continue;
 	}
 
@@ -2769,15 +3613,54 @@ xo_set_options_words (xo_handle_t *xop, int argc, char **argv)
 	    setenv("EXTERROR_VERBOSE", "verbose", 1);
 	    continue;
 
+	case XO_OPT_FIELDS: /* Keep only the given value fields */
+	    if (vp == NULL) {
+		xo_warnx("missing value for fields option");
+		rc = -1;
+	    } else
+		rc = xo_fields_add(xop, vp);
+	    continue;
+
+	case XO_OPT_FILTER_SPILL: /* Spill pending output past this size */
+	    size = vp ? xo_parse_size(vp) : -1;
+	    if (size < 0) {
+		xo_warnx("missing or bad value for filter-spill option");
+		rc = -1;
+	    } else
+		xo_set_filter_spill(xop, size);
+	    continue;
+
+	case XO_OPT_FILTER_IMAGE: /* Use a compiled filter image */
+	    if (vp == NULL) {
+		xo_warnx("missing value for filter-image option");
+		rc = -1;
+	    } else
+		rc = xo_add_filter_image(xop, vp); /* Reports its own errors */
+	    continue;
+
+	case XO_OPT_FILTER_FILE: /* Filter using the paths in a file */
+	    if (vp == NULL) {
+		xo_warnx("missing value for filter-file option");
+		rc = -1;
+	    } else
+		rc = xo_add_filter_file(xop, vp); /* Reports its own errors */
+	    continue;
+
 	default:
 	    xo_warnx("unknown libxo option value: '%s'", cp);
 	    rc = -1;
 	}
     }
 
+    /* "ndjson" implies JSON, unless another style was given */
+    if (style < 0 && ndjson)
+	style = XO_STYLE_JSON;
+
     if (style >= 0)
 	xop->xo_style= style;
 
+    xo_ndjson_fixup(xop);
+
     return final_rc ?: rc;
 }
 
@@ -2799,6 +3682,8 @@ xo_set_options (xo_handle_t *xop, const char *input)
 	return 0;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
 
 #ifdef LIBXO_COLOR_ON_BY_DEFAULT
     /* If the installer used --enable-color-on-by-default, then we allow it */
@@ -2857,8 +3742,11 @@ void
 xo_set_flags (xo_handle_t *xop, xo_xof_flags_t flags)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
     XOF_SET(xop, flags);
+    xo_ndjson_fixup(xop);
 }
 
 /**
@@ -2871,6 +3759,8 @@ int
 xo_isset_flags (xo_handle_t *xop, xo_xof_flags_t flags)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return FALSE;
 
     return (xop->xo_flags & flags) ? TRUE : FALSE;
 }
@@ -2884,6 +3774,8 @@ xo_xof_flags_t
 xo_get_flags (xo_handle_t *xop)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return 0;
 
     return xop->xo_flags;
 }
@@ -2918,6 +3810,8 @@ void
 xo_set_leading_xpath (xo_handle_t *xop, const char *path)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
     if (xop->xo_leading_xpath) {
 	xo_free(xop->xo_leading_xpath);
@@ -2941,6 +3835,8 @@ void
 xo_set_info (xo_handle_t *xop, xo_info_t *infop, int count)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
     if (count < 0 && infop) {
 	xo_info_t *xip;
@@ -2949,8 +3845,11 @@ xo_set_info (xo_handle_t *xop, xo_info_t *infop, int count)
 	    continue;
     }
 
+    static unsigned long xo_info_generation; /* Source of xo_info_gen */
+
     xop->xo_info = infop;
     xop->xo_info_count = count;
+    xop->xo_info_gen = ++xo_info_generation;
 }
 
 /**
@@ -2963,6 +3862,8 @@ xo_set_formatter (xo_handle_t *xop, xo_formatter_t func,
 		  xo_checkpointer_t cfunc)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
     xop->xo_formatter = func;
     xop->xo_checkpointer = cfunc;
@@ -2979,6 +3880,8 @@ void
 xo_clear_flags (xo_handle_t *xop, xo_xof_flags_t flags)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
     XOF_CLEAR(xop, flags);
 }
@@ -3085,6 +3988,87 @@ xo_info_find (xo_handle_t *xop, const char *name, ssize_t nlen)
     return xip;
 }
 
+/*
+ * Find the info for a field, using (and filling in) the info cached
+ * in the retained field, if we have one.  Since the name may have
+ * been mapped, we need the map's generation to match also.
+ */
+static xo_info_t *
+xo_info_find_field (xo_handle_t *xop, const char *name, ssize_t nlen)
+{
+    xo_retain_field_t *xrfp = xop->xo_rfield;
+    unsigned long map_gen = 0;
+
+#ifdef LIBXO_NEED_MAP
+    map_gen = xop->xo_map_gen;
+#endif /* LIBXO_NEED_MAP */
+
+    if (xrfp == NULL)
+	return xo_info_find(xop, name, nlen);
+
+    if (xrfp->xrf_info_handle != xop
+	    || xrfp->xrf_info_gen != xop->xo_info_gen
+	    || xrfp->xrf_info_map_gen != map_gen) {
+	xrfp->xrf_info = xo_info_find(xop, name, nlen);
+	xrfp->xrf_info_handle = xop;
+	xrfp->xrf_info_gen = xop->xo_info_gen;
+	xrfp->xrf_info_map_gen = map_gen;
+    }
+
+    return xrfp->xrf_info;
+}
+
+/*
+ * For HTML's "data-xpath" attributes, we keep the XPath of the stack,
+ * escaped and ready to use, in xo_xpath.  Rather than rebuilding it
+ * for each field, we extend it as needed and trim it when frames are
+ * popped.  xo_xpath_valid is the number of frames in xo_xpath, and
+ * each of those frames records where its part starts (xs_xpath_off)
+ * and where its keys start (xs_xpath_koff).
+ */
+static void
+xo_xpath_truncate (xo_handle_t *xop, int depth)
+{
+    if (xop->xo_xpath_valid > depth) {
+	xo_buf_set_offset(&xop->xo_xpath, xop->xo_stack[depth].xs_xpath_off);
+	xop->xo_xpath_valid = depth;
+    }
+}
+
+static void
+xo_xpath_render (xo_handle_t *xop)
+{
+    xo_buffer_t *xbp = &xop->xo_xpath;
+    xo_stack_t *xsp;
+    int i;
+
+    for (i = xop->xo_xpath_valid; i <= xop->xo_depth; i++) {
+	xsp = &xop->xo_stack[i];
+	xsp->xs_xpath_off = xsp->xs_xpath_koff = xo_buf_offset(xbp);
+
+	if (xsp->xs_name == NULL)
+	    continue;
+
+	/*
+	 * XSS_OPEN_LIST and XSS_OPEN_LEAF_LIST stack frames
+	 * are directly under XSS_OPEN_INSTANCE frames so we
+	 * don't need to put these in our XPath expressions.
+	 */
+	if (xsp->xs_state == XSS_OPEN_LIST
+		|| xsp->xs_state == XSS_OPEN_LEAF_LIST)
+	    continue;
+
+	xo_buf_append(xbp, "/", 1);
+	xo_buf_escape(xop, xbp, xsp->xs_name, strlen(xsp->xs_name), 0);
+
+	xsp->xs_xpath_koff = xo_buf_offset(xbp);
+	if (xsp->xs_keys)
+	    xo_buf_append(xbp, xsp->xs_keys, strlen(xsp->xs_keys));
+    }
+
+    xop->xo_xpath_valid = xop->xo_depth + 1;
+}
+
 #define CONVERT(_have, _need) (((_have) << 8) | (_need))
 
 /*
@@ -3385,7 +4369,10 @@ xo_format_string (xo_handle_t *xop, xo_buffer_t *xbp, xo_xff_flags_t flags,
 	}
 
     } else {
-	cp = va_arg(xop->xo_vap, char *); /* UTF-8 or native */
+	if (xfp->xf_lazy)	/* Already fetched by xo_format_lazy */
+	    cp = xfp->xf_value;
+	else
+	    cp = va_arg(xop->xo_vap, char *); /* UTF-8 or native */
 
     normal_string:
 	if (xfp->xf_skip)
@@ -3880,7 +4867,7 @@ xo_emit_field_value (xo_handle_t *xop, xo_buffer_t *xbp,
      * functions won't handle field widths for wide characters
      * correctly.  So we have to handle this ourselves.
      */
-    if (xop->xo_formatter == NULL
+    if ((xop->xo_formatter == NULL || xfp->xf_lazy)
 	    && (xfp->xf_fc == 's' || xfp->xf_fc == 'S'
 		|| xfp->xf_fc == 'm')) {
 
@@ -3966,9 +4953,10 @@ xo_advance_vap (xo_handle_t *xop, xo_format_t *xfp)
 	/*
 	 * The 'S' and 's' formats are normally handled in
 	 * xo_format_string, but if we skipped it, then we
-	 * need to pop it.
+	 * need to pop it.  Lazy values were popped by
+	 * xo_format_lazy.
 	 */
-	if (xfp->xf_skip)
+	if (xfp->xf_skip && !xfp->xf_lazy)
 	    va_arg(xop->xo_vap, char *);
 
     } else if (xfp->xf_fc == 'm') {
@@ -4003,27 +4991,83 @@ xo_advance_vap (xo_handle_t *xop, xo_format_t *xfp)
 	    } else if (xfp->xf_zflag > 0) {
 		va_arg(xop->xo_vap, size_t);
 
-	    } else if (xfp->xf_qflag > 0) {
-		va_arg(xop->xo_vap, quad_t);
+	    } else if (xfp->xf_qflag > 0) {
+		va_arg(xop->xo_vap, quad_t);
+
+	    } else {
+		va_arg(xop->xo_vap, int);
+	    }
+	} else if (strchr("eEfFgGaA", xfp->xf_fc) != NULL)
+	    if (xfp->xf_lflag)
+		xo_safe_va_arg_long_double(xop);
+	    else
+		va_arg(xop->xo_vap, double);
+
+	else if (xfp->xf_fc == 'C' || (xfp->xf_fc == 'c' && xfp->xf_lflag))
+	    va_arg(xop->xo_vap, wint_t);
+
+	else if (xfp->xf_fc == 'c')
+	    va_arg(xop->xo_vap, int);
+
+	else if (xfp->xf_fc == 'p')
+	    va_arg(xop->xo_vap, void *);
+    }
+}
+
+/*
+ * Fetch the arguments for a lazy "%@L@s" value, a callback and its
+ * opaque data, and call the callback to get the value, unless the
+ * field is being skipped or the filter will discard it (see
+ * xo_format_value).  Like snprintf, the callback returns the length
+ * of the full value, so we can grow our buffer and call it again
+ * when the value doesn't fit.
+ */
+static int
+xo_format_lazy (xo_handle_t *xop, xo_format_t *xfp,
+		const char *fmt, ssize_t flen)
+{
+    if (xfp->xf_fc != 's' || xfp->xf_lflag) {
+	xo_failure(xop, "lazy value requires '%%s' format: '%.*s'",
+		   (int) flen, fmt);
+	return -1;
+    }
+
+    if (XOF_ISSET(xop, XOF_NO_VA_ARG))
+	return 0;
+
+    xo_lazy_func_t func = va_arg(xop->xo_vap, xo_lazy_func_t);
+    void *opaque = va_arg(xop->xo_vap, void *);
+
+    if (xfp->xf_skip || func == NULL)
+	return 0;
+
+    if (XOIF_ISSET(xop, XOIF_LAZY_SKIP)) {
+	xfp->xf_skip = 1;
+	return 0;
+    }
+
+    xo_buffer_t *xbp = &xop->xo_lazy;
+    if (xbp->xb_bufp == NULL) {
+	xo_buf_init(xbp);
+	if (xbp->xb_bufp == NULL)
+	    return -1;
+    }
 
-	    } else {
-		va_arg(xop->xo_vap, int);
-	    }
-	} else if (strchr("eEfFgGaA", xfp->xf_fc) != NULL)
-	    if (xfp->xf_lflag)
-		xo_safe_va_arg_long_double(xop);
-	    else
-		va_arg(xop->xo_vap, double);
+    ssize_t len = func(opaque, xbp->xb_bufp, xbp->xb_size);
+    if (len >= xbp->xb_size) {
+	xo_buf_reset(xbp);
+	if (!xo_buf_has_room(xbp, len + 1))
+	    return -1;
+	len = func(opaque, xbp->xb_bufp, xbp->xb_size);
+    }
 
-	else if (xfp->xf_fc == 'C' || (xfp->xf_fc == 'c' && xfp->xf_lflag))
-	    va_arg(xop->xo_vap, wint_t);
+    if (len < 0 || len >= xbp->xb_size)
+	return 0;		/* Leave it NULL; we'll emit "(null)" */
 
-	else if (xfp->xf_fc == 'c')
-	    va_arg(xop->xo_vap, int);
+    xbp->xb_bufp[len] = '\0';
+    xfp->xf_value = xbp->xb_bufp;
 
-	else if (xfp->xf_fc == 'p')
-	    va_arg(xop->xo_vap, void *);
-    }
+    return 0;
 }
 
 /*
@@ -4087,12 +5131,15 @@ xo_do_format_field (xo_handle_t *xop, xo_buffer_t *xbp,
 	/*
 	 * "%@" starts an XO-specific set of flags:
 	 *   @X@ - XML-only field; ignored if style isn't XML
+	 *   @L@ - Lazy value; "%@L@s" takes a callback and opaque
 	 */
 	if (cp[1] == '@') {
 	    for (cp += 2; cp < ep; cp++) {
 		if (*cp == '@') {
 		    break;
 		}
+		if (*cp == 'L')
+		    xf.xf_lazy = 1;
 		if (*cp == '*') {
 		    /*
 		     * '*' means there's a "%*.*s" value in vap that
@@ -4148,6 +5195,9 @@ xo_do_format_field (xo_handle_t *xop, xo_buffer_t *xbp,
 	    }
 	}
 
+	if (xf.xf_lazy && xo_format_lazy(xop, &xf, fmt, flen) < 0)
+	    return -1;
+
 	/* If no max is given, it defaults to size */
 	if (xf.xf_width[XF_WIDTH_MAX] < 0 && xf.xf_width[XF_WIDTH_SIZE] >= 0)
 	    xf.xf_width[XF_WIDTH_MAX] = xf.xf_width[XF_WIDTH_SIZE];
@@ -4418,6 +5468,10 @@ xo_buf_append_div (xo_handle_t *xop, const char *class, xo_xff_flags_t flags,
 	    memcpy(cp + olen, pbp->xb_bufp, dlen);
 	    cp[olen + dlen] = '\0';
 	    xsp->xs_keys = cp;
+
+	    /* If our frame is already in xo_xpath, it's last, so append */
+	    if (xop->xo_xpath_valid > xop->xo_depth)
+		xo_buf_append(&xop->xo_xpath, pbp->xb_bufp, dlen);
 	}
 
 	/* Now we reset the xo_vap as if we were never here */
@@ -4476,36 +5530,19 @@ xo_buf_append_div (xo_handle_t *xop, const char *class, xo_xff_flags_t flags,
 	}
 
 	if (XOF_ISSET(xop, XOF_XPATH)) {
-	    int i;
-	    xo_stack_t *xsp;
-
 	    xo_data_append(xop, div_xpath, sizeof(div_xpath) - 1);
 	    if (xop->xo_leading_xpath)
 		xo_data_append(xop, xop->xo_leading_xpath,
 			       strlen(xop->xo_leading_xpath));
 
-	    for (i = 0; i <= xop->xo_depth; i++) {
-		xsp = &xop->xo_stack[i];
-		if (xsp->xs_name == NULL)
-		    continue;
+	    xo_xpath_render(xop);
 
-		/*
-		 * XSS_OPEN_LIST and XSS_OPEN_LEAF_LIST stack frames
-		 * are directly under XSS_OPEN_INSTANCE frames so we
-		 * don't need to put these in our XPath expressions.
-		 */
-		if (xsp->xs_state == XSS_OPEN_LIST
-			|| xsp->xs_state == XSS_OPEN_LEAF_LIST)
-		    continue;
+	    /* Don't show keys for the key field */
+	    xo_off_t xlen = xo_buf_offset(&xop->xo_xpath);
+	    if (flags & XFF_KEY)
+		xlen = xo_stack_cur(xop)->xs_xpath_koff;
 
-		xo_data_append(xop, "/", 1);
-		xo_data_escape(xop, xsp->xs_name, strlen(xsp->xs_name));
-		if (xsp->xs_keys) {
-		    /* Don't show keys for the key field */
-		    if (i != xop->xo_depth || !(flags & XFF_KEY))
-			xo_data_append(xop, xsp->xs_keys, strlen(xsp->xs_keys));
-		}
-	    }
+	    xo_data_append(xop, xop->xo_xpath.xb_bufp, xlen);
 
 	    xo_data_append(xop, "/", 1);
 	    xo_data_escape(xop, name, nlen);
@@ -4515,7 +5552,7 @@ xo_buf_append_div (xo_handle_t *xop, const char *class, xo_xff_flags_t flags,
 	    static char in_type[] = "\" data-type=\"";
 	    static char in_help[] = "\" data-help=\"";
 
-	    xo_info_t *xip = xo_info_find(xop, name, nlen);
+	    xo_info_t *xip = xo_info_find_field(xop, name, nlen);
 	    if (xip) {
 		if (xip->xi_type) {
 		    xo_data_append(xop, in_type, sizeof(in_type) - 1);
@@ -4798,6 +5835,8 @@ void
 xo_arg (xo_handle_t *xop)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
     fprintf(stderr, "0x%x", va_arg(xop->xo_vap, unsigned));
 }
 #endif /* 0 */
@@ -4808,21 +5847,90 @@ xo_arg (xo_handle_t *xop)
  * vocabulary as needed.  This means maintaining an array of old and
  * new names, along with the memory for the strings themselves.  We
  * want this to be specific to the handle, so when the user requests a
- * map, we don't break other users of libxo.  We'll need two fields in
- * the handle, one for the array, and one for the string buffer.
+ * map, we don't break other users of libxo.  Since maps can be large
+ * (hundreds of renames), we hash the "from" names.  The strings live
+ * in xo_map_data, so we record offsets, since the buffer can move.
+ *
+ * Since looking up a field name is still work, we cache the result
+ * with each retained field (see xo_retain_field_t), using
+ * xo_map_gen to tell if the map has changed since.
  */
 #ifdef LIBXO_NEED_MAP
+typedef struct xo_map_entry_s {
+    uint32_t xme_hash;		/* Hash of the "from" name */
+    int xme_next;		/* Next entry in our hash bucket (or -1) */
+    xo_off_t xme_from;		/* Offset of "from" name in xo_map_data */
+    xo_off_t xme_to;		/* Offset of "to" name in xo_map_data */
+    ssize_t xme_tlen;		/* Length of "to" name */
+} xo_map_entry_t;
+
+#define XO_MAP_BUCKETS 64	/* Initial number of buckets (power of 2) */
+
+static unsigned long xo_map_generation; /* Source of xo_map_gen values */
+
+static inline const char *
+xo_map_from (xo_handle_t *xop, int val)
+{
+    return xo_buf_data(&xop->xo_map_data, xop->xo_map[val].xme_from);
+}
+
+static inline const char *
+xo_map_to (xo_handle_t *xop, int val)
+{
+    return xo_buf_data(&xop->xo_map_data, xop->xo_map[val].xme_to);
+}
+
 static int
 xo_map_find (xo_handle_t *xop, const char *name, size_t len)
 {
-    for (int i = 0; i < xop->xo_map_len; i += 2) {
-	if (strncmp(xop->xo_map[i], name, len) == 0)
-	    return i;
+    if (xop->xo_map_len == 0)
+	return -1;
+
+    uint32_t hash = xo_hash_buf(XO_HASH_INIT, name, len);
+    int val = xop->xo_map_bucket[hash & (xop->xo_map_nbuckets - 1)];
+
+    for ( ; val >= 0; val = xop->xo_map[val].xme_next) {
+	if (xop->xo_map[val].xme_hash != hash)
+	    continue;
+
+	const char *from = xo_map_from(xop, val);
+	if (strncmp(from, name, len) == 0 && from[len] == '\0')
+	    return val;
     }
 
     return -1;
 }
 
+/*
+ * Make the number of buckets match the number of entries, rehashing
+ * the existing entries into the new buckets.
+ */
+static int
+xo_map_rehash (xo_handle_t *xop, unsigned nbuckets)
+{
+    int *bucket = xo_realloc(xop->xo_map_bucket, nbuckets * sizeof(*bucket));
+    if (bucket == NULL)
+	return -1;
+
+    xop->xo_map_bucket = bucket;
+    xop->xo_map_nbuckets = nbuckets;
+
+    unsigned i;
+    for (i = 0; i < nbuckets; i++)
+	bucket[i] = -1;
+
+    int val;
+    for (val = 0; val < xop->xo_map_len; val++) {
+	xo_map_entry_t *xmep = &xop->xo_map[val];
+	unsigned b = xmep->xme_hash & (nbuckets - 1);
+
+	xmep->xme_next = bucket[b];
+	bucket[b] = val;
+    }
+
+    return 0;
+}
+
 /*
  * Is the path something we can find in $XO_MAPDIR?  The current test
  * is simple: lack of '/'.
@@ -4842,13 +5950,60 @@ static inline const char *
 xo_map_name (xo_handle_t *xop UNUSED, const char *name)
 {
 #ifdef LIBXO_NEED_MAP
-    if (name == NULL)
-	return NULL;
+    if (name == NULL || xop->xo_map_len == 0)
+	return name;
+
+    int val = xo_map_find(xop, name, strlen(name));
+    if (val >= 0)
+	return xo_map_to(xop, val);
+#endif /* LIBXO_NEED_MAP */
+
+    return name;
+}
+
+/*
+ * Find the replacement string for a field name, which isn't
+ * NUL-terminated.  If the field has retained information, we use it
+ * (or fill it in) to avoid repeating the lookup.  The length of the
+ * result is returned via nlenp.
+ */
+static inline const char *
+xo_map_field_name (xo_handle_t *xop UNUSED, const char *name,
+		   ssize_t *nlenp UNUSED)
+{
+#ifdef LIBXO_NEED_MAP
+    if (xop->xo_map_len == 0)
+	return name;
+
+    xo_retain_field_t *xrfp = xop->xo_rfield;
+    if (xrfp && xrfp->xrf_map_handle == xop
+	    && xrfp->xrf_map_gen == xop->xo_map_gen) {
+	if (xrfp->xrf_map_name == NULL)
+	    return name;
 
-    size_t len = strlen(name);
-    for (int i = 0; i < xop->xo_map_len; i += 2) {
-	if (strncmp(xop->xo_map[i], name, len) == 0)
-	    return xop->xo_map[i + 1];
+	*nlenp = xrfp->xrf_map_nlen;
+	return xrfp->xrf_map_name;
+    }
+
+    const char *to = NULL;
+    ssize_t tlen = 0;
+
+    int val = xo_map_find(xop, name, *nlenp);
+    if (val >= 0) {
+	to = xo_map_to(xop, val);
+	tlen = xop->xo_map[val].xme_tlen;
+    }
+
+    if (xrfp) {
+	xrfp->xrf_map_handle = xop;
+	xrfp->xrf_map_gen = xop->xo_map_gen;
+	xrfp->xrf_map_name = to;
+	xrfp->xrf_map_nlen = tlen;
+    }
+
+    if (to) {
+	*nlenp = tlen;
+	return to;
     }
 #endif /* LIBXO_NEED_MAP */
 
@@ -4865,53 +6020,65 @@ xo_map_add (xo_handle_t *xop UNUSED, const char *from UNUSED,
 {
 #ifdef LIBXO_NEED_MAP
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
+
+    /* Append the "to" string (NUL terminated) first; we'll need it */
+    xo_off_t to_off = xo_buf_offset(&xop->xo_map_data);
+    if (xo_buf_append_val(&xop->xo_map_data, to, tlen) == NULL
+	    || !xo_buf_append_val(&xop->xo_map_data, "", 1))
+	return -1;
+
+    /* Any cached lookups are now suspect */
+    xop->xo_map_gen = ++xo_map_generation;
 
     int val = xo_map_find(xop, from, flen);
     if (val >= 0) {
 	/* We hit a "from" value that's already there; replace the "to" */
-	char *newp = xo_buf_append_val(&xop->xo_map_data, to, tlen);
-	if (newp == NULL)
-	    return -1;
-
-	/* NUL terminate the string */
-	if (!xo_buf_append_val(&xop->xo_map_data, "", 1))
-	    return -1;
-
-	xop->xo_map[val + 1] = newp;
+	xop->xo_map[val].xme_to = to_off;
+	xop->xo_map[val].xme_tlen = tlen;
 
 	return 0;
     }
 
     if (xop->xo_map_len >= xop->xo_map_size) {
-	char **newp = xo_realloc(xop->xo_map, xop->xo_map_size + XO_MAP_INCR);
+	int size = xop->xo_map_size + XO_MAP_INCR;
+	xo_map_entry_t *newp = xo_realloc(xop->xo_map, size * sizeof(*newp));
 	if (newp == NULL)
 	    return -1;
 	xop->xo_map = newp;
-	xop->xo_map_size += XO_MAP_INCR;
+	xop->xo_map_size = size;
     }
 
-    char *new_from = xo_buf_append_val(&xop->xo_map_data, from, flen);
-    if (new_from == NULL)
+    xo_off_t from_off = xo_buf_offset(&xop->xo_map_data);
+    if (xo_buf_append_val(&xop->xo_map_data, from, flen) == NULL
+	    || !xo_buf_append_val(&xop->xo_map_data, "", 1))
 	return -1;
 
-    /* NUL terminate the new string */
-    if (!xo_buf_append_val(&xop->xo_map_data, "", 1))
-	return -1;
+    val = xop->xo_map_len;	/* Use next slot */
 
-    char *new_to = xo_buf_append_val(&xop->xo_map_data, to, tlen);
-    if (new_to == NULL)
-	return -1;
+    xo_map_entry_t *xmep = &xop->xo_map[val];
+    xmep->xme_hash = xo_hash_buf(XO_HASH_INIT, from, flen);
+    xmep->xme_from = from_off;
+    xmep->xme_to = to_off;
+    xmep->xme_tlen = tlen;
 
-    /* NUL terminate the new string */
-    if (!xo_buf_append_val(&xop->xo_map_data, "", 1))
-	return -1;
+    xop->xo_map_len += 1;	/* Consume the slot */
 
-    val = xop->xo_map_len;	/* Use next slot */
+    /* Keep the load factor at or below one */
+    if ((unsigned) xop->xo_map_len > xop->xo_map_nbuckets) {
+	unsigned nbuckets = xop->xo_map_nbuckets
+	    ? xop->xo_map_nbuckets * 2 : XO_MAP_BUCKETS;
+	if (xo_map_rehash(xop, nbuckets) == 0)
+	    return 0;
 
-    xop->xo_map[val] = new_from;
-    xop->xo_map[val + 1] = new_to;
+	xop->xo_map_len -= 1;	/* Give back the slot */
+	return -1;
+    }
 
-    xop->xo_map_len += 2;	/* Consume the slot */
+    unsigned b = xmep->xme_hash & (xop->xo_map_nbuckets - 1);
+    xmep->xme_next = xop->xo_map_bucket[b];
+    xop->xo_map_bucket[b] = val;
 #endif /* LIBXO_NEED_MAP */
 
     return 0;
@@ -4962,6 +6129,8 @@ xo_map_add_file (xo_handle_t *xop UNUSED, const char *fname UNUSED)
     int first = TRUE;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
 
     FILE *fp = fopen(fname, "r");
     if (fp == NULL) {
@@ -5034,6 +6203,8 @@ xo_set_filter_data (xo_handle_t *xop UNUSED, struct xo_filter_s *xfp UNUSED)
 {
 #ifdef LIBXO_NEED_FILTERS
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
     xop->xo_filters = xfp;
 #endif /* LIBXO_NEED_FILTERS */
 }
@@ -5043,6 +6214,8 @@ xo_get_filter_data (xo_handle_t *xop UNUSED, int create UNUSED)
 {
 #ifdef LIBXO_NEED_FILTERS
     xop = xo_default(xop);
+    if (xop == NULL)
+	return NULL;
     if (xop->xo_filters == NULL && create)
 	xop->xo_filters = xo_filter_create(xop);
 
@@ -5082,6 +6255,8 @@ xo_add_filter (xo_handle_t *xop UNUSED, const char *input UNUSED)
 
 #ifdef LIBXO_NEED_FILTERS
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
 
     rc = xo_load_filter_lib(xop); /* Reports its own error */
     if (rc)
@@ -5108,6 +6283,108 @@ xo_add_filter (xo_handle_t *xop UNUSED, const char *input UNUSED)
     return rc;
 }
 
+/*
+ * Add the filters (xpaths) in a file, one per line.  This is the way
+ * to load a large set of expressions: the file is read a line at a
+ * time, repeated lines are dropped, and the filter is compiled once,
+ * rather than once per expression as with xo_add_filter.  Lines that
+ * don't parse are reported and skipped; the rest are still used.
+ */
+int
+xo_add_filter_file (xo_handle_t *xop UNUSED, const char *path UNUSED)
+{
+    int rc = -1;
+
+#ifdef LIBXO_NEED_FILTERS
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
+
+    rc = xo_load_filter_lib(xop); /* Reports its own error */
+    if (rc)
+	return rc;
+
+    XOF_SET(xop, XOF_FILTER);
+    XOIF_SET(xop, XOIF_FILTERING);
+
+    rc = xo_filter_add_file(xop, path);
+    if (rc)
+	xo_warnx("could not add all the filters in '%s'", path);
+
+#else /* LIBXO_NEED_FILTERS */
+    xo_warnx("libxo filtering is not enabled");
+#endif /* LIBXO_NEED_FILTERS */
+
+    return rc;
+}
+
+/*
+ * Filter using a compiled image, made by xo_save_filter_image.  The
+ * image file is mapped and used in place, rather than parsing and
+ * compiling the expressions again.  It must come before any other
+ * filter, though more can be added after it.
+ */
+int
+xo_add_filter_image (xo_handle_t *xop UNUSED, const char *path UNUSED)
+{
+    int rc = -1;
+
+#ifdef LIBXO_NEED_FILTERS
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
+
+    rc = xo_load_filter_lib(xop); /* Reports its own error */
+    if (rc)
+	return rc;
+
+    rc = xo_filter_image_load(xop, path);
+    if (rc) {
+	xo_warnx("could not load filter image '%s'", path);
+	return rc;
+    }
+
+    /* As with xo_add_filter, we're filtering from here on */
+    XOF_SET(xop, XOF_FILTER);
+    XOIF_SET(xop, XOIF_FILTERING);
+
+#else /* LIBXO_NEED_FILTERS */
+    xo_warnx("libxo filtering is not enabled");
+#endif /* LIBXO_NEED_FILTERS */
+
+    return rc;
+}
+
+/*
+ * Save the handle's compiled filter as an image, for use by
+ * xo_add_filter_image or the "filter-image" option
+ */
+int
+xo_save_filter_image (xo_handle_t *xop UNUSED, const char *path UNUSED)
+{
+    int rc = -1;
+
+#ifdef LIBXO_NEED_FILTERS
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
+
+    if (xo_filters(xop) == NULL) {
+	xo_warnx("no filter to save in '%s'", path);
+	return rc;
+    }
+
+    rc = xo_filter_image_save(xop, path);
+    if (rc)
+	xo_warnx("could not save filter image '%s'", path);
+
+#else /* LIBXO_NEED_FILTERS */
+    xo_warnx("libxo filtering is not enabled");
+#endif /* LIBXO_NEED_FILTERS */
+
+    return rc;
+}
+
 /*
  * Return TRUE when the current output position is permanently
  * filtered out.  An active filter has determined that no content
@@ -5126,23 +6403,146 @@ xo_add_filter (xo_handle_t *xop UNUSED, const char *input UNUSED)
  * (including TRACK and PRED, which still need key and predicate
  * fields to resolve matches).
  */
-int
-xo_discarding_output_h (xo_handle_t *xop UNUSED)
+int
+xo_discarding_output_h (xo_handle_t *xop UNUSED)
+{
+#ifdef LIBXO_NEED_FILTERS
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return TRUE;
+    if (!XOIF_ISSET(xop, XOIF_FILTERING))
+	return FALSE;
+    return xo_stack_cur(xop)->xs_fstatus == XO_STATUS_DEAD;
+#else /* LIBXO_NEED_FILTERS */
+    return FALSE;
+#endif /* LIBXO_NEED_FILTERS */
+}
+
+int
+xo_discarding_output (void)
+{
+    return xo_discarding_output_h(NULL);
+}
+
+/*
+ * Report whether the container or instance that was just opened can
+ * make any output, given the filters on the handle.  Where
+ * xo_discarding_output only reports a frame the filter has already
+ * marked dead, this also looks ahead: if no filter path can match
+ * anything below this point, the subtree isn't wanted and the caller
+ * can skip making it, closing it straight away:
+ *
+ *     xo_open_instance("route");
+ *     xo_emit("{k:prefix}", rt->rt_prefix);
+ *     if (xo_subtree_wanted()) {
+ *         ... expensive work and more xo_emit calls ...
+ *     }
+ *     xo_close_instance("route");
+ *
+ * Predicates on keys can't be decided until the keys are emitted, so
+ * ask after emitting them.  Returns TRUE when not filtering.
+ */
+int
+xo_subtree_wanted_h (xo_handle_t *xop UNUSED)
+{
+#ifdef LIBXO_NEED_FILTERS
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return FALSE;
+    if (!XOF_ISSET(xop, XOF_FILTER))
+	return TRUE;
+
+    if (xo_discarding_output_h(xop))
+	return FALSE;
+
+    return !xo_filter_subtree_dead(xop, xo_filters(xop));
+#else /* LIBXO_NEED_FILTERS */
+    return TRUE;
+#endif /* LIBXO_NEED_FILTERS */
+}
+
+int
+xo_subtree_wanted (void)
+{
+    return xo_subtree_wanted_h(NULL);
+}
+
+/*
+ * Report whether any later instance of the list that's currently open
+ * (between instances) can make output, given the filters on the
+ * handle.  Position predicates such as "route[1]" or
+ * "route[position() <= 10]" can only match so many instances; once
+ * they've been used up, the filter skips any further instances cheaply
+ * and the caller can stop making them:
+ *
+ *     xo_open_list("route");
+ *     for (rt = routes; rt && xo_list_wanted(); rt = rt->rt_next) {
+ *         xo_open_instance("route");
+ *         ...
+ *         xo_close_instance("route");
+ *     }
+ *     xo_close_list("route");
+ *
+ * Returns TRUE when not filtering or when the top of the stack isn't
+ * an open list.
+ */
+int
+xo_list_wanted_h (xo_handle_t *xop UNUSED)
+{
+#ifdef LIBXO_NEED_FILTERS
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return FALSE;
+    if (!XOF_ISSET(xop, XOF_FILTER))
+	return TRUE;
+
+    xo_stack_t *xsp = xo_stack_cur(xop);
+    if (xsp->xs_state != XSS_OPEN_LIST || xsp->xs_name == NULL)
+	return TRUE;
+
+    if (xo_discarding_output_h(xop))
+	return FALSE;
+
+    return !xo_filter_list_dead(xop, xo_filters(xop), xsp->xs_name);
+#else /* LIBXO_NEED_FILTERS */
+    return TRUE;
+#endif /* LIBXO_NEED_FILTERS */
+}
+
+int
+xo_list_wanted (void)
+{
+    return xo_list_wanted_h(NULL);
+}
+
+/*
+ * Set the size past which pending filtered output is moved to an
+ * unlinked temporary file; zero (the default) means never
+ */
+void
+xo_set_filter_spill (xo_handle_t *xop UNUSED, xo_ssize_t limit UNUSED)
 {
 #ifdef LIBXO_NEED_FILTERS
     xop = xo_default(xop);
-    if (!XOIF_ISSET(xop, XOIF_FILTERING))
-	return FALSE;
-    return xo_stack_cur(xop)->xs_fstatus == XO_STATUS_DEAD;
-#else /* LIBXO_NEED_FILTERS */
-    return FALSE;
+    if (xop == NULL)
+	return;
+
+    xop->xo_spill_limit = (limit > 0) ? limit : 0;
 #endif /* LIBXO_NEED_FILTERS */
 }
 
-int
-xo_discarding_output (void)
+void
+xo_get_spill_stats (xo_handle_t *xop UNUSED, xo_spill_stats_t *statsp)
 {
-    return xo_discarding_output_h(NULL);
+    memset(statsp, 0, sizeof(*statsp));
+
+#ifdef LIBXO_NEED_FILTERS
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return;
+
+    *statsp = xop->xo_spill_stats;
+#endif /* LIBXO_NEED_FILTERS */
 }
 
 #if defined(LIBXO_NEED_FILTERS) && defined(LIBXO_DEBUG)
@@ -5198,6 +6598,8 @@ void
 xo_filt_dump (xo_handle_t *xop, const char *tag)
 {
     xop = xo_default(xop);	/* NULL if called from lldb */
+    if (xop == NULL)
+	return;
 
     if (!XO_HAS_DEBUG(xop))
 	return;
@@ -5215,18 +6617,151 @@ xo_filt_dump (xo_handle_t *xop, const char *tag)
 	       xsp->xs_flags,
 	       (int) xsp->xs_rb_off, (int) xsp->xs_key_off, xsp->xs_keys);
 
-	if (xsp->xs_rb_off != XS_OFFSET_CLEAR)
-	    xo_filt_dump_context(xop, &xop->xo_data, xsp->xs_rb_off, 0);
+	if (xsp->xs_rb_off != XS_OFFSET_CLEAR
+		&& xsp->xs_rb_off >= xop->xo_spill_off)
+	    xo_filt_dump_context(xop, &xop->xo_data,
+				 xsp->xs_rb_off - xop->xo_spill_off, 0);
     }
 }
 #endif /* LIBXO_NEED_FILTERS && LIBXO_DEBUG */
 
 #ifdef LIBXO_NEED_FILTERS
+/*
+ * Drop the bytes of xo_data from start to end when it's written (see
+ * xo_cut_t).  Cuts are made in order, so one that touches the last
+ * cut just extends it.
+ */
+static void
+xo_filt_cut (xo_handle_t *xop, xo_off_t start, xo_off_t end)
+{
+    xo_cut_t *xcp = NULL;
+
+    if (xop->xo_cuts_count > 0) {
+	xcp = &xop->xo_cuts[xop->xo_cuts_count - 1];
+	if (start < xcp->xc_end)
+	    start = xcp->xc_end;
+    }
+
+    if (end <= start)
+	return;
+
+    xop->xo_filt_dropped += end - start;
+
+    if (xcp && xcp->xc_end == start) {
+	xcp->xc_end = end;
+
+    } else {
+	if (xop->xo_cuts_count >= xop->xo_cuts_size) {
+	    int size = xop->xo_cuts_size ? xop->xo_cuts_size * 2 : 16;
+
+	    xcp = xo_realloc(xop->xo_cuts, size * sizeof(*xcp));
+	    if (xcp == NULL) {
+		xo_failure(xop, "could not record filtered output");
+		return;
+	    }
+
+	    xop->xo_cuts = xcp;
+	    xop->xo_cuts_size = size;
+	}
+
+	xcp = &xop->xo_cuts[xop->xo_cuts_count++];
+	xcp->xc_start = start;
+	xcp->xc_end = end;
+    }
+
+    xop->xo_cuts_bytes += end - start;
+}
+
+/*
+ * The data buffer is being rolled back to 'off', so forget any cuts
+ * at or beyond it
+ */
+static void
+xo_filt_cut_trim (xo_handle_t *xop, xo_off_t off)
+{
+    while (xop->xo_cuts_count > 0) {
+	xo_cut_t *xcp = &xop->xo_cuts[xop->xo_cuts_count - 1];
+
+	if (xcp->xc_end <= off)
+	    break;
+
+	if (xcp->xc_start < off) {
+	    xop->xo_cuts_bytes -= xcp->xc_end - off;
+	    xcp->xc_end = off;
+	    break;
+	}
+
+	xop->xo_cuts_bytes -= xcp->xc_end - xcp->xc_start;
+	xop->xo_cuts_count -= 1;
+    }
+}
+
+/*
+ * Move the contents of xo_data to the end of the spill file.  If we
+ * can't, we give up spilling and let xo_data grow.
+ */
+static void
+xo_filt_spill (xo_handle_t *xop)
+{
+    xo_buffer_t *xbp = &xop->xo_data;
+    xo_off_t len = xo_buf_offset(xbp);
+    int fd;
+
+    if (xop->xo_spill_fp == NULL) {
+	xop->xo_spill_fp = tmpfile();
+	if (xop->xo_spill_fp == NULL) {
+	    xo_failure(xop, "could not make spill file: %s", strerror(errno));
+	    xop->xo_spill_limit = 0;
+	    return;
+	}
+    }
+
+    fd = fileno(xop->xo_spill_fp);
+    if (lseek(fd, xop->xo_spill_off, SEEK_SET) < 0
+	    || xo_write_fd(fd, xbp->xb_bufp, len) != len) {
+	xo_failure(xop, "could not spill output: %s", strerror(errno));
+	xop->xo_spill_limit = 0;
+	return;
+    }
+
+    xop->xo_spill_off += len;
+    xo_buf_reset(xbp);
+
+    xo_spill_stats_t *xssp = &xop->xo_spill_stats;
+    xssp->xss_spills += 1;
+    xssp->xss_bytes += len;
+    if (xssp->xss_peak < (unsigned long long) xop->xo_spill_off)
+	xssp->xss_peak = xop->xo_spill_off;
+}
+
+/*
+ * Discard the output after 'off', which may lie in the spill file
+ */
+static void
+xo_filt_truncate (xo_handle_t *xop, xo_off_t off)
+{
+    xo_off_t spilled = xop->xo_spill_off;
+
+    xo_filt_note_pending(xop);
+    if (xo_filt_offset(xop) > off)
+	xop->xo_filt_dropped += xo_filt_offset(xop) - off;
+
+    if (off >= spilled) {
+	xo_buf_set_offset(&xop->xo_data, off - spilled);
+	return;
+    }
+
+    /* The file is overwritten from here, so we needn't truncate it */
+    xo_buf_reset(&xop->xo_data);
+    xop->xo_spill_stats.xss_dropped += spilled - off;
+    xop->xo_spill_off = off;
+}
+
 /*
  * Result block filled in by xo_filt_compact_range().
  */
 typedef struct xo_compact_result_s {
-    xo_off_t xcr_write_off;	/* next write offset, or XS_OFFSET_CLEAR */
+    xo_off_t xcr_write_off;	/* end of the kept data, or XS_OFFSET_CLEAR */
     int xcr_last_clear;		/* last visited frame had xs_rb_off CLEAR */
     int xcr_prev_had_key;	/* last kept frame ended with a key field */
 } xo_compact_result_t;
@@ -5234,24 +6769,24 @@ typedef struct xo_compact_result_s {
 /*
  * Walk ancestor frames [first, end) — 'end' is exclusive — compacting
  * each one down to its opening tag plus any key fields.  Non-key
- * sibling content accumulated while the frame was TRACK is discarded
- * via memmove.  The JSON leading-comma invariant is handled here: if
+ * sibling content accumulated while the frame was TRACK is cut (see
+ * xo_filt_cut), so nothing is moved.  The JSON leading-comma invariant
+ * is handled here: if
  * a frame's tag begins with a 2-byte separator (",\n" or ", ") and
  * every prior child in that gap was also discarded (prev_keep_end <
  * tag_start and parent kept no key), the separator is stripped so the
  * compacted tag doesn't start with a stray comma.
  *
- * On return, rp is filled with the next write offset (xcr_write_off),
+ * On return, rp is filled with the end of the kept data (xcr_write_off),
  * whether the last frame visited was already committed
  * (xcr_last_clear), and whether the last kept frame ended with a key
- * (xcr_prev_had_key).  Callers use these to relocate any trailing
- * content and strip a leading comma from it when needed.
+ * (xcr_prev_had_key).  Callers use these to join any trailing content
+ * and strip a leading comma from it when needed.
  */
 static void
 xo_filt_compact_range (xo_handle_t *xop, xo_stack_t *first, xo_stack_t *end,
 		       xo_filter_status_t fstatus, xo_compact_result_t *rp)
 {
-    xo_buffer_t *xbp = &xop->xo_data;
     xo_off_t prev_keep_end = XS_OFFSET_CLEAR;
 
     rp->xcr_write_off = XS_OFFSET_CLEAR;
@@ -5297,38 +6832,48 @@ xo_filt_compact_range (xo_handle_t *xop, xo_stack_t *first, xo_stack_t *end,
 	prev_keep_end = keep_end;
 	rp->xcr_prev_had_key = (key_off != XS_OFFSET_CLEAR);
 
-	if (rp->xcr_write_off == XS_OFFSET_CLEAR)
-	    rp->xcr_write_off = actual_tag_start;
-	if (keep_len > 0) {
-	    if (actual_tag_start != rp->xcr_write_off)
-		memmove(xbp->xb_bufp + rp->xcr_write_off,
-			xbp->xb_bufp + actual_tag_start, keep_len);
-	    rp->xcr_write_off += keep_len;
-	}
+	if (rp->xcr_write_off != XS_OFFSET_CLEAR)
+	    xo_filt_cut(xop, rp->xcr_write_off, actual_tag_start);
+	rp->xcr_write_off = actual_tag_start + keep_len;
+
 	xsp->xs_rb_off = XS_OFFSET_CLEAR;
 	xsp->xs_tag_end = XS_OFFSET_CLEAR;
     }
 }
 
 /*
- * Move 'len' bytes from 'start' in the output buffer to follow 'write_off',
- * returning the updated write position.  When write_off is CLEAR, the bytes
- * are already in place and only the end offset is returned.
+ * Join the content at 'start' (which runs to the end of the output
+ * buffer) to the kept data ending at 'write_off', cutting whatever
+ * lies between.  When write_off is CLEAR, nothing was kept ahead of
+ * it, so there's nothing to cut.
  */
-static xo_off_t
-xo_filt_relocate (xo_buffer_t *xbp, xo_off_t write_off,
-		  xo_off_t start, ssize_t len)
+static void
+xo_filt_join (xo_handle_t *xop, xo_off_t write_off, xo_off_t start)
 {
-    if (len <= 0)
-	return write_off;
-    if (write_off == XS_OFFSET_CLEAR)
-	write_off = start;
-    if (start != write_off)
-	memmove(xbp->xb_bufp + write_off, xbp->xb_bufp + start, len);
-    return write_off + len;
+    if (write_off != XS_OFFSET_CLEAR)
+	xo_filt_cut(xop, write_off, start);
 }
 #endif /* LIBXO_NEED_FILTERS */
 
+/*
+ * Pending output that has grown past the spill limit goes to the
+ * spill file.  This is called where we'd flush, if filtering weren't
+ * holding the output; anchors and encoders can't spill.
+ */
+static inline void
+xo_filt_check_spill (xo_handle_t *xop UNUSED)
+{
+#ifdef LIBXO_NEED_FILTERS
+    if (xop->xo_spill_limit > 0
+	    && xo_buf_offset(&xop->xo_data) > xop->xo_spill_limit
+	    && XOIF_ISSET(xop, XOIF_FILTERING)
+	    && !XOIF_ISSET(xop, XOIF_ANCHOR)
+	    && (xo_style(xop) == XO_STYLE_XML
+		|| xo_style(xop) == XO_STYLE_JSON))
+	xo_filt_spill(xop);
+#endif /* LIBXO_NEED_FILTERS */
+}
+
 /*
  * We want our parent objects (on the stack) to be emitted, so that
  * the filtered object has appropriate context.  We'll set their
@@ -5355,21 +6900,18 @@ xo_filt_commit (xo_handle_t *xop UNUSED, xo_stack_t *cur UNUSED,
      * If the current frame still holds tentative content (xs_rb_off set),
      * ancestor TRACK frames will have buffered non-tag content (e.g. sibling
      * fields before the matching path) that must be discarded.  Compact the
-     * ancestors like xo_filt_commit_compact does, then move the current
+     * ancestors like xo_filt_commit_compact does, then join the current
      * frame's entire buffered range (opening tag plus any fields written so
-     * far) to follow the compacted ancestors.  This handles the case where a
+     * far) to the compacted ancestors.  This handles the case where a
      * predicate field or key field resolves a PRED instance to FULL while
      * ancestor TRACK containers have accumulated junk in the buffer.
      */
     if (cur && cur->xs_rb_off != XS_OFFSET_CLEAR) {
-	xo_buffer_t *xbp = &xop->xo_data;
 	xo_off_t item_start = cur->xs_rb_off;
-	xo_off_t item_end = xo_buf_offset(xbp);
-	ssize_t item_len = (item_end > item_start) ? (item_end - item_start) : 0;
 
 	xop->xo_stack[0].xs_fstatus = fstatus;
 
-	/* Compact ancestors [1, cur); cur itself is relocated wholesale below */
+	/* Compact ancestors [1, cur); cur itself is joined wholesale below */
 	xo_compact_result_t r;
 	xo_filt_compact_range(xop, xop->xo_stack + 1, cur, fstatus, &r);
 
@@ -5379,10 +6921,7 @@ xo_filt_commit (xo_handle_t *xop UNUSED, xo_stack_t *cur UNUSED,
 	cur->xs_tag_end = XS_OFFSET_CLEAR;
 	cur->xs_key_off = XS_OFFSET_CLEAR;
 
-	xo_off_t write_off =
-	    xo_filt_relocate(xbp, r.xcr_write_off, item_start, item_len);
-	if (write_off != XS_OFFSET_CLEAR)
-	    xo_buf_set_offset(xbp, write_off);
+	xo_filt_join(xop, r.xcr_write_off, item_start);
 
 	xo_filt_dump(xop, "commit after");
 	XOIF_CLEAR(xop, XOIF_FILTERING);
@@ -5413,7 +6952,7 @@ xo_filt_commit (xo_handle_t *xop UNUSED, xo_stack_t *cur UNUSED,
  * is a single leaf, not a pushed frame, so the enclosing container (cur) is
  * itself an ancestor whose buffered sibling fields must be discarded.  We
  * compact every open frame (including cur) down to its opening tag plus any
- * keys, then move the matched leaf [field_start..end] to follow.  Ancestor
+ * keys, then join the matched leaf [field_start..end] to them.  Ancestor
  * tags become permanent (context), while trailing non-matching siblings are
  * left to the normal per-field skip/rollback path.
  */
@@ -5433,9 +6972,12 @@ xo_filt_commit_field (xo_handle_t *xop UNUSED, xo_off_t field_start UNUSED,
 	   (int) field_start);
     xo_filt_dump(xop, "commit-field before");
 
-    xo_off_t item_start = field_start;
-    xo_off_t item_end = xo_buf_offset(xbp);
-    ssize_t item_len = (item_end > item_start) ? (item_end - item_start) : 0;
+    /* The field was just made, so it's still in xo_data */
+    xo_ssize_t leading_comma = 0;
+    if (xo_buf_offset(xbp) - field_start >= 2
+	    && xbp->xb_bufp[field_start] == ',')
+	leading_comma = (xbp->xb_bufp[field_start + 1] == '\n') ? 2 : 1;
+    xo_off_t item_start = field_start + xo_filt_spilled(xop);
 
     xop->xo_stack[0].xs_fstatus = fstatus;
 
@@ -5444,23 +6986,19 @@ xo_filt_commit_field (xo_handle_t *xop UNUSED, xo_off_t field_start UNUSED,
     xo_filt_compact_range(xop, xop->xo_stack + 1, cur + 1, fstatus, &r);
 
     /*
-     * In JSON the matched leaf carries a leading 2-byte separator (", " or
-     * ",\n") since siblings preceded it.  Now that those siblings are gone and
-     * the leaf becomes the first member after the parent's freshly-kept '{',
-     * strip that separator.  Only do this when the parent was compacted here
-     * (not already committed) and kept no key ahead of the leaf.
+     * In JSON the matched leaf carries a leading separator ("," or, when
+     * pretty, ",\n"; leading_comma is its length) since siblings preceded
+     * it.  Now that those siblings are gone and the leaf becomes the first
+     * member after the parent's freshly-kept '{', strip that separator.
+     * Only do this when the parent was compacted here (not already
+     * committed) and kept no key ahead of the leaf.
      */
     if (xo_style(xop) == XO_STYLE_JSON && !r.xcr_last_clear && !r.xcr_prev_had_key
-	    && item_len >= 2 && xbp->xb_bufp[item_start] == ',') {
-	item_start += 2;
-	item_len -= 2;
-    }
+	    && leading_comma)
+	item_start += leading_comma;
 
-    /* Move the matched leaf to follow the compacted ancestor tags */
-    xo_off_t write_off =
-	xo_filt_relocate(xbp, r.xcr_write_off, item_start, item_len);
-    if (write_off != XS_OFFSET_CLEAR)
-	xo_buf_set_offset(xbp, write_off);
+    /* Join the matched leaf to the compacted ancestor tags */
+    xo_filt_join(xop, r.xcr_write_off, item_start);
 
     xo_filt_dump(xop, "commit-field after");
     XOIF_CLEAR(xop, XOIF_FILTERING);
@@ -5515,7 +7053,7 @@ xo_filt_commit_compact (xo_handle_t *xop UNUSED, xo_stack_t *cur UNUSED,
     xo_filt_compact_range(xop, xop->xo_stack + 1, cur + 1, fstatus, &r);
 
     if (r.xcr_write_off != XS_OFFSET_CLEAR)
-	xo_buf_set_offset(&xop->xo_data, r.xcr_write_off);
+	xo_filt_truncate(xop, r.xcr_write_off);
 
     /*
      * Reset NOT_FIRST/CONTENT on cur so the first real child (the
@@ -5569,19 +7107,23 @@ xo_filt_rollback (xo_handle_t *xop UNUSED, xo_stack_t *cur UNUSED,
      * doing some sanity checking.
      */
     if (fstatus != XO_STATUS_FULL && cur->xs_rb_off != XS_OFFSET_CLEAR) {
-	xo_buffer_t *xbp = &xop->xo_data;
-	xo_off_t max_off = xo_buf_offset(xbp);
+	xo_off_t max_off = xo_filt_offset(xop);
 	xo_off_t cur_off = cur->xs_rb_off;
 
 	if (cur_off < max_off) { /* Sanity check */
 	    XO_DBG(xop, "xo_filt_rollback: rolling back to %u, depth %d",
 		   cur_off, xop->xo_depth);
-	    xo_buf_set_offset(xbp, cur_off);
+	    xo_filt_truncate(xop, cur_off);
+	    xo_filt_cut_trim(xop, cur_off);
 
-	    if (cur_off == 0) {
-		/* Going to zero means undo the "make output" flag */
-		XOIF_CLEAR(xop, XOIF_MADE_OUTPUT);
-		
+	    /*
+	     * Going back to the start of the buffer (with everything
+	     * before us cut) is only the start of the output if none
+	     * has been written yet; after a flush, it's just where the
+	     * next write begins.
+	     */
+	    if (cur_off == xop->xo_cuts_bytes
+		    && !XOIF_ISSET(xop, XOIF_MADE_OUTPUT)) {
 		if (xo_style(xop) == XO_STYLE_JSON) {
 		    /*
 		     * If rolling back to the very start of the buffer,
@@ -5640,11 +7182,13 @@ xo_filt_want_output (xo_handle_t *xop UNUSED, xo_filter_status_t fstatus UNUSED)
  * avoid this are:
  * - we have an anchor in place and will need to shift the contents
  * - we are filtering and may need to discard some of the buffered data
+ * - we are in the middle of an NDJSON record
  */
 static inline int
 xo_avoid_flushing (xo_handle_t *xop)
 {
-    return XOIF_ISSET(xop, XOIF_ANCHOR | XOIF_FILTERING);
+    return XOIF_ISSET(xop, XOIF_ANCHOR | XOIF_FILTERING)
+	|| (xo_is_ndjson(xop) && !xo_ndjson_at_base(xop));
 }
 
 /*
@@ -5716,6 +7260,28 @@ xo_filt_skip (xo_handle_t *xop, xo_xff_flags_t flags,
     return rc;
 }
 
+/*
+ * Decide, before a field is rendered, if its lazy values can go
+ * uncomputed.  This is stricter than xo_filt_is_skippable: a field
+ * seen while only tracking may be buffered tentatively, but only
+ * keys and predicate fields survive a commit (xo_filt_commit_compact),
+ * so other fields never need their values.
+ */
+static int
+xo_filt_lazy_skip (xo_handle_t *xop, xo_xff_flags_t flags,
+		   const char *name, xo_ssize_t nlen)
+{
+    xo_filter_status_t fstatus = xo_filter_get_status(xop, xo_filters(xop));
+
+    if (fstatus == XO_STATUS_DEAD)
+	return TRUE;
+
+    if (fstatus != XO_STATUS_TRACK || (flags & XFF_KEY) || name == NULL)
+	return FALSE;
+
+    return !xo_filter_needs_nonkey_field(xop, xo_filters(xop), name, nlen);
+}
+
 static xo_filter_status_t 
 xo_filt_do_open_field (xo_handle_t *xop, const char *name, xo_ssize_t nlen,
 		       const char *value, xo_ssize_t vlen, xo_off_t field_start,
@@ -5791,6 +7357,27 @@ xo_filt_do_close_field (xo_handle_t *xop, const char *name, xo_ssize_t nlen,
     return fstatus;
 }
 
+/*
+ * Emit the filter's aggregate results (e.g. "sum(top/item/count)")
+ * for the container being closed, as its last fields.  Only the
+ * styles that make data have a place to put them.
+ */
+static void
+xo_filt_aggregates (xo_handle_t *xop)
+{
+    if (xo_style(xop) != XO_STYLE_XML && xo_style(xop) != XO_STYLE_JSON
+	    && xo_style(xop) != XO_STYLE_ENCODER)
+	return;
+
+    const char *cp = xo_filter_aggregates(xop, xo_filters(xop));
+    const char *value;
+
+    for ( ; cp && *cp; cp = value + strlen(value) + 1) {
+	value = cp + strlen(cp) + 1;
+	xo_emit_field_h(xop, "n", cp, "%s", NULL, value);
+    }
+}
+
 static void
 xo_format_value_encoder (xo_handle_t *xop, const char *name, ssize_t nlen,
 		 const char *value, ssize_t vlen,
@@ -5832,6 +7419,13 @@ xo_format_value_encoder (xo_handle_t *xop, const char *name, ssize_t nlen,
 	xo_failure(xop, "missing field name: %s", fmt);
 	name = missing;
 	nlen = sizeof(missing) - 1;
+
+    } else if (name[nlen] != '\0') {
+	/* Encoders are handed a C string, so terminate our copy */
+	char *nbuf = alloca(nlen + 1);
+	memcpy(nbuf, name, nlen);
+	nbuf[nlen] = '\0';
+	name = nbuf;
     }
 
     xo_data_append(xop, name, nlen);
@@ -5863,6 +7457,7 @@ xo_format_value_encoder (xo_handle_t *xop, const char *name, ssize_t nlen,
 
     /* Reset our buffer, since we've sent the data to the encoder */
     xo_buf_reset(&xop->xo_data);
+    xo_filt_cuts_reset(xop);
 }
 
 static void
@@ -6108,26 +7703,229 @@ xo_format_value_xml (xo_handle_t *xop, const char *name, ssize_t nlen,
 	 */
 	xo_buf_set_offset(&xop->xo_data, start_offset);
 
-    } else {
-	/* We can't skip it, so we go ahead and make the closing tag */
-	xo_data_append(xop, "</", 2);
-	if (*leader)
-	    xo_data_append(xop, leader, 1);
-	xo_data_escape(xop, name, nlen);
-	xo_data_append(xop, ">", 1);
+    } else {
+	/* We can't skip it, so we go ahead and make the closing tag */
+	xo_data_append(xop, "</", 2);
+	if (*leader)
+	    xo_data_append(xop, leader, 1);
+	xo_data_escape(xop, name, nlen);
+	xo_data_append(xop, ">", 1);
+
+	if (pretty)
+	    xo_data_append(xop, "\n", 1);
+
+	/* Record the "end of key" offset */
+	if (flags & XFF_KEY) {
+	    xo_stack_t *xsp = xo_stack_cur(xop);
+	    xsp->xs_key_off = xo_filt_offset(xop);
+	}
+    }
+
+    if (XOF_ISSET(xop, XOF_FILTER))
+	xo_filt_do_close_field(xop, name, nlen, TRUE, flags);
+}
+
+/*
+ * Field projection: the "fields" option names the value fields to
+ * keep (e.g. "fields=name:state:mtu").  Other value fields are
+ * skipped before they are formatted, with their arguments popped
+ * from xo_vap.  Only the styles that make data project; for TEXT and
+ * HTML, fields are laid out with labels and decorations, so they are
+ * all kept.  Keys are always kept, so instances can still be told
+ * apart.  Names are those used in the format string, before mapping.
+ */
+static unsigned long xo_fields_generation; /* Source of xo_fields_gen */
+
+/*
+ * Add names to the fields list, separated by colons or plus signs
+ * (commas separate options)
+ */
+static int
+xo_fields_add (xo_handle_t *xop, const char *names)
+{
+    const char *cp, *ep;
+    size_t len;
+
+    for (cp = names; *cp; cp = ep) {
+	len = strcspn(cp, ":+");
+	ep = cp + len;
+	if (*ep)
+	    ep += 1;		/* Skip separator */
+
+	if (len == 0)
+	    continue;
+
+	if (xo_buf_append_val(&xop->xo_fields_data, cp, len) == NULL
+		|| !xo_buf_append_val(&xop->xo_fields_data, "", 1))
+	    return -1;
+
+	xop->xo_fields_count += 1;
+    }
+
+    xop->xo_fields_gen = ++xo_fields_generation;
+
+    return 0;
+}
+
+/*
+ * Copy the fields list to a new handle (a fragment)
+ */
+static void
+xo_fields_copy (xo_handle_t *dst, xo_handle_t *src)
+{
+    if (src->xo_fields_count == 0)
+	return;
+
+    if (xo_buf_append_val(&dst->xo_fields_data, src->xo_fields_data.xb_bufp,
+			  xo_buf_offset(&src->xo_fields_data)) == NULL)
+	return;
+
+    dst->xo_fields_count = src->xo_fields_count;
+    dst->xo_fields_gen = ++xo_fields_generation;
+}
+
+/*
+ * Is this name in the fields list?
+ */
+static int
+xo_fields_find (xo_handle_t *xop, const char *name, ssize_t nlen)
+{
+    const char *cp = xop->xo_fields_data.xb_bufp;
+    unsigned i;
+    size_t len;
+
+    for (i = 0; i < xop->xo_fields_count; i++, cp += len + 1) {
+	len = strlen(cp);
+	if ((ssize_t) len == nlen && memcmp(cp, name, nlen) == 0)
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Should this value field be skipped by the fields list?  For retained
+ * formats, the answer is remembered in the field's retained info, so
+ * it's only looked up once per format (and handle and list).
+ */
+static int
+xo_fields_skip (xo_handle_t *xop, const char *name, ssize_t nlen,
+		xo_xff_flags_t flags)
+{
+    if (xop->xo_fields_count == 0 || (flags & XFF_KEY) || nlen <= 0)
+	return FALSE;
+
+    if (xo_style(xop) != XO_STYLE_XML && xo_style(xop) != XO_STYLE_JSON
+	    && xo_style(xop) != XO_STYLE_ENCODER)
+	return FALSE;
+
+    /* A field a filter predicate is waiting on must still be made */
+    if (XOF_ISSET(xop, XOF_FILTER)
+	    && xo_filter_needs_nonkey_field(xop, xo_filters(xop), name, nlen))
+	return FALSE;
+
+    xo_retain_field_t *xrfp = xop->xo_rfield;
+    if (xrfp && xrfp->xrf_fields_handle == xop
+	    && xrfp->xrf_fields_gen == xop->xo_fields_gen)
+	return xrfp->xrf_fields_skip;
+
+    int skip = !xo_fields_find(xop, name, nlen);
+
+    if (xrfp) {
+	xrfp->xrf_fields_handle = xop;
+	xrfp->xrf_fields_gen = xop->xo_fields_gen;
+	xrfp->xrf_fields_skip = skip;
+    }
+
+    return skip;
+}
+
+/*
+ * Pop the arguments for a format from xo_vap, without formatting
+ * anything.  This follows xo_do_format_field, but the callbacks for
+ * lazy values aren't called.
+ */
+static int
+xo_skip_format_args (xo_handle_t *xop, const char *fmt, ssize_t flen)
+{
+    xo_format_t xf;
+    const char *cp, *ep;
+    int s;
+
+    if (fmt == NULL || XOF_ISSET(xop, XOF_NO_VA_ARG))
+	return 0;
+
+    for (cp = fmt, ep = fmt + flen; cp < ep; cp++) {
+	if (*cp != '%') {
+	    if (*cp == '\\' && cp[1] != '\0')
+		cp += 1;
+	    continue;
+
+	} else if (cp + 1 < ep && cp[1] == '%') {
+	    cp += 1;
+	    continue;
+	}
+
+	bzero(&xf, sizeof(xf));
+	xf.xf_skip = 1;
+	xf.xf_leading_zero = -1;
+	xf.xf_width[0] = xf.xf_width[1] = xf.xf_width[2] = -1;
+
+	if (cp[1] == '@') {
+	    for (cp += 2; cp < ep && *cp != '@'; cp++) {
+		if (*cp == 'L')
+		    xf.xf_lazy = 1;
+		else if (*cp == '*')
+		    (void) va_arg(xop->xo_vap, int);
+	    }
+	}
+
+	cp = xo_parse_format_spec(xop, &xf, cp, ep, fmt);
+	if (cp == NULL)
+	    return -1;
+
+	if (xf.xf_fc == 's' || xf.xf_fc == 'S') {
+	    /* xo_advance_vap leaves "%*.*s" widths to us */
+	    for (s = 0; s < XF_WIDTH_NUM; s++)
+		if (xf.xf_star[s])
+		    (void) va_arg(xop->xo_vap, int);
+	}
+
+	if (xf.xf_lazy) {
+	    (void) va_arg(xop->xo_vap, xo_lazy_func_t);
+	    (void) va_arg(xop->xo_vap, void *);
+	}
+
+	if (xf.xf_fc == 'D' || xf.xf_fc == 'O' || xf.xf_fc == 'U')
+	    xf.xf_lflag = 1;
+
+	xo_advance_vap(xop, &xf);
+    }
+
+    return 0;
+}
+
+/*
+ * Does this format contain a lazy ("%@L@s") value?
+ */
+static int
+xo_format_has_lazy (const char *fmt, ssize_t flen)
+{
+    const char *cp, *ep;
+
+    if (fmt == NULL)
+	return FALSE;
 
-	if (pretty)
-	    xo_data_append(xop, "\n", 1);
+    for (cp = fmt, ep = fmt + flen; cp + 1 < ep; cp++) {
+	if (cp[0] != '%' || cp[1] != '@')
+	    continue;
 
-	/* Record the "end of key" offset */
-	if (flags & XFF_KEY) {
-	    xo_stack_t *xsp = xo_stack_cur(xop);
-	    xsp->xs_key_off = xo_buf_offset(&xop->xo_data);
-	}
+	for (cp += 2; cp < ep && *cp != '@'; cp++)
+	    if (*cp == 'L')
+		return TRUE;
     }
 
-    if (XOF_ISSET(xop, XOF_FILTER))
-	xo_filt_do_close_field(xop, name, nlen, TRUE, flags);
+    return FALSE;
 }
 
 static void
@@ -6217,19 +8015,26 @@ xo_format_value (xo_handle_t *xop, const char *name, ssize_t nlen,
     if (name) {
 	/*
 	 * We have a name, but need to see if it's been remapped
-	 * to a different name.  To look up the tag name, we need
-	 * to make a local copy and NUL terminate it.
+	 * to a different name.
 	 */
-	char *new_name  = alloca(nlen + 1);
-	memcpy(new_name, name, nlen);
-	new_name[nlen] = '\0';
-
-	name = xo_map_name(xop, new_name);
-	nlen = strlen(name);	/* Need new length for new name */
+	name = xo_map_field_name(xop, name, &nlen);
     }
 
     const char *leader = xo_xml_leader_len(xop, name, nlen);
 
+    /*
+     * If the filter is going to discard this field, there's no need
+     * to call the callbacks for any lazy values.  Only the styles
+     * that filter can use this; the others always render the field.
+     */
+    if (XOF_ISSET(xop, XOF_FILTER)
+	    && (xo_style(xop) == XO_STYLE_XML || xo_style(xop) == XO_STYLE_JSON
+		|| xo_style(xop) == XO_STYLE_ENCODER)
+	    && (xo_format_has_lazy(fmt, flen)
+		|| xo_format_has_lazy(encoding, elen))
+	    && xo_filt_lazy_skip(xop, flags, name, nlen))
+	XOIF_SET(xop, XOIF_LAZY_SKIP);
+
     switch (xo_style(xop)) {
     case XO_STYLE_TEXT:
 	if (flags & XFF_ENCODE_ONLY)
@@ -6301,7 +8106,7 @@ xo_format_value (xo_handle_t *xop, const char *name, ssize_t nlen,
 		    | saved_not_first;
 	    } else if (flags & XFF_KEY) {
 		/* Record end-of-key offset for compact-commit, same as XML path */
-		xsp->xs_key_off = xo_buf_offset(&xop->xo_data);
+		xsp->xs_key_off = xo_filt_offset(xop);
 	    }
 	    xo_filt_do_close_field(xop, name, nlen, TRUE, flags);
 	} else {
@@ -6320,6 +8125,8 @@ xo_format_value (xo_handle_t *xop, const char *name, ssize_t nlen,
 				fmt, flen, encoding, elen, flags);
 	break;
     }
+
+    XOIF_CLEAR(xop, XOIF_LAZY_SKIP);
 }
 
 static void
@@ -6476,9 +8283,18 @@ xo_effect_find (const char *str)
     return -1;
 }
 
+/*
+ * Compile a color/effect string into a delta that can be applied to
+ * the current colors.  The tokens are processed in order, so we
+ * accumulate a set of effect bits to clear, a set to set, and any
+ * new foreground and background colors.
+ */
 static void
-xo_colors_parse (xo_handle_t *xop, xo_colors_t *xocp, char *str)
+xo_colors_compile (xo_handle_t *xop, xo_colors_delta_t *xcdp, char *str)
 {
+    bzero(xcdp, sizeof(*xcdp));
+    xcdp->xcd_col_fg = xcdp->xcd_col_bg = -1; /* Keep current colors */
+
     if (xo_text_only())
 	return;
 
@@ -6508,35 +8324,39 @@ xo_colors_parse (xo_handle_t *xop, xo_colors_t *xocp, char *str)
 	    if (rc < 0)
 		goto unknown;
 
-	    xocp->xoc_col_fg = rc;
+	    xcdp->xcd_col_fg = rc;
 
 	} else if (cp[0] == 'b' && cp[1] == 'g' && cp[2] == '-') {
 	    rc = xo_color_find(cp + 3);
 	    if (rc < 0)
 		goto unknown;
-	    xocp->xoc_col_bg = rc;
+	    xcdp->xcd_col_bg = rc;
 
 	} else if (cp[0] == 'n' && cp[1] == 'o' && cp[2] == '-') {
 	    rc = xo_effect_find(cp + 3);
 	    if (rc < 0)
 		goto unknown;
-	    xocp->xoc_effects &= ~(1 << rc);
+	    xcdp->xcd_effects_clear |= 1 << rc;
+	    xcdp->xcd_effects_set &= ~(1 << rc);
 
 	} else {
 	    rc = xo_effect_find(cp);
 	    if (rc < 0)
 		goto unknown;
-	    xocp->xoc_effects |= 1 << rc;
+	    xcdp->xcd_effects_set |= 1 << rc;
 
 	    switch (1 << rc) {
 	    case XO_EFF_RESET:
-		xocp->xoc_col_fg = xocp->xoc_col_bg = 0;
+		xcdp->xcd_col_fg = xcdp->xcd_col_bg = 0;
 		/* Note: not "|=" since we want to wipe out the old value */
-		xocp->xoc_effects = XO_EFF_RESET;
+		xcdp->xcd_effects_clear = (xo_effect_t) ~0;
+		xcdp->xcd_effects_set = XO_EFF_RESET;
 		break;
 
 	    case XO_EFF_NORMAL:
-		xocp->xoc_effects &= ~(XO_EFF_BOLD | XO_EFF_UNDERLINE
+		xcdp->xcd_effects_clear |= XO_EFF_BOLD | XO_EFF_UNDERLINE
+		    | XO_EFF_INVERSE | XO_EFF_NORMAL;
+		xcdp->xcd_effects_set &= ~(XO_EFF_BOLD | XO_EFF_UNDERLINE
 				      | XO_EFF_INVERSE | XO_EFF_NORMAL);
 		break;
 	    }
@@ -6549,6 +8369,29 @@ xo_colors_parse (xo_handle_t *xop, xo_colors_t *xocp, char *str)
     }
 }
 
+/*
+ * Apply a compiled delta to a set of colors
+ */
+static inline void
+xo_colors_apply (xo_colors_delta_t *xcdp, xo_colors_t *xocp)
+{
+    xocp->xoc_effects &= ~xcdp->xcd_effects_clear;
+    xocp->xoc_effects |= xcdp->xcd_effects_set;
+
+    if (xcdp->xcd_col_fg >= 0)
+	xocp->xoc_col_fg = xcdp->xcd_col_fg;
+    if (xcdp->xcd_col_bg >= 0)
+	xocp->xoc_col_bg = xcdp->xcd_col_bg;
+}
+
+static inline int
+xo_colors_equal (xo_colors_t *one, xo_colors_t *two)
+{
+    return one->xoc_effects == two->xoc_effects
+	&& one->xoc_col_fg == two->xoc_col_fg
+	&& one->xoc_col_bg == two->xoc_col_bg;
+}
+
 static inline int
 xo_colors_enabled (xo_handle_t *xop UNUSED)
 {
@@ -6579,13 +8422,16 @@ xo_colors_update (xo_handle_t *xop UNUSED, xo_colors_t *newp UNUSED)
 #endif /* LIBXO_TEXT_ONLY */
 }
 
-static void
-xo_colors_handle_text (xo_handle_t *xop, xo_colors_t *newp)
+/*
+ * Build the ANSI escape sequence that moves from the old colors to
+ * the new ones, returning its length (zero if nothing is needed).
+ */
+static ssize_t
+xo_colors_handle_text (xo_colors_t *oldp, xo_colors_t *newp,
+		       char *buf, ssize_t bufsiz)
 {
-    char buf[BUFSIZ];
-    char *cp = buf, *ep = buf + sizeof(buf);
+    char *cp = buf, *ep = buf + bufsiz;
     unsigned i, bit;
-    xo_colors_t *oldp = &xop->xo_colors;
     const char *code = NULL;
 
     /*
@@ -6616,7 +8462,7 @@ xo_colors_handle_text (xo_handle_t *xop, xo_colors_t *newp)
 
 	cp += snprintf(cp, ep - cp, ";%s", code);
 	if (cp >= ep)
-	    return;		/* Should not occur */
+	    return 0;		/* Should not occur */
 
 	if (bit == XO_EFF_RESET) {
 	    /* Mark up the old value so we can detect current values as new */
@@ -6630,7 +8476,7 @@ xo_colors_handle_text (xo_handle_t *xop, xo_colors_t *newp)
 	cp += snprintf(cp, ep - cp, ";3%u",
 		       (fg != XO_COL_DEFAULT) ? fg - 1 : 9);
 	if (cp >= ep)
-	    return;		/* Should not occur */
+	    return 0;		/* Should not occur */
     }
 
     xo_color_t bg = newp->xoc_col_bg;
@@ -6638,44 +8484,40 @@ xo_colors_handle_text (xo_handle_t *xop, xo_colors_t *newp)
 	cp += snprintf(cp, ep - cp, ";4%u",
 		       (bg != XO_COL_DEFAULT) ? bg - 1 : 9);
 	if (cp >= ep)
-	    return;		/* Should not occur */
+	    return 0;		/* Should not occur */
     }
 
     if (cp - buf != 1 && cp < ep - 3) {
 	buf[1] = '[';		/* Overwrite leading ';' */
 	*cp++ = 'm';
 	*cp = '\0';
-	xo_buf_append(&xop->xo_data, buf, cp - buf);
+	return cp - buf;
     }
+
+    return 0;
 }
 
-static void
-xo_colors_handle_html (xo_handle_t *xop, xo_colors_t *newp)
+/*
+ * Build the set of HTML class names for the new colors, returning
+ * its length.
+ */
+static ssize_t
+xo_colors_handle_html (xo_colors_t *newp, char *buf, ssize_t bufsiz)
 {
-    xo_colors_t *oldp = &xop->xo_colors;
+    char *cp = buf, *ep = buf + bufsiz;
+    unsigned i, bit;
 
     /*
      * HTML colors are mostly trivial: fill in xo_color_buf with
      * a set of class tags representing the colors and effects.
      */
-
-    /* If nothing changed, then do nothing */
-    if (oldp->xoc_effects == newp->xoc_effects
-	&& oldp->xoc_col_fg == newp->xoc_col_fg
-	&& oldp->xoc_col_bg == newp->xoc_col_bg)
-	return;
-
-    unsigned i, bit;
-    xo_buffer_t *xbp = &xop->xo_color_buf;
-
-    xo_buf_reset(xbp);		/* We rebuild content after each change */
+    *cp = '\0';
 
     for (i = 0, bit = 1; xo_effect_names[i]; i++, bit <<= 1) {
 	if (!(newp->xoc_effects & bit))
 	    continue;
 
-	xo_buf_append_str(xbp, " effect-");
-	xo_buf_append_str(xbp, xo_effect_names[i]);
+	SNPRINTF(cp, ep, " effect-%s", xo_effect_names[i]);
     }
 
     const char *fg = NULL;
@@ -6697,15 +8539,143 @@ xo_colors_handle_html (xo_handle_t *xop, xo_colors_t *newp)
 
     }
 
-    if (fg) {
-	xo_buf_append_str(xbp, " color-fg-");
-	xo_buf_append_str(xbp, fg);
+    if (fg)
+	SNPRINTF(cp, ep, " color-fg-%s", fg);
+
+    if (bg)
+	SNPRINTF(cp, ep, " color-bg-%s", bg);
+
+    return cp - buf;
+}
+
+/*
+ * Find (or make) the color cache for a retained field, making sure
+ * it can hold the given color string.
+ */
+static xo_colors_cache_t *
+xo_colors_cache_get (xo_retain_field_t *xrfp, ssize_t slen)
+{
+    xo_colors_cache_t *xccp = xrfp->xrf_colors;
+
+    if (xccp == NULL || xccp->xcc_size < slen) {
+	xccp = xo_realloc(xccp, sizeof(*xccp) + slen);
+	if (xccp == NULL)
+	    return NULL;	/* Old cache is still in xrf_colors */
+
+	xccp->xcc_size = slen;
+	xrfp->xrf_colors = xccp;
+    }
+
+    return xccp;
+}
+
+/*
+ * Render a color string (which isn't NUL-terminated) for text or
+ * HTML output.  If we have a retained field, we keep the compiled
+ * delta and the last transition's output in its color cache, so
+ * a field that's emitted in a loop needs neither parsing nor
+ * formatting after the first time.
+ */
+static void
+xo_colors_render (xo_handle_t *xop, const char *spec, ssize_t slen)
+{
+    xo_retain_field_t *xrfp = xop->xo_rfield;
+    xo_colors_cache_t *xccp = xrfp ? xrfp->xrf_colors : NULL;
+    xo_colors_delta_t delta;
+
+    if (xccp && xccp->xcc_slen == slen
+	    && memcmp(xccp->xcc_spec, spec, slen) == 0) {
+	delta = xccp->xcc_delta;
+
+    } else {
+	char *buf = alloca(slen + 1);
+	memcpy(buf, spec, slen);
+	buf[slen] = '\0';
+
+	xo_colors_compile(xop, &delta, buf);
+
+	xccp = xrfp ? xo_colors_cache_get(xrfp, slen) : NULL;
+	if (xccp) {
+	    xccp->xcc_delta = delta;
+	    xccp->xcc_slen = slen;
+	    memcpy(xccp->xcc_spec, spec, slen);
+	    xccp->xcc_valid = FALSE;
+	}
+    }
+
+    xo_colors_t old = xop->xo_colors;
+    xo_colors_t xoc = old;
+    xo_colors_apply(&delta, &xoc);
+    xo_colors_update(xop, &xoc);
+
+    char tbuf[XO_COLORS_OUT_MAX];
+    const char *out = tbuf;
+    ssize_t olen;
+    int style = xo_style(xop);
+
+    if (xccp && xccp->xcc_valid && xccp->xcc_style == style
+	    && xo_colors_equal(&xccp->xcc_old, &old)
+	    && xo_colors_equal(&xccp->xcc_new, &xoc)) {
+	/* Same transition as last time; reuse the results */
+	out = xccp->xcc_out;
+	olen = xccp->xcc_olen;
+	xoc = xccp->xcc_result;
+
+    } else {
+	xo_colors_t new = xoc;
+
+	if (style == XO_STYLE_TEXT) {
+	    /*
+	     * Text mode means emitting the colors as ANSI character
+	     * codes.  This will allow people who like colors to have
+	     * colors.  The issue is, of course conflicting with the
+	     * user's perfectly reasonable color scheme.  Which leads
+	     * to the hell of LSCOLORS, where even app need to have
+	     * customization hooks for adjusting colors.  Instead we
+	     * provide a simpler-but-still-annoying answer where one
+	     * can map colors to other colors.
+	     */
+	    xo_colors_t tmp = old;
+	    olen = xo_colors_handle_text(&tmp, &xoc, tbuf, sizeof(tbuf));
+	    xoc.xoc_effects &= ~XO_EFF_RESET; /* After handling it */
+
+	} else {
+	    /*
+	     * HTML output is wrapped in divs, so the color information
+	     * must appear in every div until cleared.  Most pathetic.
+	     * Most unavoidable.  If nothing changed, then do nothing
+	     * (which we record as a negative length).
+	     */
+	    xoc.xoc_effects &= ~XO_EFF_RESET; /* Before handling effects */
+	    if (xo_colors_equal(&old, &xoc))
+		olen = -1;
+	    else
+		olen = xo_colors_handle_html(&xoc, tbuf, sizeof(tbuf));
+	}
+
+	if (xccp) {
+	    xccp->xcc_valid = TRUE;
+	    xccp->xcc_style = style;
+	    xccp->xcc_old = old;
+	    xccp->xcc_new = new;
+	    xccp->xcc_result = xoc;
+	    xccp->xcc_olen = olen;
+	    if (olen > 0)
+		memcpy(xccp->xcc_out, tbuf, olen);
+	}
     }
 
-    if (bg) {
-	xo_buf_append_str(xbp, " color-bg-");
-	xo_buf_append_str(xbp, bg);
+    if (style == XO_STYLE_TEXT) {
+	if (olen > 0)
+	    xo_buf_append(&xop->xo_data, out, olen);
+
+    } else if (olen >= 0) {
+	/* We rebuild content after each change */
+	xo_buf_reset(&xop->xo_color_buf);
+	xo_buf_append(&xop->xo_color_buf, out, olen);
     }
+
+    xop->xo_colors = xoc;
 }
 
 static void
@@ -6715,56 +8685,37 @@ xo_format_colors (xo_handle_t *xop, const char *base, xo_field_info_t *xfip,
     const char *fmt = xo_foff(base, xfip->xfi_format);
     ssize_t flen = xfip->xfi_flen;
 
-    xo_buffer_t xb;
-
     /* If the string is static and we've in an encoding style, bail */
     if (vlen != 0 && xo_style_is_encoding(xop))
 	return;
 
-    xo_buf_init(&xb);
+    /* Same if the string is static and we're not doing colors */
+    if (vlen != 0 && !xo_colors_enabled(xop))
+	return;
 
-    if (vlen)
-	xo_buf_append(&xb, value, vlen);
-    else if (flen)
-	xo_do_format_field(xop, &xb, fmt, flen, 0);
-    else
-	xo_buf_append(&xb, "reset", 6); /* Default if empty */
+    xo_buffer_t xb;
+    xo_buf_zero(&xb);
+
+    const char *spec = value;
+    ssize_t slen = vlen;
+
+    if (vlen == 0) {
+	if (flen) {
+	    xo_buf_init(&xb);
+	    xo_do_format_field(xop, &xb, fmt, flen, 0);
+	    spec = xb.xb_bufp;
+	    slen = xo_buf_offset(&xb);
+	} else {
+	    spec = "reset";	/* Default if empty */
+	    slen = 5;
+	}
+    }
 
     if (xo_colors_enabled(xop)) {
 	switch (xo_style(xop)) {
 	case XO_STYLE_TEXT:
 	case XO_STYLE_HTML:
-	    xo_buf_append(&xb, "", 1);
-
-	    xo_colors_t xoc = xop->xo_colors;
-	    xo_colors_parse(xop, &xoc, xb.xb_bufp);
-	    xo_colors_update(xop, &xoc);
-
-	    if (xo_style(xop) == XO_STYLE_TEXT) {
-		/*
-		 * Text mode means emitting the colors as ANSI character
-		 * codes.  This will allow people who like colors to have
-		 * colors.  The issue is, of course conflicting with the
-		 * user's perfectly reasonable color scheme.  Which leads
-		 * to the hell of LSCOLORS, where even app need to have
-		 * customization hooks for adjusting colors.  Instead we
-		 * provide a simpler-but-still-annoying answer where one
-		 * can map colors to other colors.
-		 */
-		xo_colors_handle_text(xop, &xoc);
-		xoc.xoc_effects &= ~XO_EFF_RESET; /* After handling it */
-
-	    } else {
-		/*
-		 * HTML output is wrapped in divs, so the color information
-		 * must appear in every div until cleared.  Most pathetic.
-		 * Most unavoidable.
-		 */
-		xoc.xoc_effects &= ~XO_EFF_RESET; /* Before handling effects */
-		xo_colors_handle_html(xop, &xoc);
-	    }
-
-	    xop->xo_colors = xoc;
+	    xo_colors_render(xop, spec, slen);
 	    break;
 
 	case XO_STYLE_XML:
@@ -7465,7 +9416,245 @@ xo_gettext_rebuild_content (xo_handle_t *xop, xo_field_info_t *fields,
 
     xo_free(buf);
 }
-#else  /* HAVE_GETTEXT */
+#endif /* HAVE_GETTEXT */
+
+#if defined(HAVE_GETTEXT) && !defined(LIBXO_NO_RETAIN)
+/*
+ * The gettext cache: translating a {G:} format means simplifying it,
+ * calling dgettext(), parsing the reply, and combining (and possibly
+ * reordering) the two sets of fields.  None of that depends on the
+ * arguments, so we cache the result, keyed by the contents of the
+ * format string, the domain name, and the message locale.  Since the
+ * key uses the contents (not the address) of the format, dynamic
+ * format strings are safe, and since new_fields uses offsets, the
+ * cached fields are valid for any copy of the format string.  A
+ * "negative" entry (xgc_new_fmt == NULL) records that there's no
+ * translation, which is the common case for the "C" locale.
+ *
+ * Like the retain hash, the cache is thread-specific.  The locale is
+ * part of the key, so changing locales naturally misses, but
+ * xo_retain_clear_all() will flush the cache for callers who change
+ * catalogs via bindtextdomain(3).
+ */
+typedef struct xo_gt_cache_entry_s {
+    struct xo_gt_cache_entry_s *xgc_next; /* Next entry in this bucket */
+    uint32_t xgc_hash;			  /* Full hash value */
+    const char *xgc_format;		  /* Original format (our copy) */
+    const char *xgc_domain;		  /* Gettext domain name */
+    const char *xgc_locale;		  /* Message locale key */
+    const char *xgc_new_fmt;		  /* Translated format (or NULL) */
+    unsigned xgc_max_fields;		  /* Number of new fields */
+    int xgc_reordered;			  /* Were fields reordered? */
+    xo_field_info_t *xgc_fields;	  /* Combined fields (w/ blank slot) */
+} xo_gt_cache_entry_t;
+
+#ifndef XO_GT_CACHE_SIZE
+#define XO_GT_CACHE_SIZE 6
+#endif /* XO_GT_CACHE_SIZE */
+#define GT_CACHE_HASH_SIZE (1<<XO_GT_CACHE_SIZE)
+
+#ifndef XO_GT_CACHE_MAX
+#define XO_GT_CACHE_MAX 1024	/* Flush everything past this many entries */
+#endif /* XO_GT_CACHE_MAX */
+
+typedef struct xo_gt_cache_s {
+    xo_gt_cache_entry_t *xgc_bucket[GT_CACHE_HASH_SIZE];
+} xo_gt_cache_t;
+
+static THREAD_LOCAL(xo_gt_cache_t) xo_gt_cache;
+static THREAD_LOCAL(unsigned) xo_gt_cache_count;
+
+/*
+ * Hash the NUL-terminated string, including the NUL, so "ab"+"c" and
+ * "a"+"bc" don't collide.
+ */
+static uint32_t
+xo_gt_cache_hash_str (uint32_t hash, const char *str)
+{
+    str = str ?: "";
+    return xo_hash_buf(hash, str, strlen(str) + 1);
+}
+
+/*
+ * Build the locale part of the key.  dgettext() uses the LC_MESSAGES
+ * locale, plus the LANGUAGE environment variable (for GNU gettext).
+ */
+static const char *
+xo_gt_cache_locale (char *buf, size_t bufsiz)
+{
+#ifdef LC_MESSAGES
+    const char *lname = setlocale(LC_MESSAGES, NULL);
+#else /* LC_MESSAGES */
+    const char *lname = setlocale(LC_ALL, NULL);
+#endif /* LC_MESSAGES */
+    const char *language = getenv("LANGUAGE");
+
+    snprintf(buf, bufsiz, "%s:%s", lname ?: "", language ?: "");
+    return buf;
+}
+
+/*
+ * Release all cached translations
+ */
+static void
+xo_gettext_cache_clear_all (void)
+{
+    int i;
+    xo_gt_cache_entry_t *xgcp, *next;
+
+    for (i = 0; i < GT_CACHE_HASH_SIZE; i++) {
+	for (xgcp = xo_gt_cache.xgc_bucket[i]; xgcp; xgcp = next) {
+	    next = xgcp->xgc_next;
+	    xo_free(xgcp);
+	}
+	xo_gt_cache.xgc_bucket[i] = NULL;
+    }
+    xo_gt_cache_count = 0;
+}
+
+/*
+ * Is the cache usable for this handle?  Encoding styles don't
+ * translate at all and logging should see every lookup.
+ */
+static int
+xo_gettext_cache_usable (xo_handle_t *xop)
+{
+    return !xo_style_is_encoding(xop)
+	&& !XOF_ISSET(xop, XOF_LOG_GETTEXT | XOF_RETAIN_NONE);
+}
+
+/*
+ * The domain for the key; a NULL domain means dgettext will use the
+ * textdomain(3) value, so we use that instead.
+ */
+static const char *
+xo_gettext_cache_domain (xo_handle_t *xop)
+{
+    return xop->xo_gt_domain ?: textdomain(NULL);
+}
+
+static xo_gt_cache_entry_t *
+xo_gettext_cache_find (xo_handle_t *xop, const char *fmt)
+{
+    if (xo_gt_cache_count == 0 || !xo_gettext_cache_usable(xop))
+	return NULL;
+
+    char lbuf[BUFSIZ];
+    const char *locale = xo_gt_cache_locale(lbuf, sizeof(lbuf));
+    const char *domain = xo_gettext_cache_domain(xop);
+
+    uint32_t hash = xo_gt_cache_hash_str(XO_HASH_INIT, fmt);
+    hash = xo_gt_cache_hash_str(hash, domain);
+    hash = xo_gt_cache_hash_str(hash, locale);
+
+    xo_gt_cache_entry_t *xgcp;
+    for (xgcp = xo_gt_cache.xgc_bucket[hash & (GT_CACHE_HASH_SIZE - 1)];
+	 xgcp; xgcp = xgcp->xgc_next) {
+	if (xgcp->xgc_hash == hash && xo_streq(xgcp->xgc_format, fmt)
+		&& xo_streq(xgcp->xgc_domain, domain ?: "")
+		&& xo_streq(xgcp->xgc_locale, locale))
+	    return xgcp;
+    }
+
+    return NULL;
+}
+
+/*
+ * Record the results of a translation.  new_fmt is NULL when there's
+ * no translation; otherwise new_fields points to new_max_fields
+ * combined fields, which we save along with the leading blank slot.
+ */
+static void
+xo_gettext_cache_add (xo_handle_t *xop, const char *fmt, const char *new_fmt,
+		      xo_field_info_t *new_fields, unsigned new_max_fields,
+		      int reordered)
+{
+    if (!xo_gettext_cache_usable(xop))
+	return;
+
+    if (xo_gt_cache_count >= XO_GT_CACHE_MAX)
+	xo_gettext_cache_clear_all();
+
+    char lbuf[BUFSIZ];
+    const char *locale = xo_gt_cache_locale(lbuf, sizeof(lbuf));
+    const char *domain = xo_gettext_cache_domain(xop) ?: "";
+
+    uint32_t hash = xo_gt_cache_hash_str(XO_HASH_INIT, fmt);
+    hash = xo_gt_cache_hash_str(hash, domain);
+    hash = xo_gt_cache_hash_str(hash, locale);
+
+    size_t flen = strlen(fmt) + 1, dlen = strlen(domain) + 1;
+    size_t llen = strlen(locale) + 1;
+    size_t nlen = new_fmt ? strlen(new_fmt) + 1 : 0;
+    size_t fsz = new_fmt ? (new_max_fields + 1) * sizeof(*new_fields) : 0;
+
+    xo_gt_cache_entry_t *xgcp;
+    xgcp = xo_realloc(NULL, sizeof(*xgcp) + fsz + flen + dlen + llen + nlen);
+    if (xgcp == NULL)
+	return;
+
+    bzero(xgcp, sizeof(*xgcp));
+
+    /* The fields go first, to keep them aligned */
+    char *cp = (char *) &xgcp[1];
+    if (new_fmt) {
+	xgcp->xgc_fields = (xo_field_info_t *) cp;
+	memcpy(cp, new_fields - 1, fsz);
+	cp += fsz;
+    }
+
+    xgcp->xgc_format = memcpy(cp, fmt, flen);
+    cp += flen;
+    xgcp->xgc_domain = memcpy(cp, domain, dlen);
+    cp += dlen;
+    xgcp->xgc_locale = memcpy(cp, locale, llen);
+    cp += llen;
+    if (new_fmt)
+	xgcp->xgc_new_fmt = memcpy(cp, new_fmt, nlen);
+
+    xgcp->xgc_hash = hash;
+    xgcp->xgc_max_fields = new_max_fields;
+    xgcp->xgc_reordered = reordered;
+
+    unsigned bucket = hash & (GT_CACHE_HASH_SIZE - 1);
+    xgcp->xgc_next = xo_gt_cache.xgc_bucket[bucket];
+    xo_gt_cache.xgc_bucket[bucket] = xgcp;
+    xo_gt_cache_count += 1;
+}
+#else /* HAVE_GETTEXT && !LIBXO_NO_RETAIN */
+/*
+ * Empty implementation of the gettext cache
+ */
+typedef struct xo_gt_cache_entry_s {
+    const char *xgc_new_fmt;		  /* Translated format (or NULL) */
+    unsigned xgc_max_fields;		  /* Number of new fields */
+    int xgc_reordered;			  /* Were fields reordered? */
+    xo_field_info_t *xgc_fields;	  /* Combined fields (w/ blank slot) */
+} xo_gt_cache_entry_t;
+
+static inline void
+xo_gettext_cache_clear_all (void)
+{
+    return;
+}
+
+static inline xo_gt_cache_entry_t *
+xo_gettext_cache_find (xo_handle_t *xop UNUSED, const char *fmt UNUSED)
+{
+    return NULL;
+}
+
+static inline void
+xo_gettext_cache_add (xo_handle_t *xop UNUSED, const char *fmt UNUSED,
+		      const char *new_fmt UNUSED,
+		      xo_field_info_t *new_fields UNUSED,
+		      unsigned new_max_fields UNUSED, int reordered UNUSED)
+{
+    return;
+}
+#endif /* HAVE_GETTEXT && !LIBXO_NO_RETAIN */
+
+#ifndef HAVE_GETTEXT
 static char *
 xo_gettext_build_format (xo_handle_t *xop UNUSED,
 			 xo_field_info_t *fields UNUSED,
@@ -7493,14 +9682,54 @@ xo_gettext_rebuild_content (xo_handle_t *xop UNUSED,
 {
     return;
 }
-#endif /* HAVE_GETTEXT */
+#endif /* !HAVE_GETTEXT */
+
+static ssize_t
+xo_do_emit_fields (xo_handle_t *xop, xo_field_info_t *fields,
+		   xo_retain_field_t *rfields, unsigned max_fields,
+		   const char *fmt);
+
+/*
+ * Emit a set of (already parsed) fields to each of a tee handle's
+ * children.  Each child gets its own copy of the arguments.  We return
+ * the result from the first child.
+ */
+static ssize_t
+xo_tee_emit_fields (xo_handle_t *xop, xo_field_info_t *fields,
+		    xo_retain_field_t *rfields, unsigned max_fields,
+		    const char *fmt)
+{
+    ssize_t rc = 0, crc;
+    int i;
+
+    for (i = 0; i < xop->xo_tee_count; i++) {
+	xo_handle_t *child = xop->xo_tee[i];
+
+	child->xo_columns = 0;
+	child->xo_errno = xop->xo_errno;
+	if (xo_discarding_output_h(child))
+	    continue;
+
+	va_copy(child->xo_vap, xop->xo_vap);
+	crc = xo_do_emit_fields(child, fields, rfields, max_fields, fmt);
+	va_end(child->xo_vap);
+	bzero(&child->xo_vap, sizeof(child->xo_vap));
+
+	if (i == 0 || crc < 0)
+	    rc = crc;
+    }
+
+    return rc;
+}
 
 /*
- * Emit a set of fields.  This is really the core of libxo.
+ * Emit a set of fields.  This is really the core of libxo.  If the
+ * fields are retained, rfields holds our per-field cached information.
  */
 static ssize_t
 xo_do_emit_fields (xo_handle_t *xop, xo_field_info_t *fields,
-		   unsigned max_fields, const char *fmt)
+		   xo_retain_field_t *rfields, unsigned max_fields,
+		   const char *fmt)
 {
     int gettext_inuse = 0;
     int gettext_changed = 0;
@@ -7523,6 +9752,9 @@ xo_do_emit_fields (xo_handle_t *xop, xo_field_info_t *fields,
     const char *base = fmt;
     const char *base_fmt = fmt;
 
+    if (xop->xo_tee)
+	return xo_tee_emit_fields(xop, fields, rfields, max_fields, fmt);
+
     int flush = XOF_ISSET(xop, XOF_FLUSH);
     int flush_line = XOF_ISSET(xop, XOF_FLUSH_LINE);
     char *new_fmt = NULL;
@@ -7601,7 +9833,25 @@ xo_do_emit_fields (xo_handle_t *xop, xo_field_info_t *fields,
 	    }
 	}
 
-	if (ftype == 'V')
+	/*
+	 * Let value and color fields cache what they learn (mapped
+	 * names, compiled colors) in the retained field.
+	 */
+	if (rfields && !(flags & XFF_ARGUMENT)
+		&& (ftype == 'V' || ftype == 'C'))
+	    xop->xo_rfield = &rfields[field];
+
+	if (ftype == 'V' && xo_fields_skip(xop, content, clen, flags)) {
+	    /* Not a kept field; the data styles use the encoding format */
+	    const char *efmt = xo_foff(base_fmt, xfip->xfi_encoding);
+
+	    if (efmt && !(flags & XFF_DISPLAY_ONLY))
+		xo_skip_format_args(xop, efmt, xfip->xfi_elen);
+	    else
+		xo_skip_format_args(xop, xo_foff(base_fmt, xfip->xfi_format),
+				    xfip->xfi_flen);
+
+	} else if (ftype == 'V')
 	    xo_format_value(xop, content, clen, NULL, 0,
 			    xo_foff(base_fmt, xfip->xfi_format), xfip->xfi_flen,
 			    xo_foff(base_fmt, xfip->xfi_encoding), xfip->xfi_elen,
@@ -7631,8 +9881,36 @@ xo_do_emit_fields (xo_handle_t *xop, xo_field_info_t *fields,
 		    new_fmt = NULL;
 		}
 
+		/* Look for a previous translation of this format */
+		xo_gt_cache_entry_t *xgcp = xo_gettext_cache_find(xop, fmt);
+		if (xgcp) {
+		    if (xgcp->xgc_new_fmt == NULL)
+			continue; /* Known to have no translation */
+
+		    gettext_changed = 1;
+		    gettext_reordered = xgcp->xgc_reordered;
+		    if (gettext_reordered) {
+			flush_line = 0; /* Must keep at content */
+			XOIF_SET(xop, XOIF_REORDER);
+		    }
+
+		    ssize_t sz = (xgcp->xgc_max_fields + 1)
+			* sizeof(xo_field_info_t);
+		    new_fields = alloca(sz);
+		    memcpy(new_fields, xgcp->xgc_fields, sz);
+
+		    field = -1; /* Will be incremented at top of loop */
+		    xfip = new_fields;
+		    rfields = NULL; /* No longer the retained fields */
+		    max_fields = xgcp->xgc_max_fields;
+		    base = xgcp->xgc_new_fmt;
+		    continue;
+		}
+
 		new_fmt = xo_gettext_build_format(xop, fields, field, base);
-		if (new_fmt) {
+		if (new_fmt == NULL)
+		    xo_gettext_cache_add(xop, fmt, NULL, NULL, 0, 0);
+		else {
 		    gettext_changed = 1;
 
 		    xo_parse_t nxpp;
@@ -7666,8 +9944,13 @@ xo_do_emit_fields (xo_handle_t *xop, xo_field_info_t *fields,
 				XOIF_SET(xop, XOIF_REORDER);
 			    }
 
+			    xo_gettext_cache_add(xop, fmt, new_fmt,
+						 new_fields + 1, new_max_fields,
+						 gettext_reordered);
+
 			    field = -1; /* Will be incremented at top of loop */
 			    xfip = new_fields;
+			    rfields = NULL; /* No longer the retained fields */
 			    max_fields = new_max_fields;
 			    base = new_fmt;
 			    /*
@@ -7698,6 +9981,8 @@ xo_do_emit_fields (xo_handle_t *xop, xo_field_info_t *fields,
 		xo_failure(xop, "unknown field type: '%c'", ftype);
 	}
 
+	xop->xo_rfield = NULL;
+
 	if (flags & XFF_COLON)
 	    xo_format_content(xop, "decoration", NULL, ":", 1, NULL, 0, 0);
 
@@ -7717,10 +10002,13 @@ xo_do_emit_fields (xo_handle_t *xop, xo_field_info_t *fields,
     if (XOIF_ISSET(xop, XOIF_FILTERING)) {
 	/*
 	 * If we're filtering, we can look at the fields to see if we
-	 * have any keys.  If we don't we can bail.
+	 * have any keys.  If we don't we can bail, after seeing if
+	 * the pending output needs spilling.
 	 */
-	if (has_keys == 0)
+	if (has_keys == 0) {
+	    xo_filt_check_spill(xop);
 	    return 0;
+	}
     }
 
     if (gettext_changed && gettext_reordered) {
@@ -7743,6 +10031,8 @@ xo_do_emit_fields (xo_handle_t *xop, xo_field_info_t *fields,
 	    rc = -1;
     }
 
+    xo_filt_check_spill(xop);
+
     if (new_fmt)
 	xo_free(new_fmt);
 
@@ -7756,6 +10046,9 @@ xo_do_emit_fields (xo_handle_t *xop, xo_field_info_t *fields,
 	xop->xo_gt_domain = NULL;
     }
 
+    if (xop->xo_staging)
+	xo_shared_commit(xop);
+
     return (rc < 0) ? rc : xop->xo_columns;
 }
 
@@ -7777,6 +10070,7 @@ xo_do_emit (xo_handle_t *xop, xo_emit_flags_t flags, const char *fmt)
 
     unsigned max_fields;
     xo_field_info_t *fields = NULL;
+    xo_retain_field_t *rfields = NULL;
 
     /*
      * Retaining (caching) parsed field information means holding
@@ -7803,7 +10097,7 @@ xo_do_emit (xo_handle_t *xop, xo_emit_flags_t flags, const char *fmt)
      * dynamic using the XOEF_NO_RETAIN flag.
      */
     if (!(flags & XOEF_RETAIN)
-	|| xo_retain_find(fmt, &fields, &max_fields) != 0
+	|| xo_retain_find(fmt, &fields, &rfields, &max_fields) != 0
 	|| fields == NULL) {
 
 	/* Nothing retained; parse the format string */
@@ -7816,13 +10110,14 @@ xo_do_emit (xo_handle_t *xop, xo_emit_flags_t flags, const char *fmt)
 	if (xo_parse_fields(&xpp, fields, max_fields, fmt))
 	    return -1;		/* Warning already displayed */
 
+	rfields = NULL;
 	if (flags & XOEF_RETAIN) {
 	    /* Retain the info */
 	    xo_retain_add(fmt, fields, max_fields);
 	}
     }
 
-    return xo_do_emit_fields(xop, fields, max_fields, fmt);
+    return xo_do_emit_fields(xop, fields, rfields, max_fields, fmt);
 }
 
 /*
@@ -7857,7 +10152,7 @@ xo_do_emit_cached (xo_handle_t *xop, xo_emit_flags_t flags,
     memcpy(fields, fcp->xfc_fields, n * sizeof(fields[0]));
     bzero(&fields[n], sizeof(fields[n]));    /* xfi_ftype==0 terminates */
 
-    return xo_do_emit_fields(xop, fields, max_fields, fmt);
+    return xo_do_emit_fields(xop, fields, NULL, max_fields, fmt);
 }
 
 xo_ssize_t
@@ -7867,6 +10162,8 @@ xo_emit_cached_h (xo_handle_t *xop, const xo_format_cache_t *fcp,
     ssize_t rc;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
     va_start(xop->xo_vap, fmt);
     rc = xo_do_emit_cached(xop, 0, fcp, fmt);
     va_end(xop->xo_vap);
@@ -7910,6 +10207,8 @@ xo_emit_cached_hv (xo_handle_t *xop, const xo_format_cache_t *fcp,
     ssize_t rc;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
     va_copy(xop->xo_vap, vap);
     rc = xo_do_emit_cached(xop, 0, fcp, fmt);
     va_end(xop->xo_vap);
@@ -7925,6 +10224,8 @@ xo_emit_cached_hvf (xo_handle_t *xop, xo_emit_flags_t flags,
     ssize_t rc;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
     va_copy(xop->xo_vap, vap);
     rc = xo_do_emit_cached(xop, flags, fcp, fmt);
     va_end(xop->xo_vap);
@@ -7940,6 +10241,8 @@ xo_emit_cached_hf (xo_handle_t *xop, xo_emit_flags_t flags,
     ssize_t rc;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
     va_start(xop->xo_vap, fmt);
     rc = xo_do_emit_cached(xop, flags, fcp, fmt);
     va_end(xop->xo_vap);
@@ -7972,6 +10275,8 @@ xo_simplify_format (xo_handle_t *xop, const char *fmt, int with_numbers,
 		    xo_simplify_field_func_t field_cb)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return NULL;
 
     xop->xo_columns = 0;	/* Always reset it */
     xop->xo_errno = errno;	/* Save for "%m" */
@@ -8004,6 +10309,8 @@ xo_emit_hv (xo_handle_t *xop, const char *fmt, va_list vap)
     ssize_t rc;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
     va_copy(xop->xo_vap, vap);
     rc = xo_do_emit(xop, 0, fmt);
     va_end(xop->xo_vap);
@@ -8018,6 +10325,8 @@ xo_emit_h (xo_handle_t *xop, const char *fmt, ...)
     ssize_t rc;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
     va_start(xop->xo_vap, fmt);
     rc = xo_do_emit(xop, 0, fmt);
     va_end(xop->xo_vap);
@@ -8061,6 +10370,8 @@ xo_emit_hvf (xo_handle_t *xop, xo_emit_flags_t flags,
     ssize_t rc;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
     va_copy(xop->xo_vap, vap);
     rc = xo_do_emit(xop, flags, fmt);
     va_end(xop->xo_vap);
@@ -8075,6 +10386,8 @@ xo_emit_hf (xo_handle_t *xop, xo_emit_flags_t flags, const char *fmt, ...)
     ssize_t rc;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
     va_start(xop->xo_vap, fmt);
     rc = xo_do_emit(xop, flags, fmt);
     va_end(xop->xo_vap);
@@ -8112,6 +10425,8 @@ xo_emit_field_hvf (xo_handle_t *xop, xo_emit_flags_t flags UNUSED,
     ssize_t rc;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
 
     if (rolmod == NULL)
 	rolmod = "V";
@@ -8185,7 +10500,7 @@ xo_emit_field_hvf (xo_handle_t *xop, xo_emit_flags_t flags UNUSED,
 
     va_copy(xop->xo_vap, vap);
 
-    rc = xo_do_emit_fields(xop, &xfi, 1, xfi_base);
+    rc = xo_do_emit_fields(xop, &xfi, NULL, 1, xfi_base);
 
     va_end(xop->xo_vap);
 
@@ -8250,6 +10565,25 @@ xo_attr_hv (xo_handle_t *xop, const char *name, const char *fmt, va_list vap)
 {
     const ssize_t extra = 5; 	/* space, equals, quote, quote, and nul */
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
+
+    if (xop->xo_tee) {
+	ssize_t rc = 0, crc;
+	int i;
+
+	for (i = 0; i < xop->xo_tee_count; i++) {
+	    va_list va_local;
+
+	    va_copy(va_local, vap);
+	    crc = xo_attr_hv(xop->xo_tee[i], name, fmt, va_local);
+	    va_end(va_local);
+
+	    if (i == 0 || crc < 0)
+		rc = crc;
+	}
+	return rc;
+    }
 
     ssize_t rc = 0;
     ssize_t nlen = strlen(name);
@@ -8317,219 +10651,479 @@ xo_attr_hv (xo_handle_t *xop, const char *name, const char *fmt, va_list vap)
 }
 
 xo_ssize_t
-xo_attr_h (xo_handle_t *xop, const char *name, const char *fmt, ...)
+xo_attr_h (xo_handle_t *xop, const char *name, const char *fmt, ...)
+{
+    ssize_t rc;
+    va_list vap;
+
+    va_start(vap, fmt);
+    rc = xo_attr_hv(xop, name, fmt, vap);
+    va_end(vap);
+
+    return rc;
+}
+
+xo_ssize_t
+xo_attr (const char *name, const char *fmt, ...)
+{
+    ssize_t rc;
+    va_list vap;
+
+    va_start(vap, fmt);
+    rc = xo_attr_hv(NULL, name, fmt, vap);
+    va_end(vap);
+
+    return rc;
+}
+
+static void
+xo_depth_change (xo_handle_t *xop, const char *name,
+		 int delta, int indent, xo_state_t state,
+		 xo_xsf_flags_t flags, xo_filter_status_t fstatus,
+		 xo_off_t starting_offset)
+{
+    if (xo_style(xop) == XO_STYLE_HTML || xo_style(xop) == XO_STYLE_TEXT)
+	indent = 0;
+
+    if (XOF_ISSET(xop, XOF_DTRT))
+	flags |= XSF_DTRT;
+
+    if (delta >= 0) {			/* Push operation */
+	if (xo_depth_check(xop, xop->xo_depth + delta))
+	    return;
+
+	xo_xpath_truncate(xop, xop->xo_depth + delta);
+
+	xo_stack_t *xsp = &xop->xo_stack[xop->xo_depth + delta];
+	xsp->xs_flags = flags;
+	xsp->xs_state = state;
+	xsp->xs_fstatus = fstatus;
+	xsp->xs_rb_off = starting_offset;
+	xsp->xs_tag_end = XS_OFFSET_CLEAR;
+	xsp->xs_rb_flags = xop->xo_rb_snap; /* parent flags before this open */
+	xop->xo_rb_snap = 0;
+	xo_stack_set_flags(xop);
+
+	XO_DBG(xop, "xo_depth_change: '%s' depth %d, state %u=%s, "
+	       "status %u=%s,  rb_off %d, rb_flags %#x",
+	       name, xop->xo_depth + delta,
+	       state, xo_state_name(state),
+	       fstatus, xo_filt_status_name(fstatus),
+	       (int) starting_offset, xsp->xs_rb_flags);
+
+	if (name == NULL)
+	    name = XO_FAILURE_NAME;
+
+	xsp->xs_name = xo_strndup(name, -1);
+
+    } else {			/* Pop operation */
+	if (xop->xo_depth == 0) {
+	    if (!XOF_ISSET(xop, XOF_IGNORE_CLOSE))
+		xo_failure(xop, "close with empty stack: '%s'", name);
+	    return;
+	}
+
+	xo_stack_t *xsp = xo_stack_cur(xop);
+	if (XOF_ISSET(xop, XOF_WARN)) {
+	    const char *top = xsp->xs_name;
+	    if (top != NULL && name != NULL && !xo_streq(name, top)) {
+		xo_failure(xop, "incorrect close: '%s' .vs. '%s'",
+			      name, top);
+		return;
+	    } 
+	    if ((xsp->xs_flags & XSF_LIST) != (flags & XSF_LIST)) {
+		xo_failure(xop, "list close on list confict: '%s'",
+			      name);
+		return;
+	    }
+	    if ((xsp->xs_flags & XSF_INSTANCE) != (flags & XSF_INSTANCE)) {
+		xo_failure(xop, "list close on instance confict: '%s'",
+			      name);
+		return;
+	    }
+	}
+
+	/* Clear any offsets */
+	xsp->xs_rb_off = XS_OFFSET_CLEAR;
+	xsp->xs_tag_end = XS_OFFSET_CLEAR;
+	xsp->xs_key_off = XS_OFFSET_CLEAR;
+
+	xo_xpath_truncate(xop, xop->xo_depth);
+
+	if (xsp->xs_name) {
+	    xo_free(xsp->xs_name);
+	    xsp->xs_name = NULL;
+	}
+	if (xsp->xs_keys) {
+	    xo_free(xsp->xs_keys);
+	    xsp->xs_keys = NULL;
+	}
+    }
+
+    xop->xo_depth += delta;	/* Record new depth */
+    xop->xo_indent += indent;
+}
+
+void
+xo_set_depth (xo_handle_t *xop, int depth)
+{
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return;
+
+    if (xo_depth_check(xop, depth))
+	return;
+
+    xop->xo_depth += depth;
+    xop->xo_indent += depth;
+
+    /*
+     * Handling the "top wrapper" for JSON is a bit of a pain.  Here
+     * we need to detect that the depth has been changed to set the
+     * "XOIF_TOP_EMITTED" flag correctly.
+     */
+    if (xop->xo_style == XO_STYLE_JSON
+	&& !XOF_ISSET(xop, XOF_NO_TOP) && xop->xo_depth > 0)
+	XOIF_SET(xop, XOIF_TOP_EMITTED);
+}
+
+static xo_xsf_flags_t
+xo_stack_flags (xo_xof_flags_t xflags)
+{
+    if (xflags & XOF_DTRT)
+	return XSF_DTRT;
+    return 0;
+}
+
+static void
+xo_emit_top (xo_handle_t *xop, const char *ppn)
+{
+    xo_printf(xop, "%*s{%s", xo_indent(xop), "", ppn);
+    XOIF_SET(xop, XOIF_TOP_EMITTED);
+
+    if (xop->xo_version) {
+	xo_printf(xop, "%*s\"__version\": \"%s\", %s",
+		  xo_indent(xop), "", xop->xo_version, ppn);
+	xo_free(xop->xo_version);
+	xop->xo_version = NULL;
+    }
+}
+
+static ssize_t
+xo_do_open_container (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
+{
+    ssize_t rc = 0;
+    const char *ppn = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
+    const char *pre_nl = "";
+
+    if (name == NULL) {
+	xo_failure(xop, "NULL passed for container name");
+	name = XO_FAILURE_NAME;
+    }
+
+    name = xo_map_name(xop, name); /* Find mapped name, if any */
+
+    xo_filter_status_t fstatus;
+    fstatus = xo_filter_open_container(xop, xo_filters(xop), name);
+
+    xo_stack_t *xsp = xo_stack_cur(xop);
+    xo_filter_status_t old_fstatus = xsp->xs_fstatus;
+
+    const char *leader = xo_xml_leader(xop, name);
+    flags |= xop->xo_flags;	/* Pick up handle flags */
+
+    /* Save the starting point, so depth_change can record it later */
+    xo_off_t starting_offset = xo_filt_offset(xop);
+    xop->xo_rb_snap = xop->xo_stack[xop->xo_depth].xs_flags & XSF_RB_BITS;
+
+    switch (xo_style(xop)) {
+    case XO_STYLE_XML:
+	if (fstatus == XO_STATUS_DEAD) /* No one wants this */
+	    break;
+
+	/*
+	 * If we are newly "full", then we need all our parents to be emitted
+	 */
+	xo_filt_handle_change_status(xop, old_fstatus, fstatus);
+
+	rc = xo_printf(xop, "%*s<%s%s", xo_indent(xop), "", leader, name);
+
+	if (xop->xo_attrs.xb_curp != xop->xo_attrs.xb_bufp) {
+	    rc += xop->xo_attrs.xb_curp - xop->xo_attrs.xb_bufp;
+	    xo_data_append(xop, xop->xo_attrs.xb_bufp,
+			   xop->xo_attrs.xb_curp - xop->xo_attrs.xb_bufp);
+	    xo_buf_reset(&xop->xo_attrs);
+	}
+
+	rc += xo_printf(xop, ">%s", ppn);
+	break;
+
+    case XO_STYLE_JSON:
+	/*
+	 * If we are newly "full", then we need all our parents to be emitted
+	 */
+	xo_filt_handle_change_status(xop, old_fstatus, fstatus);
+
+	xo_stack_set_flags(xop);
+
+	if (!XOF_ISSET(xop, XOF_NO_TOP)
+	        && !XOIF_ISSET(xop, XOIF_TOP_EMITTED))
+	    xo_emit_top(xop, ppn);
+
+	if (xop->xo_stack[xop->xo_depth].xs_flags & XSF_NOT_FIRST)
+	    pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? ",\n" : ", ";
+	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+
+	/* A top-level NDJSON container is a record; wrap it */
+	if (xo_is_ndjson(xop) && xo_ndjson_at_base(xop))
+	    pre_nl = "{";
+
+	/* If we need underscores, make a local copy and doctor it */
+	const char *new_name = name;
+	if (XOF_ISSET(xop, XOF_UNDERSCORES)) {
+	    size_t len = strlen(name);
+	    const char *old_name = name;
+	    char *buf, *cp, *ep;
+
+	    buf = alloca(len + 1);
+	    for (cp = buf, ep = buf + len + 1; cp < ep; cp++, old_name++)
+		*cp = (*old_name == '-') ? '_' : *old_name;
+	    new_name = buf;
+	}
+
+	rc = xo_printf(xop, "%s%*s\"%s\": {%s",
+		       pre_nl, xo_indent(xop), "", new_name, ppn);
+	break;
+
+    case XO_STYLE_SDPARAMS:
+	break;
+
+    case XO_STYLE_ENCODER:
+	rc = xo_encoder_handle(xop, XO_OP_OPEN_CONTAINER, NULL,
+			       name, NULL, flags);
+	break;
+    }
+
+    /*
+     * FULL frames are permanently committed; xs_rb_off must be CLEAR so the
+     * close path writes the closing tag normally instead of entering the
+     * rollback branch and skipping it.
+     */
+    if (XOF_ISSET(xop, XOF_FILTER)) {
+	if (fstatus == XO_STATUS_FULL || fstatus == XO_STATUS_ZERO)
+	    starting_offset = XS_OFFSET_CLEAR;
+    }
+
+    /*
+     * After compact-commit clears XOIF_FILTERING, a new TRACK container
+     * that opens as a sibling of the committed region still needs
+     * XOIF_FILTERING set so that the buffer is not flushed to the fd
+     * before the rollback on close (which would make the opening tag
+     * permanent while the closing tag is suppressed).  Mirror the same
+     * guard used in xo_do_open_instance().
+     */
+    if (XOF_ISSET(xop, XOF_FILTER)) {
+	if (fstatus == XO_STATUS_PRED)
+	    XOIF_SET(xop, XOIF_FILTERING);
+	else if (fstatus == XO_STATUS_TRACK && old_fstatus == XO_STATUS_FULL)
+	    XOIF_SET(xop, XOIF_FILTERING);
+    }
+
+    xo_depth_change(xop, name, 1, 1, XSS_OPEN_CONTAINER,
+		    xo_stack_flags(flags), fstatus, starting_offset);
+
+    xo_stack_cur(xop)->xs_tag_end = xo_filt_offset(xop);
+
+    return rc;
+}
+
+xo_ssize_t
+xo_open_container_hf (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
 {
-    ssize_t rc;
-    va_list vap;
-
-    va_start(vap, fmt);
-    rc = xo_attr_hv(xop, name, fmt, vap);
-    va_end(vap);
+    return xo_transition(xop, flags, name, XSS_OPEN_CONTAINER);
+}
 
-    return rc;
+xo_ssize_t
+xo_open_container_h (xo_handle_t *xop, const char *name)
+{
+    return xo_open_container_hf(xop, 0, name);
 }
 
 xo_ssize_t
-xo_attr (const char *name, const char *fmt, ...)
+xo_open_container (const char *name)
 {
-    ssize_t rc;
-    va_list vap;
+    return xo_open_container_hf(NULL, 0, name);
+}
 
-    va_start(vap, fmt);
-    rc = xo_attr_hv(NULL, name, fmt, vap);
-    va_end(vap);
+xo_ssize_t
+xo_open_container_hd (xo_handle_t *xop, const char *name)
+{
+    return xo_open_container_hf(xop, XOF_DTRT, name);
+}
 
-    return rc;
+xo_ssize_t
+xo_open_container_d (const char *name)
+{
+    return xo_open_container_hf(NULL, XOF_DTRT, name);
 }
 
-static void
-xo_depth_change (xo_handle_t *xop, const char *name,
-		 int delta, int indent, xo_state_t state,
-		 xo_xsf_flags_t flags, xo_filter_status_t fstatus,
-		 xo_off_t starting_offset)
+static int
+xo_do_close_container (xo_handle_t *xop, const char *name)
 {
-    if (xo_style(xop) == XO_STYLE_HTML || xo_style(xop) == XO_STYLE_TEXT)
-	indent = 0;
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
 
-    if (XOF_ISSET(xop, XOF_DTRT))
-	flags |= XSF_DTRT;
+    ssize_t rc = 0;
+    const char *ppn = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
+    const char *pre_nl = "";
 
-    if (delta >= 0) {			/* Push operation */
-	if (xo_depth_check(xop, xop->xo_depth + delta))
-	    return;
+    if (name == NULL) {
+	xo_stack_t *xsp = xo_stack_cur(xop);
 
-	xo_stack_t *xsp = &xop->xo_stack[xop->xo_depth + delta];
-	xsp->xs_flags = flags;
-	xsp->xs_state = state;
-	xsp->xs_fstatus = fstatus;
-	xsp->xs_rb_off = starting_offset;
-	xsp->xs_tag_end = XS_OFFSET_CLEAR;
-	xsp->xs_rb_flags = xop->xo_rb_snap; /* parent flags before this open */
-	xop->xo_rb_snap = 0;
-	xo_stack_set_flags(xop);
+	name = xsp->xs_name;
+	if (name) {
+	    ssize_t len = strlen(name) + 1;
+	    /* We need to make a local copy; xo_depth_change will free it */
+	    char *cp = alloca(len);
+	    memcpy(cp, name, len);
+	    name = cp;
+	} else {
+	    if (!(xsp->xs_flags & XSF_DTRT))
+		xo_failure(xop, "missing name without 'dtrt' mode");
+	    name = XO_FAILURE_NAME;
+	}
+    }
 
-	XO_DBG(xop, "xo_depth_change: '%s' depth %d, state %u=%s, "
-	       "status %u=%s,  rb_off %d, rb_flags %#x",
-	       name, xop->xo_depth + delta,
-	       state, xo_state_name(state),
-	       fstatus, xo_filt_status_name(fstatus),
-	       (int) starting_offset, xsp->xs_rb_flags);
+    name = xo_map_name(xop, name); /* Find mapped name, if any */
 
-	if (name == NULL)
-	    name = XO_FAILURE_NAME;
+    const char *leader = xo_xml_leader(xop, name);
 
-	xsp->xs_name = xo_strndup(name, -1);
+    if (XOF_ISSET(xop, XOF_FILTER))
+	xo_filt_aggregates(xop);
 
-    } else {			/* Pop operation */
-	if (xop->xo_depth == 0) {
-	    if (!XOF_ISSET(xop, XOF_IGNORE_CLOSE))
-		xo_failure(xop, "close with empty stack: '%s'", name);
-	    return;
-	}
+    /* Now that the work is done, let the filtering code know */
+    xo_stack_t *xsp = xo_stack_cur(xop);
+    xo_filter_status_t old_fstatus = xsp->xs_fstatus;
 
-	xo_stack_t *xsp = xo_stack_cur(xop);
-	if (XOF_ISSET(xop, XOF_WARN)) {
-	    const char *top = xsp->xs_name;
-	    if (top != NULL && name != NULL && !xo_streq(name, top)) {
-		xo_failure(xop, "incorrect close: '%s' .vs. '%s'",
-			      name, top);
-		return;
-	    } 
-	    if ((xsp->xs_flags & XSF_LIST) != (flags & XSF_LIST)) {
-		xo_failure(xop, "list close on list confict: '%s'",
-			      name);
-		return;
-	    }
-	    if ((xsp->xs_flags & XSF_INSTANCE) != (flags & XSF_INSTANCE)) {
-		xo_failure(xop, "list close on instance confict: '%s'",
-			      name);
-		return;
-	    }
+    xo_filter_status_t fstatus;
+    fstatus = xo_filter_close_container(xop, xo_filters(xop), name);
+
+    switch (xo_style(xop)) {
+    case XO_STYLE_XML:
+	/*
+	 * Roll back if this container was tentatively captured (xs_rb_off set)
+	 * and is the top of the tentative region (parent's xs_rb_off is clear).
+	 * Nested containers inside a still-tracked instance must not be rolled
+	 * back independently — the enclosing instance handles that on close.
+	 */
+	if (XOF_ISSET(xop, XOF_FILTER) && xsp->xs_rb_off != XS_OFFSET_CLEAR) {
+	    xo_filt_rollback(xop, xsp, old_fstatus, fstatus);
+	    xo_depth_change(xop, name, -1, -1, XSS_CLOSE_CONTAINER,
+			    XSF_FILTER, fstatus, 0);
+	    break;
 	}
+	xo_depth_change(xop, name, -1, -1, XSS_CLOSE_CONTAINER,
+			XSF_FILTER, fstatus, 0);
+	rc = xo_printf(xop, "%*s</%s%s>%s", xo_indent(xop),
+		       "", leader, name, ppn);
+	break;
 
-	/* Clear any offsets */
-	xsp->xs_rb_off = XS_OFFSET_CLEAR;
-	xsp->xs_tag_end = XS_OFFSET_CLEAR;
-	xsp->xs_key_off = XS_OFFSET_CLEAR;
+    case XO_STYLE_JSON:
+	xo_stack_set_flags(xop);
 
-	if (xsp->xs_name) {
-	    xo_free(xsp->xs_name);
-	    xsp->xs_name = NULL;
-	}
-	if (xsp->xs_keys) {
-	    xo_free(xsp->xs_keys);
-	    xsp->xs_keys = NULL;
+	pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
+	ppn = "";
+
+	if (XOF_ISSET(xop, XOF_FILTER) && xsp->xs_rb_off != XS_OFFSET_CLEAR) {
+	    xo_filt_rollback(xop, xsp, old_fstatus, fstatus);
+	    xo_depth_change(xop, name, -1, -1, XSS_CLOSE_CONTAINER, 0, 0, 0);
+	    break;
 	}
-    }
+	xo_depth_change(xop, name, -1, -1, XSS_CLOSE_CONTAINER, 0, 0, 0);
+	if (xo_is_ndjson(xop) && xo_ndjson_at_base(xop))
+	    ppn = "}\n";	/* Close our wrapper and end the record */
+	rc = xo_printf(xop, "%s%*s}%s", pre_nl, xo_indent(xop), "", ppn);
+	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+	break;
 
-    xop->xo_depth += delta;	/* Record new depth */
-    xop->xo_indent += indent;
-}
+    case XO_STYLE_HTML:
+    case XO_STYLE_TEXT:
+	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_CONTAINER, 0, 0, 0);
+	break;
 
-void
-xo_set_depth (xo_handle_t *xop, int depth)
-{
-    xop = xo_default(xop);
+    case XO_STYLE_SDPARAMS:
+	break;
 
-    if (xo_depth_check(xop, depth))
-	return;
+    case XO_STYLE_ENCODER:
+	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_CONTAINER, 0, 0, 0);
+	rc = xo_encoder_handle(xop, XO_OP_CLOSE_CONTAINER, NULL, name, NULL, 0);
+	break;
+    }
 
-    xop->xo_depth += depth;
-    xop->xo_indent += depth;
+    return rc;
+}
 
-    /*
-     * Handling the "top wrapper" for JSON is a bit of a pain.  Here
-     * we need to detect that the depth has been changed to set the
-     * "XOIF_TOP_EMITTED" flag correctly.
-     */
-    if (xop->xo_style == XO_STYLE_JSON
-	&& !XOF_ISSET(xop, XOF_NO_TOP) && xop->xo_depth > 0)
-	XOIF_SET(xop, XOIF_TOP_EMITTED);
+xo_ssize_t
+xo_close_container_h (xo_handle_t *xop, const char *name)
+{
+    return xo_transition(xop, 0, name, XSS_CLOSE_CONTAINER);
 }
 
-static xo_xsf_flags_t
-xo_stack_flags (xo_xof_flags_t xflags)
+xo_ssize_t
+xo_close_container (const char *name)
 {
-    if (xflags & XOF_DTRT)
-	return XSF_DTRT;
-    return 0;
+    return xo_close_container_h(NULL, name);
 }
 
-static void
-xo_emit_top (xo_handle_t *xop, const char *ppn)
+xo_ssize_t
+xo_close_container_hd (xo_handle_t *xop)
 {
-    xo_printf(xop, "%*s{%s", xo_indent(xop), "", ppn);
-    XOIF_SET(xop, XOIF_TOP_EMITTED);
+    return xo_close_container_h(xop, NULL);
+}
 
-    if (xop->xo_version) {
-	xo_printf(xop, "%*s\"__version\": \"%s\", %s",
-		  xo_indent(xop), "", xop->xo_version, ppn);
-	xo_free(xop->xo_version);
-	xop->xo_version = NULL;
-    }
+xo_ssize_t
+xo_close_container_d (void)
+{
+    return xo_close_container_h(NULL, NULL);
 }
 
-static ssize_t
-xo_do_open_container (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
+static int
+xo_do_open_list (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
 {
     ssize_t rc = 0;
+    int indent = 0;
+
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
+
     const char *ppn = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
     const char *pre_nl = "";
 
-    if (name == NULL) {
-	xo_failure(xop, "NULL passed for container name");
-	name = XO_FAILURE_NAME;
-    }
-
     name = xo_map_name(xop, name); /* Find mapped name, if any */
 
-    xo_filter_status_t fstatus;
-    fstatus = xo_filter_open_container(xop, xo_filters(xop), name);
-
-    xo_stack_t *xsp = xo_stack_cur(xop);
-    xo_filter_status_t old_fstatus = xsp->xs_fstatus;
-
-    const char *leader = xo_xml_leader(xop, name);
-    flags |= xop->xo_flags;	/* Pick up handle flags */
-
-    /* Save the starting point, so depth_change can record it later */
-    xo_off_t starting_offset = xo_buf_offset(&xop->xo_data);
+    xo_off_t starting_offset = xo_filt_offset(xop);
     xop->xo_rb_snap = xop->xo_stack[xop->xo_depth].xs_flags & XSF_RB_BITS;
 
     switch (xo_style(xop)) {
-    case XO_STYLE_XML:
-	if (fstatus == XO_STATUS_DEAD) /* No one wants this */
+    case XO_STYLE_JSON:
+	/* Top-level NDJSON lists are implied by their instances */
+	if (xo_is_ndjson(xop) && xop->xo_depth == 0)
 	    break;
 
-	/*
-	 * If we are newly "full", then we need all our parents to be emitted
-	 */
-	xo_filt_handle_change_status(xop, old_fstatus, fstatus);
-
-	rc = xo_printf(xop, "%*s<%s%s", xo_indent(xop), "", leader, name);
+	indent = 1;
+	if (!XOF_ISSET(xop, XOF_NO_TOP)
+		&& !XOIF_ISSET(xop, XOIF_TOP_EMITTED))
+	    xo_emit_top(xop, ppn);
 
-	if (xop->xo_attrs.xb_curp != xop->xo_attrs.xb_bufp) {
-	    rc += xop->xo_attrs.xb_curp - xop->xo_attrs.xb_bufp;
-	    xo_data_append(xop, xop->xo_attrs.xb_bufp,
-			   xop->xo_attrs.xb_curp - xop->xo_attrs.xb_bufp);
-	    xo_buf_reset(&xop->xo_attrs);
+	if (name == NULL) {
+	    xo_failure(xop, "NULL passed for list name");
+	    name = XO_FAILURE_NAME;
 	}
 
-	rc += xo_printf(xop, ">%s", ppn);
-	break;
-
-    case XO_STYLE_JSON:
-	/*
-	 * If we are newly "full", then we need all our parents to be emitted
-	 */
-	xo_filt_handle_change_status(xop, old_fstatus, fstatus);
-
 	xo_stack_set_flags(xop);
 
-	if (!XOF_ISSET(xop, XOF_NO_TOP)
-	        && !XOIF_ISSET(xop, XOIF_TOP_EMITTED))
-	    xo_emit_top(xop, ppn);
-
 	if (xop->xo_stack[xop->xo_depth].xs_flags & XSF_NOT_FIRST)
 	    pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? ",\n" : ", ";
 	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
@@ -8547,89 +11141,217 @@ xo_do_open_container (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
 	    new_name = buf;
 	}
 
-	rc = xo_printf(xop, "%s%*s\"%s\": {%s",
+	rc = xo_printf(xop, "%s%*s\"%s\": [%s",
 		       pre_nl, xo_indent(xop), "", new_name, ppn);
 	break;
 
-    case XO_STYLE_SDPARAMS:
-	break;
-
     case XO_STYLE_ENCODER:
-	rc = xo_encoder_handle(xop, XO_OP_OPEN_CONTAINER, NULL,
-			       name, NULL, flags);
+	rc = xo_encoder_handle(xop, XO_OP_OPEN_LIST, NULL, name, NULL, flags);
 	break;
     }
 
     /*
-     * FULL frames are permanently committed; xs_rb_off must be CLEAR so the
-     * close path writes the closing tag normally instead of entering the
-     * rollback branch and skipping it.
+     * When the parent frame is committed (FULL), its xs_rb_off is CLEAR but
+     * the list frame we are about to push will carry a live starting_offset.
+     * If a tty or high-water flush fires before the first FULL item triggers
+     * commit_compact, that offset becomes meaningless — commit_compact would
+     * use it to set xb_curp to a position that no longer corresponds to the
+     * ancestor content in the buffer, corrupting output.  Keep
+     * XOIF_FILTERING set so xo_avoid_flushing() suppresses any such flush
+     * until commit_compact fires and clears both xs_rb_off and XOIF_FILTERING.
      */
     if (XOF_ISSET(xop, XOF_FILTER)) {
-	if (fstatus == XO_STATUS_FULL || fstatus == XO_STATUS_ZERO)
-	    starting_offset = XS_OFFSET_CLEAR;
+	if (xo_stack_cur(xop)->xs_fstatus == XO_STATUS_FULL)
+	    XOIF_SET(xop, XOIF_FILTERING);
     }
 
-    /*
-     * After compact-commit clears XOIF_FILTERING, a new TRACK container
-     * that opens as a sibling of the committed region still needs
-     * XOIF_FILTERING set so that the buffer is not flushed to the fd
-     * before the rollback on close (which would make the opening tag
-     * permanent while the closing tag is suppressed).  Mirror the same
-     * guard used in xo_do_open_instance().
-     */
-    if (XOF_ISSET(xop, XOF_FILTER)) {
-	if (fstatus == XO_STATUS_PRED)
-	    XOIF_SET(xop, XOIF_FILTERING);
-	else if (fstatus == XO_STATUS_TRACK && old_fstatus == XO_STATUS_FULL)
-	    XOIF_SET(xop, XOIF_FILTERING);
+    xo_depth_change(xop, name, 1, indent, XSS_OPEN_LIST,
+		    XSF_LIST | xo_stack_flags(flags), 0, starting_offset);
+
+    xo_stack_cur(xop)->xs_tag_end = xo_filt_offset(xop);
+
+    return rc;
+}
+
+xo_ssize_t
+xo_open_list_hf (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
+{
+    return xo_transition(xop, flags, name, XSS_OPEN_LIST);
+}
+
+xo_ssize_t
+xo_open_list_h (xo_handle_t *xop, const char *name)
+{
+    return xo_open_list_hf(xop, 0, name);
+}
+
+xo_ssize_t
+xo_open_list (const char *name)
+{
+    return xo_open_list_hf(NULL, 0, name);
+}
+
+xo_ssize_t
+xo_open_list_hd (xo_handle_t *xop, const char *name)
+{
+    return xo_open_list_hf(xop, XOF_DTRT, name);
+}
+
+xo_ssize_t
+xo_open_list_d (const char *name)
+{
+    return xo_open_list_hf(NULL, XOF_DTRT, name);
+}
+
+static int
+xo_do_close_list (xo_handle_t *xop, const char *name)
+{
+    ssize_t rc = 0;
+    const char *pre_nl = "";
+
+    if (name == NULL) {
+	xo_stack_t *xsp = xo_stack_cur(xop);
+
+	name = xsp->xs_name;
+	if (name) {
+	    ssize_t len = strlen(name) + 1;
+	    /* We need to make a local copy; xo_depth_change will free it */
+	    char *cp = alloca(len);
+	    memcpy(cp, name, len);
+	    name = cp;
+	} else {
+	    if (!(xsp->xs_flags & XSF_DTRT))
+		xo_failure(xop, "missing name without 'dtrt' mode");
+	    name = XO_FAILURE_NAME;
+	}
     }
 
-    xo_depth_change(xop, name, 1, 1, XSS_OPEN_CONTAINER,
-		    xo_stack_flags(flags), fstatus, starting_offset);
+    name = xo_map_name(xop, name); /* Find mapped name, if any */
+
+    xo_stack_t *xsp = xo_stack_cur(xop);
+
+    switch (xo_style(xop)) {
+    case XO_STYLE_JSON:
+	if (xo_is_ndjson(xop) && xop->xo_depth == 1) {
+	    xo_depth_change(xop, name, -1, 0, XSS_CLOSE_LIST, XSF_LIST, 0, 0);
+	    break;
+	}
+
+	if (xop->xo_stack[xop->xo_depth].xs_flags & XSF_NOT_FIRST)
+	    pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
+	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+
+	if (XOF_ISSET(xop, XOF_FILTER) && xsp->xs_rb_off != XS_OFFSET_CLEAR) {
+	    xo_filt_rollback(xop, xsp, xsp->xs_fstatus, xsp->xs_fstatus);
+	    xo_depth_change(xop, name, -1, -1, XSS_CLOSE_LIST, XSF_LIST, 0, 0);
+	    break;
+	}
 
-    xo_stack_cur(xop)->xs_tag_end = xo_buf_offset(&xop->xo_data);
+	xo_depth_change(xop, name, -1, -1, XSS_CLOSE_LIST, XSF_LIST, 0, 0);
+	rc = xo_printf(xop, "%s%*s]", pre_nl, xo_indent(xop), "");
+	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+	break;
+
+    case XO_STYLE_ENCODER:
+	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_LIST, XSF_LIST, 0, 0);
+	rc = xo_encoder_handle(xop, XO_OP_CLOSE_LIST, NULL, name, NULL, 0);
+	break;
+
+    default:
+	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_LIST, XSF_LIST, 0, 0);
+	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+	break;
+    }
 
     return rc;
 }
 
 xo_ssize_t
-xo_open_container_hf (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
+xo_close_list_h (xo_handle_t *xop, const char *name)
 {
-    return xo_transition(xop, flags, name, XSS_OPEN_CONTAINER);
+    return xo_transition(xop, 0, name, XSS_CLOSE_LIST);
 }
 
 xo_ssize_t
-xo_open_container_h (xo_handle_t *xop, const char *name)
+xo_close_list (const char *name)
 {
-    return xo_open_container_hf(xop, 0, name);
+    return xo_close_list_h(NULL, name);
 }
 
 xo_ssize_t
-xo_open_container (const char *name)
+xo_close_list_hd (xo_handle_t *xop)
 {
-    return xo_open_container_hf(NULL, 0, name);
+    return xo_close_list_h(xop, NULL);
+}
+
+xo_ssize_t
+xo_close_list_d (void)
+{
+    return xo_close_list_h(NULL, NULL);
 }
 
-xo_ssize_t
-xo_open_container_hd (xo_handle_t *xop, const char *name)
-{
-    return xo_open_container_hf(xop, XOF_DTRT, name);
-}
+static int
+xo_do_open_leaf_list (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
+{
+    ssize_t rc = 0;
+    int indent = 0;
+
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
+
+    const char *ppn = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
+    const char *pre_nl = "";
+
+    name = xo_map_name(xop, name); /* Find mapped name, if any */
+
+    xo_off_t starting_offset = xo_filt_offset(xop);
+    xop->xo_rb_snap = xop->xo_stack[xop->xo_depth].xs_flags & XSF_RB_BITS;
+
+    switch (xo_style(xop)) {
+    case XO_STYLE_JSON:
+	indent = 1;
+
+	if (!XOF_ISSET(xop, XOF_NO_TOP)) {
+	    if (!XOIF_ISSET(xop, XOIF_TOP_EMITTED)) {
+		xo_printf(xop, "%*s{%s", xo_indent(xop), "", ppn);
+		XOIF_SET(xop, XOIF_TOP_EMITTED);
+	    }
+	}
+
+	if (name == NULL) {
+	    xo_failure(xop, "NULL passed for list name");
+	    name = XO_FAILURE_NAME;
+	}
+
+	xo_stack_set_flags(xop);
+
+	if (xop->xo_stack[xop->xo_depth].xs_flags & XSF_NOT_FIRST)
+	    pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? ",\n" : ", ";
+	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+
+	rc = xo_printf(xop, "%s%*s\"%s\": [%s",
+		       pre_nl, xo_indent(xop), "", name, ppn);
+	break;
+
+    case XO_STYLE_ENCODER:
+	rc = xo_encoder_handle(xop, XO_OP_OPEN_LEAF_LIST, NULL,
+			       name, NULL, flags);
+	break;
+    }
+
+    xo_depth_change(xop, name, 1, indent, XSS_OPEN_LEAF_LIST,
+		    XSF_LIST | xo_stack_flags(flags), 0, starting_offset);
 
-xo_ssize_t
-xo_open_container_d (const char *name)
-{
-    return xo_open_container_hf(NULL, XOF_DTRT, name);
+    xo_stack_cur(xop)->xs_tag_end = xo_filt_offset(xop);
+
+    return rc;
 }
 
 static int
-xo_do_close_container (xo_handle_t *xop, const char *name)
+xo_do_close_leaf_list (xo_handle_t *xop, const char *name)
 {
-    xop = xo_default(xop);
-
     ssize_t rc = 0;
-    const char *ppn = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
     const char *pre_nl = "";
 
     if (name == NULL) {
@@ -8651,206 +11373,195 @@ xo_do_close_container (xo_handle_t *xop, const char *name)
 
     name = xo_map_name(xop, name); /* Find mapped name, if any */
 
-    const char *leader = xo_xml_leader(xop, name);
-
-    /* Now that the work is done, let the filtering code know */
     xo_stack_t *xsp = xo_stack_cur(xop);
-    xo_filter_status_t old_fstatus = xsp->xs_fstatus;
-
-    xo_filter_status_t fstatus;
-    fstatus = xo_filter_close_container(xop, xo_filters(xop), name);
 
     switch (xo_style(xop)) {
-    case XO_STYLE_XML:
-	/*
-	 * Roll back if this container was tentatively captured (xs_rb_off set)
-	 * and is the top of the tentative region (parent's xs_rb_off is clear).
-	 * Nested containers inside a still-tracked instance must not be rolled
-	 * back independently — the enclosing instance handles that on close.
-	 */
-	if (XOF_ISSET(xop, XOF_FILTER) && xsp->xs_rb_off != XS_OFFSET_CLEAR) {
-	    xo_filt_rollback(xop, xsp, old_fstatus, fstatus);
-	    xo_depth_change(xop, name, -1, -1, XSS_CLOSE_CONTAINER,
-			    XSF_FILTER, fstatus, 0);
-	    break;
-	}
-	xo_depth_change(xop, name, -1, -1, XSS_CLOSE_CONTAINER,
-			XSF_FILTER, fstatus, 0);
-	rc = xo_printf(xop, "%*s</%s%s>%s", xo_indent(xop),
-		       "", leader, name, ppn);
-	break;
-
     case XO_STYLE_JSON:
-	xo_stack_set_flags(xop);
-
-	pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
-	ppn = "";
+	if (xop->xo_stack[xop->xo_depth].xs_flags & XSF_NOT_FIRST)
+	    pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
+	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
 
 	if (XOF_ISSET(xop, XOF_FILTER) && xsp->xs_rb_off != XS_OFFSET_CLEAR) {
-	    xo_filt_rollback(xop, xsp, old_fstatus, fstatus);
-	    xo_depth_change(xop, name, -1, -1, XSS_CLOSE_CONTAINER, 0, 0, 0);
+	    xo_filt_rollback(xop, xsp, xsp->xs_fstatus, xsp->xs_fstatus);
+	    xo_depth_change(xop, name, -1, -1, XSS_CLOSE_LEAF_LIST, XSF_LIST, 0, 0);
 	    break;
 	}
-	xo_depth_change(xop, name, -1, -1, XSS_CLOSE_CONTAINER, 0, 0, 0);
-	rc = xo_printf(xop, "%s%*s}%s", pre_nl, xo_indent(xop), "", ppn);
-	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
-	break;
 
-    case XO_STYLE_HTML:
-    case XO_STYLE_TEXT:
-	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_CONTAINER, 0, 0, 0);
+	xo_depth_change(xop, name, -1, -1, XSS_CLOSE_LEAF_LIST, XSF_LIST, 0, 0);
+	rc = xo_printf(xop, "%s%*s]", pre_nl, xo_indent(xop), "");
+	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
 	break;
 
-    case XO_STYLE_SDPARAMS:
+    case XO_STYLE_XML:
+	/*
+	 * A leaf-list emits no wrapping tag, but its members may have been
+	 * buffered tentatively while filtering (xs_rb_off set).  Roll them
+	 * back on close if the list never matched, just as the JSON path
+	 * (and xo_do_close_container/instance) do.
+	 */
+	if (XOF_ISSET(xop, XOF_FILTER) && xsp->xs_rb_off != XS_OFFSET_CLEAR)
+	    xo_filt_rollback(xop, xsp, xsp->xs_fstatus, xsp->xs_fstatus);
+	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_LEAF_LIST, XSF_LIST, 0, 0);
+	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
 	break;
 
     case XO_STYLE_ENCODER:
-	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_CONTAINER, 0, 0, 0);
-	rc = xo_encoder_handle(xop, XO_OP_CLOSE_CONTAINER, NULL, name, NULL, 0);
+	rc = xo_encoder_handle(xop, XO_OP_CLOSE_LEAF_LIST, NULL, name, NULL, 0);
+	/* FALLTHRU */
+
+    default:
+	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_LEAF_LIST, XSF_LIST, 0, 0);
+	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
 	break;
     }
 
     return rc;
 }
 
-xo_ssize_t
-xo_close_container_h (xo_handle_t *xop, const char *name)
-{
-    return xo_transition(xop, 0, name, XSS_CLOSE_CONTAINER);
-}
-
-xo_ssize_t
-xo_close_container (const char *name)
-{
-    return xo_close_container_h(NULL, name);
-}
-
-xo_ssize_t
-xo_close_container_hd (xo_handle_t *xop)
-{
-    return xo_close_container_h(xop, NULL);
-}
-
-xo_ssize_t
-xo_close_container_d (void)
-{
-    return xo_close_container_h(NULL, NULL);
-}
-
 static int
-xo_do_open_list (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
+xo_do_open_instance (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
 {
-    ssize_t rc = 0;
-    int indent = 0;
-
     xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
 
+    ssize_t rc = 0;
     const char *ppn = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
     const char *pre_nl = "";
 
+    if (name == NULL) {
+	xo_failure(xop, "NULL passed for instance name");
+	name = XO_FAILURE_NAME;
+    }
+
     name = xo_map_name(xop, name); /* Find mapped name, if any */
 
-    xo_off_t starting_offset = xo_buf_offset(&xop->xo_data);
+    xo_stack_t *xsp = xo_stack_cur(xop);
+    xo_filter_status_t old_fstatus = xsp->xs_fstatus;
+
+    xo_off_t start_offset = xo_filt_offset(xop);
     xop->xo_rb_snap = xop->xo_stack[xop->xo_depth].xs_flags & XSF_RB_BITS;
 
+    xo_filter_status_t fstatus;
+    fstatus = xo_filter_open_instance(xop, xo_filters(xop), name);
+
+    const char *leader = xo_xml_leader(xop, name);
+    flags |= xop->xo_flags;
+
     switch (xo_style(xop)) {
-    case XO_STYLE_JSON:
+    case XO_STYLE_XML:
+	if (fstatus == XO_STATUS_DEAD) /* No one wants this */
+	    break;
 
-	indent = 1;
-	if (!XOF_ISSET(xop, XOF_NO_TOP)
-		&& !XOIF_ISSET(xop, XOIF_TOP_EMITTED))
-	    xo_emit_top(xop, ppn);
+	/*
+	 * If we are newly "full", then we need all our parents to be emitted
+	 */
+	xo_filt_handle_change_status(xop, old_fstatus, fstatus);
 
-	if (name == NULL) {
-	    xo_failure(xop, "NULL passed for list name");
-	    name = XO_FAILURE_NAME;
+	rc = xo_printf(xop, "%*s<%s%s", xo_indent(xop), "", leader, name);
+
+	if (xop->xo_attrs.xb_curp != xop->xo_attrs.xb_bufp) {
+	    rc += xop->xo_attrs.xb_curp - xop->xo_attrs.xb_bufp;
+	    xo_data_append(xop, xop->xo_attrs.xb_bufp,
+			   xop->xo_attrs.xb_curp - xop->xo_attrs.xb_bufp);
+	    xo_buf_reset(&xop->xo_attrs);
 	}
 
+	rc += xo_printf(xop, ">%s", ppn);
+	break;
+
+    case XO_STYLE_JSON:
+	/*
+	 * If we are newly "full", then we need all our parents to be emitted
+	 */
+	xo_filt_handle_change_status(xop, old_fstatus, fstatus);
+
 	xo_stack_set_flags(xop);
 
 	if (xop->xo_stack[xop->xo_depth].xs_flags & XSF_NOT_FIRST)
 	    pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? ",\n" : ", ";
 	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
 
-	/* If we need underscores, make a local copy and doctor it */
-	const char *new_name = name;
-	if (XOF_ISSET(xop, XOF_UNDERSCORES)) {
-	    size_t len = strlen(name);
-	    const char *old_name = name;
-	    char *buf, *cp, *ep;
+	/* NDJSON records are separated by newlines, not commas */
+	if (xo_is_ndjson(xop) && xo_ndjson_at_base(xop))
+	    pre_nl = "";
 
-	    buf = alloca(len + 1);
-	    for (cp = buf, ep = buf + len + 1; cp < ep; cp++, old_name++)
-		*cp = (*old_name == '-') ? '_' : *old_name;
-	    new_name = buf;
-	}
+	rc = xo_printf(xop, "%s%*s{%s",
+		       pre_nl, xo_indent(xop), "", ppn);
+	break;
 
-	rc = xo_printf(xop, "%s%*s\"%s\": [%s",
-		       pre_nl, xo_indent(xop), "", new_name, ppn);
+    case XO_STYLE_SDPARAMS:
 	break;
 
     case XO_STYLE_ENCODER:
-	rc = xo_encoder_handle(xop, XO_OP_OPEN_LIST, NULL, name, NULL, flags);
+	rc = xo_encoder_handle(xop, XO_OP_OPEN_INSTANCE, NULL,
+			       name, NULL, flags);
 	break;
     }
 
     /*
-     * When the parent frame is committed (FULL), its xs_rb_off is CLEAR but
-     * the list frame we are about to push will carry a live starting_offset.
-     * If a tty or high-water flush fires before the first FULL item triggers
-     * commit_compact, that offset becomes meaningless — commit_compact would
-     * use it to set xb_curp to a position that no longer corresponds to the
-     * ancestor content in the buffer, corrupting output.  Keep
-     * XOIF_FILTERING set so xo_avoid_flushing() suppresses any such flush
-     * until commit_compact fires and clears both xs_rb_off and XOIF_FILTERING.
+     * Set XOIF_FILTERING so xs_rb_off is preserved by xo_depth_change:
+     *
+     * PRED: key/non-key predicate pending — buffer tentatively until resolved.
+     *
+     * TRACK after FULL: positional predicate already matched (old_fstatus==FULL);
+     *   subsequent siblings are TRACK and must be buffered so their whiteboard
+     *   can be discarded on close.
      */
     if (XOF_ISSET(xop, XOF_FILTER)) {
-	if (xo_stack_cur(xop)->xs_fstatus == XO_STATUS_FULL)
+	if (fstatus == XO_STATUS_PRED)
+	    XOIF_SET(xop, XOIF_FILTERING);
+	else if (fstatus == XO_STATUS_TRACK && old_fstatus == XO_STATUS_FULL)
 	    XOIF_SET(xop, XOIF_FILTERING);
     }
 
-    xo_depth_change(xop, name, 1, indent, XSS_OPEN_LIST,
-		    XSF_LIST | xo_stack_flags(flags), 0, starting_offset);
+    xo_depth_change(xop, name, 1, 1, XSS_OPEN_INSTANCE,
+		    xo_stack_flags(flags), fstatus, start_offset);
 
-    xo_stack_cur(xop)->xs_tag_end = xo_buf_offset(&xop->xo_data);
+    xo_stack_cur(xop)->xs_tag_end = xo_filt_offset(xop);
 
     return rc;
 }
 
 xo_ssize_t
-xo_open_list_hf (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
+xo_open_instance_hf (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
 {
-    return xo_transition(xop, flags, name, XSS_OPEN_LIST);
+    return xo_transition(xop, flags, name, XSS_OPEN_INSTANCE);
 }
 
 xo_ssize_t
-xo_open_list_h (xo_handle_t *xop, const char *name)
+xo_open_instance_h (xo_handle_t *xop, const char *name)
 {
-    return xo_open_list_hf(xop, 0, name);
+    return xo_open_instance_hf(xop, 0, name);
 }
 
 xo_ssize_t
-xo_open_list (const char *name)
+xo_open_instance (const char *name)
 {
-    return xo_open_list_hf(NULL, 0, name);
+    return xo_open_instance_hf(NULL, 0, name);
 }
 
 xo_ssize_t
-xo_open_list_hd (xo_handle_t *xop, const char *name)
+xo_open_instance_hd (xo_handle_t *xop, const char *name)
 {
-    return xo_open_list_hf(xop, XOF_DTRT, name);
+    return xo_open_instance_hf(xop, XOF_DTRT, name);
 }
 
 xo_ssize_t
-xo_open_list_d (const char *name)
+xo_open_instance_d (const char *name)
 {
-    return xo_open_list_hf(NULL, XOF_DTRT, name);
+    return xo_open_instance_hf(NULL, XOF_DTRT, name);
 }
 
 static int
-xo_do_close_list (xo_handle_t *xop, const char *name)
+xo_do_close_instance (xo_handle_t *xop, const char *name)
 {
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
+
     ssize_t rc = 0;
+    const char *ppn = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
     const char *pre_nl = "";
 
     if (name == NULL) {
@@ -8868,37 +11579,71 @@ xo_do_close_list (xo_handle_t *xop, const char *name)
 		xo_failure(xop, "missing name without 'dtrt' mode");
 	    name = XO_FAILURE_NAME;
 	}
-    }
+    }
+
+    name = xo_map_name(xop, name); /* Find mapped name, if any */
+
+    const char *leader = xo_xml_leader(xop, name);
+
+    xo_stack_t *xsp = xo_stack_cur(xop);
+    xo_filter_status_t old_fstatus = xsp->xs_fstatus;
+
+    /* Let the filter code know we're closing */
+    xo_filter_status_t fstatus;
+    fstatus = xo_filter_close_instance(xop, xo_filters(xop), name);
+
+    /*
+     * If a non-key predicate was force-resolved to FULL at close time
+     * (the predicate field was absent from this instance), commit the
+     * rollback so all tentatively-buffered sibling content is kept.
+     */
+    if (XOF_ISSET(xop, XOF_FILTER)
+	    && old_fstatus == XO_STATUS_PRED && fstatus == XO_STATUS_FULL) {
+	xo_filt_commit(xop, xsp, XO_STATUS_FULL);
+	old_fstatus = XO_STATUS_FULL;
+    }
+
+    switch (xo_style(xop)) {
+    case XO_STYLE_XML:
+	if (XOF_ISSET(xop, XOF_FILTER)) {
+	    xo_filt_rollback(xop, xsp, old_fstatus, fstatus);
+	}
 
-    name = xo_map_name(xop, name); /* Find mapped name, if any */
+	xo_depth_change(xop, name, -1, -1, XSS_CLOSE_INSTANCE, 0, fstatus, 0);
 
-    xo_stack_t *xsp = xo_stack_cur(xop);
+	if (!XOF_ISSET(xop, XOF_FILTER)
+	        || xo_filt_want_output(xop, old_fstatus))
+	    rc = xo_printf(xop, "%*s</%s%s>%s", xo_indent(xop), "",
+			   leader, name, ppn);
+	break;
 
-    switch (xo_style(xop)) {
     case XO_STYLE_JSON:
-	if (xop->xo_stack[xop->xo_depth].xs_flags & XSF_NOT_FIRST)
-	    pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
-	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+	pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
 
 	if (XOF_ISSET(xop, XOF_FILTER) && xsp->xs_rb_off != XS_OFFSET_CLEAR) {
-	    xo_filt_rollback(xop, xsp, xsp->xs_fstatus, xsp->xs_fstatus);
-	    xo_depth_change(xop, name, -1, -1, XSS_CLOSE_LIST, XSF_LIST, 0, 0);
+	    xo_filt_rollback(xop, xsp, old_fstatus, fstatus);
+	    xo_depth_change(xop, name, -1, -1, XSS_CLOSE_INSTANCE, 0, 0, 0);
 	    break;
 	}
 
-	xo_depth_change(xop, name, -1, -1, XSS_CLOSE_LIST, XSF_LIST, 0, 0);
-	rc = xo_printf(xop, "%s%*s]", pre_nl, xo_indent(xop), "");
+	xo_depth_change(xop, name, -1, -1, XSS_CLOSE_INSTANCE, 0, 0, 0);
+	rc = xo_printf(xop, "%s%*s}%s", pre_nl, xo_indent(xop), "",
+		       (xo_is_ndjson(xop) && xo_ndjson_at_base(xop))
+		       ? "\n" : "");
 	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
 	break;
 
-    case XO_STYLE_ENCODER:
-	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_LIST, XSF_LIST, 0, 0);
-	rc = xo_encoder_handle(xop, XO_OP_CLOSE_LIST, NULL, name, NULL, 0);
+    case XO_STYLE_HTML:
+    case XO_STYLE_TEXT:
+	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_INSTANCE, 0, 0, 0);
 	break;
 
-    default:
-	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_LIST, XSF_LIST, 0, 0);
-	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+    case XO_STYLE_SDPARAMS:
+	break;
+
+    case XO_STYLE_ENCODER:
+	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_INSTANCE, 0, 0, 0);
+	rc = xo_encoder_handle(xop, XO_OP_CLOSE_INSTANCE, NULL, name, NULL, 0);
 	break;
     }
 
@@ -8906,862 +11651,1338 @@ xo_do_close_list (xo_handle_t *xop, const char *name)
 }
 
 xo_ssize_t
-xo_close_list_h (xo_handle_t *xop, const char *name)
+xo_close_instance_h (xo_handle_t *xop, const char *name)
 {
-    return xo_transition(xop, 0, name, XSS_CLOSE_LIST);
+    return xo_transition(xop, 0, name, XSS_CLOSE_INSTANCE);
 }
 
 xo_ssize_t
-xo_close_list (const char *name)
+xo_close_instance (const char *name)
 {
-    return xo_close_list_h(NULL, name);
+    return xo_close_instance_h(NULL, name);
 }
 
 xo_ssize_t
-xo_close_list_hd (xo_handle_t *xop)
+xo_close_instance_hd (xo_handle_t *xop)
 {
-    return xo_close_list_h(xop, NULL);
+    return xo_close_instance_h(xop, NULL);
 }
 
 xo_ssize_t
-xo_close_list_d (void)
+xo_close_instance_d (void)
 {
-    return xo_close_list_h(NULL, NULL);
+    return xo_close_instance_h(NULL, NULL);
 }
 
 static int
-xo_do_open_leaf_list (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
+xo_do_close_all (xo_handle_t *xop, xo_stack_t *limit)
 {
+    xo_stack_t *xsp;
     ssize_t rc = 0;
-    int indent = 0;
+    xo_xsf_flags_t flags;
 
-    xop = xo_default(xop);
+    for (xsp = xo_stack_cur(xop); xsp >= limit; xsp--) {
+	switch (xsp->xs_state) {
+	case XSS_INIT:
+	    /* Nothing */
+	    rc = 0;
+	    break;
 
-    const char *ppn = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
-    const char *pre_nl = "";
+	case XSS_OPEN_CONTAINER:
+	    rc = xo_do_close_container(xop, NULL);
+	    break;
 
-    name = xo_map_name(xop, name); /* Find mapped name, if any */
+	case XSS_OPEN_LIST:
+	    rc = xo_do_close_list(xop, NULL);
+	    break;
 
-    xo_off_t starting_offset = xo_buf_offset(&xop->xo_data);
-    xop->xo_rb_snap = xop->xo_stack[xop->xo_depth].xs_flags & XSF_RB_BITS;
+	case XSS_OPEN_INSTANCE:
+	    rc = xo_do_close_instance(xop, NULL);
+	    break;
 
-    switch (xo_style(xop)) {
-    case XO_STYLE_JSON:
-	indent = 1;
+	case XSS_OPEN_LEAF_LIST:
+	    rc = xo_do_close_leaf_list(xop, NULL);
+	    break;
 
-	if (!XOF_ISSET(xop, XOF_NO_TOP)) {
-	    if (!XOIF_ISSET(xop, XOIF_TOP_EMITTED)) {
-		xo_printf(xop, "%*s{%s", xo_indent(xop), "", ppn);
-		XOIF_SET(xop, XOIF_TOP_EMITTED);
-	    }
+	case XSS_MARKER:
+	    flags = xsp->xs_flags & XSF_MARKER_FLAGS;
+	    xo_depth_change(xop, xsp->xs_name, -1, 0, XSS_MARKER, 0, 0, 0);
+	    xop->xo_stack[xop->xo_depth].xs_flags |= flags;
+	    rc = 0;
+	    break;
 	}
 
-	if (name == NULL) {
-	    xo_failure(xop, "NULL passed for list name");
-	    name = XO_FAILURE_NAME;
-	}
+	if (rc < 0)
+	    xo_failure(xop, "close %d failed: %d", xsp->xs_state, rc);
+    }
 
-	xo_stack_set_flags(xop);
+    return 0;
+}
 
-	if (xop->xo_stack[xop->xo_depth].xs_flags & XSF_NOT_FIRST)
-	    pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? ",\n" : ", ";
-	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+/*
+ * This function is responsible for clearing out whatever is needed
+ * to get to the desired state, if possible.
+ */
+static int
+xo_do_close (xo_handle_t *xop, const char *name, xo_state_t new_state)
+{
+    xo_stack_t *xsp, *limit = NULL;
+    ssize_t rc;
+    xo_state_t need_state = new_state;
 
-	rc = xo_printf(xop, "%s%*s\"%s\": [%s",
-		       pre_nl, xo_indent(xop), "", name, ppn);
-	break;
+    if (new_state == XSS_CLOSE_CONTAINER)
+	need_state = XSS_OPEN_CONTAINER;
+    else if (new_state == XSS_CLOSE_LIST)
+	need_state = XSS_OPEN_LIST;
+    else if (new_state == XSS_CLOSE_INSTANCE)
+	need_state = XSS_OPEN_INSTANCE;
+    else if (new_state == XSS_CLOSE_LEAF_LIST)
+	need_state = XSS_OPEN_LEAF_LIST;
+    else if (new_state == XSS_MARKER)
+	need_state = XSS_MARKER;
+    else
+	return 0; /* Unknown or useless new states are ignored */
 
-    case XO_STYLE_ENCODER:
-	rc = xo_encoder_handle(xop, XO_OP_OPEN_LEAF_LIST, NULL,
-			       name, NULL, flags);
+    name = xo_map_name(xop, name);
+
+    for (xsp = xo_stack_cur(xop); xsp > xop->xo_stack; xsp--) {
+	/*
+	 * Marker's normally stop us from going any further, unless
+	 * we are popping a marker (new_state == XSS_MARKER).
+	 */
+	if (xsp->xs_state == XSS_MARKER && need_state != XSS_MARKER) {
+	    if (name) {
+		xo_failure(xop, "close (xo_%s) fails at marker '%s'; "
+			   "not found '%s'",
+			   xo_state_name(new_state),
+			   xsp->xs_name, name);
+		return 0;
+
+	    } else {
+		limit = xsp;
+		xo_failure(xop, "close stops at marker '%s'", xsp->xs_name);
+	    }
+	    break;
+	}
+	
+	if (xsp->xs_state != need_state)
+	    continue;
+
+	if (name && xsp->xs_name && !xo_streq(name, xsp->xs_name))
+	    continue;
+
+	limit = xsp;
 	break;
     }
 
-    xo_depth_change(xop, name, 1, indent, XSS_OPEN_LEAF_LIST,
-		    XSF_LIST | xo_stack_flags(flags), 0, starting_offset);
+    if (limit == NULL) {
+	xo_failure(xop, "xo_%s can't find match for '%s'",
+		   xo_state_name(new_state), name);
+	return 0;
+    }
 
-    xo_stack_cur(xop)->xs_tag_end = xo_buf_offset(&xop->xo_data);
+    rc = xo_do_close_all(xop, limit);
 
     return rc;
 }
 
-static int
-xo_do_close_leaf_list (xo_handle_t *xop, const char *name)
+/*
+ * We are in a given state and need to transition to the new state.
+ */
+static ssize_t
+xo_marker_prevents_close (xo_handle_t *xop, int old_state, int new_state)
+{
+    xo_failure(xop, "marker '%s' prevents transition from %s to %s",
+	       xop->xo_stack[xop->xo_depth].xs_name,
+	       xo_state_name(old_state), xo_state_name(new_state));
+    return -1;
+}
+
+static ssize_t
+xo_transition (xo_handle_t *xop, xo_xof_flags_t flags, const char *name,
+	       xo_state_t new_state)
 {
     ssize_t rc = 0;
-    const char *pre_nl = "";
 
-    if (name == NULL) {
-	xo_stack_t *xsp = xo_stack_cur(xop);
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
 
-	name = xsp->xs_name;
-	if (name) {
-	    ssize_t len = strlen(name) + 1;
-	    /* We need to make a local copy; xo_depth_change will free it */
-	    char *cp = alloca(len);
-	    memcpy(cp, name, len);
-	    name = cp;
-	} else {
-	    if (!(xsp->xs_flags & XSF_DTRT))
-		xo_failure(xop, "missing name without 'dtrt' mode");
-	    name = XO_FAILURE_NAME;
-	}
-    }
+    if (xop->xo_tee) {
+	int i;
 
-    name = xo_map_name(xop, name); /* Find mapped name, if any */
+	for (i = 0; i < xop->xo_tee_count; i++)
+	    if (xo_transition(xop->xo_tee[i], flags, name, new_state) < 0)
+		rc = -1;
+	return rc;
+    }
 
     xo_stack_t *xsp = xo_stack_cur(xop);
+    int old_state = xsp->xs_state;
+    int on_marker = (old_state == XSS_MARKER);
+    int flush = XOF_ISSET(xop, XOF_FLUSH);
+
+    /* If there's a marker on top of the stack, we need to find a real state */
+    while (old_state == XSS_MARKER) {
+	if (xsp == xop->xo_stack)
+	    break;
+	xsp -= 1;
+	old_state = xsp->xs_state;
+    }
+
+    /*
+     * At this point, the list of possible states are:
+     *   XSS_INIT, XSS_OPEN_CONTAINER, XSS_OPEN_LIST,
+     *   XSS_OPEN_INSTANCE, XSS_OPEN_LEAF_LIST, XSS_DISCARDING
+     */
+    switch (XSS_TRANSITION(old_state, new_state)) {
+
+    case XSS_TRANSITION(XSS_INIT, XSS_OPEN_CONTAINER):
+    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_OPEN_CONTAINER):
+    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_OPEN_CONTAINER):
+       rc = xo_do_open_container(xop, flags, name);
+       break;
+
+    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_OPEN_CONTAINER):
+    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_OPEN_CONTAINER):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close_leaf_list(xop, NULL);
+	if (rc >= 0)
+	    rc = xo_do_open_container(xop, flags, name);
+	break;
+
+    case XSS_TRANSITION(XSS_INIT, XSS_CLOSE_CONTAINER):
+	/* This is an exception for "xo --close" */
+	rc = xo_do_close_container(xop, name);
+	break;
+
+    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_CLOSE_CONTAINER):
+    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_CLOSE_CONTAINER):
+    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_CLOSE_CONTAINER):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close(xop, name, new_state);
+	break;
 
-    switch (xo_style(xop)) {
-    case XO_STYLE_JSON:
-	if (xop->xo_stack[xop->xo_depth].xs_flags & XSF_NOT_FIRST)
-	    pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
-	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_CLOSE_CONTAINER):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close_leaf_list(xop, NULL);
+	if (rc >= 0)
+	    rc = xo_do_close(xop, name, new_state);
+	break;
 
-	if (XOF_ISSET(xop, XOF_FILTER) && xsp->xs_rb_off != XS_OFFSET_CLEAR) {
-	    xo_filt_rollback(xop, xsp, xsp->xs_fstatus, xsp->xs_fstatus);
-	    xo_depth_change(xop, name, -1, -1, XSS_CLOSE_LEAF_LIST, XSF_LIST, 0, 0);
-	    break;
-	}
+    case XSS_TRANSITION(XSS_INIT, XSS_OPEN_LIST):
+    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_OPEN_LIST):
+    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_OPEN_LIST):
+	rc = xo_do_open_list(xop, flags, name);
+	break;
 
-	xo_depth_change(xop, name, -1, -1, XSS_CLOSE_LEAF_LIST, XSF_LIST, 0, 0);
-	rc = xo_printf(xop, "%s%*s]", pre_nl, xo_indent(xop), "");
-	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_OPEN_LIST):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close_list(xop, NULL);
+	if (rc >= 0)
+	    rc = xo_do_open_list(xop, flags, name);
 	break;
 
-    case XO_STYLE_XML:
-	/*
-	 * A leaf-list emits no wrapping tag, but its members may have been
-	 * buffered tentatively while filtering (xs_rb_off set).  Roll them
-	 * back on close if the list never matched, just as the JSON path
-	 * (and xo_do_close_container/instance) do.
-	 */
-	if (XOF_ISSET(xop, XOF_FILTER) && xsp->xs_rb_off != XS_OFFSET_CLEAR)
-	    xo_filt_rollback(xop, xsp, xsp->xs_fstatus, xsp->xs_fstatus);
-	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_LEAF_LIST, XSF_LIST, 0, 0);
-	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_OPEN_LIST):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close_leaf_list(xop, NULL);
+	if (rc >= 0)
+	    rc = xo_do_open_list(xop, flags, name);
 	break;
 
-    case XO_STYLE_ENCODER:
-	rc = xo_encoder_handle(xop, XO_OP_CLOSE_LEAF_LIST, NULL, name, NULL, 0);
-	/* FALLTHRU */
+    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_CLOSE_LIST):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close(xop, name, new_state);
+	break;
 
-    default:
-	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_LEAF_LIST, XSF_LIST, 0, 0);
-	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+    case XSS_TRANSITION(XSS_INIT, XSS_CLOSE_LIST):
+    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_CLOSE_LIST):
+    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_CLOSE_LIST):
+    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_CLOSE_LIST):
+	rc = xo_do_close(xop, name, new_state);
 	break;
-    }
 
-    return rc;
-}
+    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_OPEN_INSTANCE):
+	rc = xo_do_open_instance(xop, flags, name);
+	break;
 
-static int
-xo_do_open_instance (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
-{
-    xop = xo_default(xop);
+    case XSS_TRANSITION(XSS_INIT, XSS_OPEN_INSTANCE):
+    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_OPEN_INSTANCE):
+	rc = xo_do_open_list(xop, flags, name);
+	if (rc >= 0)
+	    rc = xo_do_open_instance(xop, flags, name);
+	break;
 
-    ssize_t rc = 0;
-    const char *ppn = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
-    const char *pre_nl = "";
+    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_OPEN_INSTANCE):
+	if (on_marker) {
+	    rc = xo_do_open_list(xop, flags, name);
+	} else {
+	    rc = xo_do_close_instance(xop, NULL);
+	}
+	if (rc >= 0)
+	    rc = xo_do_open_instance(xop, flags, name);
+	break;
 
-    if (name == NULL) {
-	xo_failure(xop, "NULL passed for instance name");
-	name = XO_FAILURE_NAME;
-    }
+    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_OPEN_INSTANCE):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close_leaf_list(xop, NULL);
+	if (rc >= 0)
+	    rc = xo_do_open_instance(xop, flags, name);
+	break;
 
-    name = xo_map_name(xop, name); /* Find mapped name, if any */
+    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_CLOSE_INSTANCE):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close_instance(xop, name);
+	break;
 
-    xo_stack_t *xsp = xo_stack_cur(xop);
-    xo_filter_status_t old_fstatus = xsp->xs_fstatus;
+    case XSS_TRANSITION(XSS_INIT, XSS_CLOSE_INSTANCE):
+	/* This one makes no sense; ignore it */
+	xo_failure(xop, "xo_close_instance ignored when called from "
+		   "initial state ('%s')", name ?: "(unknown)");
+	break;
 
-    ssize_t start_offset = xo_buf_offset(&xop->xo_data);
-    xop->xo_rb_snap = xop->xo_stack[xop->xo_depth].xs_flags & XSF_RB_BITS;
+    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_CLOSE_INSTANCE):
+    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_CLOSE_INSTANCE):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close(xop, name, new_state);
+	break;
 
-    xo_filter_status_t fstatus;
-    fstatus = xo_filter_open_instance(xop, xo_filters(xop), name);
+    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_CLOSE_INSTANCE):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close_leaf_list(xop, NULL);
+	if (rc >= 0)
+	    rc = xo_do_close(xop, name, new_state);
+	break;
 
-    const char *leader = xo_xml_leader(xop, name);
-    flags |= xop->xo_flags;
+    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_OPEN_LEAF_LIST):
+    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_OPEN_LEAF_LIST):
+    case XSS_TRANSITION(XSS_INIT, XSS_OPEN_LEAF_LIST):
+	rc = xo_do_open_leaf_list(xop, flags, name);
+	break;
 
-    switch (xo_style(xop)) {
-    case XO_STYLE_XML:
-	if (fstatus == XO_STATUS_DEAD) /* No one wants this */
-	    break;
+    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_OPEN_LEAF_LIST):
+    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_OPEN_LEAF_LIST):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close_list(xop, NULL);
+	if (rc >= 0)
+	    rc = xo_do_open_leaf_list(xop, flags, name);
+	break;
 
-	/*
-	 * If we are newly "full", then we need all our parents to be emitted
-	 */
-	xo_filt_handle_change_status(xop, old_fstatus, fstatus);
+    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_CLOSE_LEAF_LIST):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close_leaf_list(xop, name);
+	break;
 
-	rc = xo_printf(xop, "%*s<%s%s", xo_indent(xop), "", leader, name);
+    case XSS_TRANSITION(XSS_INIT, XSS_CLOSE_LEAF_LIST):
+	/* Makes no sense; ignore */
+	xo_failure(xop, "xo_close_leaf_list ignored when called from "
+		   "initial state ('%s')", name ?: "(unknown)");
+	break;
 
-	if (xop->xo_attrs.xb_curp != xop->xo_attrs.xb_bufp) {
-	    rc += xop->xo_attrs.xb_curp - xop->xo_attrs.xb_bufp;
-	    xo_data_append(xop, xop->xo_attrs.xb_bufp,
-			   xop->xo_attrs.xb_curp - xop->xo_attrs.xb_bufp);
-	    xo_buf_reset(&xop->xo_attrs);
-	}
+    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_CLOSE_LEAF_LIST):
+    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_CLOSE_LEAF_LIST):
+    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_CLOSE_LEAF_LIST):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close(xop, name, new_state);
+	break;
 
-	rc += xo_printf(xop, ">%s", ppn);
+    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_EMIT):
+    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_EMIT):
 	break;
 
-    case XO_STYLE_JSON:
-	/*
-	 * If we are newly "full", then we need all our parents to be emitted
-	 */
-	xo_filt_handle_change_status(xop, old_fstatus, fstatus);
+    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_EMIT):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close(xop, NULL, XSS_CLOSE_LIST);
+	break;
 
-	xo_stack_set_flags(xop);
+    case XSS_TRANSITION(XSS_INIT, XSS_EMIT):
+	/* Missing a top-level container, so we must fake one */
+	if (!XOF_ISSET(xop, XOF_NO_TOP_LEVEL)) {
+	    xo_failure(xop, "emitting a field before a top-level tag");
+	    rc = xo_do_open_container(xop, flags, XO_FAKE_TOP_LEVEL_NAME);
+	}
+	break;
 
-	if (xop->xo_stack[xop->xo_depth].xs_flags & XSF_NOT_FIRST)
-	    pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? ",\n" : ", ";
-	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
+    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_EMIT):
+	if (on_marker)
+	    return xo_marker_prevents_close(xop, old_state, new_state);
+	rc = xo_do_close_leaf_list(xop, NULL);
+	break;
 
-	rc = xo_printf(xop, "%s%*s{%s",
-		       pre_nl, xo_indent(xop), "", ppn);
+    case XSS_TRANSITION(XSS_INIT, XSS_EMIT_LEAF_LIST):
+    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_EMIT_LEAF_LIST):
+    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_EMIT_LEAF_LIST):
+	rc = xo_do_open_leaf_list(xop, flags, name);
 	break;
 
-    case XO_STYLE_SDPARAMS:
+    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_EMIT_LEAF_LIST):
 	break;
 
-    case XO_STYLE_ENCODER:
-	rc = xo_encoder_handle(xop, XO_OP_OPEN_INSTANCE, NULL,
-			       name, NULL, flags);
+    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_EMIT_LEAF_LIST):
+	/*
+	 * We need to be backward compatible with the pre-xo_open_leaf_list
+	 * API, where both lists and leaf-lists were opened as lists.  So
+	 * if we find an open list that hasn't had anything written to it,
+	 * we'll accept it.
+	 */
 	break;
+
+    default:
+	xo_failure(xop, "unknown transition: (%u -> %u)",
+		   xsp->xs_state, new_state);
     }
 
     /*
-     * Set XOIF_FILTERING so xs_rb_off is preserved by xo_depth_change:
-     *
-     * PRED: key/non-key predicate pending — buffer tentatively until resolved.
-     *
-     * TRACK after FULL: positional predicate already matched (old_fstatus==FULL);
-     *   subsequent siblings are TRACK and must be buffered so their whiteboard
-     *   can be discarded on close.
+     * If we've got enough data, flush it.
      */
-    if (XOF_ISSET(xop, XOF_FILTER)) {
-	if (fstatus == XO_STATUS_PRED)
-	    XOIF_SET(xop, XOIF_FILTERING);
-	else if (fstatus == XO_STATUS_TRACK && old_fstatus == XO_STATUS_FULL)
-	    XOIF_SET(xop, XOIF_FILTERING);
-    }
+    if (xo_buf_offset(&xop->xo_data) > XO_BUF_HIGH_WATER)
+	flush = 1;
+
+    /* Handle the flush flag */
+    if (flush && rc >= 0 && !xo_avoid_flushing(xop))
+	if (xo_flush_h(xop) < 0)
+	    rc = -1;
 
-    xo_depth_change(xop, name, 1, 1, XSS_OPEN_INSTANCE,
-		    xo_stack_flags(flags), fstatus, start_offset);
+    xo_filt_check_spill(xop);
 
-    xo_stack_cur(xop)->xs_tag_end = xo_buf_offset(&xop->xo_data);
+    /* Emits transition mid-record; only opens and closes can finish one */
+    if (xop->xo_staging && new_state != XSS_EMIT
+	    && new_state != XSS_EMIT_LEAF_LIST)
+	xo_shared_commit(xop);
 
     return rc;
 }
 
 xo_ssize_t
-xo_open_instance_hf (xo_handle_t *xop, xo_xof_flags_t flags, const char *name)
+xo_open_marker_h (xo_handle_t *xop, const char *name)
 {
-    return xo_transition(xop, flags, name, XSS_OPEN_INSTANCE);
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
+
+    if (xop->xo_tee) {
+	int i;
+
+	for (i = 0; i < xop->xo_tee_count; i++)
+	    xo_open_marker_h(xop->xo_tee[i], name);
+	return 0;
+    }
+
+    xo_depth_change(xop, name, 1, 0, XSS_MARKER,
+	    xop->xo_stack[xop->xo_depth].xs_flags & XSF_MARKER_FLAGS, 0, 0);
+
+    return 0;
 }
 
 xo_ssize_t
-xo_open_instance_h (xo_handle_t *xop, const char *name)
+xo_open_marker (const char *name)
 {
-    return xo_open_instance_hf(xop, 0, name);
+    return xo_open_marker_h(NULL, name);
 }
 
 xo_ssize_t
-xo_open_instance (const char *name)
+xo_close_marker_h (xo_handle_t *xop, const char *name)
 {
-    return xo_open_instance_hf(NULL, 0, name);
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
+
+    if (xop->xo_tee) {
+	ssize_t rc = 0;
+	int i;
+
+	for (i = 0; i < xop->xo_tee_count; i++)
+	    if (xo_close_marker_h(xop->xo_tee[i], name) < 0)
+		rc = -1;
+	return rc;
+    }
+
+    ssize_t rc = xo_do_close(xop, name, XSS_MARKER);
+
+    if (xop->xo_staging)
+	xo_shared_commit(xop);
+
+    return rc;
 }
 
 xo_ssize_t
-xo_open_instance_hd (xo_handle_t *xop, const char *name)
+xo_close_marker (const char *name)
 {
-    return xo_open_instance_hf(xop, XOF_DTRT, name);
+    return xo_close_marker_h(NULL, name);
 }
 
-xo_ssize_t
-xo_open_instance_d (const char *name)
+/*
+ * Record custom output functions into the xo handle, allowing
+ * integration with a variety of output frameworks.
+ */
+void
+xo_set_writer (xo_handle_t *xop, void *opaque, xo_write_func_t write_func,
+	       xo_close_func_t close_func, xo_flush_func_t flush_func)
 {
-    return xo_open_instance_hf(NULL, XOF_DTRT, name);
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return;
+
+    xop->xo_opaque = opaque;
+    xop->xo_write = write_func;
+    xop->xo_write_nb = NULL;
+    xop->xo_close = close_func;
+    xop->xo_flush = flush_func;
 }
 
-static int
-xo_do_close_instance (xo_handle_t *xop, const char *name)
+/**
+ * Record a non-blocking write function.  Unlike an xo_write_func_t,
+ * this function is given the length of the data and may write only
+ * part of it, returning the number of bytes written.  If it can't
+ * write anything, it should return -1 with errno set to EAGAIN.
+ * libxo queues whatever isn't written, and the caller must then use
+ * xo_drain() (typically when xo_get_pollfd() is writable) to write
+ * it.  Any other error is returned to the libxo caller.
+ *
+ * @param xop XO handle to alter (or NULL for default handle)
+ * @param opaque Opaque data passed to write_func and close_func
+ * @param write_func Non-blocking write function
+ * @param close_func Close function (used with XOF_CLOSE_FP)
+ * @param pollfd Descriptor for the caller to poll (or -1)
+ */
+void
+xo_set_writer_nb (xo_handle_t *xop, void *opaque,
+		  xo_write_nb_func_t write_func, xo_close_func_t close_func,
+		  int pollfd)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
-    ssize_t rc = 0;
-    const char *ppn = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
-    const char *pre_nl = "";
+    xop->xo_opaque = opaque;
+    xop->xo_write = NULL;
+    xop->xo_write_nb = write_func;
+    xop->xo_close = close_func;
+    xop->xo_flush = NULL;
+    xop->xo_pollfd = pollfd;
+}
 
-    if (name == NULL) {
-	xo_stack_t *xsp = xo_stack_cur(xop);
+/*
+ * Non-blocking write and close functions for file descriptors
+ */
+static xo_ssize_t
+xo_write_nb_fd (void *opaque, const char *data, xo_ssize_t len)
+{
+    return write((int) (intptr_t) opaque, data, len);
+}
 
-	name = xsp->xs_name;
-	if (name) {
-	    ssize_t len = strlen(name) + 1;
-	    /* We need to make a local copy; xo_depth_change will free it */
-	    char *cp = alloca(len);
-	    memcpy(cp, name, len);
-	    name = cp;
-	} else {
-	    if (!(xsp->xs_flags & XSF_DTRT))
-		xo_failure(xop, "missing name without 'dtrt' mode");
-	    name = XO_FAILURE_NAME;
-	}
-    }
+static void
+xo_close_fd (void *opaque)
+{
+    close((int) (intptr_t) opaque);
+}
 
-    name = xo_map_name(xop, name); /* Find mapped name, if any */
+/**
+ * Write output to a file descriptor, which is typically (but need not
+ * be) non-blocking.  See xo_set_writer_nb().
+ *
+ * @param xop XO handle to alter (or NULL for default handle)
+ * @param fd File descriptor
+ */
+void
+xo_set_writer_fd (xo_handle_t *xop, int fd)
+{
+    xo_set_writer_nb(xop, (void *) (intptr_t) fd, xo_write_nb_fd,
+		     xo_close_fd, fd);
+}
 
-    const char *leader = xo_xml_leader(xop, name);
+/**
+ * Return the number of bytes queued for a non-blocking writer
+ *
+ * @param xop XO handle (or NULL for default handle)
+ * @return Number of bytes not yet written
+ */
+xo_ssize_t
+xo_pending_bytes (xo_handle_t *xop)
+{
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
 
-    xo_stack_t *xsp = xo_stack_cur(xop);
-    xo_filter_status_t old_fstatus = xsp->xs_fstatus;
+    return xo_nb_pending(xop);
+}
 
-    /* Let the filter code know we're closing */
-    xo_filter_status_t fstatus;
-    fstatus = xo_filter_close_instance(xop, xo_filters(xop), name);
+/**
+ * Return the descriptor given to xo_set_writer_nb(), so the caller
+ * can poll it for writability when output is pending
+ *
+ * @param xop XO handle (or NULL for default handle)
+ * @return Descriptor, or -1 if none
+ */
+int
+xo_get_pollfd (xo_handle_t *xop)
+{
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
 
-    /*
-     * If a non-key predicate was force-resolved to FULL at close time
-     * (the predicate field was absent from this instance), commit the
-     * rollback so all tentatively-buffered sibling content is kept.
-     */
-    if (XOF_ISSET(xop, XOF_FILTER)
-	    && old_fstatus == XO_STATUS_PRED && fstatus == XO_STATUS_FULL) {
-	xo_filt_commit(xop, xsp, XO_STATUS_FULL);
-	old_fstatus = XO_STATUS_FULL;
-    }
+    return xop->xo_write_nb ? xop->xo_pollfd : -1;
+}
 
-    switch (xo_style(xop)) {
-    case XO_STYLE_XML:
-	if (XOF_ISSET(xop, XOF_FILTER)) {
-	    xo_filt_rollback(xop, xsp, old_fstatus, fstatus);
-	}
+/**
+ * Write as much pending output as the non-blocking writer will take
+ *
+ * @param xop XO handle (or NULL for default handle)
+ * @return Number of bytes still pending, or -1 on error
+ */
+xo_ssize_t
+xo_drain (xo_handle_t *xop)
+{
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
 
-	xo_depth_change(xop, name, -1, -1, XSS_CLOSE_INSTANCE, 0, fstatus, 0);
+    if (xop->xo_write_nb == NULL)
+	return 0;
 
-	if (!XOF_ISSET(xop, XOF_FILTER)
-	        || xo_filt_want_output(xop, old_fstatus))
-	    rc = xo_printf(xop, "%*s</%s%s>%s", xo_indent(xop), "",
-			   leader, name, ppn);
-	break;
+    return xo_nb_drain(xop);
+}
 
-    case XO_STYLE_JSON:
-	pre_nl = XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "";
+/**
+ * Set watermarks for output pending on a non-blocking writer.  When
+ * the pending output grows above "high", func is called with "above"
+ * set; when it has been drained to "low" or below, func is called
+ * again with "above" clear.  This lets producers throttle themselves.
+ * func must not make output on the handle.
+ *
+ * @param xop XO handle to alter (or NULL for default handle)
+ * @param high High watermark, in bytes
+ * @param low Low watermark, in bytes
+ * @param func Function to call (or NULL to turn off)
+ * @param opaque Opaque data passed to func
+ */
+void
+xo_set_pending_limit (xo_handle_t *xop, xo_ssize_t high, xo_ssize_t low,
+		      xo_pending_func_t func, void *opaque)
+{
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
-	if (XOF_ISSET(xop, XOF_FILTER) && xsp->xs_rb_off != XS_OFFSET_CLEAR) {
-	    xo_filt_rollback(xop, xsp, old_fstatus, fstatus);
-	    xo_depth_change(xop, name, -1, -1, XSS_CLOSE_INSTANCE, 0, 0, 0);
-	    break;
-	}
+    xop->xo_pending_high = high;
+    xop->xo_pending_low = low;
+    xop->xo_pending_func = func;
+    xop->xo_pending_opaque = opaque;
+    XOIF_CLEAR(xop, XOIF_PENDING_HIGH);
+}
 
-	xo_depth_change(xop, name, -1, -1, XSS_CLOSE_INSTANCE, 0, 0, 0);
-	rc = xo_printf(xop, "%s%*s}", pre_nl, xo_indent(xop), "");
-	xop->xo_stack[xop->xo_depth].xs_flags |= XSF_NOT_FIRST;
-	break;
+void
+xo_set_allocator (xo_realloc_func_t realloc_func, xo_free_func_t free_func)
+{
+    xo_realloc = realloc_func;
+    xo_free = free_func;
+}
 
-    case XO_STYLE_HTML:
-    case XO_STYLE_TEXT:
-	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_INSTANCE, 0, 0, 0);
-	break;
+xo_ssize_t
+xo_flush_h (xo_handle_t *xop)
+{
+    ssize_t rc;
 
-    case XO_STYLE_SDPARAMS:
-	break;
+    if (xop && xop->xo_shared)
+	return xo_shared_flush(xop);
+
+    xop = xo_default(xop);
+
+    if (xop->xo_tee) {
+	int i;
+
+	for (i = 0, rc = 0; i < xop->xo_tee_count; i++)
+	    if (xo_flush_h(xop->xo_tee[i]) < 0)
+		rc = -1;
+	return rc;
+    }
 
+    switch (xo_style(xop)) {
     case XO_STYLE_ENCODER:
-	xo_depth_change(xop, name, -1, 0, XSS_CLOSE_INSTANCE, 0, 0, 0);
-	rc = xo_encoder_handle(xop, XO_OP_CLOSE_INSTANCE, NULL, name, NULL, 0);
-	break;
+	xo_encoder_handle(xop, XO_OP_FLUSH, NULL, NULL, NULL, 0);
     }
 
+    /* NDJSON records are only written whole */
+    if (xo_is_ndjson(xop) && !xo_ndjson_at_base(xop))
+	return 0;
+
+    rc = xo_write(xop);
+    if (rc >= 0 && xop->xo_flush)
+	if (xop->xo_flush(xop->xo_opaque) < 0)
+	    return -1;
+
+    /* A non-blocking writer may have room for queued output by now */
+    if (rc >= 0 && xop->xo_write_nb)
+	if (xo_nb_drain(xop) < 0)
+	    return -1;
+
     return rc;
 }
 
 xo_ssize_t
-xo_close_instance_h (xo_handle_t *xop, const char *name)
+xo_flush (void)
 {
-    return xo_transition(xop, 0, name, XSS_CLOSE_INSTANCE);
+    return xo_flush_h(NULL);
 }
 
-xo_ssize_t
-xo_close_instance (const char *name)
+/*
+ * Write function for fragments: output is saved in xo_frag_data until
+ * the fragment is spliced into its parent.
+ */
+static xo_ssize_t
+xo_write_to_fragment (void *opaque, const char *data)
 {
-    return xo_close_instance_h(NULL, name);
-}
+    xo_handle_t *xop = opaque;
+    ssize_t len = strlen(data);
 
-xo_ssize_t
-xo_close_instance_hd (xo_handle_t *xop)
-{
-    return xo_close_instance_h(xop, NULL);
-}
+    if (xo_buf_append_val(&xop->xo_frag_data, data, len) == NULL)
+	return -1;
 
-xo_ssize_t
-xo_close_instance_d (void)
-{
-    return xo_close_instance_h(NULL, NULL);
+    return len;
 }
 
-static int
-xo_do_close_all (xo_handle_t *xop, xo_stack_t *limit)
+/*
+ * Make a handle that renders at xop's current position, saving its
+ * output in xo_frag_data.  This is the guts of both fragments and
+ * the per-thread staging handles used by shared handles.
+ */
+static xo_handle_t *
+xo_fragment_make (xo_handle_t *xop)
 {
-    xo_stack_t *xsp;
-    ssize_t rc = 0;
-    xo_xsf_flags_t flags;
+    if (xo_style(xop) == XO_STYLE_ENCODER || XOF_ISSET(xop, XOF_FILTER)
+	    || xop->xo_tee || xop->xo_shared)
+	return NULL;
 
-    for (xsp = xo_stack_cur(xop); xsp >= limit; xsp--) {
-	switch (xsp->xs_state) {
-	case XSS_INIT:
-	    /* Nothing */
-	    rc = 0;
-	    break;
+    xo_handle_t *frag = xo_create(xo_style(xop),
+				  xop->xo_flags & ~XOF_CLOSE_FP);
+    if (frag == NULL)
+	return NULL;
+
+    frag->xo_frag_parent = xop;
+    frag->xo_frag_depth = xop->xo_depth;
+    xo_set_writer(frag, frag, xo_write_to_fragment, NULL, NULL);
+
+    if (xo_depth_check(frag, xop->xo_depth)) {
+	xo_destroy(frag);
+	return NULL;
+    }
+
+    /* Copy the stack, giving the fragment its own names and keys */
+    int i;
+    for (i = 0; i <= xop->xo_depth; i++) {
+	xo_stack_t *src = &xop->xo_stack[i];
+	xo_stack_t *dst = &frag->xo_stack[i];
+
+	dst->xs_flags = src->xs_flags;
+	dst->xs_state = src->xs_state;
+	dst->xs_fstatus = src->xs_fstatus;
+	dst->xs_name = src->xs_name ? xo_strndup(src->xs_name, -1) : NULL;
+	dst->xs_keys = src->xs_keys ? xo_strndup(src->xs_keys, -1) : NULL;
+    }
+    frag->xo_depth = xop->xo_depth;
+
+    /* The fragment's first instance is first; splicing adds any comma */
+    xo_stack_cur(frag)->xs_flags &= ~(XSF_NOT_FIRST | XSF_CONTENT);
+
+    frag->xo_indent = xop->xo_indent;
+    frag->xo_indent_by = xop->xo_indent_by;
+    frag->xo_iflags |= xop->xo_iflags & XOIF_TOP_EMITTED;
+    frag->xo_formatter = xop->xo_formatter;
+    frag->xo_checkpointer = xop->xo_checkpointer;
+    frag->xo_info = xop->xo_info;
+    frag->xo_info_count = xop->xo_info_count;
+    frag->xo_info_gen = xop->xo_info_gen;
+    if (xop->xo_leading_xpath)
+	frag->xo_leading_xpath = xo_strndup(xop->xo_leading_xpath, -1);
+
+#ifndef LIBXO_TEXT_ONLY
+    memcpy(frag->xo_color_map_fg, xop->xo_color_map_fg,
+	   sizeof(frag->xo_color_map_fg));
+    memcpy(frag->xo_color_map_bg, xop->xo_color_map_bg,
+	   sizeof(frag->xo_color_map_bg));
+#endif /* LIBXO_TEXT_ONLY */
+    frag->xo_colors = xop->xo_colors;
+    if (!xo_buf_is_empty(&xop->xo_color_buf))
+	xo_buf_append(&frag->xo_color_buf, xop->xo_color_buf.xb_bufp,
+		      xo_buf_offset(&xop->xo_color_buf));
 
-	case XSS_OPEN_CONTAINER:
-	    rc = xo_do_close_container(xop, NULL);
-	    break;
+#ifdef LIBXO_NEED_MAP
+    for (i = 0; i < xop->xo_map_len; i++) {
+	const char *from = xo_map_from(xop, i);
 
-	case XSS_OPEN_LIST:
-	    rc = xo_do_close_list(xop, NULL);
-	    break;
+	xo_map_add(frag, from, strlen(from),
+		   xo_map_to(xop, i), xop->xo_map[i].xme_tlen);
+    }
+#endif /* LIBXO_NEED_MAP */
 
-	case XSS_OPEN_INSTANCE:
-	    rc = xo_do_close_instance(xop, NULL);
-	    break;
+    xo_fields_copy(frag, xop);
 
-	case XSS_OPEN_LEAF_LIST:
-	    rc = xo_do_close_leaf_list(xop, NULL);
-	    break;
+    return frag;
+}
 
-	case XSS_MARKER:
-	    flags = xsp->xs_flags & XSF_MARKER_FLAGS;
-	    xo_depth_change(xop, xsp->xs_name, -1, 0, XSS_MARKER, 0, 0, 0);
-	    xop->xo_stack[xop->xo_depth].xs_flags |= flags;
-	    rc = 0;
-	    break;
-	}
+/**
+ * Create a "fragment" handle, which renders instances of the list
+ * that is currently open on the parent handle.  The fragment
+ * inherits the parent's style, flags, and stack, so its output is
+ * exactly what the parent would have made, but it's saved until
+ * xo_splice_fragment() appends it to the parent.  This allows list
+ * instances to be rendered on other threads and spliced back in
+ * order.  The fragment must be created (and spliced and destroyed)
+ * by the thread using the parent, but may be used by any single
+ * thread in between.
+ *
+ * Fragments are not supported for encoders or when filtering.
+ *
+ * @param xop Parent handle, with a list open
+ * @return Newly allocated handle (or NULL on failure)
+ * @see xo_splice_fragment
+ */
+xo_handle_t *
+xo_create_fragment (xo_handle_t *xop)
+{
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return NULL;
 
-	if (rc < 0)
-	    xo_failure(xop, "close %d failed: %d", xsp->xs_state, rc);
+    xo_stack_t *xsp = xo_stack_cur(xop);
+    if (xsp->xs_state != XSS_OPEN_LIST && xsp->xs_state != XSS_OPEN_LEAF_LIST) {
+	xo_failure(xop, "xo_create_fragment: no list is open");
+	return NULL;
     }
 
-    return 0;
+    return xo_fragment_make(xop);
 }
 
 /*
- * This function is responsible for clearing out whatever is needed
- * to get to the desired state, if possible.
+ * Append output made by a fragment, whose list had "fflags" set, to
+ * xop's current list, adding any comma needed between the parent's
+ * instances and the fragment's.
  */
-static int
-xo_do_close (xo_handle_t *xop, const char *name, xo_state_t new_state)
+static ssize_t
+xo_splice_data (xo_handle_t *xop, const char *data, ssize_t len,
+		xo_xsf_flags_t fflags)
 {
-    xo_stack_t *xsp, *limit = NULL;
-    ssize_t rc;
-    xo_state_t need_state = new_state;
+    xo_stack_t *xsp = xo_stack_cur(xop);
 
-    if (new_state == XSS_CLOSE_CONTAINER)
-	need_state = XSS_OPEN_CONTAINER;
-    else if (new_state == XSS_CLOSE_LIST)
-	need_state = XSS_OPEN_LIST;
-    else if (new_state == XSS_CLOSE_INSTANCE)
-	need_state = XSS_OPEN_INSTANCE;
-    else if (new_state == XSS_CLOSE_LEAF_LIST)
-	need_state = XSS_OPEN_LEAF_LIST;
-    else if (new_state == XSS_MARKER)
-	need_state = XSS_MARKER;
-    else
-	return 0; /* Unknown or useless new states are ignored */
+    if (len > 0) {
+	if (xo_style(xop) == XO_STYLE_JSON
+		&& (xsp->xs_flags & XSF_NOT_FIRST)
+		&& (fflags & XSF_NOT_FIRST)
+		&& !(xo_is_ndjson(xop) && xo_ndjson_at_base(xop))) {
+	    if (XOF_ISSET(xop, XOF_PRETTY))
+		xo_data_append(xop, ",\n", 2);
+	    else
+		xo_data_append(xop, ", ", 2);
+	}
 
-    name = xo_map_name(xop, name);
+	xo_data_append(xop, data, len);
+    }
 
-    for (xsp = xo_stack_cur(xop); xsp > xop->xo_stack; xsp--) {
-	/*
-	 * Marker's normally stop us from going any further, unless
-	 * we are popping a marker (new_state == XSS_MARKER).
-	 */
-	if (xsp->xs_state == XSS_MARKER && need_state != XSS_MARKER) {
-	    if (name) {
-		xo_failure(xop, "close (xo_%s) fails at marker '%s'; "
-			   "not found '%s'",
-			   xo_state_name(new_state),
-			   xsp->xs_name, name);
-		return 0;
+    xsp->xs_flags |= fflags & (XSF_NOT_FIRST | XSF_CONTENT);
 
-	    } else {
-		limit = xsp;
-		xo_failure(xop, "close stops at marker '%s'", xsp->xs_name);
-	    }
-	    break;
-	}
-	
-	if (xsp->xs_state != need_state)
-	    continue;
+    if (xo_buf_offset(&xop->xo_data) > XO_BUF_HIGH_WATER)
+	if (xo_flush_h(xop) < 0)
+	    return -1;
 
-	if (name && xsp->xs_name && !xo_streq(name, xsp->xs_name))
-	    continue;
+    return len;
+}
 
-	limit = xsp;
-	break;
+/**
+ * Append the output of a fragment to its parent, which must be back
+ * at the list where the fragment was created, as must the fragment.
+ * Any comma needed between the parent's instances and the fragment's
+ * is added.  The fragment is left empty and can be used again.
+ *
+ * @param xop Parent handle
+ * @param frag Fragment created from xop by xo_create_fragment()
+ * @return -1 on error, or the number of bytes spliced
+ */
+xo_ssize_t
+xo_splice_fragment (xo_handle_t *xop, xo_handle_t *frag)
+{
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return -1;
+
+    if (frag == NULL || frag->xo_frag_parent != xop) {
+	xo_failure(xop, "xo_splice_fragment: not a fragment of this handle");
+	return -1;
     }
 
-    if (limit == NULL) {
-	xo_failure(xop, "xo_%s can't find match for '%s'",
-		   xo_state_name(new_state), name);
-	return 0;
+    if (frag->xo_depth != frag->xo_frag_depth
+	    || xop->xo_depth != frag->xo_frag_depth) {
+	xo_failure(xop, "xo_splice_fragment: not at the fragment's list");
+	return -1;
     }
 
-    rc = xo_do_close_all(xop, limit);
+    xo_write(frag);		/* Move any pending output to xo_frag_data */
+
+    xo_buffer_t *xbp = &frag->xo_frag_data;
+    xo_stack_t *fsp = xo_stack_cur(frag);
+    ssize_t rc;
+
+    rc = xo_splice_data(xop, xbp->xb_bufp, xo_buf_offset(xbp),
+			fsp->xs_flags);
+
+    xo_buf_reset(xbp);
+    fsp->xs_flags &= ~(XSF_NOT_FIRST | XSF_CONTENT);
 
     return rc;
 }
 
 /*
- * We are in a given state and need to transition to the new state.
+ * Move a fragment's output into "xfop", leaving the fragment empty,
+ * as xo_splice_fragment() would, so it can be used again while the
+ * output waits its turn to be spliced by xo_splice_output().  The
+ * output is copied to a buffer of its own size, so waiting output
+ * costs only its own bytes.  Returns 0, or -1 on error.
  */
-static ssize_t
-xo_marker_prevents_close (xo_handle_t *xop, int old_state, int new_state)
+int
+xo_fragment_save (xo_handle_t *frag, xo_frag_output_t *xfop)
 {
-    xo_failure(xop, "marker '%s' prevents transition from %s to %s",
-	       xop->xo_stack[xop->xo_depth].xs_name,
-	       xo_state_name(old_state), xo_state_name(new_state));
-    return -1;
-}
+    bzero(xfop, sizeof(*xfop));
 
-static ssize_t
-xo_transition (xo_handle_t *xop, xo_xof_flags_t flags, const char *name,
-	       xo_state_t new_state)
-{
-    ssize_t rc = 0;
+    if (frag->xo_frag_parent == NULL
+	    || frag->xo_depth != frag->xo_frag_depth)
+	return -1;
 
-    xop = xo_default(xop);
+    xo_write(frag);		/* Move any pending output to xo_frag_data */
 
-    xo_stack_t *xsp = xo_stack_cur(xop);
-    int old_state = xsp->xs_state;
-    int on_marker = (old_state == XSS_MARKER);
-    int flush = XOF_ISSET(xop, XOF_FLUSH);
+    xo_buffer_t *xbp = &frag->xo_frag_data;
+    xo_stack_t *fsp = xo_stack_cur(frag);
+    ssize_t len = xo_buf_offset(xbp);
 
-    /* If there's a marker on top of the stack, we need to find a real state */
-    while (old_state == XSS_MARKER) {
-	if (xsp == xop->xo_stack)
-	    break;
-	xsp -= 1;
-	old_state = xsp->xs_state;
+    if (len > 0) {
+	xfop->xfo_data = xo_realloc(NULL, len);
+	if (xfop->xfo_data == NULL)
+	    return -1;
+	memcpy(xfop->xfo_data, xbp->xb_bufp, len);
     }
 
-    /*
-     * At this point, the list of possible states are:
-     *   XSS_INIT, XSS_OPEN_CONTAINER, XSS_OPEN_LIST,
-     *   XSS_OPEN_INSTANCE, XSS_OPEN_LEAF_LIST, XSS_DISCARDING
-     */
-    switch (XSS_TRANSITION(old_state, new_state)) {
-
-    case XSS_TRANSITION(XSS_INIT, XSS_OPEN_CONTAINER):
-    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_OPEN_CONTAINER):
-    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_OPEN_CONTAINER):
-       rc = xo_do_open_container(xop, flags, name);
-       break;
+    xfop->xfo_parent = frag->xo_frag_parent;
+    xfop->xfo_depth = frag->xo_frag_depth;
+    xfop->xfo_len = len;
+    xfop->xfo_flags = fsp->xs_flags;
 
-    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_OPEN_CONTAINER):
-    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_OPEN_CONTAINER):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close_leaf_list(xop, NULL);
-	if (rc >= 0)
-	    rc = xo_do_open_container(xop, flags, name);
-	break;
+    xo_buf_reset(xbp);
+    fsp->xs_flags &= ~(XSF_NOT_FIRST | XSF_CONTENT);
 
-    case XSS_TRANSITION(XSS_INIT, XSS_CLOSE_CONTAINER):
-	/* This is an exception for "xo --close" */
-	rc = xo_do_close_container(xop, name);
-	break;
+    return 0;
+}
 
-    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_CLOSE_CONTAINER):
-    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_CLOSE_CONTAINER):
-    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_CLOSE_CONTAINER):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close(xop, name, new_state);
-	break;
+/*
+ * Splice output saved by xo_fragment_save() into its parent, which
+ * must be back at the fragment's list, and release it.  Returns -1
+ * on error, or the number of bytes spliced.
+ */
+xo_ssize_t
+xo_splice_output (xo_handle_t *xop, xo_frag_output_t *xfop)
+{
+    ssize_t rc = -1;
 
-    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_CLOSE_CONTAINER):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close_leaf_list(xop, NULL);
-	if (rc >= 0)
-	    rc = xo_do_close(xop, name, new_state);
-	break;
+    xop = xo_default(xop);
+    if (xop != NULL) {
+	if (xfop->xfo_parent != xop)
+	    xo_failure(xop, "xo_splice_output: not output of this handle");
+	else if (xop->xo_depth != xfop->xfo_depth)
+	    xo_failure(xop, "xo_splice_output: not at the fragment's list");
+	else
+	    rc = xo_splice_data(xop, xfop->xfo_data, xfop->xfo_len,
+				xfop->xfo_flags);
+    }
 
-    case XSS_TRANSITION(XSS_INIT, XSS_OPEN_LIST):
-    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_OPEN_LIST):
-    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_OPEN_LIST):
-	rc = xo_do_open_list(xop, flags, name);
-	break;
+    if (xfop->xfo_data)
+	xo_free(xfop->xfo_data);
+    bzero(xfop, sizeof(*xfop));
 
-    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_OPEN_LIST):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close_list(xop, NULL);
-	if (rc >= 0)
-	    rc = xo_do_open_list(xop, flags, name);
-	break;
+    return rc;
+}
 
-    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_OPEN_LIST):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close_leaf_list(xop, NULL);
-	if (rc >= 0)
-	    rc = xo_do_open_list(xop, flags, name);
-	break;
+#ifdef LIBXO_NEED_THREADS
 
-    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_CLOSE_LIST):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close(xop, name, new_state);
-	break;
+/*
+ * A shared handle lets several threads make output on one parent
+ * handle.  Each thread renders into its own staging handle (made by
+ * xo_fragment_make and found via xsh_key), and whenever the staging
+ * handle gets back to the parent's depth, its output is spliced into
+ * the parent under xsh_mutex.  Records (e.g. top-level instances)
+ * are therefore never interleaved, and only the splice is serialized.
+ */
+typedef struct xo_shared_s {
+    xo_handle_t *xsh_parent;	/* Handle we commit to */
+    pthread_mutex_t xsh_mutex;	/* Protects xsh_parent and xsh_stages */
+    pthread_key_t xsh_key;	/* This thread's staging handle */
+    xo_handle_t **xsh_stages;	/* All staging handles */
+    int xsh_count;		/* Number of staging handles */
+    int xsh_size;		/* Allocated size of xsh_stages */
+} xo_shared_t;
+
+#define XO_SHARED_INCR 16	/* Growth of xsh_stages */
 
-    case XSS_TRANSITION(XSS_INIT, XSS_CLOSE_LIST):
-    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_CLOSE_LIST):
-    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_CLOSE_LIST):
-    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_CLOSE_LIST):
-	rc = xo_do_close(xop, name, new_state);
-	break;
+/*
+ * Return the calling thread's staging handle, making it if needed,
+ * or NULL if we can't.
+ */
+static xo_handle_t *
+xo_shared_stage (xo_handle_t *xop)
+{
+    xo_shared_t *xshp = xop->xo_shared;
+    xo_handle_t *stage = pthread_getspecific(xshp->xsh_key);
 
-    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_OPEN_INSTANCE):
-	rc = xo_do_open_instance(xop, flags, name);
-	break;
+    if (stage)
+	return stage;
 
-    case XSS_TRANSITION(XSS_INIT, XSS_OPEN_INSTANCE):
-    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_OPEN_INSTANCE):
-	rc = xo_do_open_list(xop, flags, name);
-	if (rc >= 0)
-	    rc = xo_do_open_instance(xop, flags, name);
-	break;
+    pthread_mutex_lock(&xshp->xsh_mutex);
 
-    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_OPEN_INSTANCE):
-	if (on_marker) {
-	    rc = xo_do_open_list(xop, flags, name);
-	} else {
-	    rc = xo_do_close_instance(xop, NULL);
+    if (xshp->xsh_count >= xshp->xsh_size) {
+	int size = xshp->xsh_size + XO_SHARED_INCR;
+	xo_handle_t **newp = xo_realloc(xshp->xsh_stages,
+					size * sizeof(*newp));
+	if (newp) {
+	    xshp->xsh_stages = newp;
+	    xshp->xsh_size = size;
 	}
-	if (rc >= 0)
-	    rc = xo_do_open_instance(xop, flags, name);
-	break;
-
-    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_OPEN_INSTANCE):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close_leaf_list(xop, NULL);
-	if (rc >= 0)
-	    rc = xo_do_open_instance(xop, flags, name);
-	break;
+    }
 
-    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_CLOSE_INSTANCE):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close_instance(xop, name);
-	break;
+    if (xshp->xsh_count < xshp->xsh_size) {
+	stage = xo_fragment_make(xshp->xsh_parent);
+	if (stage) {
+	    stage->xo_staging = xshp;
+	    xshp->xsh_stages[xshp->xsh_count++] = stage;
+	    pthread_setspecific(xshp->xsh_key, stage);
+	}
+    }
 
-    case XSS_TRANSITION(XSS_INIT, XSS_CLOSE_INSTANCE):
-	/* This one makes no sense; ignore it */
-	xo_failure(xop, "xo_close_instance ignored when called from "
-		   "initial state ('%s')", name ?: "(unknown)");
-	break;
+    if (stage == NULL)
+	xo_failure(xshp->xsh_parent,
+		   "could not make a staging handle for this thread");
 
-    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_CLOSE_INSTANCE):
-    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_CLOSE_INSTANCE):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close(xop, name, new_state);
-	break;
+    pthread_mutex_unlock(&xshp->xsh_mutex);
 
-    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_CLOSE_INSTANCE):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close_leaf_list(xop, NULL);
-	if (rc >= 0)
-	    rc = xo_do_close(xop, name, new_state);
-	break;
+    return stage;
+}
 
-    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_OPEN_LEAF_LIST):
-    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_OPEN_LEAF_LIST):
-    case XSS_TRANSITION(XSS_INIT, XSS_OPEN_LEAF_LIST):
-	rc = xo_do_open_leaf_list(xop, flags, name);
-	break;
+/*
+ * Splice a staging handle's output into the parent; the caller must
+ * hold xsh_mutex.
+ */
+static void
+xo_shared_splice (xo_shared_t *xshp, xo_handle_t *stage)
+{
+    xo_handle_t *parent = xshp->xsh_parent;
 
-    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_OPEN_LEAF_LIST):
-    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_OPEN_LEAF_LIST):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close_list(xop, NULL);
-	if (rc >= 0)
-	    rc = xo_do_open_leaf_list(xop, flags, name);
-	break;
+    if (xo_splice_fragment(parent, stage) > 0
+	    && (XOF_ISSET(parent, XOF_FLUSH)
+		|| XOF_ISSET(parent, XOF_FLUSH_LINE)))
+	xo_flush_h(parent);
+}
 
-    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_CLOSE_LEAF_LIST):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close_leaf_list(xop, name);
-	break;
+/*
+ * If a staging handle is back at the parent's depth, its record is
+ * complete, so commit it.  The output is moved to xo_frag_data before
+ * taking the lock, so the critical section is just the splice.
+ */
+static void
+xo_shared_commit (xo_handle_t *xop)
+{
+    if (xop->xo_depth != xop->xo_frag_depth)
+	return;
 
-    case XSS_TRANSITION(XSS_INIT, XSS_CLOSE_LEAF_LIST):
-	/* Makes no sense; ignore */
-	xo_failure(xop, "xo_close_leaf_list ignored when called from "
-		   "initial state ('%s')", name ?: "(unknown)");
-	break;
+    xo_write(xop);
+    if (xo_buf_is_empty(&xop->xo_frag_data))
+	return;
 
-    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_CLOSE_LEAF_LIST):
-    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_CLOSE_LEAF_LIST):
-    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_CLOSE_LEAF_LIST):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close(xop, name, new_state);
-	break;
+    xo_shared_t *xshp = xop->xo_staging;
 
-    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_EMIT):
-    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_EMIT):
-	break;
+    pthread_mutex_lock(&xshp->xsh_mutex);
+    xo_shared_splice(xshp, xop);
+    pthread_mutex_unlock(&xshp->xsh_mutex);
+}
 
-    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_EMIT):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close(xop, NULL, XSS_CLOSE_LIST);
-	break;
+/*
+ * The xsh_key destructor: when a thread exits, its staging handle is
+ * committed, if its record is complete, or else discarded, and then
+ * freed, so short-lived threads don't leave handles behind.
+ */
+static void
+xo_shared_exit (void *arg)
+{
+    xo_handle_t *stage = arg;
+    xo_shared_t *xshp = stage->xo_staging;
+    int i;
 
-    case XSS_TRANSITION(XSS_INIT, XSS_EMIT):
-	/* Missing a top-level container, so we must fake one */
-	if (!XOF_ISSET(xop, XOF_NO_TOP_LEVEL)) {
-	    xo_failure(xop, "emitting a field before a top-level tag");
-	    rc = xo_do_open_container(xop, flags, XO_FAKE_TOP_LEVEL_NAME);
+    pthread_mutex_lock(&xshp->xsh_mutex);
+
+    if (stage->xo_depth == stage->xo_frag_depth)
+	xo_shared_splice(xshp, stage);
+    else
+	xo_failure(xshp->xsh_parent,
+		   "discarding an unfinished record from an exiting thread");
+
+    for (i = 0; i < xshp->xsh_count; i++) {
+	if (xshp->xsh_stages[i] == stage) {
+	    xshp->xsh_stages[i] = xshp->xsh_stages[--xshp->xsh_count];
+	    break;
 	}
-	break;
+    }
 
-    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_EMIT):
-	if (on_marker)
-	    return xo_marker_prevents_close(xop, old_state, new_state);
-	rc = xo_do_close_leaf_list(xop, NULL);
-	break;
+    pthread_mutex_unlock(&xshp->xsh_mutex);
 
-    case XSS_TRANSITION(XSS_INIT, XSS_EMIT_LEAF_LIST):
-    case XSS_TRANSITION(XSS_OPEN_CONTAINER, XSS_EMIT_LEAF_LIST):
-    case XSS_TRANSITION(XSS_OPEN_INSTANCE, XSS_EMIT_LEAF_LIST):
-	rc = xo_do_open_leaf_list(xop, flags, name);
-	break;
+    xo_destroy(stage);
+}
 
-    case XSS_TRANSITION(XSS_OPEN_LEAF_LIST, XSS_EMIT_LEAF_LIST):
-	break;
+/*
+ * Flush a shared handle: commit the calling thread's record, if it's
+ * complete, and flush the parent.
+ */
+static ssize_t
+xo_shared_flush (xo_handle_t *xop)
+{
+    xo_shared_t *xshp = xop->xo_shared;
+    xo_handle_t *stage = pthread_getspecific(xshp->xsh_key);
+    ssize_t rc;
 
-    case XSS_TRANSITION(XSS_OPEN_LIST, XSS_EMIT_LEAF_LIST):
-	/*
-	 * We need to be backward compatible with the pre-xo_open_leaf_list
-	 * API, where both lists and leaf-lists were opened as lists.  So
-	 * if we find an open list that hasn't had anything written to it,
-	 * we'll accept it.
-	 */
-	break;
+    if (stage)
+	xo_shared_commit(stage);
 
-    default:
-	xo_failure(xop, "unknown transition: (%u -> %u)",
-		   xsp->xs_state, new_state);
+    pthread_mutex_lock(&xshp->xsh_mutex);
+    rc = xo_flush_h(xshp->xsh_parent);
+    pthread_mutex_unlock(&xshp->xsh_mutex);
+
+    return rc;
+}
+
+/*
+ * Finish a shared handle, once the other threads are done with it.
+ * Complete records from all threads are committed, then the parent
+ * is finished.
+ */
+static ssize_t
+xo_shared_finish (xo_handle_t *xop)
+{
+    xo_shared_t *xshp = xop->xo_shared;
+    ssize_t rc;
+    int i;
+
+    pthread_mutex_lock(&xshp->xsh_mutex);
+
+    for (i = 0; i < xshp->xsh_count; i++) {
+	xo_handle_t *stage = xshp->xsh_stages[i];
+
+	if (stage->xo_depth == stage->xo_frag_depth)
+	    xo_shared_splice(xshp, stage);
     }
 
-    /*
-     * If we've got enough data, flush it.
-     */
-    if (xo_buf_offset(&xop->xo_data) > XO_BUF_HIGH_WATER)
-	flush = 1;
+    rc = xo_finish_h(xshp->xsh_parent);
 
-    /* Handle the flush flag */
-    if (flush && rc >= 0 && !xo_avoid_flushing(xop))
-	if (xo_flush_h(xop) < 0)
-	    rc = -1;
+    pthread_mutex_unlock(&xshp->xsh_mutex);
 
     return rc;
 }
 
-xo_ssize_t
-xo_open_marker_h (xo_handle_t *xop, const char *name)
+/*
+ * Release a shared handle's staging handles, committing any complete
+ * records first.  The handle itself is then destroyed as usual.
+ */
+static void
+xo_shared_release (xo_handle_t *xop)
 {
-    xop = xo_default(xop);
+    xo_shared_t *xshp = xop->xo_shared;
+    int i;
 
-    xo_depth_change(xop, name, 1, 0, XSS_MARKER,
-	    xop->xo_stack[xop->xo_depth].xs_flags & XSF_MARKER_FLAGS, 0, 0);
+    for (i = 0; i < xshp->xsh_count; i++) {
+	xo_handle_t *stage = xshp->xsh_stages[i];
 
-    return 0;
+	if (stage->xo_depth == stage->xo_frag_depth)
+	    xo_shared_splice(xshp, stage);
+	xo_destroy(stage);
+    }
+
+    pthread_key_delete(xshp->xsh_key);
+    pthread_mutex_destroy(&xshp->xsh_mutex);
+    if (xshp->xsh_stages)
+	xo_free(xshp->xsh_stages);
+    xo_free(xshp);
+
+    xop->xo_shared = NULL;
 }
 
-xo_ssize_t
-xo_open_marker (const char *name)
+/**
+ * Create a "shared" handle, allowing several threads to make output
+ * on one parent handle without locking around each record.  Each
+ * thread that uses the shared handle gets its own staging handle,
+ * which starts at the parent's current position (e.g. inside an open
+ * list).  When a thread's calls bring it back to that position, such
+ * as by closing a top-level instance, the completed record is
+ * appended to the parent in one short critical section, so records
+ * from different threads never interleave.
+ *
+ * The parent must not be used directly while the shared handle is
+ * in use.  xo_finish_h() and xo_destroy() on the shared handle must
+ * be called after the other threads are done with it.  A thread's
+ * staging handle is freed when the thread exits.  Options and flags
+ * should be set on the parent before the shared handle is made.
+ * Shared handles are not supported for encoders or when filtering,
+ * or when libxo is built without threads.  If a thread's staging
+ * handle can't be made, that thread's calls on the shared handle
+ * fail.
+ *
+ * @param xop Parent handle
+ * @return Newly allocated handle (or NULL on failure)
+ * @see xo_destroy
+ */
+xo_handle_t *
+xo_create_shared (xo_handle_t *xop)
 {
-    return xo_open_marker_h(NULL, name);
+    xop = xo_default(xop);
+    if (xop == NULL)
+	return NULL;
+
+    if (xo_style(xop) == XO_STYLE_ENCODER || XOF_ISSET(xop, XOF_FILTER)
+	    || xop->xo_tee || xop->xo_staging)
+	return NULL;
+
+    /* The top-level JSON brace must be made once, by the parent */
+    if (xo_style(xop) == XO_STYLE_JSON && xop->xo_depth == 0
+	    && !XOF_ISSET(xop, XOF_NO_TOP)
+	    && !XOIF_ISSET(xop, XOIF_TOP_EMITTED))
+	xo_emit_top(xop, XOF_ISSET(xop, XOF_PRETTY) ? "\n" : "");
+
+    xo_shared_t *xshp = xo_realloc(NULL, sizeof(*xshp));
+    if (xshp == NULL)
+	return NULL;
+
+    bzero(xshp, sizeof(*xshp));
+    xshp->xsh_parent = xop;
+
+    if (pthread_key_create(&xshp->xsh_key, xo_shared_exit) != 0) {
+	xo_free(xshp);
+	return NULL;
+    }
+    pthread_mutex_init(&xshp->xsh_mutex, NULL);
+
+    xo_handle_t *shared = xo_create(XO_STYLE_TEXT, 0);
+    if (shared == NULL) {
+	pthread_key_delete(xshp->xsh_key);
+	pthread_mutex_destroy(&xshp->xsh_mutex);
+	xo_free(xshp);
+	return NULL;
+    }
+
+    shared->xo_shared = xshp;
+
+    return shared;
 }
 
-xo_ssize_t
-xo_close_marker_h (xo_handle_t *xop, const char *name)
+#else /* LIBXO_NEED_THREADS */
+
+/*
+ * Without threads, xo_create_shared() makes no shared handles, so
+ * xo_shared is never set and these are never called
+ */
+static xo_handle_t *
+xo_shared_stage (xo_handle_t *xop UNUSED)
 {
-    xop = xo_default(xop);
+    return NULL;
+}
 
-    return xo_do_close(xop, name, XSS_MARKER);
+static void
+xo_shared_commit (xo_handle_t *xop UNUSED)
+{
 }
 
-xo_ssize_t
-xo_close_marker (const char *name)
+static ssize_t
+xo_shared_flush (xo_handle_t *xop UNUSED)
 {
-    return xo_close_marker_h(NULL, name);
+    return -1;
 }
 
-/*
- * Record custom output functions into the xo handle, allowing
- * integration with a variety of output frameworks.
- */
-void
-xo_set_writer (xo_handle_t *xop, void *opaque, xo_write_func_t write_func,
-	       xo_close_func_t close_func, xo_flush_func_t flush_func)
+static ssize_t
+xo_shared_finish (xo_handle_t *xop UNUSED)
 {
-    xop = xo_default(xop);
+    return -1;
+}
 
-    xop->xo_opaque = opaque;
-    xop->xo_write = write_func;
-    xop->xo_close = close_func;
-    xop->xo_flush = flush_func;
+static void
+xo_shared_release (xo_handle_t *xop UNUSED)
+{
 }
 
-void
-xo_set_allocator (xo_realloc_func_t realloc_func, xo_free_func_t free_func)
+xo_handle_t *
+xo_create_shared (xo_handle_t *xop UNUSED)
 {
-    xo_realloc = realloc_func;
-    xo_free = free_func;
+    return NULL;
 }
 
-xo_ssize_t
-xo_flush_h (xo_handle_t *xop)
+#endif /* LIBXO_NEED_THREADS */
+
+/*
+ * Report what filtering did, for the "filter-stats" option.  Output
+ * that's discarded or held isn't owned by any one expression, so
+ * those counts are for the handle; the filter adds a line for each
+ * expression.
+ */
+static void
+xo_filt_stats_report (xo_handle_t *xop UNUSED)
 {
-    ssize_t rc;
+#ifdef LIBXO_NEED_FILTERS
+    if (xo_filters(xop) == NULL)
+	return;
 
-    xop = xo_default(xop);
+    xo_spill_stats_t *xssp = &xop->xo_spill_stats;
 
-    switch (xo_style(xop)) {
-    case XO_STYLE_ENCODER:
-	xo_encoder_handle(xop, XO_OP_FLUSH, NULL, NULL, NULL, 0);
-    }
+    xo_filt_note_pending(xop);
+    xo_warn_hc(xop, -1, "filter-stats: peak pending %lld bytes, "
+	       "rolled back %llu bytes", (long long) xop->xo_filt_peak,
+	       xop->xo_filt_dropped);
 
-    rc = xo_write(xop);
-    if (rc >= 0 && xop->xo_flush)
-	if (xop->xo_flush(xop->xo_opaque) < 0)
-	    return -1;
+    if (xssp->xss_spills)
+	xo_warn_hc(xop, -1, "filter-stats: spilled %lu times (%llu bytes), "
+		   "replayed %llu bytes, dropped %llu bytes",
+		   xssp->xss_spills, xssp->xss_bytes, xssp->xss_replayed,
+		   xssp->xss_dropped);
 
-    return rc;
-}
+    const char *cp = xo_filter_stats(xop, xo_filters(xop));
 
-xo_ssize_t
-xo_flush (void)
-{
-    return xo_flush_h(NULL);
+    for ( ; cp && *cp; cp += strlen(cp) + 1)
+	xo_warn_hc(xop, -1, "filter-stats: %s", cp);
+#endif /* LIBXO_NEED_FILTERS */
 }
 
 xo_ssize_t
 xo_finish_h (xo_handle_t *xop)
 {
     const char *open_if_empty = "";
+
+    if (xop && xop->xo_shared)
+	return xo_shared_finish(xop);
+
     xop = xo_default(xop);
 
+    if (xop->xo_tee) {
+	ssize_t rc = 0;
+	int i;
+
+	for (i = 0; i < xop->xo_tee_count; i++)
+	    if (xo_finish_h(xop->xo_tee[i]) < 0)
+		rc = -1;
+	return rc;
+    }
+
     if (!XOF_ISSET(xop, XOF_NO_CLOSE))
 	xo_do_close_all(xop, xop->xo_stack);
 
@@ -9793,6 +13014,9 @@ xo_finish_h (xo_handle_t *xop)
 	break;
     }
 
+    if (XOF_ISSET(xop, XOF_FILTER_STATS))
+	xo_filt_stats_report(xop);
+
     return xo_flush_h(xop);
 }
 
@@ -9819,6 +13043,8 @@ void
 xo_errorn_hv (xo_handle_t *xop, int need_newline, const char *fmt, va_list vap)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
     /*
      * If the format string doesn't end with a newline, we pop
@@ -10035,6 +13261,8 @@ xo_dump_stack (xo_handle_t *xop)
     xo_stack_t *xsp;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
     fprintf(stderr, "Stack dump: (buf: cur %ld, size %ld)\n",
 	    xop->xo_data.xb_curp - xop->xo_data.xb_bufp, xop->xo_data.xb_size);
@@ -10060,6 +13288,8 @@ void
 xo_set_version_h (xo_handle_t *xop, const char *version)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
     if (version == NULL || strchr(version, '"') != NULL)
 	return;
@@ -10107,6 +13337,8 @@ xo_emit_warn_hcv (xo_handle_t *xop, int as_warning, int code,
 		  const char *fmt, va_list vap)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
     if (fmt == NULL)
 	return;
@@ -10240,6 +13472,8 @@ void *
 xo_get_private (xo_handle_t *xop)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return NULL;
     return xop->xo_private;
 }
 
@@ -10250,6 +13484,8 @@ void
 xo_set_private (xo_handle_t *xop, void *opaque)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
     xop->xo_private = opaque;
 }
 
@@ -10260,6 +13496,8 @@ xo_encoder_func_t
 xo_get_encoder (xo_handle_t *xop)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return NULL;
     return xop->xo_encoder;
 }
 
@@ -10270,6 +13508,8 @@ xo_whiteboard_func_t
 xo_get_wb_marker (xo_handle_t *xop)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return NULL;
     return xop->xo_wb_marker;
 }
 
@@ -10281,6 +13521,8 @@ xo_set_encoder (xo_handle_t *xop, xo_encoder_func_t encoder,
 		xo_whiteboard_func_t wb_marker)
 {
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
     xop->xo_style = XO_STYLE_ENCODER;
     xop->xo_encoder = encoder;
@@ -10328,6 +13570,8 @@ xo_explicit_transition (xo_handle_t *xop, xo_state_t new_state,
     xo_xsf_flags_t xsf_flags;
 
     xop = xo_default(xop);
+    if (xop == NULL)
+	return;
 
     switch (new_state) {
 
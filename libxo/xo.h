@@ -111,6 +111,8 @@ typedef unsigned long long xo_xof_flags_t;
 
 #define XOF_NO_TOP_LEVEL XOF_BIT(36) /** Don't make a fake top-level tag */
 #define XOF_FILTER_WARN	XOF_BIT(37)  /** Warn about runtime errors w/ filters */
+#define XOF_NDJSON	XOF_BIT(38) /** One record per line (JSON) */
+#define XOF_FILTER_STATS XOF_BIT(39) /** Report what the filter did, at finish */
 
 typedef unsigned xo_emit_flags_t; /* Flags to xo_emit() and friends */
 #define XOEF_RETAIN	(1<<0)	  /* Retain parsed formatting information */
@@ -249,6 +251,10 @@ typedef void (*xo_close_func_t)(void *);
 typedef int (*xo_flush_func_t)(void *);
 typedef void *(*xo_realloc_func_t)(void *, size_t);
 typedef void (*xo_free_func_t)(void *);
+typedef void (*xo_fragment_func_t)(xo_handle_t *, size_t, void *);
+typedef xo_ssize_t (*xo_write_nb_func_t)(void *, const char *, xo_ssize_t);
+typedef void (*xo_pending_func_t)(xo_handle_t *, void *, xo_ssize_t, int);
+typedef xo_ssize_t (*xo_lazy_func_t)(void *, char *, xo_ssize_t);
 
 /*
  * The formatter function mirrors "vsnprintf", with an additional argument
@@ -265,6 +271,22 @@ xo_create (xo_style_t style, xo_xof_flags_t flags);
 xo_handle_t *
 xo_create_to_file (FILE *fp, xo_style_t style, xo_xof_flags_t flags);
 
+xo_handle_t *
+xo_create_tee (xo_handle_t *xop, ...);
+
+xo_handle_t *
+xo_create_fragment (xo_handle_t *xop);
+
+xo_ssize_t
+xo_splice_fragment (xo_handle_t *xop, xo_handle_t *frag);
+
+xo_handle_t *
+xo_create_shared (xo_handle_t *xop);
+
+int
+xo_render_list_parallel (xo_handle_t *xop, size_t count, size_t chunk,
+			 int nthreads, xo_fragment_func_t func, void *opaque);
+
 void
 xo_destroy (xo_handle_t *xop);
 
@@ -272,6 +294,27 @@ void
 xo_set_writer (xo_handle_t *xop, void *opaque, xo_write_func_t write_func,
 	       xo_close_func_t close_func, xo_flush_func_t flush_func);
 
+void
+xo_set_writer_nb (xo_handle_t *xop, void *opaque,
+		  xo_write_nb_func_t write_func, xo_close_func_t close_func,
+		  int pollfd);
+
+void
+xo_set_writer_fd (xo_handle_t *xop, int fd);
+
+xo_ssize_t
+xo_pending_bytes (xo_handle_t *xop);
+
+int
+xo_get_pollfd (xo_handle_t *xop);
+
+xo_ssize_t
+xo_drain (xo_handle_t *xop);
+
+void
+xo_set_pending_limit (xo_handle_t *xop, xo_ssize_t high, xo_ssize_t low,
+		      xo_pending_func_t func, void *opaque);
+
 void
 xo_set_allocator (xo_realloc_func_t realloc_func, xo_free_func_t free_func);
 
@@ -947,10 +990,49 @@ xo_map_add_file (xo_handle_t *xop, const char *fname);
 int
 xo_add_filter (xo_handle_t *xop, const char *vp);
 
+int
+xo_add_filter_file (xo_handle_t *xop, const char *path);
+
+int
+xo_add_filter_image (xo_handle_t *xop, const char *path);
+
+int
+xo_save_filter_image (xo_handle_t *xop, const char *path);
+
 int
 xo_discarding_output_h (xo_handle_t *xop);
 
 int
 xo_discarding_output (void);
 
+int
+xo_subtree_wanted_h (xo_handle_t *xop);
+
+int
+xo_subtree_wanted (void);
+
+int
+xo_list_wanted_h (xo_handle_t *xop);
+
+int
+xo_list_wanted (void);
+
+/*
+ * Counters kept by a handle that spills pending filtered output to a
+ * temporary file (see xo_set_filter_spill)
+ */
+typedef struct xo_spill_stats_s {
+    unsigned long xss_spills;	/* Number of times output was spilled */
+    unsigned long long xss_bytes; /* Bytes written to the spill file */
+    unsigned long long xss_replayed; /* Bytes read back to be written */
+    unsigned long long xss_dropped; /* Spilled bytes that were discarded */
+    unsigned long long xss_peak; /* Largest size of the spill file */
+} xo_spill_stats_t;
+
+void
+xo_set_filter_spill (xo_handle_t *xop, xo_ssize_t limit);
+
+void
+xo_get_spill_stats (xo_handle_t *xop, xo_spill_stats_t *statsp);
+
 #endif /* INCLUDE_XO_H */
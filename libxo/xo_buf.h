@@ -170,9 +170,11 @@ xo_buf_has_some_room (xo_buffer_t *xbp, ssize_t len, ssize_t bufsiz)
 {
     if (xbp->xb_curp + len >= xbp->xb_bufp + xbp->xb_size) {
 	/*
-	 * Find out how much new space we need, round it up to bufsiz
+	 * Find out how much new space we need, round it up to bufsiz.
+	 * Like the test above, leave a byte past the data, so callers
+	 * can NUL-terminate it (vsnprintf will).
 	 */
-	ssize_t sz = (xbp->xb_curp + len) - xbp->xb_bufp;
+	ssize_t sz = (xbp->xb_curp + len) - xbp->xb_bufp + 1;
 	sz = (sz + bufsiz - 1) & ~(bufsiz - 1);
 
 	char *bp = xo_realloc(xbp->xb_bufp, sz);
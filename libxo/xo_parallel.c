@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+/**
+ * Render the instances of a list on a set of worker threads.  The
+ * list is cut into chunks, and each worker renders its chunks into
+ * its own fragment (see xo_create_fragment), saving each chunk's
+ * output as it finishes; the saved output is spliced into the parent
+ * handle in order by the calling thread as it completes.  Handles
+ * are made per worker, not per chunk, so their cost follows the
+ * number of threads.  Each
+ * worker starts with an equal range of chunks, taking them from the
+ * front; when its range is empty, it steals chunks from the back of
+ * the other workers' ranges, so uneven instances don't leave threads
+ * idle.  When libxo is built without threads (--disable-threads), the
+ * instances are rendered in order on the calling thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xo_config.h"
+#include "xo.h"
+#include "xo_private.h"
+
+#ifdef LIBXO_NEED_THREADS
+
+#include <pthread.h>
+
+#define XO_PAR_CHUNKS_PER_THREAD 8 /* Default chunks per thread */
+
+/* A chunk of instances, rendered into a worker's fragment */
+typedef struct xo_par_chunk_s {
+    xo_frag_output_t xpc_output; /* This chunk's output, once done */
+    int xpc_done;		/* Has this chunk been rendered? */
+    int xpc_failed;		/* Could its output not be saved? */
+} xo_par_chunk_t;
+
+/* A worker's range of chunks */
+typedef struct xo_par_range_s {
+    pthread_mutex_t xpr_mutex;	/* Protects xpr_next and xpr_end */
+    size_t xpr_next;		/* Next chunk (taken by the owner) */
+    size_t xpr_end;		/* End of range (stolen by others) */
+} xo_par_range_t;
+
+typedef struct xo_par_s {
+    size_t xp_count;		/* Number of instances */
+    size_t xp_chunk;		/* Number of instances per chunk */
+    size_t xp_nchunks;		/* Number of chunks */
+    int xp_nthreads;		/* Number of workers */
+    xo_fragment_func_t xp_func;	/* Caller's function */
+    void *xp_opaque;		/* Caller's opaque data */
+    xo_par_chunk_t *xp_chunks;	/* Chunks (xp_nchunks) */
+    xo_par_range_t *xp_ranges;	/* Ranges (xp_nthreads) */
+    pthread_mutex_t xp_mutex;	/* Protects xpc_done and xpc_failed */
+    pthread_cond_t xp_cond;	/* Signaled when a chunk is done */
+} xo_par_t;
+
+typedef struct xo_par_worker_s {
+    xo_par_t *xpw_par;		/* Shared state */
+    int xpw_id;			/* Our range */
+    xo_handle_t *xpw_frag;	/* Our fragment, reused for each chunk */
+} xo_par_worker_t;
+
+/*
+ * Take a chunk from the front of our own range, or failing that, from
+ * the back of someone else's.  Returns -1 when no work remains.
+ */
+static ssize_t
+xo_par_take (xo_par_t *xpp, int id)
+{
+    xo_par_range_t *xprp;
+    ssize_t num = -1;
+    int i;
+
+    xprp = &xpp->xp_ranges[id];
+    pthread_mutex_lock(&xprp->xpr_mutex);
+    if (xprp->xpr_next < xprp->xpr_end)
+	num = xprp->xpr_next++;
+    pthread_mutex_unlock(&xprp->xpr_mutex);
+
+    for (i = 1; num < 0 && i < xpp->xp_nthreads; i++) {
+	xprp = &xpp->xp_ranges[(id + i) % xpp->xp_nthreads];
+
+	pthread_mutex_lock(&xprp->xpr_mutex);
+	if (xprp->xpr_next < xprp->xpr_end)
+	    num = --xprp->xpr_end;
+	pthread_mutex_unlock(&xprp->xpr_mutex);
+    }
+
+    return num;
+}
+
+static void *
+xo_par_worker (void *arg)
+{
+    xo_par_worker_t *xpwp = arg;
+    xo_par_t *xpp = xpwp->xpw_par;
+    ssize_t num;
+
+    while ((num = xo_par_take(xpp, xpwp->xpw_id)) >= 0) {
+	xo_par_chunk_t *xpcp = &xpp->xp_chunks[num];
+	size_t start = num * xpp->xp_chunk;
+	size_t end = start + xpp->xp_chunk;
+	size_t i;
+
+	if (end > xpp->xp_count)
+	    end = xpp->xp_count;
+
+	for (i = start; i < end; i++)
+	    xpp->xp_func(xpwp->xpw_frag, i, xpp->xp_opaque);
+
+	int failed = (xo_fragment_save(xpwp->xpw_frag, &xpcp->xpc_output) < 0);
+
+	pthread_mutex_lock(&xpp->xp_mutex);
+	xpcp->xpc_done = TRUE;
+	xpcp->xpc_failed = failed;
+	pthread_cond_broadcast(&xpp->xp_cond);
+	pthread_mutex_unlock(&xpp->xp_mutex);
+    }
+
+    return NULL;
+}
+
+/*
+ * Release whatever xo_render_list_parallel() managed to allocate
+ */
+static void
+xo_par_cleanup (xo_par_t *xpp, xo_par_worker_t *workers)
+{
+    size_t i;
+
+    for (i = 0; i < (size_t) xpp->xp_nthreads; i++)
+	if (workers[i].xpw_frag)
+	    xo_destroy(workers[i].xpw_frag);
+
+    if (xpp->xp_chunks) {
+	for (i = 0; i < xpp->xp_nchunks; i++)
+	    if (xpp->xp_chunks[i].xpc_output.xfo_data)
+		xo_free(xpp->xp_chunks[i].xpc_output.xfo_data);
+	xo_free(xpp->xp_chunks);
+    }
+
+    if (xpp->xp_ranges) {
+	for (i = 0; i < (size_t) xpp->xp_nthreads; i++)
+	    pthread_mutex_destroy(&xpp->xp_ranges[i].xpr_mutex);
+	xo_free(xpp->xp_ranges);
+    }
+}
+
+/**
+ * Render "count" instances of the list that is open on "xop", calling
+ * "func" for each index on one of "nthreads" worker threads.  "func"
+ * is passed a fragment handle, which it must use for all its libxo
+ * calls, and should open and close the instance itself.  Output is
+ * spliced into "xop" in index order, so it matches what a simple
+ * loop would have made.  Zero for "chunk" or "nthreads" picks a
+ * default.  When fragments can't be used (encoders and filtering),
+ * or only one thread is wanted, the instances are rendered in order
+ * on the calling thread, as they always are when libxo is built
+ * without threads.
+ *
+ * @param xop Handle to use (or NULL for default handle)
+ * @param count Number of instances
+ * @param chunk Number of instances handed to a worker at a time
+ * @param nthreads Number of worker threads
+ * @param func Function to render one instance
+ * @param opaque Data passed to func
+ * @return 0 on success, -1 on failure
+ */
+int
+xo_render_list_parallel (xo_handle_t *xop, size_t count, size_t chunk,
+			 int nthreads, xo_fragment_func_t func, void *opaque)
+{
+    xo_par_t par;
+    size_t i;
+    int rc = 0;
+
+    if (nthreads <= 0) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = (ncpu > 0) ? ncpu : 1;
+    }
+
+    if (chunk == 0) {
+	chunk = count / (nthreads * XO_PAR_CHUNKS_PER_THREAD);
+	if (chunk == 0)
+	    chunk = 1;
+    }
+
+    bzero(&par, sizeof(par));
+    par.xp_count = count;
+    par.xp_chunk = chunk;
+    par.xp_nchunks = (count + chunk - 1) / chunk;
+    par.xp_func = func;
+    par.xp_opaque = opaque;
+
+    if ((size_t) nthreads > par.xp_nchunks)
+	nthreads = par.xp_nchunks;
+
+    /* Fragments are made here, since they copy xop's state */
+    xo_handle_t *frag = NULL;
+    if (nthreads > 1)
+	frag = xo_create_fragment(xop);
+
+    if (frag == NULL) {
+	for (i = 0; i < count; i++)
+	    func(xop, i, opaque);
+	return 0;
+    }
+
+    pthread_t tids[nthreads];
+    xo_par_worker_t workers[nthreads];
+    int started = 0;
+
+    bzero(workers, sizeof(workers));
+    par.xp_nthreads = nthreads;
+
+    workers[0].xpw_frag = frag;
+    for (i = 1; i < (size_t) nthreads; i++) {
+	workers[i].xpw_frag = xo_create_fragment(xop);
+	if (workers[i].xpw_frag == NULL) {
+	    xo_par_cleanup(&par, workers);
+	    return -1;
+	}
+    }
+
+    par.xp_chunks = xo_realloc(NULL, par.xp_nchunks * sizeof(par.xp_chunks[0]));
+    if (par.xp_chunks == NULL) {
+	xo_par_cleanup(&par, workers);
+	return -1;
+    }
+    bzero(par.xp_chunks, par.xp_nchunks * sizeof(par.xp_chunks[0]));
+
+    par.xp_ranges = xo_realloc(NULL, nthreads * sizeof(par.xp_ranges[0]));
+    if (par.xp_ranges == NULL) {
+	xo_par_cleanup(&par, workers);
+	return -1;
+    }
+
+    /* Deal out equal ranges of chunks; stealing evens out the rest */
+    for (i = 0; i < (size_t) nthreads; i++) {
+	xo_par_range_t *xprp = &par.xp_ranges[i];
+
+	pthread_mutex_init(&xprp->xpr_mutex, NULL);
+	xprp->xpr_next = i * par.xp_nchunks / nthreads;
+	xprp->xpr_end = (i + 1) * par.xp_nchunks / nthreads;
+    }
+
+    pthread_mutex_init(&par.xp_mutex, NULL);
+    pthread_cond_init(&par.xp_cond, NULL);
+
+    for (i = 0; i < (size_t) nthreads; i++) {
+	workers[i].xpw_par = &par;
+	workers[i].xpw_id = i;
+
+	if (pthread_create(&tids[started], NULL, xo_par_worker,
+			   &workers[i]) == 0)
+	    started += 1;
+    }
+
+    /* If we couldn't get any threads, we'll do the work ourselves */
+    if (started == 0)
+	xo_par_worker(&workers[0]);
+
+    /* Splice the chunks in order, as they complete */
+    for (i = 0; i < par.xp_nchunks; i++) {
+	xo_par_chunk_t *xpcp = &par.xp_chunks[i];
+
+	pthread_mutex_lock(&par.xp_mutex);
+	while (!xpcp->xpc_done)
+	    pthread_cond_wait(&par.xp_cond, &par.xp_mutex);
+	pthread_mutex_unlock(&par.xp_mutex);
+
+	if (xpcp->xpc_failed || xo_splice_output(xop, &xpcp->xpc_output) < 0)
+	    rc = -1;
+    }
+
+    for (i = 0; i < (size_t) started; i++)
+	pthread_join(tids[i], NULL);
+
+    pthread_cond_destroy(&par.xp_cond);
+    pthread_mutex_destroy(&par.xp_mutex);
+    xo_par_cleanup(&par, workers);
+
+    return rc;
+}
+
+#else /* LIBXO_NEED_THREADS */
+
+/*
+ * Without threads, the instances are rendered in order on the calling
+ * thread, which makes the same output
+ */
+int
+xo_render_list_parallel (xo_handle_t *xop, size_t count, size_t chunk UNUSED,
+			 int nthreads UNUSED, xo_fragment_func_t func,
+			 void *opaque)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+	func(xop, i, opaque);
+
+    return 0;
+}
+
+#endif /* LIBXO_NEED_THREADS */
@@ -52,6 +52,25 @@ xo_streqn (const char *one, const char *two, ssize_t len_of_two)
     return strncmp(one, two, len_of_two + 1) == 0;
 }
 
+/*
+ * A simple string hash (FNV-1a), for use in our hash tables.  Start
+ * with XO_HASH_INIT and feed in as many pieces as needed.
+ */
+#define XO_HASH_INIT 2166136261U
+
+static inline uint32_t
+xo_hash_buf (uint32_t hash, const char *buf, ssize_t len)
+{
+    const unsigned char *cp = (const unsigned char *) buf;
+
+    for ( ; len > 0; len--, cp++) {
+	hash ^= *cp;
+	hash *= 16777619;
+    }
+
+    return hash;
+}
+
 /* Rather lame that we can't count on these... */
 #ifndef FALSE
 #define FALSE 0
@@ -108,6 +127,26 @@ xo_dbg (xo_handle_t *xop, const char *fmt, ...);
 void
 xo_dbg_v (xo_handle_t *xop UNUSED, const char *fmt UNUSED, va_list vap UNUSED);
 
+/*
+ * Output moved out of a fragment by xo_fragment_save(), waiting to be
+ * spliced into the parent by xo_splice_output().  This lets
+ * xo_render_list_parallel() use one fragment per worker, however
+ * many chunks complete ahead of their turn.
+ */
+typedef struct xo_frag_output_s {
+    xo_handle_t *xfo_parent;	/* Handle the fragment was made from */
+    int xfo_depth;		/* Depth of the parent's list */
+    unsigned xfo_flags;		/* Fragment's list flags (XSF_*) */
+    char *xfo_data;		/* Output (NULL if none) */
+    xo_ssize_t xfo_len;		/* Length of xfo_data */
+} xo_frag_output_t;
+
+int
+xo_fragment_save (xo_handle_t *frag, xo_frag_output_t *xfop);
+
+xo_ssize_t
+xo_splice_output (xo_handle_t *xop, xo_frag_output_t *xfop);
+
 /*
  * The base libxo code needs to know just a little about filtering.
  * Anything it needs goes here.
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * membuf.h: a libxo writer that collects output in memory, for the
+ * tests that make output on a handle and then report what it made.
+ * Use it with:
+ *     xo_set_writer(xop, &mem, write_buf, NULL, NULL);
+ * The output is kept NUL-terminated; set mb_len to zero to reuse
+ * the buffer, and free mb_buf when done.
+ */
+
+#ifndef TESTS_CORE_MEMBUF_H
+#define TESTS_CORE_MEMBUF_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xo.h"
+
+typedef struct membuf_s {
+    char *mb_buf;		/* Output made so far (NUL-terminated) */
+    size_t mb_len;		/* Length of output */
+    size_t mb_size;		/* Allocated size of mb_buf */
+} membuf_t;
+
+static xo_ssize_t
+write_buf (void *opaque, const char *data)
+{
+    membuf_t *mbp = opaque;
+    size_t len = strlen(data);
+
+    if (mbp->mb_len + len + 1 > mbp->mb_size) {
+	mbp->mb_size = (mbp->mb_len + len + 1) * 2;
+	mbp->mb_buf = realloc(mbp->mb_buf, mbp->mb_size);
+	if (mbp->mb_buf == NULL)
+	    exit(1);
+    }
+
+    memcpy(mbp->mb_buf + mbp->mb_len, data, len + 1);
+    mbp->mb_len += len;
+
+    return len;
+}
+
+#endif /* TESTS_CORE_MEMBUF_H */
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_15.c: verify xo_create_tee() fans one set of calls out to
+ * several handles.  The first handle writes to stdout in the style
+ * given on the command line, and the second writes pretty JSON to
+ * stderr.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "xo.h"
+
+/*
+ * Find the options given with "--libxo", before xo_parse_args()
+ * removes them, so the first handle can be given the same ones
+ */
+static const char *
+libxo_options (int argc, char **argv)
+{
+    int i;
+
+    for (i = 1; i < argc; i++) {
+	if (strncmp(argv[i], "--libxo", 7) != 0)
+	    continue;
+
+	if (argv[i][7] == ':')
+	    return argv[i] + 7;
+	if (argv[i][7] == '=')
+	    return argv[i] + 8;
+	if (argv[i][7] == '\0' && i + 1 < argc)
+	    return argv[i + 1];
+    }
+
+    return NULL;
+}
+
+int
+main (int argc, char **argv)
+{
+    static const char fmt[] = "{k:name/%-10s/%s} {:count/%5d} {:state}\n";
+    static const char *names[] = { "alpha", "beta", "gamma", NULL };
+    const char *options = libxo_options(argc, argv);
+    int i;
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    xo_handle_t *out = xo_create_to_file(stdout, XO_STYLE_TEXT, 0);
+    if (out && xo_set_options(out, options) < 0)
+	return 1;
+
+    xo_handle_t *json = xo_create_to_file(stderr, XO_STYLE_JSON, XOF_PRETTY);
+    xo_handle_t *xop = xo_create_tee(out, json, NULL);
+
+    if (xop == NULL)
+	return 1;
+
+    xo_open_container_h(xop, "top");
+    xo_emit_h(xop, "{T:Name/%-10s} {T:Count/%5s} {T:State}\n");
+
+    xo_open_list_h(xop, "item");
+    for (i = 0; names[i]; i++) {
+	xo_open_instance_h(xop, "item");
+	xo_attr_h(xop, "seq", "%d", i);
+	xo_emit_hf(xop, XOEF_RETAIN, fmt, names[i], i * 100, "ok");
+
+	xo_open_marker_h(xop, "m1");
+	xo_open_container_h(xop, "detail");
+	xo_emit_h(xop, "  {Lwc:Length}{:length/%zu}\n", strlen(names[i]));
+	xo_close_marker_h(xop, "m1");	/* Closes "detail" */
+
+	xo_close_instance_h(xop, "item");
+    }
+    xo_close_list_h(xop, "item");
+
+    xo_emit_field_h(xop, "V", "total", "%d", NULL, i);
+    xo_emit_h(xop, "\n");
+
+    xo_close_container_h(xop, "top");
+
+    xo_finish_h(xop);
+    xo_destroy(xop);
+
+    xo_destroy(json);
+    xo_destroy(out);
+
+    return 0;
+}
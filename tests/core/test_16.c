@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_16.c: verify fragments and xo_render_list_parallel() make the
+ * same output as rendering the list in a simple loop.  Also used by
+ * "make benchmark-parallel", via the "count", "threads", and "chunk"
+ * arguments.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xo.h"
+
+/* The opaque argument for render_item */
+typedef struct state_s {
+    const char *s_name;		/* Value of the "state" field */
+} state_t;
+
+static state_t st_ok = { "ok" };
+static state_t st_parent = { "parent" };
+static state_t st_fragment = { "fragment" };
+static state_t st_reused = { "reused" };
+
+static void
+render_item (xo_handle_t *xop, size_t index, void *opaque)
+{
+    const char *state = ((state_t *) opaque)->s_name;
+
+    xo_open_instance_h(xop, "item");
+    xo_emit_hf(xop, XOEF_RETAIN,
+	       "{k:name/item-%04zu} {:square/%zu} {:parity} {:state}\n",
+	       index, index * index, (index & 1) ? "odd" : "even", state);
+    xo_close_instance_h(xop, "item");
+}
+
+int
+main (int argc, char **argv)
+{
+    size_t count = 40, chunk = 3;
+    int threads = 4;
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (argv[argc + 1] == NULL)
+	    break;
+	if (strcmp(argv[argc], "count") == 0)
+	    count = atoi(argv[++argc]);
+	else if (strcmp(argv[argc], "threads") == 0)
+	    threads = atoi(argv[++argc]);
+	else if (strcmp(argv[argc], "chunk") == 0)
+	    chunk = atoi(argv[++argc]);
+    }
+
+    xo_open_container("top");
+    xo_emit("{T:Name} {T:Square} {T:Parity} {T:State}\n");
+
+    xo_open_list("item");
+    xo_render_list_parallel(NULL, count, chunk, threads, render_item, &st_ok);
+    xo_close_list("item");
+
+    /* Splice by hand, around instances made on the parent */
+    xo_open_container("more");
+    xo_open_list("item");
+    render_item(NULL, 100, &st_parent);
+
+    xo_handle_t *frag = xo_create_fragment(NULL);
+    if (frag) {
+	render_item(frag, 101, &st_fragment);
+	render_item(frag, 102, &st_fragment);
+	xo_splice_fragment(NULL, frag);
+
+	xo_splice_fragment(NULL, frag); /* Empty; adds nothing */
+
+	render_item(frag, 103, &st_reused);
+	xo_splice_fragment(NULL, frag);
+	xo_destroy(frag);
+    } else {
+	/* No fragments for encoders; make the same output directly */
+	render_item(NULL, 101, &st_fragment);
+	render_item(NULL, 102, &st_fragment);
+	render_item(NULL, 103, &st_reused);
+    }
+
+    render_item(NULL, 104, &st_parent);
+    xo_close_list("item");
+    xo_close_container("more");
+
+    xo_close_container("top");
+
+    xo_finish();
+
+    return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_17.c: verify xo_create_shared() keeps records from several
+ * threads whole.  The threads make JSON into a memory buffer, which
+ * is then checked for torn or missing records; only a summary goes
+ * to the default handle.  The threads are made in waves, so staging
+ * handles are freed as threads exit, and then one thread exits
+ * partway through a record, which must be discarded.  Also used by "make benchmark-shared", via
+ * the "threads" and "count" arguments; "mutex" makes the same output
+ * using a plain handle and a lock around each record, for comparison.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "xo.h"
+#include "membuf.h"
+
+static membuf_t mem;		/* Output made by our handles */
+
+static int use_mutex;
+static pthread_mutex_t big_lock = PTHREAD_MUTEX_INITIALIZER;
+static int count = 100;
+static int waves = 3;
+
+typedef struct worker_s {
+    xo_handle_t *w_xop;		/* Handle to make output on */
+    int w_num;			/* Our thread number */
+} worker_t;
+
+static void *
+worker (void *arg)
+{
+    worker_t *wp = arg;
+    xo_handle_t *xop = wp->w_xop;
+    int tnum = wp->w_num;
+    char tag[32];
+    int i;
+
+    for (i = 0; i < count; i++) {
+	snprintf(tag, sizeof(tag), "@%d.%d@", tnum, i);
+
+	if (use_mutex)
+	    pthread_mutex_lock(&big_lock);
+
+	xo_open_instance_h(xop, "event");
+	xo_emit_hf(xop, XOEF_RETAIN,
+		   "{:thread/%d}{:seq/%d}{:a/%s}{:b/%s}{:c/%s}",
+		   tnum, i, tag, tag, tag);
+	xo_close_instance_h(xop, "event");
+
+	if (use_mutex)
+	    pthread_mutex_unlock(&big_lock);
+    }
+
+    xo_flush_h(xop);
+
+    return NULL;
+}
+
+/*
+ * Exit partway through a record; its lone tag would count as torn
+ */
+static void *
+quitter (void *arg)
+{
+    xo_handle_t *xop = arg;
+
+    xo_open_instance_h(xop, "event");
+    xo_emit_h(xop, "{:a/%s}", "@quit@");
+
+    return NULL;
+}
+
+/*
+ * Each record has three copies of its tag; they must appear together
+ */
+static void
+check_buf (int *recordsp, int *tornp, int *sepsp)
+{
+    char *cp, *ep, *last = NULL;
+    size_t last_len = 0;
+    int run = 0;
+
+    for (cp = mem.mb_buf; (cp = strchr(cp, '@')) != NULL; cp = ep + 1) {
+	ep = strchr(cp + 1, '@');
+	if (ep == NULL)
+	    break;
+
+	size_t len = ep - cp;
+	if (run > 0 && run < 3 && len == last_len
+		&& strncmp(cp, last, len) == 0) {
+	    run += 1;
+	} else {
+	    if (run != 0 && run != 3)
+		*tornp += 1;
+	    run = 1;
+	}
+
+	if (run == 3)
+	    *recordsp += 1;
+
+	last = cp;
+	last_len = len;
+    }
+
+    if (run != 0 && run != 3)
+	*tornp += 1;
+
+    for (cp = mem.mb_buf; (cp = strstr(cp, "}, {")) != NULL; cp += 4)
+	*sepsp += 1;
+}
+
+int
+main (int argc, char **argv)
+{
+    int threads = 4, i;
+    int records = 0, torn = 0, seps = 0;
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (strcmp(argv[argc], "mutex") == 0)
+	    use_mutex = 1;
+	if (argv[argc + 1] == NULL)
+	    break;
+	if (strcmp(argv[argc], "count") == 0)
+	    count = atoi(argv[++argc]);
+	else if (strcmp(argv[argc], "threads") == 0)
+	    threads = atoi(argv[++argc]);
+	else if (strcmp(argv[argc], "waves") == 0)
+	    waves = atoi(argv[++argc]);
+    }
+
+    xo_handle_t *parent = xo_create(XO_STYLE_JSON, XOF_WARN);
+    if (parent == NULL)
+	return 1;
+    xo_set_writer(parent, &mem, write_buf, NULL, NULL);
+
+    xo_open_list_h(parent, "event");
+
+    xo_handle_t *xop = use_mutex ? parent : xo_create_shared(parent);
+    if (xop == NULL)
+	return 1;
+
+    pthread_t tids[threads];
+    worker_t workers[threads];
+    int wave;
+    for (wave = 0; wave < waves; wave++) {
+	for (i = 0; i < threads; i++) {
+	    workers[i].w_xop = xop;
+	    workers[i].w_num = wave * threads + i;
+	    pthread_create(&tids[i], NULL, worker, &workers[i]);
+	}
+	for (i = 0; i < threads; i++)
+	    pthread_join(tids[i], NULL);
+    }
+
+    if (xop != parent) {
+	pthread_create(&tids[0], NULL, quitter, xop);
+	pthread_join(tids[0], NULL);
+    }
+
+    if (xop != parent)
+	xo_destroy(xop);
+
+    xo_close_list_h(parent, "event");
+    xo_finish_h(parent);
+    xo_destroy(parent);
+
+    if (mem.mb_buf)
+	check_buf(&records, &torn, &seps);
+
+    xo_open_container("top");
+    xo_emit("{Lwc:Records}{:records/%d}\n", records);
+    xo_emit("{Lwc:Expected}{:expected/%d}\n", waves * threads * count);
+    xo_emit("{Lwc:Torn}{:torn/%d}\n", torn);
+    xo_emit("{Lwc:Separators}{:separators/%d}\n", seps);
+    xo_close_container("top");
+
+    xo_finish();
+
+    free(mem.mb_buf);
+
+    return 0;
+}
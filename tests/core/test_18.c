@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_18.c: verify NDJSON output.  For JSON styles, the default
+ * handle is put in NDJSON mode, so each record is a line.  Then
+ * several processes append records (some larger than PIPE_BUF) to
+ * one file, which is checked for torn or missing lines.  Last, a file
+ * not opened for appending must get a warning, with its flags left
+ * alone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "xo.h"
+
+static void
+append_records (const char *path, int num, int count)
+{
+    char tag[32];
+    char *big;
+    int i;
+
+    /* Appending is what keeps the processes from clobbering */
+    FILE *fp = fopen(path, "a");
+    if (fp == NULL)
+	exit(1);
+
+    xo_handle_t *xop = xo_create_to_file(fp, XO_STYLE_JSON,
+					 XOF_NDJSON | XOF_CLOSE_FP);
+    if (xop == NULL)
+	exit(1);
+
+    big = malloc(PIPE_BUF + 1);
+    if (big == NULL)
+	exit(1);
+    memset(big, 'x', PIPE_BUF);
+    big[PIPE_BUF] = '\0';
+
+    xo_open_list_h(xop, "event");
+    for (i = 0; i < count; i++) {
+	snprintf(tag, sizeof(tag), "@%d.%d@", num, i);
+
+	xo_open_instance_h(xop, "event");
+	xo_emit_h(xop, "{:a/%s}{:pad/%s}{:b/%s}",
+		  tag, (i % 10 == 0) ? big : "", tag);
+	xo_close_instance_h(xop, "event");
+    }
+    xo_close_list_h(xop, "event");
+
+    xo_finish_h(xop);
+    xo_destroy(xop);
+    free(big);
+
+    _exit(0);
+}
+
+/*
+ * Each line must be a record, holding two copies of the same tag
+ */
+static void
+check_file (const char *path, int *linesp, int *tornp)
+{
+    FILE *fp = fopen(path, "r");
+    char *line = NULL, *cp, *ep;
+    size_t size = 0;
+    ssize_t len;
+
+    if (fp == NULL)
+	return;
+
+    while ((len = getline(&line, &size, fp)) > 0) {
+	*linesp += 1;
+
+	if (len < 3 || line[0] != '{' || strcmp(line + len - 2, "}\n") != 0) {
+	    *tornp += 1;
+	    continue;
+	}
+
+	cp = strchr(line, '@');
+	ep = cp ? strchr(cp + 1, '@') : NULL;
+	if (ep == NULL) {
+	    *tornp += 1;
+	    continue;
+	}
+
+	ep += 1;
+	*ep++ = '\0';
+	if (strstr(ep, cp) == NULL)
+	    *tornp += 1;
+    }
+
+    free(line);
+    fclose(fp);
+}
+
+/*
+ * Write a record to a file that isn't open for appending, returning
+ * TRUE if libxo turned O_APPEND on
+ */
+static int
+not_appending (const char *path)
+{
+    FILE *fp = fopen(path, "r+");
+    if (fp == NULL)
+	return 0;
+
+    xo_handle_t *xop = xo_create_to_file(fp, XO_STYLE_JSON,
+					 XOF_NDJSON | XOF_WARN);
+    if (xop == NULL)
+	exit(1);
+
+    xo_open_instance_h(xop, "event");
+    xo_emit_h(xop, "{:id/%d}", 1);
+    xo_close_instance_h(xop, "event");
+    xo_finish_h(xop);
+
+    int fl = fcntl(fileno(fp), F_GETFL);
+
+    xo_destroy(xop);
+    fclose(fp);
+
+    return fl >= 0 && (fl & O_APPEND);
+}
+
+int
+main (int argc, char **argv)
+{
+    int procs = 4, count = 50, i;
+    int lines = 0, torn = 0;
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (argv[argc + 1] == NULL)
+	    break;
+	if (strcmp(argv[argc], "count") == 0)
+	    count = atoi(argv[++argc]);
+	else if (strcmp(argv[argc], "procs") == 0)
+	    procs = atoi(argv[++argc]);
+    }
+
+    if (xo_get_style(NULL) == XO_STYLE_JSON)
+	xo_set_flags(NULL, XOF_NDJSON);
+
+    xo_open_list("event");
+    for (i = 0; i < 3; i++) {
+	xo_open_instance("event");
+	xo_emit("{k:id/%d} {:name/%s}\n", i, (i == 1) ? "beta" : "alpha");
+
+	xo_open_container("detail");
+	xo_emit("  {Lwc:Size}{:size/%d}\n", i * 100);
+	xo_emit("  {Lwc:Tags}{l:tag}{l:tag}\n", "one", "two");
+	xo_close_container("detail");
+
+	xo_close_instance("event");
+    }
+    xo_close_list("event");
+
+    char path[] = "/tmp/libxo-test-18.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+	return 1;
+    close(fd);
+
+    for (i = 0; i < procs; i++) {
+	fflush(stdout);
+	if (fork() == 0)
+	    append_records(path, i, count);
+    }
+
+    while (wait(NULL) > 0)
+	continue;
+
+    check_file(path, &lines, &torn);
+
+    int changed = not_appending(path);
+    unlink(path);
+
+    xo_open_container("summary");
+    xo_emit("{Lwc:Lines}{:lines/%d}\n", lines);
+    xo_emit("{Lwc:Expected}{:expected/%d}\n", procs * count);
+    xo_emit("{Lwc:Torn}{:torn/%d}\n", torn);
+    xo_emit("{Lwc:Flags changed}{:flags-changed/%s}\n",
+	    changed ? "true" : "false");
+    xo_close_container("summary");
+
+    xo_finish();
+
+    return 0;
+}
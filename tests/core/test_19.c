@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_19.c: verify non-blocking writers.  A "stingy" writer takes a
+ * few bytes at a time and reports EAGAIN every other call; output is
+ * drained until nothing is pending and compared with the same output
+ * made by a normal writer.  The same is then done over a non-blocking
+ * socket, using xo_get_pollfd() and poll(2).  Last, handles are
+ * destroyed with output still queued: a writer that starts taking
+ * data again must get all of it, and one that fails must get a
+ * warning about what was discarded.  Only a summary goes to the
+ * default handle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "xo.h"
+
+typedef struct output_s {
+    char *o_buf;		/* Data written */
+    size_t o_len;		/* Length of data */
+    size_t o_size;		/* Allocated size of o_buf */
+    int o_calls;		/* Number of write calls */
+} output_t;
+
+static void
+output_add (output_t *op, const char *data, size_t len)
+{
+    if (op->o_len + len + 1 > op->o_size) {
+	op->o_size = (op->o_len + len + 1) * 2;
+	op->o_buf = realloc(op->o_buf, op->o_size);
+	if (op->o_buf == NULL)
+	    exit(1);
+    }
+
+    memcpy(op->o_buf + op->o_len, data, len);
+    op->o_len += len;
+    op->o_buf[op->o_len] = '\0';
+}
+
+static xo_ssize_t
+write_normal (void *opaque, const char *data)
+{
+    size_t len = strlen(data);
+
+    output_add(opaque, data, len);
+    return len;
+}
+
+static xo_ssize_t
+write_stingy (void *opaque, const char *data, xo_ssize_t len)
+{
+    output_t *op = opaque;
+
+    if (op->o_calls++ & 1) {
+	errno = EAGAIN;
+	return -1;
+    }
+
+    if (len > 7)
+	len = 7;
+
+    output_add(op, data, len);
+    return len;
+}
+
+static int refusals;		/* Calls for write_late to refuse */
+static int broken;		/* Should write_late fail? */
+
+static xo_ssize_t
+write_late (void *opaque, const char *data, xo_ssize_t len)
+{
+    if (refusals > 0) {
+	refusals -= 1;
+	errno = EAGAIN;
+	return -1;
+    }
+
+    if (broken) {
+	errno = EPIPE;
+	return -1;
+    }
+
+    output_add(opaque, data, len);
+    return len;
+}
+
+static int highs, lows;
+
+static void
+pending_limit (xo_handle_t *xop __attribute__ ((__unused__)),
+	       void *opaque __attribute__ ((__unused__)),
+	       xo_ssize_t pending __attribute__ ((__unused__)), int above)
+{
+    if (above)
+	highs += 1;
+    else
+	lows += 1;
+}
+
+static void
+make_output (xo_handle_t *xop, int count)
+{
+    int i;
+
+    xo_open_container_h(xop, "top");
+    xo_open_list_h(xop, "item");
+    for (i = 0; i < count; i++) {
+	xo_open_instance_h(xop, "item");
+	xo_emit_hf(xop, XOEF_RETAIN, "{k:name/item-%d}{:value/%d}"
+		   "{:text/the quick brown fox jumps over the lazy dog}",
+		   i, i * 3);
+	xo_close_instance_h(xop, "item");
+	xo_flush_h(xop);
+    }
+    xo_close_list_h(xop, "item");
+    xo_close_container_h(xop, "top");
+    xo_finish_h(xop);
+}
+
+int
+main (int argc, char **argv)
+{
+    output_t normal, stingy, big, sock, late;
+    int count = 200, max_pending = 0, drains = 0, fds[2];
+    xo_ssize_t pending;
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    bzero(&normal, sizeof(normal));
+    bzero(&stingy, sizeof(stingy));
+    bzero(&big, sizeof(big));
+    bzero(&sock, sizeof(sock));
+    bzero(&late, sizeof(late));
+
+    xo_handle_t *xop = xo_create(XO_STYLE_JSON, 0);
+    xo_set_writer(xop, &normal, write_normal, NULL, NULL);
+    make_output(xop, count);
+    xo_destroy(xop);
+
+    xop = xo_create(XO_STYLE_JSON, 0);
+    xo_set_writer(xop, &big, write_normal, NULL, NULL);
+    make_output(xop, count * 50);
+    xo_destroy(xop);
+
+    /* The stingy writer can't keep up, so output queues up */
+    xop = xo_create(XO_STYLE_JSON, 0);
+    xo_set_writer_nb(xop, &stingy, write_stingy, NULL, -1);
+    xo_set_pending_limit(xop, 4096, 1024, pending_limit, NULL);
+    make_output(xop, count);
+
+    while ((pending = xo_pending_bytes(xop)) > 0) {
+	if (pending > max_pending)
+	    max_pending = pending;
+	if (xo_drain(xop) < 0)
+	    break;
+    }
+    xo_destroy(xop);
+
+    /* A non-blocking socket, drained by polling */
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+	return 1;
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    xop = xo_create(XO_STYLE_JSON, 0);
+    xo_set_writer_fd(xop, fds[0]);
+    make_output(xop, count * 50);
+
+    while (xo_pending_bytes(xop) > 0) {
+	struct pollfd pfd[2] = {
+	    { .fd = xo_get_pollfd(xop), .events = POLLOUT },
+	    { .fd = fds[1], .events = POLLIN },
+	};
+	char buf[4096];
+
+	if (poll(pfd, 2, 1000) <= 0)
+	    break;
+
+	if (pfd[1].revents & POLLIN) {
+	    ssize_t len = read(fds[1], buf, sizeof(buf));
+	    if (len > 0)
+		output_add(&sock, buf, len);
+	}
+
+	if (pfd[0].revents & POLLOUT) {
+	    drains += 1;
+	    if (xo_drain(xop) < 0)
+		break;
+	}
+    }
+
+    xo_set_flags(xop, XOF_CLOSE_FP);
+    xo_destroy(xop);	/* Closes fds[0] */
+
+    for (;;) {
+	char buf[4096];
+	ssize_t len = read(fds[1], buf, sizeof(buf));
+	if (len <= 0)
+	    break;
+	output_add(&sock, buf, len);
+    }
+    close(fds[1]);
+
+    int sock_ok = (drains > 0 && sock.o_len == big.o_len
+		   && memcmp(sock.o_buf, big.o_buf, big.o_len) == 0);
+
+    /* Destroyed while queued; the writer is ready again soon after */
+    refusals = 1000000;
+    xop = xo_create(XO_STYLE_JSON, XOF_WARN);
+    xo_set_writer_nb(xop, &late, write_late, NULL, -1);
+    make_output(xop, count);
+    refusals = 3;
+    xo_destroy(xop);
+
+    int late_ok = (late.o_len == normal.o_len
+		   && memcmp(late.o_buf, normal.o_buf, normal.o_len) == 0);
+
+    /* Destroyed while queued, and the writer fails; this warns */
+    refusals = 1000000;
+    xop = xo_create(XO_STYLE_JSON, XOF_WARN);
+    xo_set_writer_nb(xop, &late, write_late, NULL, -1);
+    make_output(xop, 10);
+    refusals = 0;
+    broken = 1;
+    xo_destroy(xop);
+
+    xo_open_container("top");
+    xo_emit("{Lwc:Stingy output matches}{:stingy-match/%s}\n",
+	    (stingy.o_len == normal.o_len
+	     && memcmp(stingy.o_buf, normal.o_buf, normal.o_len) == 0)
+	    ? "true" : "false");
+    xo_emit("{Lwc:Queued output}{:queued/%s}\n",
+	    (max_pending > 4096) ? "true" : "false");
+    xo_emit("{Lwc:High watermark calls}{:high-calls/%d}\n", highs);
+    xo_emit("{Lwc:Low watermark calls}{:low-calls/%d}\n", lows);
+    xo_emit("{Lwc:Socket output complete}{:socket-complete/%s}\n",
+	    sock_ok ? "true" : "false");
+    xo_emit("{Lwc:Output drained by xo_destroy}{:destroy-drained/%s}\n",
+	    late_ok ? "true" : "false");
+    xo_close_container("top");
+
+    xo_finish();
+
+    free(normal.o_buf);
+    free(stingy.o_buf);
+    free(big.o_buf);
+    free(sock.o_buf);
+    free(late.o_buf);
+
+    return 0;
+}
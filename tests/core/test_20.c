@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_20.c: verify lazy ("%@L@s") values.  The list is made on the
+ * default handle, where every value is needed, and then on filtered
+ * JSON handles writing to memory, where the callbacks should only be
+ * made for the fields the filter keeps or that a predicate needs.
+ * Only the call counts (and the number of the first item whose
+ * "detail" was kept) are reported for the filtered handles.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xo.h"
+#include "membuf.h"
+
+/* From the filter library; links it in without dynamic loading */
+void xo_filter_setup_test (void);
+
+#define NUM_ITEMS 8
+#define DETAIL_LEN 10000	/* Longer than libxo's lazy buffer */
+
+static membuf_t mem;		/* Output made by our handles */
+
+static int total_calls;		/* Calls to lazy_total */
+static int detail_calls;	/* Calls to lazy_detail */
+
+/* The "expensive" value: a sum over the item */
+static xo_ssize_t
+lazy_total (void *opaque, char *vbuf, xo_ssize_t size)
+{
+    int num = *(int *) opaque;
+    int i, total = 0;
+
+    total_calls += 1;
+
+    for (i = 0; i <= num; i++)
+	total += i * 10;
+
+    return snprintf(vbuf, size, "%d", total);
+}
+
+/* A long value, larger than libxo's initial buffer */
+static xo_ssize_t
+lazy_detail (void *opaque, char *vbuf, xo_ssize_t size)
+{
+    int num = *(int *) opaque;
+    xo_ssize_t len = DETAIL_LEN + num;
+
+    detail_calls += 1;
+
+    if (len < size) {
+	memset(vbuf, 'a' + num, len);
+	vbuf[len] = '\0';
+    }
+
+    return len;
+}
+
+static void
+make_list (xo_handle_t *xop, int with_detail)
+{
+    int nums[NUM_ITEMS];
+    int i;
+
+    xo_open_container_h(xop, "top");
+    xo_open_list_h(xop, "item");
+
+    for (i = 0; i < NUM_ITEMS; i++) {
+	nums[i] = i;
+
+	xo_open_instance_h(xop, "item");
+	xo_emit_h(xop, "{k:name/item-%d} {:total/%@L@s} {:state/%s}\n",
+		  i, lazy_total, &nums[i], (i & 1) ? "odd" : "even");
+	if (with_detail)
+	    xo_emit_h(xop, "{e:detail/%@L@s}", lazy_detail, &nums[i]);
+	xo_close_instance_h(xop, "item");
+    }
+
+    xo_close_list_h(xop, "item");
+    xo_close_container_h(xop, "top");
+}
+
+static void
+filtered (const char *test, const char *filter)
+{
+    xo_handle_t *xop = xo_create(XO_STYLE_JSON, 0);
+    if (xop == NULL)
+	return;
+
+    xo_set_writer(xop, &mem, write_buf, NULL, NULL);
+    xo_add_filter(xop, filter);
+
+    total_calls = detail_calls = mem.mb_len = 0;
+    make_list(xop, 1);
+    xo_finish_h(xop);
+    xo_destroy(xop);
+
+    /* Report the first detail, to show long values survive */
+    static const char detail[] = "\"detail\":\"";
+    const char *cp = mem.mb_len ? strstr(mem.mb_buf, detail) : NULL;
+    size_t dlen = cp ? strcspn(cp + sizeof(detail) - 1, "\"") : 0;
+    int dnum = dlen ? (int) (dlen - DETAIL_LEN) : -1;
+
+    xo_open_instance("test");
+    xo_emit("{k:name} {:total-calls/%d} {:detail-calls/%d} "
+	    "{:first-detail/%d}\n",
+	    test, total_calls, detail_calls, dnum);
+    xo_close_instance("test");
+}
+
+int
+main (int argc, char **argv)
+{
+    xo_filter_setup_test();
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    make_list(NULL, 0);
+
+    xo_open_container("summary");
+    xo_emit("{:total-calls/%d} {:detail-calls/%d}\n",
+	    total_calls, detail_calls);
+
+    xo_open_list("test");
+    filtered("key", "top/item[name == 'item-3']");
+    filtered("predicate", "top/item[state == 'odd']");
+    filtered("none", "top/item[name == 'item-99']");
+    xo_close_list("test");
+    xo_close_container("summary");
+
+    xo_finish();
+
+    return 0;
+}
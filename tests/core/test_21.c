@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_21.c: verify xo_subtree_wanted().  A routing table is made on
+ * filtered JSON handles writing to memory, once making everything and
+ * once skipping the subtrees that aren't wanted.  The output must be
+ * the same; we report how many routes were made, and whether the
+ * outputs matched.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xo.h"
+#include "membuf.h"
+
+/* From the filter library; links it in without dynamic loading */
+void xo_filter_setup_test (void);
+
+#define NUM_ROUTES 16
+
+/* Make the table, returning the number of routes made in full */
+static int
+make_table (xo_handle_t *xop, int skip)
+{
+    int i, made = 0;
+
+    xo_open_container_h(xop, "top");
+    if (!skip || xo_subtree_wanted_h(xop)) {
+	xo_open_list_h(xop, "route");
+
+	for (i = 0; i < NUM_ROUTES; i++) {
+	    xo_open_instance_h(xop, "route");
+	    xo_emit_h(xop, "{k:prefix/10.%d.0.0\\/16}", i);
+
+	    if (!skip || xo_subtree_wanted_h(xop)) {
+		made += 1;
+		xo_emit_h(xop, "{:metric/%d}", i * 10);
+
+		xo_open_list_h(xop, "nexthop");
+		xo_open_instance_h(xop, "nexthop");
+		xo_emit_h(xop, "{k:gateway/192.0.2.%d}{:interface/em%d}",
+			  i % 4, i % 2);
+		xo_close_instance_h(xop, "nexthop");
+		xo_close_list_h(xop, "nexthop");
+	    }
+
+	    xo_close_instance_h(xop, "route");
+	}
+
+	xo_close_list_h(xop, "route");
+    }
+    xo_close_container_h(xop, "top");
+
+    return made;
+}
+
+static int
+filtered (membuf_t *mbp, const char *filter, int skip)
+{
+    xo_handle_t *xop = xo_create(XO_STYLE_JSON, 0);
+    if (xop == NULL)
+	return -1;
+
+    xo_set_writer(xop, mbp, write_buf, NULL, NULL);
+    xo_add_filter(xop, filter);
+
+    int made = make_table(xop, skip);
+
+    xo_finish_h(xop);
+    xo_destroy(xop);
+
+    return made;
+}
+
+static void
+test_filter (const char *filter)
+{
+    membuf_t all, some;
+
+    bzero(&all, sizeof(all));
+    bzero(&some, sizeof(some));
+
+    int made_all = filtered(&all, filter, 0);
+    int made_some = filtered(&some, filter, 1);
+    int same = (all.mb_len == some.mb_len
+		&& (all.mb_len == 0
+		    || memcmp(all.mb_buf, some.mb_buf, all.mb_len) == 0));
+
+    xo_open_instance("test");
+    xo_emit("{k:filter} {:made/%d}/{:total/%d} {:same/%s}\n",
+	    filter, made_some, made_all, same ? "true" : "false");
+    xo_close_instance("test");
+
+    free(all.mb_buf);
+    free(some.mb_buf);
+}
+
+int
+main (int argc, char **argv)
+{
+    xo_filter_setup_test();
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    xo_open_container("subtree");
+    xo_emit("{T:Filter} {T:Made} {T:Same}\n");
+
+    xo_open_list("test");
+    test_filter("/top/route[prefix == '10.3.0.0/16']");
+    test_filter("/top/route/nexthop[gateway == '192.0.2.1']");
+    test_filter("route[prefix == '10.3.0.0/16']");
+    test_filter("/top/route[metric == 50]");
+    test_filter("/other");
+    test_filter("!/top/route[prefix == '10.3.0.0/16']");
+    xo_close_list("test");
+
+    xo_close_container("subtree");
+
+    xo_finish();
+
+    return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_22.c: verify the "fields" option.  The data styles should only
+ * make the keys and the named fields, while the skipped fields must
+ * still pop their arguments; the display styles make everything.
+ * Lazy values for skipped fields should not be computed.  A retained
+ * format used on two handles with different names must give each
+ * handle its own fields.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xo.h"
+#include "membuf.h"
+
+static int lazy_calls;		/* Calls to lazy_counters */
+
+static membuf_t mem;		/* Output made by our handles */
+
+static xo_ssize_t
+lazy_counters (void *opaque, char *vbuf, xo_ssize_t size)
+{
+    int num = *(int *) opaque;
+
+    lazy_calls += 1;
+
+    return snprintf(vbuf, size, "%d/%d", num * 100, num * 3);
+}
+
+static void
+make_list (const char *list, int count)
+{
+    int nums[count];
+    int i;
+
+    xo_open_list(list);
+
+    for (i = 0; i < count; i++) {
+	nums[i] = i;
+
+	xo_open_instance(list);
+	xo_emitr("{k:name/em%d} {:mtu/%u} {:speed/%lld} {:load/%6.2f} "
+		 "{:descr/%-*s} {:state/%s} {:counters/%@L@s} "
+		 "{:flags/%04x/%u} {:ratio/%d}\n",
+		 i, 1500 + i, (long long) i * 1000000000LL, i * 0.25,
+		 8, "uplink", (i & 1) ? "down" : "up",
+		 lazy_counters, &nums[i], i * 3, i * 10);
+
+	/* Not retained, with the name given as an argument */
+	xo_emit("{a:/%d}{:note/%s}\n", "errors", i * 2, "ok");
+	xo_close_instance(list);
+    }
+
+    xo_close_list(list);
+}
+
+/*
+ * Use one retained format on two JSON handles, taking turns, where
+ * each handle keeps different fields, and report what each made
+ */
+static void
+two_handles (void)
+{
+    static const char *options[] = { "fields=mtu:state", "fields=state+speed" };
+    xo_handle_t *handles[2];
+    int i, h;
+
+    for (h = 0; h < 2; h++) {
+	handles[h] = xo_create(XO_STYLE_JSON, 0);
+	if (handles[h] == NULL)
+	    return;
+
+	xo_set_writer(handles[h], &mem, write_buf, NULL, NULL);
+	xo_set_options(handles[h], options[h]);
+	xo_open_list_h(handles[h], "interface");
+    }
+
+    for (i = 0; i < 3; i++) {
+	for (h = 0; h < 2; h++) {
+	    xo_open_instance_h(handles[h], "interface");
+	    xo_emit_hf(handles[h], XOEF_RETAIN,
+		       "{k:name/ge%d} {:mtu/%u} {:speed/%u} {:state/%s}\n",
+		       i, 1500 + i, 1000 * i, (i & 1) ? "down" : "up");
+	    xo_close_instance_h(handles[h], "interface");
+	}
+    }
+
+    xo_open_list("handle");
+
+    for (h = 0; h < 2; h++) {
+	mem.mb_len = 0;
+	xo_close_list_h(handles[h], "interface");
+	xo_finish_h(handles[h]);
+	xo_destroy(handles[h]);
+
+	if (mem.mb_len && mem.mb_buf[mem.mb_len - 1] == '\n')
+	    mem.mb_buf[--mem.mb_len] = '\0';
+
+	xo_open_instance("handle");
+	xo_emit("{k:options} {:output}\n", options[h], mem.mb_len ? mem.mb_buf : "");
+	xo_close_instance("handle");
+    }
+
+    xo_close_list("handle");
+}
+
+int
+main (int argc, char **argv)
+{
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    /* Commas separate options, so names use colons or plus signs */
+    xo_set_options(NULL, "fields=mtu:state+errors");
+
+    xo_open_container("top");
+
+    make_list("interface", 4);
+
+    /* Adding a name must be seen by the retained fields */
+    xo_set_options(NULL, "fields=counters+note+lazy-calls");
+    make_list("more", 2);
+
+    xo_emit("{:lazy-calls/%d}\n", lazy_calls);
+
+    xo_set_options(NULL, "fields=output");
+    two_handles();
+
+    xo_close_container("top");
+
+    xo_finish();
+
+    free(mem.mb_buf);
+
+    return 0;
+}
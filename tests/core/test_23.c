@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_23.c: verify filter predicates, which are compiled into small
+ * programs.  A list of interfaces is made on filtered JSON handles
+ * writing to memory, and we report the names of the interfaces that
+ * were kept.  Also used by "make benchmark-pred", via the "count" and
+ * "filter" arguments, which make a long list on the default handle,
+ * by "make benchmark-paths", whose "paths" argument adds that many
+ * extra paths to the filter, and by "make benchmark-keys", whose "keys"
+ * argument makes a filter of that many "name == 'ge-0/0/N'" paths.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xo.h"
+#include "membuf.h"
+
+/* From the filter library; links it in without dynamic loading */
+void xo_filter_setup_test (void);
+
+static struct ifinfo {
+    const char *if_name;
+    unsigned if_mtu;
+    const char *if_state;
+    const char *if_descr;
+} iflist[] = {
+    { "ge-0/0/0", 1500, "up", "core uplink" },
+    { "ge-0/0/1", 9192, "up", "core downlink" },
+    { "ge-0/0/2", 1514, "down", "spare" },
+    { "xe-1/0/0", 9000, "up", "backbone" },
+    { "xe-1/0/1", 4470, "down", "core backup" },
+    { "lo0", 65535, "up", "loopback" },
+    { "em0", 1500, "up", "management" },
+    { "ge-0/0/3", 2000, "testing", "lab" },
+};
+
+#define NUM_IFS (sizeof(iflist) / sizeof(iflist[0]))
+
+static membuf_t mem;		/* Output made by our handles */
+
+static void
+make_list (xo_handle_t *xop, unsigned long count)
+{
+    unsigned long i;
+
+    xo_open_container_h(xop, "top");
+    xo_open_list_h(xop, "interface");
+
+    for (i = 0; i < count; i++) {
+	struct ifinfo *ifp = &iflist[i % NUM_IFS];
+
+	xo_open_instance_h(xop, "interface");
+	xo_emit_hf(xop, XOEF_RETAIN,
+		   "{k:name/%s} {:mtu/%u} {:state/%s} {:description/%s}\n",
+		   ifp->if_name, ifp->if_mtu + (unsigned) (i / NUM_IFS),
+		   ifp->if_state, ifp->if_descr);
+	xo_close_instance_h(xop, "interface");
+    }
+
+    xo_close_list_h(xop, "interface");
+    xo_close_container_h(xop, "top");
+}
+
+/*
+ * Return the filter, joined with "count" extra paths for fields the
+ * list doesn't have, so none of them match
+ */
+static char *
+union_paths (const char *filter, unsigned long count)
+{
+    size_t size = strlen(filter) + count * 40 + 1;
+    char *str = malloc(size), *cp = str, *ep = str + size;
+    unsigned long i;
+
+    if (str == NULL)
+	exit(1);
+
+    cp += snprintf(cp, ep - cp, "%s", filter);
+    for (i = 0; i < count; i++)
+	cp += snprintf(cp, ep - cp, " | top/interface/counter-%lu", i);
+
+    return str;
+}
+
+/*
+ * Return a union of "count" paths, each picking one interface name
+ */
+static char *
+union_keys (unsigned long count)
+{
+    size_t size = count * 48 + 1;
+    char *str = malloc(size), *cp = str, *ep = str + size;
+    unsigned long i;
+
+    if (str == NULL)
+	exit(1);
+
+    *cp = '\0';
+    for (i = 0; i < count; i++)
+	cp += snprintf(cp, ep - cp, "%stop/interface[name == 'ge-0/0/%lu']",
+		       i ? " | " : "", i);
+
+    return str;
+}
+
+static void
+filtered (const char *filter)
+{
+    xo_handle_t *xop = xo_create(XO_STYLE_JSON, 0);
+    if (xop == NULL)
+	return;
+
+    xo_set_writer(xop, &mem, write_buf, NULL, NULL);
+    xo_add_filter(xop, filter);
+
+    mem.mb_len = 0;
+    make_list(xop, NUM_IFS);
+    xo_finish_h(xop);
+    xo_destroy(xop);
+
+    /* Pull out the names that were kept */
+    char names[256], *np = names, *ep = names + sizeof(names);
+    static const char name[] = "\"name\":\"";
+    const char *cp;
+    int count = 0;
+
+    *np = '\0';
+    for (cp = mem.mb_len ? strstr(mem.mb_buf, name) : NULL; cp;
+	 cp = strstr(cp, name)) {
+	cp += sizeof(name) - 1;
+	size_t len = strcspn(cp, "\"");
+	np += snprintf(np, ep - np, "%s%.*s", count++ ? " " : "",
+		       (int) len, cp);
+	if (np >= ep)
+	    np = ep - 1;
+    }
+
+    xo_open_instance("test");
+    xo_emit("{k:filter} {:count/%d} {:names}\n", filter, count, names);
+    xo_close_instance("test");
+}
+
+int
+main (int argc, char **argv)
+{
+    unsigned long count = 0, paths = 0, keys = 0;
+    const char *filter = NULL;
+    char *all;
+
+    xo_filter_setup_test();
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (argv[argc + 1] == NULL)
+	    break;
+	if (strcmp(argv[argc], "count") == 0)
+	    count = strtoul(argv[++argc], NULL, 0);
+	else if (strcmp(argv[argc], "filter") == 0)
+	    filter = argv[++argc];
+	else if (strcmp(argv[argc], "paths") == 0)
+	    paths = strtoul(argv[++argc], NULL, 0);
+	else if (strcmp(argv[argc], "keys") == 0)
+	    keys = strtoul(argv[++argc], NULL, 0);
+    }
+
+    if (count) {
+	if (keys) {
+	    all = union_keys(keys);
+	    xo_add_filter(NULL, all);
+	    free(all);
+	} else if (filter && paths) {
+	    all = union_paths(filter, paths);
+	    xo_add_filter(NULL, all);
+	    free(all);
+	} else if (filter)
+	    xo_add_filter(NULL, filter);
+	make_list(NULL, count);
+	xo_finish();
+	return 0;
+    }
+
+    xo_open_container("predicates");
+    xo_emit("{T:Filter} {T:Count} {T:Names}\n");
+
+    xo_open_list("test");
+    filtered("top/interface[mtu > 1500 and starts-with(name, 'ge-')]");
+    filtered("top/interface[mtu >= 9000 or state == 'down']");
+    filtered("top/interface[not(state == 'up')]");
+    filtered("top/interface[mtu + 100 > 1600 * 1]");
+    filtered("top/interface[ends-with(name, '/1')]");
+    filtered("top/interface[contains(description, 'core')]");
+    filtered("top/interface[mtu mod 2 == 1]");
+    filtered("top/interface[3]");
+    filtered("top/interface[state == 'up'][2]");
+    filtered("top/interface[string-length(name) < 4]");
+    filtered("top/interface[concat(name, '-x') == 'lo0-x']");
+    filtered("top/interface[mtu > 1 div 0]");
+    filtered("top/interface[speed == 'fast' or true()]");
+    filtered("top/interface[speed == 'fast' and false()]");
+    filtered("top/interface[mtu > 1500 and mtu < 9000 and state != 'down']");
+    filtered("top/interface[true() and 1 > 2]");
+    filtered("top/interface[(2 * 3 + 1) * 1000 < mtu]");
+    filtered("top/interface[name == 'lo0' or name == 'em0'][mtu > 1500]");
+    filtered("top/interface[boolean(mtu - 1500)]");
+    filtered("top/interface[starts-with(mtu, 15)]");
+    filtered("top/interface[mtu > '2000']");
+    filtered("top/interface[rematch('^(ge|xe)-[0-9]+/0/', name)]");
+    filtered("top/interface[rematch('^ge-', name)]");
+    filtered("top/interface[rematch('/1$', name)]");
+    filtered("top/interface[rematch('lo0', name, 'b')]");
+    filtered("top/interface[rematch('link', description, 's') == 'link']");
+    filtered("top/interface[rematch('CORE', description, 'i')]");
+    filtered("top/interface[rematch(concat('^', state), 'upstairs')]");
+    filtered("top/interface[rematch('([a-z]+)-([0-9])', name, 'm2') == '1']");
+    filtered("top/interface[substring-after(name, '-') == '0/0/2']");
+    filtered("top/interface[substring-before(description, ' ') == 'core']");
+    filtered("top/interface[substring(name, 4) == '0/0/1'"
+	     " or substring(name, 1, 2) == 'lo']");
+    filtered("top/interface[translate(name, '/-', '..') == 'xe.1.0.1']");
+    filtered("top/interface[normalize-space(string(description)) == 'lab']");
+    filtered("top/interface[concat(substring(name, 1, 2), mtu) == 'ge2000']");
+    filtered("top/interface[mtu >= 1500 and mtu <= 1514"
+	     " and number(mtu) != 1514 and mtu * 2 == 3000]");
+    filtered("top/interface[name == 'lo0'] | top/interface[name == 'em0']");
+    filtered("top/interface[mtu > 9000] | top/interface/state");
+    filtered("!top/interface[state == 'up'] | top/interface[mtu > 4000]");
+    filtered("top/interface[mtu == 1500] | interface[state == 'testing']");
+    filtered("top/*[name == 'lo0'] | top/interface[name == 'em0']");
+    filtered("top/interface/state | !top/interface/state");
+    filtered("/top/interface[name == 'lo0'] | top/interface[name == 'em0']");
+    filtered("top/interface[mtu > 9000] | /top/interface[state == 'down']");
+
+    /* Many paths sharing a prefix */
+    all = union_paths("top/interface[mtu == 9000]", 20);
+    filtered(all);
+    free(all);
+
+    /* Equality tests on the same field, which are looked up by value */
+    filtered("top/interface[name == 'ge-0/0/1'] | top/interface[name == 'lo0']"
+	     " | top/interface['em0' == name] | top/interface[name == 'nope']"
+	     " | top/interface[name == 'xe-1/0/1']");
+    filtered("top/interface[description == 'spare']"
+	     " | top/interface[description == 'lab']"
+	     " | top/interface[description == 'loopback']"
+	     " | top/interface[description == 'Lab']");
+    filtered("top/interface[name == 'lo0'] | top/interface[name == 'lo0']"
+	     " | top/interface[name == 'em0'] | top/interface[name == 'xe-1/0/0']");
+    filtered("top/interface[name == 'lo0'] | top/interface[name == 'em0']"
+	     " | top/interface[name == 'xe-1/0/0'] | top/interface[name == '']");
+    filtered("top/interface[name == 'lo0'] | top/interface[name == 'em0']"
+	     " | top/interface[name == 'xe-1/0/0'] | top/interface[mtu == 9192]"
+	     " | top/interface[name == 'ge-0/0/3'][mtu > 1]");
+
+    all = union_keys(12);
+    filtered(all);
+    free(all);
+    xo_close_list("test");
+
+    xo_close_container("predicates");
+
+    xo_finish();
+
+    free(mem.mb_buf);
+
+    return 0;
+}
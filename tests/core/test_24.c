@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_24.c: verify filtering of deep documents, where an instance's
+ * fate isn't known until a late field arrives, so its output is kept
+ * tentatively and later dropped or compacted.  A tree of nodes is made
+ * on filtered XML and JSON handles writing to memory, and we report
+ * what was kept.  We also make some with a small spill limit, so the
+ * pending output goes to a temporary file, and check that the output
+ * is unchanged, and check which "filter-spill" values are accepted,
+ * including ones too big to hold.  Also used by "make benchmark-deep", via the "count",
+ * "depth", "width", "fields", and "filter" arguments, which make a
+ * large tree on the default handle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xo.h"
+#include "membuf.h"
+
+/* From the filter library; links it in without dynamic loading */
+void xo_filter_setup_test (void);
+
+static const char *field_names[] = {
+    "rx", "tx", "errors", "drops", "queued", "retries", "resets", "flaps",
+};
+
+#define NUM_FIELDS (sizeof(field_names) / sizeof(field_names[0]))
+
+static unsigned long tree_depth, tree_width, tree_fields;
+
+static membuf_t mem;		/* Output made by our handles */
+
+/*
+ * Make a node, with its counters, its children, and then the "flag"
+ * field, which comes last so predicates on it are decided late
+ */
+static void
+make_node (xo_handle_t *xop, unsigned long depth, unsigned long id)
+{
+    char fmt[32];
+    unsigned long i;
+
+    xo_open_instance_h(xop, "node");
+    xo_emit_h(xop, "{k:id/%lu}", id);
+
+    for (i = 0; i < tree_fields; i++) {
+	snprintf(fmt, sizeof(fmt), "{:%s/%%lu}",
+		 field_names[i % NUM_FIELDS]);
+	xo_emit_h(xop, fmt, id * 7 + i);
+    }
+
+    if (depth > 0) {
+	xo_open_list_h(xop, "node");
+	for (i = 0; i < tree_width; i++)
+	    make_node(xop, depth - 1, id * tree_width + i + 1);
+	xo_close_list_h(xop, "node");
+    }
+
+    xo_emit_h(xop, "{:flag/%s}", (id % 3 == 0) ? "keep" : "drop");
+    xo_close_instance_h(xop, "node");
+}
+
+static void
+make_tree (xo_handle_t *xop, unsigned long count)
+{
+    unsigned long i;
+
+    xo_open_container_h(xop, "top");
+    xo_emit_h(xop, "{:version/%d}", 1);
+    xo_open_list_h(xop, "node");
+
+    for (i = 0; i < count; i++)
+	make_node(xop, tree_depth, i * 100);
+
+    xo_close_list_h(xop, "node");
+
+    /* A container without keys, so a field that matches follows others */
+    xo_open_container_h(xop, "summary");
+    xo_emit_h(xop, "{:nodes/%lu}{:depth/%lu}", count, tree_depth);
+    xo_close_container_h(xop, "summary");
+
+    xo_close_container_h(xop, "top");
+}
+
+/*
+ * Make a filtered tree into mem, spilling past 'spill' bytes if
+ * that's not zero
+ */
+static void
+render (xo_style_t style, const char *filter, unsigned long count,
+	xo_ssize_t spill, xo_spill_stats_t *statsp)
+{
+    xo_handle_t *xop = xo_create(style, 0);
+    if (xop == NULL)
+	exit(1);
+
+    xo_set_writer(xop, &mem, write_buf, NULL, NULL);
+    xo_add_filter(xop, filter);
+    xo_set_filter_spill(xop, spill);
+
+    mem.mb_len = 0;
+    if (mem.mb_buf)
+	*mem.mb_buf = '\0';
+    make_tree(xop, count);
+    xo_finish_h(xop);
+    xo_get_spill_stats(xop, statsp);
+    xo_destroy(xop);
+}
+
+static void
+filtered (xo_style_t style, const char *filter, unsigned long count)
+{
+    xo_spill_stats_t stats;
+
+    render(style, filter, count, 0, &stats);
+
+    xo_open_instance("test");
+    xo_emit("{k:filter} {k:style} {:length/%zu}\n",
+	    filter, (style == XO_STYLE_XML) ? "xml" : "json", mem.mb_len);
+
+    /* Big documents are summed; small ones are shown whole */
+    if (mem.mb_len > 2048) {
+	unsigned long sum = 0;
+	size_t i;
+
+	for (i = 0; i < mem.mb_len; i++)
+	    sum = sum * 31 + (unsigned char) mem.mb_buf[i];
+	xo_emit("  {:sum/%08lx}\n", sum & 0xffffffff);
+    } else
+	xo_emit("  {:output}\n", mem.mb_len ? mem.mb_buf : "");
+
+    xo_close_instance("test");
+}
+
+static void
+spilled (xo_style_t style, const char *filter, unsigned long count)
+{
+    xo_spill_stats_t stats;
+    char *plain;
+    size_t plain_len;
+
+    render(style, filter, count, 0, &stats);
+    plain = strdup(mem.mb_buf ? mem.mb_buf : "");
+    plain_len = mem.mb_len;
+    if (plain == NULL)
+	exit(1);
+
+    render(style, filter, count, 1024, &stats);
+
+    xo_open_instance("spill");
+    xo_emit("{k:filter} {k:style} {:length/%zu} {:same/%s}\n",
+	    filter, (style == XO_STYLE_XML) ? "xml" : "json", mem.mb_len,
+	    (plain_len == mem.mb_len && memcmp(plain, mem.mb_buf, mem.mb_len) == 0)
+	    ? "yes" : "no");
+    xo_emit("  {:spills/%lu} {:bytes/%llu} {:replayed/%llu} "
+	    "{:dropped/%llu} {:peak/%llu}\n",
+	    stats.xss_spills, stats.xss_bytes, stats.xss_replayed,
+	    stats.xss_dropped, stats.xss_peak);
+    xo_close_instance("spill");
+
+    free(plain);
+}
+
+/* Report whether the "filter-spill" option accepts "value" */
+static void
+spill_option (const char *value)
+{
+    char opt[64];
+
+    xo_handle_t *xop = xo_create(XO_STYLE_JSON, 0);
+    if (xop == NULL)
+	exit(1);
+
+    xo_set_writer(xop, &mem, write_buf, NULL, NULL);
+    snprintf(opt, sizeof(opt), "filter-spill=%s", value);
+    int rc = xo_set_options(xop, opt);
+    xo_destroy(xop);
+
+    xo_open_instance("option");
+    xo_emit("{k:value} {:accepted/%s}\n", value, (rc < 0) ? "no" : "yes");
+    xo_close_instance("option");
+}
+
+int
+main (int argc, char **argv)
+{
+    unsigned long count = 0;
+    const char *filter = NULL;
+    static const char *filters[] = {
+	"top/node[flag == 'keep']",
+	"node[flag == 'keep']",
+	"top/node/node[flag == 'keep']",
+	"top/node[id == '100']",
+	"node[id == '201']/node",
+	"top/node/node[rx > 710]",
+	"node/errors",
+	"top/node/node/node/flag",
+	"top/version | top/node[id == '200']/tx",
+	"top/summary/depth[. > 1]",
+	NULL
+    };
+    const char **fp;
+
+    xo_filter_setup_test();
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    tree_depth = 2;
+    tree_width = 2;
+    tree_fields = 3;
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (argv[argc + 1] == NULL)
+	    break;
+	if (strcmp(argv[argc], "count") == 0)
+	    count = strtoul(argv[++argc], NULL, 0);
+	else if (strcmp(argv[argc], "depth") == 0)
+	    tree_depth = strtoul(argv[++argc], NULL, 0);
+	else if (strcmp(argv[argc], "width") == 0)
+	    tree_width = strtoul(argv[++argc], NULL, 0);
+	else if (strcmp(argv[argc], "fields") == 0)
+	    tree_fields = strtoul(argv[++argc], NULL, 0);
+	else if (strcmp(argv[argc], "filter") == 0)
+	    filter = argv[++argc];
+    }
+
+    if (count) {
+	if (filter)
+	    xo_add_filter(NULL, filter);
+	make_tree(NULL, count);
+	xo_finish();
+	return 0;
+    }
+
+    xo_open_container("deep");
+    xo_open_list("test");
+
+    for (fp = filters; *fp; fp++) {
+	filtered(XO_STYLE_XML, *fp, 3);
+	filtered(XO_STYLE_JSON, *fp, 3);
+    }
+
+    /* Enough output to be flushed while filtering goes on */
+    tree_depth = 3;
+    tree_width = 4;
+    tree_fields = 8;
+    filtered(XO_STYLE_XML, "node[flag == 'keep']", 40);
+    filtered(XO_STYLE_JSON, "node[flag == 'keep']", 40);
+    filtered(XO_STYLE_JSON, "top/node/node[flag == 'keep']", 40);
+    filtered(XO_STYLE_JSON, "node/drops", 40);
+
+    xo_close_list("test");
+
+    /* Pending output past 1k goes to a spill file */
+    xo_open_list("spill");
+    spilled(XO_STYLE_XML, "node[flag == 'keep']", 40);
+    spilled(XO_STYLE_JSON, "node[flag == 'keep']", 40);
+    spilled(XO_STYLE_JSON, "top/node/node[flag == 'keep']", 40);
+    spilled(XO_STYLE_JSON, "node/drops", 40);
+    spilled(XO_STYLE_XML, "top/node[id == '2000']", 40);
+    spilled(XO_STYLE_XML, "top/node/node/node[flag == 'keep']", 40);
+    xo_close_list("spill");
+
+    /* Sizes that overflow, before or after the suffix, are rejected */
+    xo_open_list("option");
+    spill_option("64");
+    spill_option("1k");
+    spill_option("2G");
+    spill_option("0x10m");
+    spill_option("99999999999g");
+    spill_option("8589934592g");
+    spill_option("18446744073709551616");
+    spill_option("-1");
+    spill_option("12q");
+    xo_close_list("option");
+    xo_close_container("deep");
+
+    xo_finish();
+
+    free(mem.mb_buf);
+
+    return 0;
+}
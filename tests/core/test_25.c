@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_25.c: verify xo_list_wanted() and position predicates.  A
+ * routing table is made on filtered JSON handles writing to memory,
+ * once making every route and once stopping when the list is no longer
+ * wanted.  The output must be the same; we report how many routes were
+ * made, the prefixes that were kept, and whether the outputs matched.
+ * Also used by "make benchmark-position", via the "count" and "filter"
+ * arguments, which make a long list on the default handle, stopping
+ * early if "stop" is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xo.h"
+#include "membuf.h"
+
+/* From the filter library; links it in without dynamic loading */
+void xo_filter_setup_test (void);
+
+#define NUM_ROUTES 16
+
+/* Make the table, returning the number of routes made */
+static unsigned long
+make_table (xo_handle_t *xop, unsigned long count, int stop)
+{
+    unsigned long i, made = 0;
+
+    xo_open_container_h(xop, "top");
+    xo_open_list_h(xop, "route");
+
+    for (i = 0; i < count; i++) {
+	if (stop && !xo_list_wanted_h(xop))
+	    break;
+
+	made += 1;
+	xo_open_instance_h(xop, "route");
+	xo_emit_h(xop, "{k:prefix/10.%lu.0.0\\/16}{:metric/%lu}",
+		  i, (i * 7) % 10);
+	xo_close_instance_h(xop, "route");
+    }
+
+    xo_close_list_h(xop, "route");
+    xo_emit_h(xop, "{:count/%lu}", count);
+    xo_close_container_h(xop, "top");
+
+    return made;
+}
+
+static unsigned long
+filtered (membuf_t *mbp, const char *filter, int stop)
+{
+    xo_handle_t *xop = xo_create(XO_STYLE_JSON, 0);
+    if (xop == NULL)
+	return 0;
+
+    xo_set_writer(xop, mbp, write_buf, NULL, NULL);
+    xo_add_filter(xop, filter);
+
+    unsigned long made = make_table(xop, NUM_ROUTES, stop);
+
+    xo_finish_h(xop);
+    xo_destroy(xop);
+
+    return made;
+}
+
+static void
+test_filter (const char *filter)
+{
+    membuf_t all, some;
+
+    bzero(&all, sizeof(all));
+    bzero(&some, sizeof(some));
+
+    unsigned long made_all = filtered(&all, filter, 0);
+    unsigned long made_some = filtered(&some, filter, 1);
+    int same = (all.mb_len == some.mb_len
+		&& (all.mb_len == 0
+		    || memcmp(all.mb_buf, some.mb_buf, all.mb_len) == 0));
+
+    /* Pull out the prefixes that were kept */
+    char names[256], *np = names, *ep = names + sizeof(names);
+    static const char name[] = "\"prefix\":\"";
+    const char *cp;
+    int count = 0;
+
+    *np = '\0';
+    for (cp = all.mb_len ? strstr(all.mb_buf, name) : NULL; cp;
+	 cp = strstr(cp, name)) {
+	cp += sizeof(name) - 1;
+	size_t len = strcspn(cp, "\"");
+	np += snprintf(np, ep - np, "%s%.*s", count++ ? " " : "",
+		       (int) len, cp);
+	if (np >= ep)
+	    np = ep - 1;
+    }
+
+    xo_open_instance("test");
+    xo_emit("{k:filter} {:made/%lu}/{:total/%lu} {:same/%s} {:prefixes}\n",
+	    filter, made_some, made_all, same ? "true" : "false", names);
+    xo_close_instance("test");
+
+    free(all.mb_buf);
+    free(some.mb_buf);
+}
+
+int
+main (int argc, char **argv)
+{
+    unsigned long count = 0;
+    const char *filter = NULL;
+    int stop = 0;
+
+    xo_filter_setup_test();
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (strcmp(argv[argc], "stop") == 0)
+	    stop = 1;
+	if (argv[argc + 1] == NULL)
+	    break;
+	if (strcmp(argv[argc], "count") == 0)
+	    count = strtoul(argv[++argc], NULL, 0);
+	else if (strcmp(argv[argc], "filter") == 0)
+	    filter = argv[++argc];
+    }
+
+    if (count) {
+	if (filter)
+	    xo_add_filter(NULL, filter);
+	make_table(NULL, count, stop);
+	xo_finish();
+	return 0;
+    }
+
+    xo_open_container("position");
+    xo_emit("{T:Filter} {T:Made} {T:Same} {T:Prefixes}\n");
+
+    xo_open_list("test");
+    test_filter("/top/route[1]");
+    test_filter("/top/route[3]");
+    test_filter("/top/route[position() <= 4]");
+    test_filter("/top/route[position() < 3]");
+    test_filter("/top/route[2 >= position()]");
+    test_filter("/top/route[position() == 5]");
+    test_filter("/top/route[position() > 14]");
+    test_filter("/top/route[metric == 4][2]");
+    test_filter("/top/route[metric > 5][position() <= 3]");
+    test_filter("/top/route[1] | /top/route[4]");
+    test_filter("/top/route[2] | /top/count");
+    test_filter("/top/route[1] | /top/route[metric == 9]");
+    test_filter("/top/*[2]");
+    test_filter("/top/route[1]/metric");
+    test_filter("route[2]");
+    test_filter("/top/route[2] | !/top/count");
+    xo_close_list("test");
+
+    xo_close_container("position");
+
+    xo_finish();
+
+    return 0;
+}
@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_26.c: verify compiled filter images.  Each filter is compiled
+ * and saved as an image, and a list of interfaces is made on a JSON
+ * handle using the filter and on one using the image.  We report the
+ * names of the interfaces that were kept and whether the outputs
+ * matched.  Also used by "make benchmark-image", via the "keys" and
+ * "save" arguments, which save an image of a filter of that many
+ * "name == 'ge-0/0/N'" paths, and the "count" argument, which makes a
+ * list on the default handle, filtered by "keys" or "filter-image".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "xo.h"
+#include "membuf.h"
+
+/* From the filter library; links it in without dynamic loading */
+void xo_filter_setup_test (void);
+
+#define IMAGE_FILE "test_26.image"
+
+static struct ifinfo {
+    const char *if_name;
+    unsigned if_mtu;
+    const char *if_state;
+} iflist[] = {
+    { "ge-0/0/0", 1500, "up" },
+    { "ge-0/0/1", 9192, "up" },
+    { "ge-0/0/2", 1514, "down" },
+    { "xe-1/0/0", 9000, "up" },
+    { "xe-1/0/1", 4470, "down" },
+    { "lo0", 65535, "up" },
+    { "em0", 1500, "up" },
+    { "ge-0/0/3", 2000, "testing" },
+};
+
+#define NUM_IFS (sizeof(iflist) / sizeof(iflist[0]))
+
+static void
+make_list (xo_handle_t *xop, unsigned long count)
+{
+    unsigned long i;
+
+    xo_open_container_h(xop, "top");
+    xo_open_list_h(xop, "interface");
+
+    for (i = 0; i < count; i++) {
+	struct ifinfo *ifp = &iflist[i % NUM_IFS];
+
+	xo_open_instance_h(xop, "interface");
+	xo_emit_h(xop, "{k:name/%s} {:mtu/%u} {:state/%s}\n",
+		  ifp->if_name, ifp->if_mtu, ifp->if_state);
+	xo_close_instance_h(xop, "interface");
+    }
+
+    xo_close_list_h(xop, "interface");
+    xo_close_container_h(xop, "top");
+}
+
+/*
+ * Return a union of "count" paths, each picking one interface name
+ */
+static char *
+union_keys (unsigned long count)
+{
+    size_t size = count * 48 + 1;
+    char *str = malloc(size), *cp = str, *ep = str + size;
+    unsigned long i;
+
+    if (str == NULL)
+	exit(1);
+
+    *cp = '\0';
+    for (i = 0; i < count; i++)
+	cp += snprintf(cp, ep - cp, "%stop/interface[name == 'ge-0/0/%lu']",
+		       i ? " | " : "", i);
+
+    return str;
+}
+
+/*
+ * Make the list on a handle writing to mbp, with the given filter
+ * and image (either may be NULL); the image comes first
+ */
+static int
+render (membuf_t *mbp, const char *image, const char *filter)
+{
+    xo_handle_t *xop = xo_create(XO_STYLE_JSON, 0);
+    int rc = 0;
+
+    if (xop == NULL)
+	exit(1);
+
+    xo_set_writer(xop, mbp, write_buf, NULL, NULL);
+    if (image)
+	rc |= xo_add_filter_image(xop, image);
+    if (filter)
+	rc |= xo_add_filter(xop, filter);
+
+    make_list(xop, NUM_IFS);
+    xo_finish_h(xop);
+    xo_destroy(xop);
+
+    return rc;
+}
+
+/*
+ * Compile a filter and save its image
+ */
+static int
+save_image (const char *filter, const char *path)
+{
+    xo_handle_t *xop = xo_create(XO_STYLE_JSON, 0);
+    if (xop == NULL)
+	exit(1);
+
+    int rc = xo_add_filter(xop, filter);
+    if (rc == 0)
+	rc = xo_save_filter_image(xop, path);
+
+    xo_destroy(xop);
+
+    return rc;
+}
+
+static void
+report (const char *test, const char *filter, membuf_t *want, membuf_t *got,
+	int rc)
+{
+    /* Pull out the names that were kept */
+    char names[256], *np = names, *ep = names + sizeof(names);
+    static const char name[] = "\"name\":\"";
+    const char *cp;
+    int count = 0;
+
+    *np = '\0';
+    for (cp = got->mb_len ? strstr(got->mb_buf, name) : NULL; cp;
+	 cp = strstr(cp, name)) {
+	cp += sizeof(name) - 1;
+	size_t len = strcspn(cp, "\"");
+	np += snprintf(np, ep - np, "%s%.*s", count++ ? " " : "",
+		       (int) len, cp);
+	if (np >= ep)
+	    np = ep - 1;
+    }
+
+    int same = (want->mb_len == got->mb_len
+		&& (want->mb_len == 0
+		    || memcmp(want->mb_buf, got->mb_buf, want->mb_len) == 0));
+
+    xo_open_instance(test);
+    xo_emit("{k:filter} {:rc/%d} {:same/%s} {:names}\n",
+	    filter, rc, same ? "true" : "false", names);
+    xo_close_instance(test);
+
+    free(want->mb_buf);
+    free(got->mb_buf);
+}
+
+static void
+test_image (const char *filter)
+{
+    membuf_t want, got;
+    int rc;
+
+    bzero(&want, sizeof(want));
+    bzero(&got, sizeof(got));
+
+    render(&want, NULL, filter);
+    rc = save_image(filter, IMAGE_FILE);
+    if (rc == 0)
+	rc = render(&got, IMAGE_FILE, NULL);
+
+    report("test", filter, &want, &got, rc);
+}
+
+/*
+ * Load an image and then add another filter, which recompiles the
+ * image's expressions with it
+ */
+static void
+test_more (const char *filter, const char *more)
+{
+    membuf_t want, got;
+    char both[1024];
+    int rc;
+
+    bzero(&want, sizeof(want));
+    bzero(&got, sizeof(got));
+
+    snprintf(both, sizeof(both), "%s | %s", filter, more);
+    render(&want, NULL, both);
+    rc = save_image(filter, IMAGE_FILE);
+    if (rc == 0)
+	rc = render(&got, IMAGE_FILE, more);
+
+    report("more", both, &want, &got, rc);
+}
+
+/*
+ * Use an image via the "filter-image" option
+ */
+static void
+test_option (const char *filter)
+{
+    membuf_t want, got;
+    int rc;
+
+    bzero(&want, sizeof(want));
+    bzero(&got, sizeof(got));
+
+    render(&want, NULL, filter);
+    rc = save_image(filter, IMAGE_FILE);
+
+    xo_handle_t *xop = xo_create(XO_STYLE_JSON, 0);
+    if (xop == NULL)
+	exit(1);
+
+    xo_set_writer(xop, &got, write_buf, NULL, NULL);
+    rc |= xo_set_options(xop, "filter-image=" IMAGE_FILE);
+    make_list(xop, NUM_IFS);
+    xo_finish_h(xop);
+    xo_destroy(xop);
+
+    report("option", filter, &want, &got, rc);
+}
+
+/*
+ * Images that can't be used: garbage, a truncated image, and an
+ * image loaded after another filter
+ */
+static void
+test_bad (void)
+{
+    membuf_t got;
+    struct stat st;
+    FILE *fp;
+    char buf[64];
+    int i, rc;
+
+    xo_open_list("bad");
+
+    bzero(&got, sizeof(got));
+    fp = fopen(IMAGE_FILE, "w");
+    if (fp == NULL)
+	exit(1);
+    memset(buf, 'x', sizeof(buf));
+    for (i = 0; i < 8; i++)
+	fwrite(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    rc = render(&got, IMAGE_FILE, NULL);
+    xo_open_instance("bad");
+    xo_emit("{k:test} {:rc/%d} {:length/%zu}\n", "garbage", rc, got.mb_len);
+    xo_close_instance("bad");
+    free(got.mb_buf);
+
+    bzero(&got, sizeof(got));
+    save_image("top/interface[mtu > 9000]", IMAGE_FILE);
+    if (stat(IMAGE_FILE, &st) < 0 || truncate(IMAGE_FILE, st.st_size - 8) < 0)
+	exit(1);
+    rc = render(&got, IMAGE_FILE, NULL);
+    xo_open_instance("bad");
+    xo_emit("{k:test} {:rc/%d} {:length/%zu}\n", "truncated", rc, got.mb_len);
+    xo_close_instance("bad");
+    free(got.mb_buf);
+
+    bzero(&got, sizeof(got));
+    save_image("top/interface[mtu > 9000]", IMAGE_FILE);
+    xo_handle_t *xop = xo_create(XO_STYLE_JSON, 0);
+    if (xop == NULL)
+	exit(1);
+    xo_set_writer(xop, &got, write_buf, NULL, NULL);
+    xo_add_filter(xop, "top/interface[mtu == 1500]");
+    rc = xo_add_filter_image(xop, IMAGE_FILE);
+    make_list(xop, NUM_IFS);
+    xo_finish_h(xop);
+    xo_destroy(xop);
+    xo_open_instance("bad");
+    xo_emit("{k:test} {:rc/%d} {:length/%zu}\n", "late", rc, got.mb_len);
+    xo_close_instance("bad");
+    free(got.mb_buf);
+
+    xo_close_list("bad");
+}
+
+int
+main (int argc, char **argv)
+{
+    unsigned long count = 0, keys = 0;
+    const char *save = NULL;
+    char *all;
+
+    xo_filter_setup_test();
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (argv[argc + 1] == NULL)
+	    break;
+	if (strcmp(argv[argc], "count") == 0)
+	    count = strtoul(argv[++argc], NULL, 0);
+	else if (strcmp(argv[argc], "keys") == 0)
+	    keys = strtoul(argv[++argc], NULL, 0);
+	else if (strcmp(argv[argc], "save") == 0)
+	    save = argv[++argc];
+    }
+
+    if (save) {
+	all = union_keys(keys);
+	int rc = save_image(all, save);
+	free(all);
+	return rc ? 1 : 0;
+    }
+
+    if (count) {
+	if (keys) {
+	    all = union_keys(keys);
+	    xo_add_filter(NULL, all);
+	    free(all);
+	}
+	make_list(NULL, count);
+	xo_finish();
+	return 0;
+    }
+
+    xo_open_container("images");
+    xo_emit("{T:Filter} {T:Rc} {T:Same} {T:Names}\n");
+
+    xo_open_list("test");
+    test_image("top/interface[mtu > 1500 and starts-with(name, 'ge-')]");
+    test_image("top/interface[not(state == 'up')]");
+    test_image("/top/interface[3]");
+    test_image("top/interface[state == 'up'][2]");
+    test_image("top/interface[rematch('^(ge|xe)-[0-9]+/0/', name)]");
+    test_image("top/interface[mtu + 100 > 1600 * 1]");
+    test_image("!top/interface[state == 'up'] | top/interface[mtu > 4000]");
+    test_image("top/interface/state | /top/interface[name == 'lo0']/mtu");
+    test_image("top/interface[name == 'lo0'] | top/interface[name == 'em0']"
+	       " | top/interface[name == 'xe-1/0/0'] | top/interface[name == '']"
+	       " | top/interface[mtu == 9192]");
+    all = union_keys(6);
+    test_image(all);
+    free(all);
+    xo_close_list("test");
+
+    xo_open_list("more");
+    test_more("top/interface[name == 'lo0']", "top/interface[mtu == 9000]");
+    all = union_keys(5);
+    test_more(all, "top/interface[name == 'em0']");
+    free(all);
+    xo_close_list("more");
+
+    xo_open_list("option");
+    test_option("top/interface[state == 'down']");
+    xo_close_list("option");
+
+    test_bad();
+
+    xo_close_container("images");
+
+    xo_finish();
+
+    unlink(IMAGE_FILE);
+
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_27.c: verify filter aggregates (count(), sum(), min(), and
+ * max()).  A list of interfaces, grouped by slot, is made on filtered
+ * XML and JSON handles writing to memory, and we report the output,
+ * where the results appear as fields at the end of their containers.
+ * Also used by "make benchmark-aggregate", via the "count" and
+ * "filter" arguments, which make a long list on the default handle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xo.h"
+#include "membuf.h"
+
+/* From the filter library; links it in without dynamic loading */
+void xo_filter_setup_test (void);
+
+static struct ifinfo {
+    const char *if_name;
+    unsigned if_mtu;
+    unsigned long if_rx;
+    const char *if_load;
+    const char *if_state;
+} iflist[] = {
+    { "ge-0/0/0", 1500, 1200, "0.25", "up" },
+    { "ge-0/0/1", 9192, 880, "0.5", "up" },
+    { "ge-0/0/2", 1514, 0, "n/a", "down" },
+    { "xe-1/0/0", 9000, 4000000000, "1.125", "up" },
+    { "xe-1/0/1", 4470, 7, "0", "down" },
+};
+
+#define NUM_IFS (sizeof(iflist) / sizeof(iflist[0]))
+
+static membuf_t mem;		/* Output made by our handles */
+
+/*
+ * Make "count" interfaces, in slots of "per" interfaces each.  Each
+ * slot is a container holding a list.
+ */
+static void
+make_list (xo_handle_t *xop, unsigned long count, unsigned long per)
+{
+    unsigned long i;
+
+    xo_open_container_h(xop, "top");
+    xo_open_list_h(xop, "slot");
+
+    for (i = 0; i < count; i++) {
+	struct ifinfo *ifp = &iflist[i % NUM_IFS];
+
+	if (i % per == 0) {
+	    xo_open_instance_h(xop, "slot");
+	    xo_emit_h(xop, "{k:id/%lu}", i / per);
+	    xo_open_container_h(xop, "ports");
+	    xo_open_list_h(xop, "interface");
+	}
+
+	xo_open_instance_h(xop, "interface");
+	xo_emit_h(xop, "{k:name/%s}{:mtu/%u}{:rx/%lu}{:load/%s}{:state/%s}",
+		  ifp->if_name, ifp->if_mtu, ifp->if_rx + i,
+		  ifp->if_load, ifp->if_state);
+	xo_close_instance_h(xop, "interface");
+
+	if (i % per == per - 1 || i == count - 1) {
+	    xo_close_list_h(xop, "interface");
+	    xo_close_container_h(xop, "ports");
+	    xo_close_instance_h(xop, "slot");
+	}
+    }
+
+    xo_close_list_h(xop, "slot");
+    xo_emit_h(xop, "{:version/%d}", 3);
+    xo_close_container_h(xop, "top");
+}
+
+static void
+filtered (xo_style_t style, const char *filter)
+{
+    xo_handle_t *xop = xo_create(style, 0);
+    if (xop == NULL)
+	exit(1);
+
+    xo_set_writer(xop, &mem, write_buf, NULL, NULL);
+    int rc = xo_add_filter(xop, filter);
+
+    mem.mb_len = 0;
+    if (mem.mb_buf)
+	*mem.mb_buf = '\0';
+    make_list(xop, NUM_IFS + 2, 4);
+    xo_finish_h(xop);
+    xo_destroy(xop);
+
+    xo_open_instance("test");
+    xo_emit("{k:filter} {k:style} {:rc/%d}\n",
+	    filter, (style == XO_STYLE_XML) ? "xml" : "json", rc);
+    xo_emit("  {:output}\n", mem.mb_len ? mem.mb_buf : "");
+    xo_close_instance("test");
+}
+
+int
+main (int argc, char **argv)
+{
+    unsigned long count = 0;
+    const char *filter = NULL;
+    static const char *filters[] = {
+	"sum(top/slot/ports/interface/mtu)",
+	"count(interface)",
+	"min(interface/mtu) | max(interface/mtu)",
+	"sum(interface/rx) | sum(interface/load)",
+	"max(/top/slot/ports/interface[starts-with(name, 'xe-')]/rx)",
+	"count(interface/mtu[. > 1514])",
+	"count(interface[state == 'down'])",
+	"sum(interface/state) | count(interface/state)",
+	"top/slot[id == '1'] | count(interface)",
+	"top/version | sum(interface/*)",
+	"count(top/slot/id) | min(top/slot/id)",
+	"sum(interface/mtu) | !top/slot/ports/interface[2]",
+	"avg(interface/mtu)",
+	"sum(interface/mtu, 1)",
+	NULL
+    };
+    const char **fp;
+
+    xo_filter_setup_test();
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (argv[argc + 1] == NULL)
+	    break;
+	if (strcmp(argv[argc], "count") == 0)
+	    count = strtoul(argv[++argc], NULL, 0);
+	else if (strcmp(argv[argc], "filter") == 0)
+	    filter = argv[++argc];
+    }
+
+    if (count) {
+	if (filter)
+	    xo_add_filter(NULL, filter);
+	make_list(NULL, count, count);
+	xo_finish();
+	return 0;
+    }
+
+    xo_open_container("aggregate");
+    xo_open_list("test");
+
+    for (fp = filters; *fp; fp++) {
+	filtered(XO_STYLE_XML, *fp);
+	filtered(XO_STYLE_JSON, *fp);
+    }
+
+    xo_close_list("test");
+    xo_close_container("aggregate");
+
+    xo_finish();
+
+    free(mem.mb_buf);
+
+    return 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_28.c: verify loading filters from a file, via xo_add_filter_file
+ * and the "filter-file" option.  A file of expressions (with comments,
+ * blank lines, repeats, and bad lines) is written, a list of interfaces
+ * is made on filtered JSON handles writing to memory, and we report the
+ * names of the interfaces that were kept, and whether the output is the
+ * same as adding the good lines one at a time with xo_add_filter.  Also
+ * used by "make benchmark-file", via the "lines" and "count" arguments,
+ * which write a file of that many "name == 'ge-0/0/N'" paths and load
+ * it (or, with "add 1", add each line with xo_add_filter) before making
+ * a list on the default handle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xo.h"
+#include "membuf.h"
+
+/* From the filter library; links it in without dynamic loading */
+void xo_filter_setup_test (void);
+
+static struct ifinfo {
+    const char *if_name;
+    unsigned if_mtu;
+    const char *if_state;
+} iflist[] = {
+    { "ge-0/0/0", 1500, "up" },
+    { "ge-0/0/1", 9192, "up" },
+    { "ge-0/0/2", 1514, "down" },
+    { "xe-1/0/0", 9000, "up" },
+    { "xe-1/0/1", 4470, "down" },
+    { "lo0", 65535, "up" },
+};
+
+#define NUM_IFS (sizeof(iflist) / sizeof(iflist[0]))
+
+static const char filter_file[] = "test_28.filters";
+
+static membuf_t mem;		/* Output made by our handles */
+
+static void
+make_list (xo_handle_t *xop, unsigned long count)
+{
+    unsigned long i;
+
+    xo_open_container_h(xop, "top");
+    xo_open_list_h(xop, "interface");
+
+    for (i = 0; i < count; i++) {
+	struct ifinfo *ifp = &iflist[i % NUM_IFS];
+
+	xo_open_instance_h(xop, "interface");
+	xo_emit_hf(xop, XOEF_RETAIN, "{k:name/%s} {:mtu/%u} {:state/%s}\n",
+		   ifp->if_name, ifp->if_mtu, ifp->if_state);
+	xo_close_instance_h(xop, "interface");
+    }
+
+    xo_close_list_h(xop, "interface");
+    xo_close_container_h(xop, "top");
+}
+
+static void
+write_file (const char *contents)
+{
+    FILE *fp = fopen(filter_file, "w");
+    if (fp == NULL)
+	exit(1);
+
+    fputs(contents, fp);
+    fclose(fp);
+}
+
+/*
+ * Make the list on a filtered handle, returning the output, which the
+ * caller frees.  "how" is "file", "option", or "add", the last taking
+ * the expressions in "adds", one per call to xo_add_filter.
+ */
+static char *
+run (const char *how, const char **adds, int *rcp)
+{
+    xo_handle_t *xop = xo_create(XO_STYLE_JSON, 0);
+    if (xop == NULL)
+	exit(1);
+
+    xo_set_writer(xop, &mem, write_buf, NULL, NULL);
+
+    int rc = 0;
+    if (strcmp(how, "file") == 0)
+	rc = xo_add_filter_file(xop, filter_file);
+    else if (strcmp(how, "option") == 0) {
+	char opt[64];
+	snprintf(opt, sizeof(opt), "filter-file=%s", filter_file);
+	rc = xo_set_options(xop, opt);
+    } else {
+	for ( ; *adds; adds++)
+	    if (xo_add_filter(xop, *adds) < 0)
+		rc = -1;
+    }
+
+    mem.mb_len = 0;
+    make_list(xop, NUM_IFS);
+    xo_finish_h(xop);
+    xo_destroy(xop);
+
+    *rcp = rc;
+    return strdup(mem.mb_len ? mem.mb_buf : "");
+}
+
+/*
+ * Report the names of the interfaces kept by a file of expressions,
+ * and whether adding "adds" one at a time gives the same output
+ */
+static void
+filtered (const char *title, const char *contents, const char **adds)
+{
+    int rc, opt_rc, add_rc;
+
+    write_file(contents);
+
+    char *out = run("file", NULL, &rc);
+    char *opt_out = run("option", NULL, &opt_rc);
+    char *add_out = run("add", adds, &add_rc);
+
+    /* Pull out the names that were kept */
+    char names[256], *np = names, *ep = names + sizeof(names);
+    static const char name[] = "\"name\":\"";
+    const char *cp;
+    int count = 0;
+
+    *np = '\0';
+    for (cp = strstr(out, name); cp; cp = strstr(cp, name)) {
+	cp += sizeof(name) - 1;
+	size_t len = strcspn(cp, "\"");
+	np += snprintf(np, ep - np, "%s%.*s", count++ ? " " : "",
+		       (int) len, cp);
+	if (np >= ep)
+	    np = ep - 1;
+    }
+
+    xo_open_instance("test");
+    xo_emit("{k:title} {:rc/%d} {:count/%d} {:names} "
+	    "{:option/%s} {:add/%s}\n", title, rc, count, names,
+	    strcmp(out, opt_out) == 0 ? "same" : "different",
+	    strcmp(out, add_out) == 0 ? "same" : "different");
+    xo_close_instance("test");
+
+    free(out);
+    free(opt_out);
+    free(add_out);
+}
+
+/*
+ * Write a file of "lines" expressions, each picking one interface name
+ */
+static void
+write_keys (unsigned long lines)
+{
+    FILE *fp = fopen(filter_file, "w");
+    unsigned long i;
+
+    if (fp == NULL)
+	exit(1);
+
+    for (i = 0; i < lines; i++)
+	fprintf(fp, "top/interface[name == 'ge-0/0/%lu']\n", i);
+    fclose(fp);
+}
+
+int
+main (int argc, char **argv)
+{
+    unsigned long count = 0, lines = 0, add = 0;
+
+    xo_filter_setup_test();
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (argv[argc + 1] == NULL)
+	    break;
+	if (strcmp(argv[argc], "count") == 0)
+	    count = strtoul(argv[++argc], NULL, 0);
+	else if (strcmp(argv[argc], "lines") == 0)
+	    lines = strtoul(argv[++argc], NULL, 0);
+	else if (strcmp(argv[argc], "add") == 0)
+	    add = strtoul(argv[++argc], NULL, 0);
+    }
+
+    if (count) {
+	if (lines) {
+	    write_keys(lines);
+	    if (add) {
+		char line[64];
+		for (unsigned long i = 0; i < lines; i++) {
+		    snprintf(line, sizeof(line),
+			     "top/interface[name == 'ge-0/0/%lu']", i);
+		    xo_add_filter(NULL, line);
+		}
+	    } else
+		xo_add_filter_file(NULL, filter_file);
+	    unlink(filter_file);
+	}
+	make_list(NULL, count);
+	xo_finish();
+	return 0;
+    }
+
+    xo_open_container("filter-file");
+    xo_emit("{T:Title} {T:Rc} {T:Count} {T:Names} {T:Option} {T:Add}\n");
+
+    xo_open_list("test");
+
+    static const char *simple[] = {
+	"top/interface[mtu > 9000]", "top/interface[name == 'lo0']", NULL
+    };
+    filtered("simple",
+	     "top/interface[mtu > 9000]\n"
+	     "top/interface[name == 'lo0']\n", simple);
+
+    /* A BOM, comments, blank lines, padding, repeats, and no newline */
+    static const char *messy[] = {
+	"top/interface[state == 'down']", "top/interface[name == 'lo0']", NULL
+    };
+    filtered("messy",
+	     "\xEF\xBB\xBF# Interfaces we care about\n"
+	     "\n"
+	     "   top/interface[state == 'down']  \r\n"
+	     "\t# indented comment\n"
+	     "top/interface[state == 'down']\n"
+	     "top/interface[name == 'lo0']\n"
+	     "top/interface[state == 'down']\n"
+	     "top/interface[name == 'lo0']", messy);
+
+    /* Bad lines are reported and skipped; the rest are used */
+    static const char *bad[] = {
+	"top/interface[mtu == 1514]", "top/interface[name == 'xe-1/0/0']", NULL
+    };
+    filtered("bad",
+	     "top/interface[mtu == 1514]\n"
+	     "top/interface[name ==\n"
+	     "string(top/interface)\n"
+	     "top/interface[name == 'xe-1/0/0']\n", bad);
+
+    /* Unions, negation, and aggregates */
+    static const char *mixed[] = {
+	"top/interface[name == 'ge-0/0/0'] | top/interface[name == 'ge-0/0/1']",
+	"!top/interface[mtu == 9192]", "count(top/interface)", NULL
+    };
+    filtered("mixed",
+	     "top/interface[name == 'ge-0/0/0'] | top/interface[name == 'ge-0/0/1']\n"
+	     "!top/interface[mtu == 9192]\n"
+	     "count(top/interface)\n", mixed);
+
+    /* Nothing but comments leaves the filter empty */
+    static const char *none[] = { NULL };
+    filtered("empty", "# nothing here\n\n", none);
+
+    xo_close_list("test");
+
+    /* A file that isn't there */
+    unlink(filter_file);
+    xo_handle_t *xop = xo_create(XO_STYLE_JSON, 0);
+    int rc = xo_add_filter_file(xop, filter_file);
+    xo_destroy(xop);
+    xo_emit("{:missing/%d}\n", rc);
+
+    xo_close_container("filter-file");
+
+    xo_finish();
+
+    free(mem.mb_buf);
+
+    return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_29.c: verify the "filter-stats" option.  A list of interfaces
+ * is made on filtered JSON handles writing to memory, and we report the
+ * names of the interfaces that were kept.  The statistics themselves
+ * are written to stderr by xo_finish_h, and are checked there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xo.h"
+#include "membuf.h"
+
+/* From the filter library; links it in without dynamic loading */
+void xo_filter_setup_test (void);
+
+static struct ifinfo {
+    const char *if_name;
+    unsigned if_mtu;
+    const char *if_state;
+} iflist[] = {
+    { "ge-0/0/0", 1500, "up" },
+    { "ge-0/0/1", 9192, "up" },
+    { "ge-0/0/2", 1514, "down" },
+    { "xe-1/0/0", 9000, "up" },
+    { "xe-1/0/1", 4470, "down" },
+    { "lo0", 65535, "up" },
+};
+
+#define NUM_IFS (sizeof(iflist) / sizeof(iflist[0]))
+
+static membuf_t mem;		/* Output made by our handles */
+
+static void
+make_list (xo_handle_t *xop)
+{
+    unsigned long i;
+
+    xo_open_container_h(xop, "top");
+    xo_open_list_h(xop, "interface");
+
+    for (i = 0; i < NUM_IFS; i++) {
+	struct ifinfo *ifp = &iflist[i];
+
+	xo_open_instance_h(xop, "interface");
+	xo_emit_hf(xop, XOEF_RETAIN, "{k:name/%s} {:mtu/%u} {:state/%s}\n",
+		   ifp->if_name, ifp->if_mtu, ifp->if_state);
+	xo_close_instance_h(xop, "interface");
+    }
+
+    xo_close_list_h(xop, "interface");
+    xo_close_container_h(xop, "top");
+}
+
+/*
+ * Make the list with the filter expressions in "filters" (a NULL
+ * terminated array), setting "options" before adding them, or after
+ * if "late" is set
+ */
+static void
+filtered (const char *title, const char *options, int late,
+	  const char **filters)
+{
+    xo_handle_t *xop = xo_create(XO_STYLE_JSON, 0);
+    if (xop == NULL)
+	return;
+
+    xo_set_writer(xop, &mem, write_buf, NULL, NULL);
+
+    if (!late)
+	xo_set_options(xop, options);
+    for ( ; *filters; filters++)
+	xo_add_filter(xop, *filters);
+    if (late)
+	xo_set_options(xop, options);
+
+    fprintf(stderr, "%s:\n", title);
+    fflush(stderr);
+
+    mem.mb_len = 0;
+    make_list(xop);
+    xo_finish_h(xop);
+    xo_destroy(xop);
+
+    /* Pull out the names that were kept */
+    char names[256], *np = names, *ep = names + sizeof(names);
+    static const char name[] = "\"name\":\"";
+    const char *cp;
+    int count = 0;
+
+    *np = '\0';
+    for (cp = mem.mb_len ? strstr(mem.mb_buf, name) : NULL; cp;
+	 cp = strstr(cp, name)) {
+	cp += sizeof(name) - 1;
+	size_t len = strcspn(cp, "\"");
+	np += snprintf(np, ep - np, "%s%.*s", count++ ? " " : "",
+		       (int) len, cp);
+	if (np >= ep)
+	    np = ep - 1;
+    }
+
+    xo_open_instance("test");
+    xo_emit("{k:title} {:count/%d} {:names}\n", title, count, names);
+    xo_close_instance("test");
+}
+
+int
+main (int argc, char **argv)
+{
+    xo_filter_setup_test();
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    xo_open_container("filter-stats");
+    xo_emit("{T:Title} {T:Count} {T:Names}\n");
+
+    xo_open_list("test");
+
+    /* Predicates decided when the field arrives, and at open */
+    static const char *simple[] = {
+	"top/interface[mtu > 9000]", "top/interface[3]", NULL
+    };
+    filtered("simple", "filter-stats", 0, simple);
+
+    /* A union of equality tests becomes a keyed lookup */
+    static const char *keyed[] = {
+	"top/interface[name == 'lo0'] | top/interface[name == 'ge-0/0/1']"
+	" | top/interface[name == 'em0'] | top/interface[name == 'xe-1/0/0']",
+	NULL
+    };
+    filtered("keyed", "filter-stats", 0, keyed);
+
+    /* A field that never appears forces the predicate at close */
+    static const char *forced[] = {
+	"top/interface[speed == 'fast' or state == 'down']", NULL
+    };
+    filtered("forced", "filter-stats", 0, forced);
+
+    /* Negation and aggregates */
+    static const char *mixed[] = {
+	"!top/interface[state == 'up']", "top/interface/name",
+	"count(top/interface)", NULL
+    };
+    filtered("mixed", "filter-stats", 0, mixed);
+
+    /* Pending output past the spill limit is counted too */
+    static const char *spill[] = { "top/interface[state == 'down']", NULL };
+    filtered("spill", "filter-stats,filter-spill=64", 0, spill);
+
+    /* Without the option when the filter is added, paths are numbered */
+    filtered("late", "filter-stats", 1, simple);
+
+    /* Nothing is reported without the option */
+    filtered("none", "filter-warn", 0, simple);
+
+    xo_close_list("test");
+
+    xo_close_container("filter-stats");
+
+    xo_finish();
+
+    free(mem.mb_buf);
+
+    return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_30.c: verify values that reach the end of the output buffer.
+ * A number is made after padding that puts it at every offset around
+ * the end of libxo's first buffer, on handles writing to memory, and
+ * we report how many numbers came out intact.  Then values made only
+ * of characters that must be escaped are made at lengths around the
+ * buffer size, and we report how many escapes came out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xo.h"
+#include "membuf.h"
+
+/* The size of libxo's first buffer (XO_BUFSIZ) */
+#define BUFFER_SIZE (8 * 1024)
+
+/* How far either side of the end of the buffer we go */
+#define SPREAD 64
+
+static membuf_t mem;		/* Output made by our handles */
+
+static const char *
+style_name (xo_style_t style)
+{
+    switch (style) {
+    case XO_STYLE_TEXT:
+	return "text";
+    case XO_STYLE_XML:
+	return "xml";
+    case XO_STYLE_JSON:
+	return "json";
+    case XO_STYLE_HTML:
+	return "html";
+    case XO_STYLE_SDPARAMS:
+	return "sdparams";
+    }
+
+    return "unknown";
+}
+
+/*
+ * Make a number after "pad" bytes of padding, returning TRUE if it
+ * came out intact
+ */
+static int
+padded_number (xo_style_t style, const char *pad)
+{
+    xo_handle_t *xop = xo_create(style, 0);
+    if (xop == NULL)
+	return 0;
+
+    xo_set_writer(xop, &mem, write_buf, NULL, NULL);
+
+    mem.mb_len = 0;
+    xo_emit_h(xop, "{:pad/%s}{:number/%8d}\n", pad, 12345678);
+    xo_finish_h(xop);
+    xo_destroy(xop);
+
+    return mem.mb_len && strstr(mem.mb_buf, "12345678") != NULL;
+}
+
+static void
+test_numbers (xo_style_t style)
+{
+    static char pad[BUFFER_SIZE + SPREAD];
+    int len, intact = 0;
+
+    for (len = BUFFER_SIZE - SPREAD; len < BUFFER_SIZE + SPREAD; len++) {
+	memset(pad, 'x', len);
+	pad[len] = '\0';
+	intact += padded_number(style, pad);
+    }
+
+    xo_open_instance("test");
+    xo_emit("{k:style} {:made/%d} {:intact/%d}\n",
+	    style_name(style), SPREAD * 2, intact);
+    xo_close_instance("test");
+}
+
+/*
+ * Make a value of "len" characters that each need escaping in "style",
+ * returning the number of escapes that came out
+ */
+static int
+escaped_value (xo_style_t style, int len)
+{
+    static char value[BUFFER_SIZE * 2];
+    const char *escape;
+    int ch;
+
+    switch (style) {
+    case XO_STYLE_JSON:
+	ch = '"';
+	escape = "\\\"";
+	break;
+    case XO_STYLE_SDPARAMS:
+	ch = ']';
+	escape = "\\]";
+	break;
+    default:
+	ch = '&';
+	escape = "&amp;";
+    }
+
+    xo_handle_t *xop = xo_create(style, 0);
+    if (xop == NULL)
+	return 0;
+
+    xo_set_writer(xop, &mem, write_buf, NULL, NULL);
+
+    memset(value, ch, len);
+    value[len] = '\0';
+
+    mem.mb_len = 0;
+    xo_emit_h(xop, "{:value/%s}\n", value);
+    xo_finish_h(xop);
+    xo_destroy(xop);
+
+    int count = 0;
+    const char *cp;
+    size_t elen = strlen(escape);
+
+    for (cp = mem.mb_len ? strstr(mem.mb_buf, escape) : NULL; cp;
+	 cp = strstr(cp + elen, escape))
+	count += 1;
+
+    return count;
+}
+
+static void
+test_escapes (xo_style_t style)
+{
+    int len, made = 0, escaped = 0;
+
+    for (len = BUFFER_SIZE / 2; len < BUFFER_SIZE * 2; len += SPREAD / 2 + 1) {
+	made += len;
+	escaped += escaped_value(style, len);
+    }
+
+    xo_open_instance("escape");
+    xo_emit("{k:style} {:made/%d} {:escaped/%d}\n",
+	    style_name(style), made, escaped);
+    xo_close_instance("escape");
+}
+
+int
+main (int argc, char **argv)
+{
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    xo_open_container("buffer-end");
+    xo_emit("{T:Style} {T:Made} {T:Intact}\n");
+
+    xo_open_list("test");
+    test_numbers(XO_STYLE_TEXT);
+    test_numbers(XO_STYLE_XML);
+    test_numbers(XO_STYLE_JSON);
+    test_numbers(XO_STYLE_HTML);
+    xo_close_list("test");
+
+    xo_emit("{T:Style} {T:Made} {T:Escaped}\n");
+
+    xo_open_list("escape");
+    test_escapes(XO_STYLE_XML);
+    test_escapes(XO_STYLE_JSON);
+    test_escapes(XO_STYLE_HTML);
+    test_escapes(XO_STYLE_SDPARAMS);
+    xo_close_list("escape");
+
+    xo_close_container("buffer-end");
+
+    xo_finish();
+
+    free(mem.mb_buf);
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2025, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that LICENSE.
+ *
+ * test_31.c: verify filtered output that is flushed partway.  A list
+ * is made on filtered XML and JSON handles writing to memory, flushing
+ * after each instance, so instances that aren't kept are rolled back
+ * to the start of the (just written) buffer.  The output is reported
+ * whole.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xo.h"
+#include "membuf.h"
+
+/* From the filter library; links it in without dynamic loading */
+void xo_filter_setup_test (void);
+
+#define NUM_ITEMS 6
+
+static membuf_t mem;		/* Output made by our handles */
+
+/* Make the list, keeping the items whose bit is set in "keep" */
+static void
+flushed (xo_style_t style, unsigned keep)
+{
+    xo_handle_t *xop = xo_create(style, 0);
+    if (xop == NULL)
+	return;
+
+    xo_set_writer(xop, &mem, write_buf, NULL, NULL);
+    xo_add_filter(xop, "top/item[flag == 'keep']");
+
+    mem.mb_len = 0;
+    xo_open_container_h(xop, "top");
+    xo_open_list_h(xop, "item");
+
+    int i;
+    for (i = 0; i < NUM_ITEMS; i++) {
+	xo_open_instance_h(xop, "item");
+	xo_emit_h(xop, "{k:id/%d}{:flag/%s}",
+		  i, (keep & (1 << i)) ? "keep" : "drop");
+	xo_close_instance_h(xop, "item");
+	xo_flush_h(xop);
+    }
+
+    xo_close_list_h(xop, "item");
+    xo_close_container_h(xop, "top");
+    xo_finish_h(xop);
+    xo_destroy(xop);
+
+    if (mem.mb_len && mem.mb_buf[mem.mb_len - 1] == '\n')
+	mem.mb_buf[--mem.mb_len] = '\0';
+
+    xo_open_instance("test");
+    xo_emit("{k:style} {k:keep/%#x}\n  {:output}\n",
+	    (style == XO_STYLE_XML) ? "xml" : "json", keep,
+	    mem.mb_len ? mem.mb_buf : "");
+    xo_close_instance("test");
+}
+
+int
+main (int argc, char **argv)
+{
+    xo_filter_setup_test();
+
+    argc = xo_parse_args(argc, argv);
+    if (argc < 0)
+	return 1;
+
+    xo_open_container("flushed");
+    xo_open_list("test");
+
+    /* Items dropped after a flush, with a later one kept */
+    flushed(XO_STYLE_XML, 0x11);
+    flushed(XO_STYLE_JSON, 0x11);
+
+    /*
+     * The first item dropped, so the top container and list are still
+     * tentative when flushed, and are joined to the kept item later
+     */
+    flushed(XO_STYLE_XML, 0x12);
+    flushed(XO_STYLE_JSON, 0x12);
+
+    /* Items dropped after a flush, with none kept after them */
+    flushed(XO_STYLE_XML, 0x01);
+    flushed(XO_STYLE_JSON, 0x01);
+
+    xo_close_list("test");
+    xo_close_container("flushed");
+
+    xo_finish();
+
+    free(mem.mb_buf);
+
+    return 0;
+}
@@ -122,6 +122,20 @@ main (int argc, char **argv)
 
     xo_emit("{G:}{Lwcg:Windings}{g:windings}\n", "lotus-o-delta");
 
+    /* Repeated formats are translated once per domain and locale */
+    const char *domains[] = { "ldns", "gt_01", "ldns", NULL };
+    for (i = 0; domains[i]; i++)
+	xo_emit("{G:/%s}Received {:received/%zu} {Ngp:byte,bytes} "
+		"from {:from/%s}#{:port/%d} in {:time/%d} ms\n",
+		domains[i], (size_t) 1234, "foop", 4321, 32);
+
+    for (i = 0; i < 2; i++)
+	xo_emit("{G:}Version {:version}\n", "1.2.4");
+
+    /* Changing the locale must not return stale translations */
+    setlocale(LC_MESSAGES, "C");
+    xo_emit("{G:}Version {:version}\n", "1.2.5");
+
     xo_close_container("top");
     xo_finish();
 